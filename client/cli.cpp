@@ -1,4 +1,5 @@
 #include "crypto.h"
+#include "proto.h"
 
 #include <iostream>
 #include <cstring>
@@ -7,54 +8,117 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <sys/select.h>
 #include <stdexcept>
+#include <chrono>
+#include <poll.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sstream>
+#include <ctime>
 
 #define BUFSZ 1024
+#define BATCH_BUFSZ 65536       // 批处理模式单次读写的缓冲区大小
+#define MAX_OUTBUF (4u << 20)   // 批处理模式待发送数据超过这么多就暂停读输入
+#define HISTORY_CMD ".history"  // 消息内容为 ".history [条数 [起始 [截止]]]" 时改为查询与收件人的聊天记录，时间为 Unix 秒
+#define REKEY_CMD ".rekey"      // 在输入收件人时输入，立即更新会话密钥
+#define REKEY_AFTER (1u << 24)  // 当前密钥加解密这么多帧后自动更新
 
 Crypto crypto{};
+uint32_t next_seq = 1;      // 扩展帧的序号，服务端的确认带回同一个序号
 
 
 // ==================== 工具函数 ====================
-inline void send_msg(int sock, const std::string& to, const std::string& msg);  // 发送消息
-inline void process_msg(const char* buf, int len, std::string& from, std::string& msg); // 拆解消息
+inline uint32_t send_msg(int sock, const std::string& to, const std::string& msg);  // 发送消息，返回序号，失败返回 0
+inline bool append_msg(std::string& out, uint32_t seq, const std::string& to, const std::string& msg);   // 组装消息，追加到 out
+inline void process_msg(const FrameView& f, std::string& from, std::string& msg);          // 解密已解析的消息
+inline bool parse_history_cmd(const std::string& msg, HistQuery& q);                        // 消息是否为查询聊天记录的命令
+inline bool append_key_update(std::string& out, uint32_t gen);  // 用当前密钥组装第 gen 代的 FT_KEY_UPDATE ，追加到 out
+inline bool handle_key_update(const FrameView& f, std::string& reply);     // 处理服务端发来的更新，需要回复的追加到 reply
 
 void Send(int sock, const char* sp, int len);
 void send_for_ka(int sock, const unsigned char* vp, int len);
 void recv_for_ka(int sock, std::vector<unsigned char>& vp, int& len);
 
+// 从 recvbuf 中取出所有完整的包，消息交给 on_msg ，确认交给 on_ack ，要回给服务端的帧（密钥更新）追加到 reply 。
+// 剩下的帧头长度不合法时返回 false ，连接已经不同步，调用者应断开
+template<class F, class G>
+bool drain_frames(std::string& recvbuf, std::string& reply, F&& on_msg, G&& on_ack);
+
+// 非交互的批处理模式：从 in_fd 流式读取 “收件人/消息” 交替的行，流水线发送，收到的消息以紧凑格式写到 stdout
+int run_batch(int sock, int in_fd, int wait_ms);
+
 
 // ==================== 主函数 ====================
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        std::cerr << std::format("Usage: {} <Server IP> <Server Port> <Username>", argv[0]) << std::endl;
+    auto usage = [&]() {
+        std::cerr << std::format("Usage: {} <Server IP> <Server Port> <Username> [--batch <File, - for stdin>] [--wait <Idle ms>]\n"
+                                 "       {} --unix <Socket path> [--plain] <Username> [--batch <File, - for stdin>] [--wait <Idle ms>]", 
+            argv[0], argv[0]) << std::endl;
         exit(1);
+    };
+
+    std::string batch_file, unix_path;
+    int wait_ms = 1000;
+    bool plain = false;     // 经 Unix 域 socket 连接时请求不加密，服务端不同意就照常加密
+    static const option long_opts[] = {
+        {"batch", required_argument, nullptr, 'b'},
+        {"wait", required_argument, nullptr, 'w'},
+        {"unix", required_argument, nullptr, 'u'},
+        {"plain", no_argument, nullptr, 'p'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "b:w:u:p", long_opts, nullptr)) != -1) {
+        switch (c) {
+        case 'b': batch_file = optarg; break;
+        case 'w': wait_ms = atoi(optarg); break;
+        case 'u': unix_path = optarg; break;
+        case 'p': plain = true; break;
+        default: usage();
+        }
     }
-    if (strlen(argv[3]) > 500ul) {
+    // 连 Unix 域 socket 时只有用户名一个位置参数
+    if (argc - optind != (unix_path.empty() ? 3 : 1) || (plain && unix_path.empty()) || unix_path.size() >= sizeof(sockaddr_un::sun_path)) usage();
+    argv += optind - 1;     // 之后 argv[1..3] 就是三个位置参数
+    const char* username = unix_path.empty() ? argv[3] : argv[1];
+
+    if (strlen(username) > 500ul) {
         std::cerr << "Username can't be longer than 500 characters" << std::endl;
         exit(1);
     }
 
-    int sock = socket(PF_INET, SOCK_STREAM, 0);
+    int sock = socket(unix_path.empty() ? PF_INET : AF_UNIX, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("socket");
         exit(1);
     }
 
     sockaddr_in srv_addr{};
-    srv_addr.sin_family = AF_INET;
-    srv_addr.sin_addr.s_addr = inet_addr(argv[1]);
-    srv_addr.sin_port = htons(atoi(argv[2]));
+    sockaddr_un srv_uaddr{};
+    socklen_t addr_len;
+    if (unix_path.empty()) {
+        srv_addr.sin_family = AF_INET;
+        srv_addr.sin_addr.s_addr = inet_addr(argv[1]);
+        srv_addr.sin_port = htons(atoi(argv[2]));
+        addr_len = sizeof(srv_addr);
+    } else {
+        srv_uaddr.sun_family = AF_UNIX;
+        strcpy(srv_uaddr.sun_path, unix_path.c_str());
+        addr_len = sizeof(srv_uaddr);
+    }
 
-    if (connect(sock, (sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) {
+    if (connect(sock, unix_path.empty() ? (sockaddr *)&srv_addr : (sockaddr *)&srv_uaddr, addr_len) < 0) {
         perror("connect");
         close(sock);
         exit(1);
     }
-    std::cout << "Initializing, plz wait...\n" << std::endl;
+    if (batch_file.empty()) std::cout << "Initializing, plz wait...\n" << std::endl;
 
     char buf[BUFSZ];
-    send_for_ka(sock, reinterpret_cast<const unsigned char*>(argv[3]), strlen(argv[3]));    // 用户名发给服务器
+    if (plain) send_for_ka(sock, KA_PLAIN, sizeof(KA_PLAIN));                             // 先请求不加密
+    send_for_ka(sock, reinterpret_cast<const unsigned char*>(username), strlen(username));  // 用户名发给服务器
 
     vecuc srv_pubkey;
     int len;
@@ -69,35 +133,52 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
-    try {
-        crypto.generate_ecdh_keypr();                       // 生成 ECC 密钥对
-    } catch (const std::exception& e) {
-        std::cerr << "Generate ephemeral ECDH keypair: " << e.what() << std::endl;
-        close(sock);
-        exit(1);
+    if (plain && srv_pubkey.size() == sizeof(KA_PLAIN) && srv_pubkey[0] == KA_PLAIN[0]) {
+        crypto.use_plaintext();                             // 服务端同意不加密，不交换公钥
+        if (batch_file.empty()) std::cout << "Plaintext session (trusted local peer)\n" << std::endl;
+    } else {
+        if (plain && batch_file.empty()) std::cout << "Server refused plaintext, using encryption\n" << std::endl;
+        try {
+            crypto.generate_ecdh_keypr();                       // 生成 ECC 密钥对
+        } catch (const std::exception& e) {
+            std::cerr << "Generate ephemeral ECDH keypair: " << e.what() << std::endl;
+            close(sock);
+            exit(1);
+        }
+
+        vecuc cli_pubkey = crypto.get_ecdh_pubkey();            // 获取客户端 ECC 公钥
+
+        try {
+            crypto.set_peer_ecdh_pubkey(srv_pubkey);            // 设置服务端 ECC 公钥
+
+            // 使用与服务器相同的固定盐值
+            static const vecuc fixed_salt = {0x11, 0x45, 0x14, 0x19, 0x19, 0x81, 0x0f, 0x91, 
+                                            0x0d, 0x00, 0x07, 0x21, 0xc1, 0x2a, 0xc1, 0x01};
+            crypto.derive_shared_secret(&fixed_salt);           // 计算共享密钥并派生 AES 密钥
+        } catch (const std::exception& e) {
+            std::cerr << "ECDH derive: " << e.what() << std::endl;
+            close(sock);
+            exit(1);
+        }
+
+        send_for_ka(sock, cli_pubkey.data(), cli_pubkey.size());    // 发送客户端 ECC 公钥
     }
 
-    vecuc cli_pubkey = crypto.get_ecdh_pubkey();            // 获取客户端 ECC 公钥
-    
-    try {
-        crypto.set_peer_ecdh_pubkey(srv_pubkey);            // 设置服务端 ECC 公钥
-        
-        // 使用与服务器相同的固定盐值
-        static const vecuc fixed_salt = {0x11, 0x45, 0x14, 0x19, 0x19, 0x81, 0x0f, 0x91, 
-                                        0x0d, 0x00, 0x07, 0x21, 0xc1, 0x2a, 0xc1, 0x01};
-        crypto.derive_shared_secret(&fixed_salt);           // 计算共享密钥并派生 AES 密钥
-    } catch (const std::exception& e) {
-        std::cerr << "ECDH derive: " << e.what() << std::endl;
+    if (!batch_file.empty()) {
+        int in_fd = batch_file == "-" ? fileno(stdin) : open(batch_file.c_str(), O_RDONLY);
+        if (in_fd < 0) {
+            perror("open");
+            close(sock);
+            exit(1);
+        }
+        int ret = run_batch(sock, in_fd, wait_ms);
         close(sock);
-        exit(1);
+        return ret;
     }
 
-    send_for_ka(sock, cli_pubkey.data(), cli_pubkey.size());    // 发送客户端 ECC 公钥
-
     fd_set fds;
     int mxfd = std::max(sock, fileno(stdin));
     std::string from, to, msg, recvbuf;
-    int expected_len = -1;
 
     while (1) {
         // 重新初始化可读事件的文件描述符集合，应包含服务器消息和键盘输入
@@ -129,23 +210,27 @@ int main(int argc, char* argv[]) {
             buf[len] = '\0';
             recvbuf.append(buf, len);
 
-            // 设置期望长度
-            if (expected_len == -1 && recvbuf.length() >= 6ul) {
-                uint16_t n_fromlen;
-                uint32_t n_msglen;
-                memcpy(&n_fromlen, recvbuf.c_str(), sizeof(n_fromlen));
-                memcpy(&n_msglen, recvbuf.c_str() + sizeof(n_fromlen), sizeof(n_msglen));
-                expected_len = 6 + static_cast<int>(ntohs(n_fromlen)) + ntohl(n_msglen);
+            // 一次可能收到多条消息，逐条显示
+            std::string reply;
+            bool ok = drain_frames(recvbuf, reply, [&](const std::string& from, const std::string& msg) {
+                std::cout << std::format("\n> {}:\n> {}\n", from, msg) << std::endl;
+            }, [&](uint32_t seq, uint8_t status) {
+                if (status == ACK_STORED) {
+                    std::cout << std::format("\n- #{} STORED: recipient offline\n", seq) << std::endl;
+                } else if (!ack_accepted(status)) {     // 送达的消息不再打扰用户
+                    std::cout << std::format("\n- #{} NOT DELIVERED: {}\n", seq, ack_status_str(status)) << std::endl;
+                }
+            });
+            if (!ok) {
+                std::cerr << "Invalid frame from server." << std::endl;
+                break;
             }
-
-            // 收到的消息长度够了才处理
-            if (expected_len != -1 && recvbuf.length() >= expected_len) {
-                std::string pck = recvbuf.substr(0, expected_len);
-                recvbuf.erase(0, expected_len);
-                expected_len = -1;
-
-                process_msg(pck.c_str(), pck.length(), from, msg);
-                std::cout << format("\n> {}:\n> {}\n", from, msg) << std::endl;
+            if (!reply.empty()) {
+                try {
+                    Send(sock, reply.c_str(), reply.length());
+                } catch (const std::exception& e) {
+                    std::cerr << "Send: " << e.what() << std::endl;
+                }
             }
         }
 
@@ -153,13 +238,23 @@ int main(int argc, char* argv[]) {
         if (FD_ISSET(fileno(stdin), &fds)) {
             if (!std::getline(std::cin, msg) || msg == ".exit") break;
 
-            // 没设收件人则设置
-            if (!to.length()) to = msg;
+            // 没设收件人时可以输入命令，否则设置收件人
+            if (!to.length() && msg == REKEY_CMD) {
+                std::string pck;
+                try {
+                    uint32_t gen = crypto.start_key_update();
+                    if (append_key_update(pck, gen)) Send(sock, pck.c_str(), pck.length());
+                    std::cout << std::format("- KEY UPDATED (generation {})\n", gen) << std::endl;
+                } catch (const std::exception& e) {
+                    std::cerr << "Key update: " << e.what() << std::endl;
+                }
+            }
+            else if (!to.length()) to = msg;
 
             else {
-                send_msg(sock, to, msg);
+                uint32_t seq = send_msg(sock, to, msg);
                 to = "";
-                std::cout << "- SENT\n" << std::endl;
+                if (seq) std::cout << std::format("- SENT #{}\n", seq) << std::endl;
             }
         }
     }
@@ -171,53 +266,300 @@ int main(int argc, char* argv[]) {
 
 
 // ==================== 工具函数实现 ====================
-inline void send_msg(int sock, const std::string& to, const std::string& msg) {
-    std::string c_to, c_msg;
+inline bool append_msg(std::string& out, uint32_t seq, const std::string& to, const std::string& msg) {
+    // 查询聊天记录的命令改发 FT_HIST ，内容换成编码后的查询
+    HistQuery q;
+    unsigned char qbuf[HIST_QUERY_LEN];
+    bool hist = parse_history_cmd(msg, q);
+    bytes_view body = to_bytes(msg);
+    if (hist) {
+        put_hist_query(qbuf, q);
+        body = bytes_view(qbuf, sizeof(qbuf));
+    }
+
+    // 当前密钥用得够多了就先发一个更新，这条消息用新密钥加密
+    if (++crypto.key_uses >= REKEY_AFTER && !crypto.key_update_pending && !crypto.plain) {
+        try {
+            append_key_update(out, crypto.start_key_update());
+        } catch (const std::exception& e) {
+            std::cerr << "Key update: " << e.what() << std::endl;
+        }
+    }
+
+    if (msg_frame_len(to.length(), body.size()) > MAX_FRAME_LEN) {
+        std::cerr << std::format("Message too long (at most {} bytes)", MAX_FRAME_LEN - msg_frame_len(to.length(), 0)) << std::endl;
+        return false;
+    }
+    size_t at = out.length();
+    out.resize(at + msg_frame_len(to.length(), body.size()));
+
+    // 头部写在前面，两段密文直接加密到 out 中
     try {
-        c_to = crypto.aes_encrypt(to), c_msg = crypto.aes_encrypt(msg);
+        build_msg(reinterpret_cast<unsigned char*>(out.data() + at), seq, to_bytes(to), body, 
+            [](const unsigned char* plain, size_t len, unsigned char* p) { return crypto.aes_encrypt(plain, len, p); }, 
+            hist ? FT_HIST : FT_MSG);
     } catch (const std::exception& e) {
         std::cerr << "AES encrypt: " << e.what() << std::endl;
-        return;
+        out.resize(at);
+        return false;
     }
+    return true;
+}
 
-    uint16_t n_tolen = htons(static_cast<uint16_t>(c_to.length()));
-    uint32_t n_msglen = htonl(static_cast<uint32_t>(c_msg.length()));
+
+inline uint32_t send_msg(int sock, const std::string& to, const std::string& msg) {
     std::string pck;
-    pck.reserve(sizeof(n_tolen) + sizeof(n_msglen) + c_to.length() + c_msg.length());
-    pck.append(reinterpret_cast<const char*>(&n_tolen), sizeof(n_tolen));
-    pck.append(reinterpret_cast<const char*>(&n_msglen), sizeof(n_msglen));
-    pck += c_to, pck += c_msg;
+    uint32_t seq = next_seq;
+    if (!append_msg(pck, seq, to, msg)) return 0;
+    ++next_seq;
 
     try {
         Send(sock, pck.c_str(), pck.length());
     } catch (const std::exception& e) {
         std::cerr << "Send: " << e.what() << std::endl;
+        return 0;
     }
+    return seq;
 }
 
 
-inline void process_msg(const char* pckptr, int len, std::string& from, std::string& msg) {
-    if (len < 6) {
+inline void process_msg(const FrameView& f, std::string& from, std::string& msg) {
+    // 直接从接收缓冲区解密到输出字符串。更新密钥后服务端还在路上的旧帧， aes_decrypt 会改用上一代密钥
+    ++crypto.key_uses;
+    try {
+        from.resize(f.c_a.size() - AES_OVERHEAD);
+        msg.resize(f.c_b.size() - AES_OVERHEAD);
+        from.resize(crypto.aes_decrypt(f.c_a.data(), f.c_a.size(), reinterpret_cast<unsigned char*>(from.data())));
+        msg.resize(crypto.aes_decrypt(f.c_b.data(), f.c_b.size(), reinterpret_cast<unsigned char*>(msg.data())));
+    } catch (const std::exception& e) {
+        std::cerr << "AES decrypt: " << e.what() << std::endl;
         from.clear(), msg.clear();
-        return;
     }
+}
 
-    uint16_t n_fromlen;
-    uint32_t n_msglen;
-    std::memcpy(&n_fromlen, pckptr, sizeof(n_fromlen));
-    std::memcpy(&n_msglen, pckptr + sizeof(n_fromlen), sizeof(n_msglen));
-    int fromlen = ntohs(n_fromlen), msglen = ntohl(n_msglen);
 
-    if (fromlen < 0 || msglen < 0 || 6 + fromlen + msglen > len) {
-        from.clear(), msg.clear();
-        return;
+inline bool parse_history_cmd(const std::string& msg, HistQuery& q) {
+    size_t n = strlen(HISTORY_CMD);
+    if (msg.compare(0, n, HISTORY_CMD) || (msg.size() > n && msg[n] != ' ')) return false;
+    std::istringstream in(msg.substr(n));
+    double since = 0, until = 0;
+    q = HistQuery{};
+    in >> q.limit >> since >> until;
+    q.since_us = static_cast<uint64_t>(since * 1e6), q.until_us = static_cast<uint64_t>(until * 1e6);
+    return true;
+}
+
+
+inline bool append_key_update(std::string& out, uint32_t gen) {
+    size_t at = out.length();
+    out.resize(at + KEY_UPDATE_FRAME_LEN);
+    try {
+        build_key_update(reinterpret_cast<unsigned char*>(out.data() + at), gen, 
+            [](const unsigned char* plain, size_t len, unsigned char* p) { return crypto.aes_encrypt(plain, len, p); });
+    } catch (const std::exception& e) {
+        std::cerr << "AES encrypt: " << e.what() << std::endl;
+        out.resize(at);
+        return false;
     }
+    return true;
+}
+
 
+inline bool handle_key_update(const FrameView& f, std::string& reply) {
+    Crypto::KeyUpdate r;
     try {
-        from = crypto.aes_decrypt(std::string(pckptr + 6, fromlen));
-        msg = crypto.aes_decrypt(std::string(pckptr + 6 + fromlen, msglen));
+        r = crypto.on_key_update(f.seq, f.c_a.data(), f.c_a.size());
     } catch (const std::exception& e) {
-        std::cerr << "AES decrypt: " << e.what() << std::endl;
-        from.clear(), msg.clear();
+        std::cerr << "Key update: " << e.what() << std::endl;
+        return false;
     }
-}
\ No newline at end of file
+    if (r == Crypto::KeyUpdate::Invalid) {
+        std::cerr << std::format("Invalid key update from server (generation {})", f.seq) << std::endl;
+        return false;
+    }
+    return r == Crypto::KeyUpdate::Confirmed || append_key_update(reply, f.seq);
+}
+
+
+template<class F, class G>
+bool drain_frames(std::string& recvbuf, std::string& reply, F&& on_msg, G&& on_ack) {
+    std::string from, msg;
+    size_t used = for_each_frame(to_bytes(recvbuf), [&](bytes_view pck) {
+        FrameView f;
+        if (!parse_frame(pck, f)) return;           // 格式不对或不认识的扩展帧直接跳过
+        if (f.type == FT_ACK) {
+            on_ack(f.seq, f.status);
+        } else if (f.type == FT_KEY_UPDATE) {
+            handle_key_update(f, reply);
+        } else if (f.type == 0) {
+            process_msg(f, from, msg);
+            on_msg(from, msg);
+        } else if (f.type == FT_HIST) {
+            // 聊天记录： from 的前 8 字节是时间戳，显示为 “<发送者> (history, <UTC 时间>)”
+            process_msg(f, from, msg);
+            if (from.size() < 8) return;
+            time_t ts = static_cast<time_t>(get_u64(reinterpret_cast<const unsigned char*>(from.data())) / 1000000);
+            tm t{};
+            char when[32];
+            strftime(when, sizeof(when), "%F %T", gmtime_r(&ts, &t));
+            on_msg(std::format("{} (history, {} UTC)", std::string_view(from).substr(8), when), msg);
+        }
+    });
+    if (used) recvbuf.erase(0, used);
+    return frame_len_valid(to_bytes(recvbuf));
+}
+
+
+// 批处理输出格式：每条消息一行 "<发送者>\t<内容>" ，其中的 \ 、制表符、换行分别转义为 \\ 、\t 、\n
+static void append_escaped(std::string& out, const std::string& s) {
+    for (char ch : s) {
+        switch (ch) {
+        case '\\': out += "\\\\"; break;
+        case '\t': out += "\\t"; break;
+        case '\n': out += "\\n"; break;
+        default: out += ch;
+        }
+    }
+}
+
+
+int run_batch(int sock, int in_fd, int wait_ms) {
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    std::string inbuf, outbuf, recvbuf, printbuf, to;
+    bool have_to = false, in_eof = false;
+    long sent_msgs = 0, recv_msgs = 0, acked_msgs = 0, nacked_msgs = 0;
+    char rbuf[BATCH_BUFSZ];
+
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now(), last_sent = start, first_recv = start, last_recv = start;
+
+    auto on_msg = [&](const std::string& from, const std::string& msg) {
+        if (!recv_msgs++) first_recv = clock::now();
+        last_recv = clock::now();
+        append_escaped(printbuf, from);
+        printbuf += '\t';
+        append_escaped(printbuf, msg);
+        printbuf += '\n';
+    };
+
+    // 确认只计数，未送达的在标准错误输出注明序号（即输入中的第几条消息）
+    auto on_ack = [&](uint32_t seq, uint8_t status) {
+        if (ack_accepted(status)) {
+            ++acked_msgs;
+        } else {
+            ++nacked_msgs;
+            std::cerr << std::format("[batch] #{} not delivered: {}", seq, ack_status_str(status)) << std::endl;
+        }
+    };
+
+    auto flush_print = [&]() {
+        if (!printbuf.empty()) fwrite(printbuf.data(), 1, printbuf.size(), stdout);
+        printbuf.clear();
+    };
+
+    while (1) {
+        bool sending = !outbuf.empty();
+        if (in_eof && !sending) break;
+
+        pollfd pfds[2] = {{sock, static_cast<short>(POLLIN | (sending ? POLLOUT : 0)), 0}, {in_fd, 0, 0}};
+        int nfds = 1;
+        if (!in_eof && outbuf.size() < MAX_OUTBUF) pfds[1].events = POLLIN, nfds = 2;   // 积压太多就先不读输入
+
+        if (poll(pfds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+
+        // 读输入，按行拆成 收件人/消息 对，组装好追加到待发送缓冲区
+        if (nfds == 2 && (pfds[1].revents & (POLLIN | POLLHUP))) {
+            ssize_t n = read(in_fd, rbuf, sizeof(rbuf));
+            if (n <= 0) {
+                in_eof = true;
+                if (!inbuf.empty()) inbuf += '\n';     // 最后一行没有换行符
+            } else {
+                inbuf.append(rbuf, n);
+            }
+
+            size_t pos = 0, nl;
+            while ((nl = inbuf.find('\n', pos)) != std::string::npos) {
+                std::string line = inbuf.substr(pos, nl - pos);
+                pos = nl + 1;
+                if (!have_to) {
+                    to = std::move(line), have_to = true;
+                } else {
+                    if (append_msg(outbuf, next_seq, to, line)) ++sent_msgs, ++next_seq;
+                    have_to = false;
+                }
+            }
+            inbuf.erase(0, pos);
+        }
+
+        // 尽量把待发送缓冲区写出去，不等回复
+        if (pfds[0].revents & POLLOUT) {
+            ssize_t n = send(sock, outbuf.data(), outbuf.size(), MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("send");
+                return 1;
+            }
+            if (n > 0) outbuf.erase(0, n);
+            if (outbuf.empty()) last_sent = clock::now();
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(sock, rbuf, sizeof(rbuf), 0);
+            if (n == 0) {
+                std::cerr << "Server closed." << std::endl;
+                break;
+            }
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recv");
+                break;
+            }
+            if (n > 0) {
+                recvbuf.append(rbuf, n);
+                if (!drain_frames(recvbuf, outbuf, on_msg, on_ack)) {
+                    std::cerr << "Invalid frame from server." << std::endl;
+                    break;
+                }
+                if (printbuf.size() >= BATCH_BUFSZ) flush_print();
+            }
+        }
+    }
+
+    // 发完后继续接收，直到空闲 wait_ms 。期间回复的密钥更新也要发出去
+    while (1) {
+        pollfd pfd{sock, static_cast<short>(POLLIN | (outbuf.empty() ? 0 : POLLOUT)), 0};
+        int ready = poll(&pfd, 1, wait_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) break;
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(sock, outbuf.data(), outbuf.size(), MSG_NOSIGNAL);
+            if (n > 0) outbuf.erase(0, n);
+        }
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        ssize_t n = recv(sock, rbuf, sizeof(rbuf), 0);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            break;
+        }
+        recvbuf.append(rbuf, n);
+        if (!drain_frames(recvbuf, outbuf, on_msg, on_ack)) {
+            std::cerr << "Invalid frame from server." << std::endl;
+            break;
+        }
+        if (printbuf.size() >= BATCH_BUFSZ) flush_print();
+    }
+    flush_print();
+    fflush(stdout);
+
+    double send_secs = std::chrono::duration<double>(last_sent - start).count();
+    double recv_secs = std::chrono::duration<double>(last_recv - first_recv).count();
+    std::cerr << std::format("[batch] Sent {} msgs in {:.3f} s ({:.2f} msgs/sec), received {} msgs in {:.3f} s ({:.2f} msgs/sec)", 
+        sent_msgs, send_secs, send_secs > 0 ? sent_msgs / send_secs : 0, 
+        recv_msgs, recv_secs, recv_secs > 0 ? recv_msgs / recv_secs : 0) << std::endl;
+    std::cerr << std::format("[batch] Acked {}, not delivered {}, unconfirmed {}", 
+        acked_msgs, nacked_msgs, sent_msgs - acked_msgs - nacked_msgs) << std::endl;
+    return 0;
+}
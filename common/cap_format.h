@@ -0,0 +1,68 @@
+#ifndef CAP_FORMAT_H
+#define CAP_FORMAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <arpa/inet.h>
+
+// ==================== 流量抓包文件格式 ====================
+// 文件头 16 字节： "TCPCAP1\n" + u8 标志 + 7 字节保留
+// 之后是连续的记录，整数均为网络字节序：
+//   [u64 时间戳(微秒，相对开始抓包)][u16 fromlen][u16 tolen][u32 消息长度][u8 是否带内容][from][to][内容(可选)]
+
+#define CAP_MAGIC "TCPCAP1\n"
+#define CAP_HDR_LEN 16
+#define CAP_REC_HDR_LEN 17
+#define CAP_FLAG_PAYLOAD 0x01   // 文件头标志：抓包时记录了消息内容
+
+struct CapRecord {
+    uint64_t ts_us;
+    std::string_view from, to;
+    uint32_t size;                  // 原消息长度
+    std::string_view payload;       // 没有记录内容时为空
+};
+
+
+inline void cap_append(std::string& out, uint64_t ts_us, std::string_view from, std::string_view to,
+                       const unsigned char* msg, uint32_t size, bool with_payload) {
+    uint32_t hi = htonl(static_cast<uint32_t>(ts_us >> 32)), lo = htonl(static_cast<uint32_t>(ts_us));
+    uint16_t n_fromlen = htons(static_cast<uint16_t>(from.size())), n_tolen = htons(static_cast<uint16_t>(to.size()));
+    uint32_t n_size = htonl(size);
+    out.append(reinterpret_cast<const char*>(&hi), 4);
+    out.append(reinterpret_cast<const char*>(&lo), 4);
+    out.append(reinterpret_cast<const char*>(&n_fromlen), 2);
+    out.append(reinterpret_cast<const char*>(&n_tolen), 2);
+    out.append(reinterpret_cast<const char*>(&n_size), 4);
+    out.push_back(with_payload ? 1 : 0);
+    out.append(from), out.append(to);
+    if (with_payload) out.append(reinterpret_cast<const char*>(msg), size);
+}
+
+
+// 从 p 开始解析一条记录，成功返回记录总长度，数据不完整或格式错误返回 0
+inline size_t cap_parse(const char* p, size_t len, CapRecord& rec) {
+    if (len < CAP_REC_HDR_LEN) return 0;
+
+    uint32_t hi, lo, n_size;
+    uint16_t n_fromlen, n_tolen;
+    memcpy(&hi, p, 4), memcpy(&lo, p + 4, 4);
+    memcpy(&n_fromlen, p + 8, 2), memcpy(&n_tolen, p + 10, 2);
+    memcpy(&n_size, p + 12, 4);
+    bool has_payload = p[16] != 0;
+
+    size_t fromlen = ntohs(n_fromlen), tolen = ntohs(n_tolen);
+    rec.ts_us = (static_cast<uint64_t>(ntohl(hi)) << 32) | ntohl(lo);
+    rec.size = ntohl(n_size);
+
+    size_t total = CAP_REC_HDR_LEN + fromlen + tolen + (has_payload ? rec.size : 0);
+    if (total > len) return 0;
+
+    rec.from = std::string_view(p + CAP_REC_HDR_LEN, fromlen);
+    rec.to = std::string_view(p + CAP_REC_HDR_LEN + fromlen, tolen);
+    rec.payload = has_payload ? std::string_view(p + CAP_REC_HDR_LEN + fromlen + tolen, rec.size) : std::string_view();
+    return total;
+}
+
+#endif // CAP_FORMAT_H
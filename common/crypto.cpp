@@ -6,16 +6,18 @@
 #include <cstring>
 #include <openssl/rand.h>
 #include <openssl/kdf.h>
+#include <arpa/inet.h>
 
 
 // 构造函数仅创建空对象
-Crypto::Crypto() noexcept : ecdh_keypr(nullptr, EVP_PKEY_free), peer_ecdh_pubkey(nullptr, EVP_PKEY_free) {}
+Crypto::Crypto() noexcept {}
 
 Crypto::~Crypto() {
     if (!aeskey.empty()) {
         OPENSSL_cleanse(aeskey.data(), aeskey.size());
         // vector 析构会自动释放，无需 clear
     }
+    if (!prev_aeskey.empty()) OPENSSL_cleanse(prev_aeskey.data(), prev_aeskey.size());
 }
 
 
@@ -114,6 +116,10 @@ void Crypto::derive_shared_secret(const vecuc *salt_override) {
 
     EVP_PKEY_CTX_free(ctx);
 
+    // 临时密钥用完即丢：之后只用 AES 密钥，长期在线的连接不必一直占着两个 EVP_PKEY
+    ecdh_keypr.reset();
+    peer_ecdh_pubkey.reset();
+
     // ------------------------------------------------------------
     // 接下来使用 HKDF-SHA256 从共享密钥派生出 32 字节 (256 位) 的 AES-256 密钥
     // ------------------------------------------------------------
@@ -172,108 +178,254 @@ void Crypto::derive_shared_secret(const vecuc *salt_override) {
     }
 
     EVP_PKEY_CTX_free(kdf_ctx);
+    OPENSSL_cleanse(shared_secret.data(), shared_secret.size());
 
     aeskey = std::move(derived_key);
 }
 
 
+// ========== 线程本地的 AES 上下文 ==========
+// 每次加解密都新建/释放 EVP_CIPHER_CTX 是两次堆分配，改为每个线程复用一个
+namespace {
+
+struct CipherCtx {
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    ~CipherCtx() { EVP_CIPHER_CTX_free(ctx); }
+};
+
+EVP_CIPHER_CTX* thread_cipher_ctx() {
+    thread_local CipherCtx holder;
+    if (!holder.ctx) throw std::runtime_error("Failed to create AES CTX");
+    return holder.ctx;
+}
+
+} // namespace
+
+
 // ========== AES 加密 ==========
-vecuc Crypto::aes_encrypt(const vecuc &plain) const {
-    if (aeskey.size() != 32) throw std::runtime_error("Invalid AES key length");
+// 输出格式： IV(12) | 密文(len) | tag(16)
+size_t Crypto::aes_encrypt_with(const unsigned char* key, const unsigned char* plain, size_t len, unsigned char* out) {
+    unsigned char iv[12];
+    if (!RAND_bytes(iv, 12)) throw std::runtime_error("Failed to generate IV");
+    return aes_encrypt_iv(key, iv, plain, len, out);
+}
 
-    vecuc iv(12);
-    if (!RAND_bytes(iv.data(), 12)) throw std::runtime_error("Failed to generate IV");
 
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) throw std::runtime_error("Failed to create AES CTX");
+size_t Crypto::aes_encrypt_iv(const unsigned char* key, const unsigned char* iv, const unsigned char* plain, size_t len, unsigned char* out) {
+    memcpy(out, iv, 12);
 
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, aeskey.data(), iv.data()) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    // 只换 IV 时不传算法和密钥，OpenSSL 保留已扩展的密钥
+    EVP_CIPHER_CTX *ctx = thread_cipher_ctx();
+    if (EVP_EncryptInit_ex(ctx, key ? EVP_aes_256_gcm() : nullptr, nullptr, key, iv) != 1) {
         throw std::runtime_error("AES encryption INIT error");
     }
 
-    vecuc cipher(plain.size() + EVP_MAX_BLOCK_LENGTH);
-    int len;
-    if (EVP_EncryptUpdate(ctx, cipher.data(), &len, plain.data(), static_cast<int>(plain.size())) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    int outl;
+    if (EVP_EncryptUpdate(ctx, out + 12, &outl, plain, static_cast<int>(len)) != 1) {
         throw std::runtime_error("AES encryption UPDATE error");
     }
-    int totlen = len;
+    size_t totlen = outl;
 
-    if (EVP_EncryptFinal_ex(ctx, cipher.data() + len, &len) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    if (EVP_EncryptFinal_ex(ctx, out + 12 + totlen, &outl) != 1) {
         throw std::runtime_error("AES encryption FINAL error");
     }
-    totlen += len;
+    totlen += outl;     // GCM 是流模式，totlen == len
 
-    vecuc tag(16);
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag.data()) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, out + 12 + totlen) != 1) {
         throw std::runtime_error("Failed to GET AES authentication tag");
     }
 
-    EVP_CIPHER_CTX_free(ctx);
-
-    vecuc(res);
-    res.reserve(iv.size() + totlen + tag.size());
-    res.insert(res.end(), iv.begin(), iv.end());
-    res.insert(res.end(), cipher.begin(), cipher.begin() + totlen);
-    res.insert(res.end(), tag.begin(), tag.end());
-    return res;
+    return 12 + totlen + 16;
 }
 
 
 // ========== AES 解密 ==========
-vecuc Crypto::aes_decrypt(const vecuc &cipher) const {
-    if (cipher.size() < 28 || aeskey.size() != 32) throw std::runtime_error("Invalid length of AES key or cipher");
+size_t Crypto::aes_decrypt_with(const unsigned char* key, const unsigned char* cipher, size_t len, unsigned char* out) {
+    if (len < AES_OVERHEAD) throw std::runtime_error("Invalid length of AES cipher");
 
-    vecuc iv(cipher.begin(), cipher.begin() + 12), tag(cipher.end() - 16, cipher.end()),
-        data(cipher.begin() + 12, cipher.end() - 16);
+    const unsigned char* iv = cipher;
+    const unsigned char* data = cipher + 12;
+    size_t datalen = len - AES_OVERHEAD;
+    unsigned char tag[16];
+    memcpy(tag, cipher + len - 16, 16);
 
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) throw std::runtime_error("Failed to create AES CTX");
-
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, aeskey.data(), iv.data()) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    EVP_CIPHER_CTX *ctx = thread_cipher_ctx();
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key, iv) != 1) {
         throw std::runtime_error("AES decryption INIT error");
     }
 
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, tag.data()) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, tag) != 1) {
         throw std::runtime_error("Failed to SET AES authentication tag");
     }
 
-    vecuc plain(cipher.size() + EVP_MAX_BLOCK_LENGTH);
-    int len;
-    if (EVP_DecryptUpdate(ctx, plain.data(), &len, data.data(), static_cast<int>(data.size())) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    int outl;
+    if (EVP_DecryptUpdate(ctx, out, &outl, data, static_cast<int>(datalen)) != 1) {
         throw std::runtime_error("AES decryption UPDATE error");
     }
-    int totlen = len;
+    size_t totlen = outl;
 
-    if (EVP_DecryptFinal_ex(ctx, plain.data() + len, &len) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    if (EVP_DecryptFinal_ex(ctx, out + totlen, &outl) != 1) {
         throw std::runtime_error("AES authentication (decryption FINAL) failed");
     }
-    totlen += len;
+    totlen += outl;
+
+    return totlen;
+}
+
+
+size_t Crypto::aes_decrypt_either(const unsigned char* key, const unsigned char* prev, const unsigned char* cipher, size_t len, unsigned char* out) {
+    try {
+        return aes_decrypt_with(key, cipher, len, out);
+    } catch (const std::exception&) {
+        if (!prev) throw;
+    }
+    return aes_decrypt_with(prev, cipher, len, out);
+}
+
+
+// ========== 不加密 ==========
+void Crypto::use_plaintext() {
+    ecdh_keypr.reset();
+    peer_ecdh_pubkey.reset();
+    aeskey.assign(32, 0);
+    plain = true;
+}
+
+
+size_t Crypto::plain_seal(const unsigned char* plain, size_t len, unsigned char* out) {
+    memset(out, 0, 12);
+    memcpy(out + 12, plain, len);
+    memset(out + 12 + len, 0, 16);
+    return len + AES_OVERHEAD;
+}
+
+
+size_t Crypto::plain_open(const unsigned char* cipher, size_t len, unsigned char* out) {
+    if (len < AES_OVERHEAD) throw std::runtime_error("Invalid length of AES cipher");
+    memcpy(out, cipher + 12, len - AES_OVERHEAD);
+    return len - AES_OVERHEAD;
+}
+
+
+size_t Crypto::aes_encrypt(const unsigned char* plain, size_t len, unsigned char* out) const {
+    if (aeskey.size() != 32) throw std::runtime_error("Invalid AES key length");
+    if (this->plain) return plain_seal(plain, len, out);
+    return aes_encrypt_with(aeskey.data(), plain, len, out);
+}
+
 
-    EVP_CIPHER_CTX_free(ctx);
-    plain.resize(totlen);
+size_t Crypto::aes_decrypt(const unsigned char* cipher, size_t len, unsigned char* out) const {
+    if (aeskey.size() != 32) throw std::runtime_error("Invalid AES key length");
+    if (plain) return plain_open(cipher, len, out);
+    return aes_decrypt_either(aeskey.data(), prev_aeskey.size() == 32 ? prev_aeskey.data() : nullptr, cipher, len, out);
+}
+
+
+// ========== 重载 AES 加密 ==========
+vecuc Crypto::aes_encrypt(const vecuc &plain) const {
+    vecuc res(plain.size() + AES_OVERHEAD);
+    aes_encrypt(plain.data(), plain.size(), res.data());
+    return res;
+}
+
+
+// ========== 重载 AES 解密 ==========
+vecuc Crypto::aes_decrypt(const vecuc &cipher) const {
+    if (cipher.size() < AES_OVERHEAD || aeskey.size() != 32) throw std::runtime_error("Invalid length of AES key or cipher");
+    vecuc plain(cipher.size() - AES_OVERHEAD);
+    plain.resize(aes_decrypt(cipher.data(), cipher.size(), plain.data()));
     return plain;
 }
 
 
 // ========== 重载 AES 加密 ==========
 std::string Crypto::aes_encrypt(const std::string &plainstr) const {
-    vecuc tmp(plainstr.begin(), plainstr.end());
-    vecuc res = aes_encrypt(tmp);
-    return std::string(res.begin(), res.end());
+    std::string res(plainstr.size() + AES_OVERHEAD, '\0');
+    aes_encrypt(reinterpret_cast<const unsigned char*>(plainstr.data()), plainstr.size(),
+        reinterpret_cast<unsigned char*>(res.data()));
+    return res;
 }
 
 
 // ========== 重载 AES 解密 ==========
 std::string Crypto::aes_decrypt(const std::string &cipherstr) const {
-    vecuc tmp(cipherstr.begin(), cipherstr.end());
-    vecuc res = aes_decrypt(tmp);
-    return std::string(res.begin(), res.end());
-}
\ No newline at end of file
+    if (cipherstr.size() < AES_OVERHEAD || aeskey.size() != 32) throw std::runtime_error("Invalid length of AES key or cipher");
+    std::string res(cipherstr.size() - AES_OVERHEAD, '\0');
+    res.resize(aes_decrypt(reinterpret_cast<const unsigned char*>(cipherstr.data()), cipherstr.size(),
+        reinterpret_cast<unsigned char*>(res.data())));
+    return res;
+}
+
+
+// ========== 密钥更新 ==========
+// 下一代密钥 = HKDF-SHA256(当前密钥, info) ，只用到哈希，代价远小于一次 ECDH
+void Crypto::next_key(const unsigned char* key, unsigned char* out) {
+    static const char info[] = "tcpchat key update";
+
+    EVP_PKEY_CTX* kdf_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    if (!kdf_ctx) throw std::runtime_error("Failed to create HKDF CTX");
+
+    size_t outlen = 32;
+    bool ok = EVP_PKEY_derive_init(kdf_ctx) == 1
+        && EVP_PKEY_CTX_hkdf_mode(kdf_ctx, EVP_PKEY_HKDEF_MODE_EXTRACT_AND_EXPAND) == 1
+        && EVP_PKEY_CTX_set_hkdf_md(kdf_ctx, EVP_sha256()) == 1
+        && EVP_PKEY_CTX_set1_hkdf_key(kdf_ctx, key, 32) == 1
+        && EVP_PKEY_CTX_add1_hkdf_info(kdf_ctx, reinterpret_cast<const unsigned char *>(info), sizeof(info) - 1) == 1
+        && EVP_PKEY_derive(kdf_ctx, out, &outlen) == 1 && outlen == 32;
+    EVP_PKEY_CTX_free(kdf_ctx);
+    if (!ok) throw std::runtime_error("Failed to derive next AES key via HKDF");
+}
+
+
+uint32_t Crypto::start_key_update() {
+    if (aeskey.size() != 32) throw std::runtime_error("Invalid AES key length");
+    if (plain) throw std::runtime_error("Plaintext connection has no key to update");
+    vecuc next(32);
+    next_key(aeskey.data(), next.data());
+
+    if (!prev_aeskey.empty()) OPENSSL_cleanse(prev_aeskey.data(), prev_aeskey.size());
+    prev_aeskey = std::move(aeskey);
+    aeskey = std::move(next);
+    key_update_pending = true;
+    key_uses = 0;
+    return ++key_gen;
+}
+
+
+Crypto::KeyUpdate Crypto::on_key_update(uint32_t gen, const unsigned char* proof, size_t len) {
+    if (aeskey.size() != 32 || plain || len != 4 + AES_OVERHEAD) return KeyUpdate::Invalid;
+
+    // proof 解出来应该就是代数本身
+    auto check = [&](const unsigned char* key) {
+        unsigned char plain[4];
+        try {
+            if (aes_decrypt_with(key, proof, len, plain) != 4) return false;
+        } catch (const std::exception&) {
+            return false;
+        }
+        uint32_t v;
+        memcpy(&v, plain, 4);
+        return v == htonl(gen);
+    };
+
+    if (gen == key_gen && key_update_pending) {
+        if (!check(aeskey.data())) return KeyUpdate::Invalid;
+        key_update_pending = false;
+        return KeyUpdate::Confirmed;
+    }
+    if (gen != key_gen + 1) return KeyUpdate::Invalid;
+
+    vecuc next(32);
+    next_key(aeskey.data(), next.data());
+    if (!check(next.data())) {
+        OPENSSL_cleanse(next.data(), next.size());
+        return KeyUpdate::Invalid;
+    }
+    if (!prev_aeskey.empty()) OPENSSL_cleanse(prev_aeskey.data(), prev_aeskey.size());
+    prev_aeskey = std::move(aeskey);
+    aeskey = std::move(next);
+    key_update_pending = false;
+    key_uses = 0;
+    ++key_gen;
+    return KeyUpdate::Reply;
+}
@@ -3,21 +3,35 @@
 
 #include <vector>
 #include <memory>
+#include <string>
+#include <cstdint>
 #include <openssl/evp.h>
 
 #define vecuc std::vector<unsigned char> // [NOTICE]
+#define AES_OVERHEAD 28                  // 每段密文比明文多出 12 字节 IV + 16 字节 tag
 
 // 统一的加密工具类。对于非文本的 “字符串” ，最好用 vector<unsigned char>
 class Crypto {
   private:
-    // ECC 密钥对（服务端长期密钥 + 客户端临时密钥）
-    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> ecdh_keypr;
-    // 对方的 ECC 公钥（服务端存客户端的，客户端存服务端的）
-    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> peer_ecdh_pubkey;
+    // 无状态的删除器，unique_ptr 不必再存一个函数指针
+    struct PkeyFree {
+        void operator()(EVP_PKEY* p) const { EVP_PKEY_free(p); }
+    };
+    // ECC 密钥对（双方的临时密钥）和对方的 ECC 公钥，只在握手期间持有，派生出 AES 密钥后即释放
+    std::unique_ptr<EVP_PKEY, PkeyFree> ecdh_keypr;
+    std::unique_ptr<EVP_PKEY, PkeyFree> peer_ecdh_pubkey;
 
   public:
     vecuc aeskey;  
 
+    // 密钥更新（见 proto.h 的 FT_KEY_UPDATE）：新密钥由当前密钥经 HKDF 派生，不再做 ECDH 。
+    // 上一代密钥保留到下一次更新，对方在更新前发出、还在路上的帧仍能解密
+    vecuc prev_aeskey;
+    uint32_t key_gen = 0;               // 当前密钥是第几代，握手得到的为第 0 代
+    bool key_update_pending = false;    // 本方发起了更新，还没收到对方的回应
+    uint64_t key_uses = 0;              // 当前密钥已加解密的帧数，由使用者计数，决定何时更新
+    bool plain = false;                 // 不加密（见 use_plaintext）
+
     explicit Crypto() noexcept;   // 构造函数仅构造无密钥的实例
     ~Crypto();                    // 析构函数用于安全擦除 AES 密钥内存
 
@@ -31,13 +45,42 @@ class Crypto {
     void generate_ecdh_keypr();                           // 生成 ECC 密钥对
     vecuc get_ecdh_pubkey() const;                        // 获取 ECC 公钥
     void set_peer_ecdh_pubkey(const vecuc &pubkey_der);   // 设置对方的 ECC 公钥
-    void derive_shared_secret(const vecuc *salt_override = nullptr);  // 计算共享密钥并派生 AES 密钥，可选传入盐值确保双方一致
+    void derive_shared_secret(const vecuc *salt_override = nullptr);  // 计算共享密钥并派生 AES 密钥，可选传入盐值确保双方一致。之后释放 ECC 密钥
+
+    // 本机可信连接不加密（见 proto.h 的 KA_PLAIN）：密钥置为全 0 占位，之后的 aes_* 只按密文的格式封装、不做运算，
+    // 帧格式和解析都不用变。也不做密钥更新
+    void use_plaintext();
 
     // =========== AES ===========
     vecuc aes_encrypt(const vecuc &plain) const;                  // AES 加密
     vecuc aes_decrypt(const vecuc &cipher) const;                 // AES 解密
     std::string aes_encrypt(const std::string &plainstr) const;   // 兼容性重载
     std::string aes_decrypt(const std::string &cipherstr) const;  // 兼容性重载
+
+    // 直接写入调用方提供的缓冲区，不产生任何临时对象。返回写入的字节数，失败抛异常
+    size_t aes_encrypt(const unsigned char* plain, size_t len, unsigned char* out) const;   // out 至少 len + AES_OVERHEAD
+    size_t aes_decrypt(const unsigned char* cipher, size_t len, unsigned char* out) const;  // out 至少 len - AES_OVERHEAD
+    // 同上，但使用外部给出的 32 字节密钥，方便在锁外用密钥副本加解密
+    static size_t aes_encrypt_with(const unsigned char* key, const unsigned char* plain, size_t len, unsigned char* out);
+    static size_t aes_decrypt_with(const unsigned char* key, const unsigned char* cipher, size_t len, unsigned char* out);
+    // 批量加密用：IV 由调用者给出（可一次生成一批）；key 为 nullptr 时沿用本线程上一次的密钥，省去密钥扩展
+    static size_t aes_encrypt_iv(const unsigned char* key, const unsigned char* iv, const unsigned char* plain, size_t len, unsigned char* out);
+    // 先用 key 解密，认证失败且 prev 不为 nullptr 时再用 prev 试一次（密钥更新的重叠期）
+    static size_t aes_decrypt_either(const unsigned char* key, const unsigned char* prev, const unsigned char* cipher, size_t len, unsigned char* out);
+    // 不加密的连接用：按 IV(12) | 明文 | tag(16) 的格式封装 / 取出，IV 和 tag 为 0
+    static size_t plain_seal(const unsigned char* plain, size_t len, unsigned char* out);
+    static size_t plain_open(const unsigned char* cipher, size_t len, unsigned char* out);
+
+    // =========== 密钥更新 ===========
+    static void next_key(const unsigned char* key, unsigned char* out);  // 由 32 字节的 key 派生下一代密钥，写入 out
+    uint32_t start_key_update();        // 本方发起：换成下一代密钥，返回新的代数。调用者随即发出 FT_KEY_UPDATE
+
+    enum class KeyUpdate { Reply, Confirmed, Invalid };
+    // 处理对方发来的 FT_KEY_UPDATE ：gen 为对方的代数，proof 为用该代密钥加密的代数。
+    //   Reply     对方发起的更新，已换成新密钥，调用者应以同一代数回一个 FT_KEY_UPDATE ；
+    //   Confirmed 对本方更新的回应（或双方同时发起了同一代），无需回复；
+    //   Invalid   代数对不上或 proof 认证失败，密钥不变
+    KeyUpdate on_key_update(uint32_t gen, const unsigned char* proof, size_t len);
 };
 
 #endif // CRYPTO_H
\ No newline at end of file
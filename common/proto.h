@@ -0,0 +1,299 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include "crypto.h"
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <span>
+#include <string_view>
+#include <arpa/inet.h>
+
+// ==================== 协议编解码 ====================
+// 服务端、客户端和各测试工具共用，只有头文件。
+//   解析：校验长度后返回指向收包缓冲区的 std::span ，不拷贝、不分配；
+//   组装：写进调用者给出的缓冲区，密文由传入的加密函数直接写到最终位置。
+//
+// 普通帧为 [u16 tolen][u32 msglen][c_to][c_msg] ，c_to 是密文，至少 AES_OVERHEAD 字节，所以 tolen 不会是 0 。
+// 借此用 tolen == 0 表示扩展帧： [u16 0][u32 bodylen][u8 类型][u32 序号][按类型而定] ，整数均为网络字节序。
+// 帧长仍是 6 + tolen + msglen ，收包拆包的逻辑不用改；服务端发给客户端的方向同理（fromlen == 0）。
+//   FT_MSG （客户端 -> 服务端）： [u16 c_tolen][c_to][c_msg] ，服务端路由后回一个 FT_ACK
+//   FT_ACK （服务端 -> 客户端）： [u8 状态] ，序号与对应的 FT_MSG 相同
+//   FT_HIST（双向）：布局同 FT_MSG 。客户端发出的是历史查询，c_to 为对方用户名，c_msg 为 HistQuery ；
+//          服务端逐条回复查到的消息，c_to 为 [u64 时间戳][发送者]，c_msg 为内容，最后以同一序号的 FT_ACK 结束
+//   FT_KEY_UPDATE（双向）：[c_proof] ，序号位置放新密钥的代数，c_proof 是用新密钥加密的 u32 代数。
+//          发出后本方改用新密钥加密；对方收到后同样换成新密钥，并以同一代数回一个，表示此后发来的帧都用新密钥。
+//          双方都保留上一代密钥解密在途的旧帧，所以更新期间消息照常收发。没有确认
+// 普通帧照旧可用，但不会收到确认
+//
+// 握手阶段的数据（用户名、公钥）另有一种更简单的封装： [u32 len][内容]
+// 经 Unix 域 socket 连接的本机客户端可以在用户名之前先发一个 KA_PLAIN ，请求不加密。服务端认可对端的凭据（SO_PEERCRED）时
+// 以 KA_PLAIN 代替公钥回复，双方都不再交换公钥，之后的帧格式不变，只是不加密（见 Crypto::use_plaintext）；
+// 不认可时照常回复公钥，客户端继续密钥交换
+
+using bytes_view = std::span<const unsigned char>;
+
+// 各种头部的布局
+inline constexpr size_t FRAME_HDR_LEN = 6;                                  // [u16][u32]
+inline constexpr size_t EXT_TYPE_OFF = FRAME_HDR_LEN;                       // 扩展帧的类型
+inline constexpr size_t EXT_SEQ_OFF = EXT_TYPE_OFF + 1;                     // 扩展帧的序号
+inline constexpr size_t EXT_HDR_LEN = 5;                                    // [u8 类型][u32 序号]
+inline constexpr size_t EXT_MSG_HDR_LEN = FRAME_HDR_LEN + EXT_HDR_LEN + 2;  // FT_MSG 密文之前的部分
+inline constexpr size_t ACK_STATUS_OFF = FRAME_HDR_LEN + EXT_HDR_LEN;
+inline constexpr size_t ACK_FRAME_LEN = ACK_STATUS_OFF + 1;
+inline constexpr size_t MIN_FRAME_LEN = FRAME_HDR_LEN + EXT_HDR_LEN;        // 最短的合法帧（扩展帧头）；普通帧的两段密文更长
+inline constexpr size_t MAX_FRAME_LEN = 64u << 20;                          // 帧长上限，超过的视为对端出错，断开连接
+inline constexpr size_t KA_HDR_LEN = 4;                                     // 握手数据的 [u32 len]
+inline constexpr unsigned char KA_PLAIN[1] = {0};                           // 请求 / 同意不加密。用户名和公钥都不会是单个 0 字节
+
+// 帧类型
+inline constexpr uint8_t FT_MSG = 1;
+inline constexpr uint8_t FT_ACK = 2;
+inline constexpr uint8_t FT_HIST = 3;
+inline constexpr uint8_t FT_KEY_UPDATE = 4;
+
+// 确认状态
+inline constexpr uint8_t ACK_OK = 0;            // 已交给收件人的发送队列
+inline constexpr uint8_t ACK_FORWARDED = 1;     // 收件人不在本节点，已交给集群转发。整个集群都找不到时，仍以 "No such user." 消息通知
+inline constexpr uint8_t NACK_NO_USER = 2;      // 收件人不在线
+inline constexpr uint8_t NACK_BAD_FRAME = 3;    // 格式错误或解密失败
+inline constexpr uint8_t NACK_RATE_LIMITED = 4; // 超出服务端的限速，已丢弃
+inline constexpr uint8_t NACK_NOT_MEMBER = 5;   // 不是该群的成员
+inline constexpr uint8_t NACK_FORBIDDEN = 6;    // 无权广播
+inline constexpr uint8_t ACK_STORED = 7;        // 收件人登录过但不在线，已存为离线消息，下次登录时投递
+inline constexpr uint8_t NACK_MAILBOX_FULL = 8; // 收件人不在线，且离线消息已达上限
+inline constexpr uint8_t NACK_UNSUPPORTED = 9;  // 服务端未启用该功能（如历史记录）
+
+// 服务端已接受（送达、转发或存为离线消息），不必重发
+inline bool ack_accepted(uint8_t status) { return status == ACK_OK || status == ACK_FORWARDED || status == ACK_STORED; }
+
+// 群组与广播。收件人以 GROUP_PREFIX 开头即为群名，等于 BROADCAST_TO 则发给本节点所有在线用户（仅限管理员）。
+// 发给群的消息内容为 GROUP_JOIN / GROUP_LEAVE 时是加入 / 退出，不转发。群只在本节点内有效，最后一个成员离开即解散
+inline constexpr char GROUP_PREFIX = '#';
+inline constexpr std::string_view BROADCAST_TO = "*";
+inline constexpr std::string_view GROUP_JOIN = ".join";
+inline constexpr std::string_view GROUP_LEAVE = ".leave";
+
+inline bool is_group_name(std::string_view to) { return !to.empty() && (to[0] == GROUP_PREFIX || to == BROADCAST_TO); }
+
+
+inline void put_u16(unsigned char* p, uint16_t v) { v = htons(v); memcpy(p, &v, 2); }
+inline void put_u32(unsigned char* p, uint32_t v) { v = htonl(v); memcpy(p, &v, 4); }
+inline uint16_t get_u16(const unsigned char* p) { uint16_t v; memcpy(&v, p, 2); return ntohs(v); }
+inline uint32_t get_u32(const unsigned char* p) { uint32_t v; memcpy(&v, p, 4); return ntohl(v); }
+
+inline void put_u64(unsigned char* p, uint64_t v) { put_u32(p, static_cast<uint32_t>(v >> 32)); put_u32(p + 4, static_cast<uint32_t>(v)); }
+inline uint64_t get_u64(const unsigned char* p) { return (static_cast<uint64_t>(get_u32(p)) << 32) | get_u32(p + 4); }
+
+inline bytes_view to_bytes(std::string_view sv) { return {reinterpret_cast<const unsigned char*>(sv.data()), sv.size()}; }
+
+
+// 历史查询：与对方的会话中，时间戳（Unix 微秒）在 [since, until) 内的最后 limit 条，按时间先后返回。
+// since / until 为 0 表示不限，limit 为 0 或超过 HIST_MAX_LIMIT 时按 HIST_MAX_LIMIT 算
+struct HistQuery {
+    uint32_t limit = 0;
+    uint64_t since_us = 0, until_us = 0;
+};
+
+inline constexpr size_t HIST_QUERY_LEN = 20;    // [u32 limit][u64 since][u64 until]
+inline constexpr uint32_t HIST_MAX_LIMIT = 1000;
+
+inline void put_hist_query(unsigned char* p, const HistQuery& q) {
+    put_u32(p, q.limit), put_u64(p + 4, q.since_us), put_u64(p + 12, q.until_us);
+}
+
+inline bool get_hist_query(bytes_view b, HistQuery& q) {
+    if (b.size() != HIST_QUERY_LEN) return false;
+    q.limit = get_u32(b.data()), q.since_us = get_u64(b.data() + 4), q.until_us = get_u64(b.data() + 12);
+    return true;
+}
+
+
+// ==================== 长度 ====================
+constexpr size_t cipher_len(size_t plain_len) { return plain_len + AES_OVERHEAD; }
+
+// 两段明文分别为 alen 、blen 字节时，普通帧 / FT_MSG 的总长
+constexpr size_t frame_len(size_t alen, size_t blen) { return FRAME_HDR_LEN + cipher_len(alen) + cipher_len(blen); }
+constexpr size_t msg_frame_len(size_t tolen, size_t msglen) { return EXT_MSG_HDR_LEN + cipher_len(tolen) + cipher_len(msglen); }
+
+inline constexpr size_t KEY_UPDATE_FRAME_LEN = FRAME_HDR_LEN + EXT_HDR_LEN + cipher_len(4);
+
+static_assert(EXT_MSG_HDR_LEN == 13 && ACK_FRAME_LEN == 12);
+
+
+// 缓冲区开头那一帧的总长。头部还没收全时返回 0
+inline size_t peek_frame_len(bytes_view buf) {
+    if (buf.size() < FRAME_HDR_LEN) return 0;
+    return FRAME_HDR_LEN + get_u16(buf.data()) + static_cast<size_t>(get_u32(buf.data() + 2));
+}
+
+
+// 缓冲区开头那一帧的长度是否合法。头部还没收全时算合法
+inline bool frame_len_valid(bytes_view buf) {
+    size_t len = peek_frame_len(buf);
+    return !len || (len >= MIN_FRAME_LEN && len <= MAX_FRAME_LEN);
+}
+
+
+// ==================== 解析 ====================
+// 一帧的解析结果，span 都指向原缓冲区，缓冲区释放前有效
+struct FrameView {
+    uint8_t type = 0;           // 普通帧为 0
+    uint32_t seq = 0;
+    uint8_t status = 0;         // 仅 FT_ACK
+    bytes_view c_a, c_b;        // 普通帧和 FT_MSG 的两段密文：发送者或收件人，消息
+};
+
+
+// pck 是一个完整的帧。格式不对（长度不符、密文过短、未知的扩展帧类型）时返回 false
+inline bool parse_frame(bytes_view pck, FrameView& f) {
+    size_t len = peek_frame_len(pck);
+    if (!len || len > pck.size()) return false;
+
+    size_t alen = get_u16(pck.data()), blen = get_u32(pck.data() + 2);
+    size_t at = FRAME_HDR_LEN;
+    f.type = 0, f.seq = 0, f.status = 0;
+    if (alen == 0) {
+        if (blen < EXT_HDR_LEN) return false;
+        f.type = pck[EXT_TYPE_OFF];
+        f.seq = get_u32(pck.data() + EXT_SEQ_OFF);
+        switch (f.type) {
+        case FT_ACK:
+            if (blen < EXT_HDR_LEN + 1) return false;
+            f.status = pck[ACK_STATUS_OFF];
+            f.c_a = f.c_b = {};
+            return true;
+        case FT_KEY_UPDATE:
+            if (blen != EXT_HDR_LEN + cipher_len(4)) return false;
+            f.c_a = pck.subspan(FRAME_HDR_LEN + EXT_HDR_LEN, cipher_len(4));
+            f.c_b = {};
+            return true;
+        case FT_MSG:
+        case FT_HIST:
+            if (blen < EXT_HDR_LEN + 2) return false;
+            alen = get_u16(pck.data() + FRAME_HDR_LEN + EXT_HDR_LEN);
+            if (EXT_HDR_LEN + 2 + alen > blen) return false;
+            blen -= EXT_HDR_LEN + 2 + alen;
+            at = EXT_MSG_HDR_LEN;
+            break;
+        default:
+            return false;
+        }
+    }
+    if (alen < AES_OVERHEAD || blen < AES_OVERHEAD) return false;
+    f.c_a = pck.subspan(at, alen);
+    f.c_b = pck.subspan(at + alen, blen);
+    return true;
+}
+
+
+// 只取扩展帧的序号，不校验其余部分。用于回复无法解析或不予处理的帧
+inline bool peek_seq(bytes_view pck, uint32_t& seq) {
+    if (pck.size() < FRAME_HDR_LEN + EXT_HDR_LEN || get_u16(pck.data()) != 0) return false;
+    seq = get_u32(pck.data() + EXT_SEQ_OFF);
+    return true;
+}
+
+
+// 只取扩展帧的类型，普通帧或头部不全时返回 0
+inline uint8_t peek_type(bytes_view pck) {
+    if (pck.size() <= EXT_TYPE_OFF || get_u16(pck.data()) != 0) return 0;
+    return pck[EXT_TYPE_OFF];
+}
+
+
+// 依次取出 buf 中所有完整的帧交给 on_frame(bytes_view) ，返回用掉的字节数，剩下的是不完整的帧。
+// 遇到长度不合法的帧就停下，调用者可以用 frame_len_valid 检查剩下的部分
+template<class F>
+size_t for_each_frame(bytes_view buf, F&& on_frame) {
+    size_t off = 0;
+    while (1) {
+        size_t len = peek_frame_len(buf.subspan(off));
+        if (!len || !frame_len_valid(buf.subspan(off)) || buf.size() - off < len) break;
+        on_frame(buf.subspan(off, len));
+        off += len;
+    }
+    return off;
+}
+
+
+// ==================== 组装 ====================
+// enc(const unsigned char* plain, size_t len, unsigned char* out) 把明文加密到 out ，返回写入的字节数，失败抛异常。
+// 组装函数都要求 out 至少有对应的 *_len() 字节，返回实际写入的字节数
+
+// 普通帧（服务端投递的消息，以及旧客户端发的消息）
+template<class Enc>
+size_t build_frame(unsigned char* out, bytes_view a, bytes_view b, Enc&& enc) {
+    put_u16(out, static_cast<uint16_t>(cipher_len(a.size())));
+    put_u32(out + 2, static_cast<uint32_t>(cipher_len(b.size())));
+    size_t at = FRAME_HDR_LEN;
+    at += enc(a.data(), a.size(), out + at);
+    at += enc(b.data(), b.size(), out + at);
+    return at;
+}
+
+
+// FT_MSG （或同样布局的 FT_HIST）的头部，两段密文由调用者紧接着写入。序号单独改写时也可以只调这个
+inline void ext_msg_hdr(unsigned char* p, uint32_t seq, size_t c_tolen, size_t c_msglen, uint8_t type = FT_MSG) {
+    put_u16(p, 0);
+    put_u32(p + 2, static_cast<uint32_t>(EXT_HDR_LEN + 2 + c_tolen + c_msglen));
+    p[EXT_TYPE_OFF] = type;
+    put_u32(p + EXT_SEQ_OFF, seq);
+    put_u16(p + FRAME_HDR_LEN + EXT_HDR_LEN, static_cast<uint16_t>(c_tolen));
+}
+
+
+template<class Enc>
+size_t build_msg(unsigned char* out, uint32_t seq, bytes_view to, bytes_view msg, Enc&& enc, uint8_t type = FT_MSG) {
+    ext_msg_hdr(out, seq, cipher_len(to.size()), cipher_len(msg.size()), type);
+    size_t at = EXT_MSG_HDR_LEN;
+    at += enc(to.data(), to.size(), out + at);
+    at += enc(msg.data(), msg.size(), out + at);
+    return at;
+}
+
+
+inline void make_ack(unsigned char* p, uint32_t seq, uint8_t status) {
+    put_u16(p, 0);
+    put_u32(p + 2, EXT_HDR_LEN + 1);
+    p[EXT_TYPE_OFF] = FT_ACK;
+    put_u32(p + EXT_SEQ_OFF, seq);
+    p[ACK_STATUS_OFF] = status;
+}
+
+
+// enc 须使用新一代的密钥
+template<class Enc>
+size_t build_key_update(unsigned char* out, uint32_t gen, Enc&& enc) {
+    put_u16(out, 0);
+    put_u32(out + 2, static_cast<uint32_t>(EXT_HDR_LEN + cipher_len(4)));
+    out[EXT_TYPE_OFF] = FT_KEY_UPDATE;
+    put_u32(out + EXT_SEQ_OFF, gen);
+    unsigned char plain[4];
+    put_u32(plain, gen);
+    return FRAME_HDR_LEN + EXT_HDR_LEN + enc(plain, 4, out + FRAME_HDR_LEN + EXT_HDR_LEN);
+}
+
+
+// 握手数据的头部，内容由调用者紧接着写入
+inline void ka_hdr(unsigned char* p, size_t len) { put_u32(p, static_cast<uint32_t>(len)); }
+
+
+inline const char* ack_status_str(uint8_t status) {
+    switch (status) {
+    case ACK_OK: return "Delivered";
+    case ACK_FORWARDED: return "Forwarded";
+    case NACK_NO_USER: return "No such user";
+    case NACK_BAD_FRAME: return "Bad frame";
+    case NACK_RATE_LIMITED: return "Rate limited";
+    case NACK_NOT_MEMBER: return "Not a member";
+    case NACK_FORBIDDEN: return "Forbidden";
+    case ACK_STORED: return "Stored";
+    case NACK_MAILBOX_FULL: return "Mailbox full";
+    case NACK_UNSUPPORTED: return "Not supported";
+    default: return "Unknown";
+    }
+}
+
+#endif // PROTO_H
@@ -1,3 +1,6 @@
+#include "crypto.h"
+#include "proto.h"
+
 #include <iostream>
 #include <sys/socket.h>
 #include <cerrno>
@@ -8,9 +11,11 @@
 #include <cstring>
 #include <cstdint>
 #include <arpa/inet.h>
+#include <poll.h>
 
 #define MAX_RETRIES 100     // 最大重试次数
-#define BUFSZ 1024
+#define KA_TIMEOUT_MS 5000  // 非阻塞 socket 上握手等待对端数据的最长时间
+#define KA_MAX_LEN 65536    // 握手数据的长度上限
 
 
 void Send(int sock, const char* sp, int len) {
@@ -42,46 +47,93 @@ void Send(int sock, const char* sp, int len) {
 
 // 内容前面加上 4 字节长度
 void send_for_ka(int sock, const unsigned char* vp, int len) {
-    std::string s;
-    s.reserve(len + 4);
-    uint32_t n_len = htonl(static_cast<uint32_t>(len));
-    s.append(reinterpret_cast<const char*>(&n_len), sizeof(n_len));
-    s.append(std::string(reinterpret_cast<const char*>(vp), len));
+    std::string s(KA_HDR_LEN + len, '\0');
+    unsigned char* p = reinterpret_cast<unsigned char*>(s.data());
+    ka_hdr(p, len);
+    memcpy(p + KA_HDR_LEN, vp, len);
     Send(sock, s.c_str(), s.length());
 }
 
 
-// 内容放进 vp, 长度放进 len, 调用方实现错误处理
-void recv_for_ka(int sock, std::vector<unsigned char>& vp, int& len) {
-    int tot{}, expected;
-    char buf[BUFSZ];
-    std::string s{};
-
-    while (tot < 4) {
-        int rlen = recv(sock, buf, BUFSZ - 1, 0);
-        if (rlen <= 0) {
-            len = rlen;
-            return;
+// 阻塞 socket 同 recv ；非阻塞 socket 没数据时用 poll 等待，超时返回 -1
+static int recv_wait(int sock, char* buf, int len) {
+    while (1) {
+        int rlen = recv(sock, buf, len, 0);
+        if (rlen >= 0) return rlen;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return rlen;
+
+        pollfd pfd{sock, POLLIN, 0};
+        int ready = poll(&pfd, 1, KA_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
         }
-        tot += rlen;
-        s += std::string(buf, rlen);
     }
+}
 
-    uint32_t n_len;
-    memcpy(&n_len, s.c_str(), sizeof(n_len));
-    expected = ntohl(n_len);
-    tot -= 4;
 
-    while (tot < expected) {
-        int rlen = recv(sock, buf, BUFSZ - 1, 0);
-        if (rlen <= 0) {
-            len = rlen;
-            return;
-        }
+// 恰好收 n 字节。失败时返回 recv_wait 的返回值（0 或 -1），成功返回 n
+static int recv_exact(int sock, unsigned char* p, int n) {
+    int tot = 0;
+    while (tot < n) {
+        int rlen = recv_wait(sock, reinterpret_cast<char*>(p + tot), n - tot);
+        if (rlen <= 0) return rlen;
         tot += rlen;
-        s += std::string(buf, rlen);
+    }
+    return tot;
+}
+
+
+// 内容放进 vp, 长度放进 len, 调用方实现错误处理。只读这一段数据，不会多读走对端之后发来的内容
+void recv_for_ka(int sock, std::vector<unsigned char>& vp, int& len) {
+    unsigned char hdr[KA_HDR_LEN];
+    int rlen = recv_exact(sock, hdr, KA_HDR_LEN);
+    if (rlen <= 0) {
+        len = rlen;
+        return;
     }
 
-    vp = std::vector<unsigned char>(s.begin() + 4, s.begin() + 4 + expected);
-    len = expected;
-}
\ No newline at end of file
+    uint32_t expected = get_u32(hdr);
+    if (expected > KA_MAX_LEN) {     // 握手数据只有用户名和公钥，过长的一定不对
+        len = -1;
+        return;
+    }
+    vp.resize(expected);
+    rlen = recv_exact(sock, vp.data(), expected);
+    len = rlen <= 0 ? rlen : static_cast<int>(expected);
+}
+
+
+// 客户端一侧的完整握手：发送用户名，收服务端公钥，派生 AES 密钥，再发送自己的公钥。
+// plain 为 true 时先请求不加密（见 proto.h 的 KA_PLAIN），服务端同意就到此为止，不同意照常交换密钥
+bool cli_handshake(int sock, const std::string& username, Crypto& crypto, bool plain) {
+    if (plain) send_for_ka(sock, KA_PLAIN, sizeof(KA_PLAIN));
+    send_for_ka(sock, reinterpret_cast<const unsigned char*>(username.c_str()), username.length());
+
+    std::vector<unsigned char> srv_pubkey;
+    int len;
+    recv_for_ka(sock, srv_pubkey, len);
+    if (len <= 0) return false;
+    if (plain && srv_pubkey.size() == sizeof(KA_PLAIN) && srv_pubkey[0] == KA_PLAIN[0]) {
+        crypto.use_plaintext();
+        return true;
+    }
+
+    try {
+        crypto.generate_ecdh_keypr();
+        vecuc cli_pubkey = crypto.get_ecdh_pubkey();
+        crypto.set_peer_ecdh_pubkey(srv_pubkey);
+
+        // 与服务端相同的固定盐值
+        static const vecuc fixed_salt = {0x11, 0x45, 0x14, 0x19, 0x19, 0x81, 0x0f, 0x91, 
+                                        0x0d, 0x00, 0x07, 0x21, 0xc1, 0x2a, 0xc1, 0x01};
+        crypto.derive_shared_secret(&fixed_salt);
+
+        send_for_ka(sock, cli_pubkey.data(), cli_pubkey.size());
+    } catch (const std::exception& e) {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,186 @@
+#include "buf_pool.h"
+
+#include <cstdlib>
+#include <new>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+#define TCACHE_CAP 128      // 每个线程每级最多缓存多少块
+#define TCACHE_BATCH 32     // 与全局仓库之间一次搬运多少块
+#define NSLOTS 256          // 分配计数槽数量
+
+
+// ==================== 分配计数 ====================
+namespace {
+
+struct alignas(64) CounterSlot {
+    std::atomic<uint64_t> heap_allocs{}, pool_gets{}, pool_misses{};
+};
+
+// 全是常量初始化，operator new 在静态初始化阶段被调用也是安全的
+CounterSlot slots[NSLOTS];
+std::atomic<unsigned> next_slot{0};
+thread_local int my_slot = -1;
+
+inline CounterSlot& counters() noexcept {
+    if (my_slot < 0) my_slot = static_cast<int>(next_slot.fetch_add(1, std::memory_order_relaxed) % NSLOTS);
+    return slots[my_slot];
+}
+
+} // namespace
+
+
+AllocStats alloc_stats() {
+    AllocStats s{};
+    for (auto& c : slots) {
+        s.heap_allocs += c.heap_allocs.load(std::memory_order_relaxed);
+        s.pool_gets += c.pool_gets.load(std::memory_order_relaxed);
+        s.pool_misses += c.pool_misses.load(std::memory_order_relaxed);
+    }
+    return s;
+}
+
+
+// 替换全局 operator new ，只为计数。delete 仍然是 free 。本文件只链接进服务端（srv 和 bench），客户端和测试工具不受影响
+void* operator new(size_t n) {
+    counters().heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(n ? n : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+
+// ==================== 全局仓库与线程缓存 ====================
+namespace {
+
+struct Depot {
+    std::mutex mtx[BufPool::NCLS];
+    std::vector<unsigned char*> blocks[BufPool::NCLS];
+};
+
+// 故意不析构：线程缓存可能在静态对象析构之后才归还
+Depot& depot() {
+    static Depot* d = new Depot;
+    return *d;
+}
+
+struct ThreadCache {
+    unsigned char* blocks[BufPool::NCLS][TCACHE_CAP];
+    size_t cnt[BufPool::NCLS]{};
+
+    // 缓存满了，把最早放进来的一批交给全局仓库
+    void spill(int cls, size_t n) {
+        Depot& d = depot();
+        std::lock_guard<std::mutex> lock(d.mtx[cls]);
+        d.blocks[cls].insert(d.blocks[cls].end(), blocks[cls], blocks[cls] + n);
+        cnt[cls] -= n;
+        for (size_t i = 0; i < cnt[cls]; ++i) blocks[cls][i] = blocks[cls][i + n];
+    }
+
+    // 缓存空了，从全局仓库取一批
+    void refill(int cls) {
+        Depot& d = depot();
+        std::lock_guard<std::mutex> lock(d.mtx[cls]);
+        auto& v = d.blocks[cls];
+        size_t n = std::min<size_t>(TCACHE_BATCH, v.size());
+        for (size_t i = 0; i < n; ++i) blocks[cls][cnt[cls]++] = v[v.size() - n + i];
+        v.resize(v.size() - n);
+    }
+
+    ~ThreadCache() {
+        for (size_t c = 0; c < BufPool::NCLS; ++c) {
+            if (cnt[c]) spill(static_cast<int>(c), cnt[c]);
+        }
+    }
+};
+
+thread_local ThreadCache tcache;
+
+inline int size_to_cls(size_t n) noexcept {
+    for (size_t c = 0; c < BufPool::NCLS; ++c) {
+        if (n <= BufPool::cls_size[c]) return static_cast<int>(c);
+    }
+    return -1;
+}
+
+} // namespace
+
+
+// ==================== BufPool ====================
+Buf BufPool::get(size_t n) {
+    counters().pool_gets.fetch_add(1, std::memory_order_relaxed);
+
+    Buf b;
+    b.cls = size_to_cls(n);
+    b.len = n;
+
+    if (b.cls < 0) {
+        counters().pool_misses.fetch_add(1, std::memory_order_relaxed);
+        b.ptr = static_cast<unsigned char*>(std::malloc(n));
+        if (!b.ptr) throw std::bad_alloc();
+        b.cap = n;
+        return b;
+    }
+
+    b.cap = cls_size[b.cls];
+    ThreadCache& tc = tcache;
+    if (!tc.cnt[b.cls]) tc.refill(b.cls);
+    if (tc.cnt[b.cls]) {
+        b.ptr = tc.blocks[b.cls][--tc.cnt[b.cls]];
+        return b;
+    }
+
+    counters().pool_misses.fetch_add(1, std::memory_order_relaxed);
+    b.ptr = static_cast<unsigned char*>(std::malloc(b.cap));
+    if (!b.ptr) throw std::bad_alloc();
+    return b;
+}
+
+
+void BufPool::put(unsigned char* p, int cls) noexcept {
+    if (cls < 0) {
+        std::free(p);
+        return;
+    }
+    ThreadCache& tc = tcache;
+    if (tc.cnt[cls] == TCACHE_CAP) tc.spill(cls, TCACHE_BATCH);
+    tc.blocks[cls][tc.cnt[cls]++] = p;
+}
+
+
+void* BufPool::alloc(size_t n) {
+    Buf b = get(n);
+    return std::exchange(b.ptr, nullptr);
+}
+
+
+void BufPool::free(void* p, size_t n) noexcept {
+    put(static_cast<unsigned char*>(p), size_to_cls(n));
+}
+
+
+// ==================== Buf ====================
+Buf::~Buf() {
+    if (ptr) BufPool::put(ptr, cls);
+}
+
+Buf::Buf(Buf &&o) noexcept : ptr(o.ptr), len(o.len), cap(o.cap), cls(o.cls) {
+    o.ptr = nullptr, o.len = o.cap = 0;
+}
+
+Buf &Buf::operator=(Buf &&o) noexcept {
+    if (this != &o) {
+        if (ptr) BufPool::put(ptr, cls);
+        ptr = o.ptr, len = o.len, cap = o.cap, cls = o.cls;
+        o.ptr = nullptr, o.len = o.cap = 0;
+    }
+    return *this;
+}
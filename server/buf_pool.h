@@ -0,0 +1,65 @@
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+
+// ==================== 分级缓冲区池 ====================
+// 帧缓冲和加解密临时空间按大小分级复用，每个线程一份空闲链表，不够时再从全局仓库批量取。
+// Buf 只能移动，可以在 Reactor 和工作线程之间转手；谁最后析构，块就回到谁的线程缓存，不必回到 malloc 。
+
+class Buf {
+  private:
+    unsigned char* ptr{};
+    size_t len{};
+    size_t cap{};
+    int cls{-1};     // 所属大小级别，-1 表示超出最大级别、直接 malloc 的块
+
+    friend class BufPool;
+
+  public:
+    Buf() noexcept = default;
+    ~Buf();
+
+    Buf(const Buf &) = delete;
+    Buf &operator=(const Buf &) = delete;
+    Buf(Buf &&o) noexcept;
+    Buf &operator=(Buf &&o) noexcept;
+
+    unsigned char* data() noexcept { return ptr; }
+    const unsigned char* data() const noexcept { return ptr; }
+    const char* c_str() const noexcept { return reinterpret_cast<const char*>(ptr); }   // 不保证以 '\0' 结尾
+    size_t size() const noexcept { return len; }
+    size_t capacity() const noexcept { return cap; }
+    bool empty() const noexcept { return len == 0; }
+
+    void resize(size_t n) noexcept { len = n; }     // 只改有效长度，调用方保证 n <= capacity()
+};
+
+
+class BufPool {
+  public:
+    static constexpr size_t NCLS = 6;
+    static constexpr size_t cls_size[NCLS] = {64, 256, 1024, 4096, 16384, 65536};
+
+    static Buf get(size_t n);   // 取一块容量不小于 n 的缓冲区，有效长度为 n
+    static void put(unsigned char* p, int cls) noexcept;
+
+    // 不包成 Buf 的裸块，归还时给出同样的大小。协程帧用它（帧的 operator delete 带大小）
+    static void* alloc(size_t n);
+    static void free(void* p, size_t n) noexcept;
+};
+
+
+// ==================== 分配计数 ====================
+// 每个线程独占一个计数槽（不够用时多个线程共享），读取时汇总。全局 operator new 也计入 heap_allocs
+struct AllocStats {
+    uint64_t heap_allocs;   // operator new 调用次数
+    uint64_t pool_gets;     // BufPool::get 调用次数
+    uint64_t pool_misses;   // 其中线程缓存和全局仓库都没有、只好 malloc 的次数
+};
+
+AllocStats alloc_stats();
+
+#endif // BUF_POOL_H
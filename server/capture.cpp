@@ -0,0 +1,74 @@
+#include "capture.h"
+#include "cap_format.h"
+#include "mem_account.h"
+#include "util.h"
+
+#include <iostream>
+#include <format>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#define CAP_FLUSH_MS 100            // 最长多久写一次盘
+
+
+Capture::Capture(const std::string& path, bool with_payload) : with_payload(with_payload), start(std::chrono::steady_clock::now()) {
+    fp = fopen(path.c_str(), "wb");
+    if (!fp) throw std::runtime_error(std::format("Cannot open capture file {}: {}", path, strerror(errno)));
+
+    char hdr[CAP_HDR_LEN]{};
+    memcpy(hdr, CAP_MAGIC, 8);
+    hdr[8] = with_payload ? CAP_FLAG_PAYLOAD : 0;
+    fwrite(hdr, 1, sizeof(hdr), fp);
+
+    writer = std::thread([this] { writer_loop(); });
+}
+
+
+Capture::~Capture() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+    }
+    cv.notify_one();
+    writer.join();
+    fclose(fp);
+}
+
+
+void Capture::record(std::string_view from, std::string_view to, const unsigned char* msg, size_t len) {
+    uint64_t ts = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    bool notify;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (pending.size() > WRITER_MAX_PENDING) return;
+        size_t before = pending.size();
+        cap_append(pending, ts, from, to, msg, static_cast<uint32_t>(len), with_payload);
+        MemAccount::add(MEM_CAPTURE, -1, pending.size() - before);
+        notify = pending.size() >= WRITER_FLUSH_BYTES;
+    }
+    if (notify) cv.notify_one();
+}
+
+
+void Capture::writer_loop() {
+    std::string batch;
+    while (1) {
+        bool done;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait_for(lock, std::chrono::milliseconds(CAP_FLUSH_MS), [this] { return stop || pending.size() >= WRITER_FLUSH_BYTES; });
+            batch.swap(pending);
+            done = stop;
+        }
+        if (!batch.empty()) {
+            if (fwrite(batch.data(), 1, batch.size(), fp) != batch.size()) {
+                std::cerr << std::format("Capture write: {}", strerror(errno)) << std::endl;
+            }
+            fflush(fp);
+            MemAccount::add(MEM_CAPTURE, -1, -static_cast<int64_t>(batch.size()));
+            batch.clear();
+        }
+        if (done) return;
+    }
+}
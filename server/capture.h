@@ -0,0 +1,40 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <string>
+#include <string_view>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+
+// ==================== 流量抓包 ====================
+// 以明文层面记录每条路由的消息（时间戳、发送者、接收者、长度，可选内容），格式见 cap_format.h 。
+// 工作线程只把编码好的记录追加到内存缓冲区，由单独的线程定期整批写盘，不阻塞路由
+class Capture {
+  private:
+    FILE* fp = nullptr;
+    bool with_payload;
+    std::chrono::steady_clock::time_point start;
+
+    std::string pending;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread writer;
+    bool stop = false;
+
+    void writer_loop();
+
+  public:
+    // 打开文件并写入文件头，失败抛异常
+    Capture(const std::string& path, bool with_payload);
+    ~Capture();     // 写完剩余记录再关闭
+
+    Capture(const Capture &) = delete;
+    Capture &operator=(const Capture &) = delete;
+
+    void record(std::string_view from, std::string_view to, const unsigned char* msg, size_t len);
+};
+
+#endif // CAPTURE_H
@@ -0,0 +1,580 @@
+#include "cluster.h"
+#include "mem_account.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <format>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <chrono>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#define LINK_BUFSZ 65536                // 节点间链路单次 recv 的缓冲区大小
+#define MAX_OUTQ (64u << 20)            // 单条链路最多积压多少字节，超出则丢弃新记录
+#define MAX_HOPS 3                      // 一条消息最多在节点间转发几次
+#define MAX_REC_LEN (MAX_OUTQ - 4)      // 记录长度上限。更长的记录在发送端 enqueue 时就被丢弃，不可能合法地收到
+#define AUTH_NONCE_LEN 32
+#define AUTH_MAC_LEN 32                 // HMAC-SHA256
+#define AUTH_TIMEOUT_S 5                // 认证时等对端每一段数据的最长时间
+#define MIN_SECRET_LEN 16
+
+// 链路记录类型。记录格式： [u32 长度][u8 类型][内容]
+enum : uint8_t {
+    REC_REG = 1,        // [u16 node][u16 ulen][user]
+    REC_UNREG = 2,      // 同上
+    REC_FWD = 3,        // [u16 origin][u8 hops][u16 fromlen][u16 tolen][u32 msglen][from][to][msg]
+    REC_NOUSER = 4,     // [u16 fromlen][u16 tolen][from][to]
+};
+
+void Send(int sock, const char* sp, int len);
+
+
+// ==================== 编码工具 ====================
+namespace {
+
+inline void put_u8(std::string& s, uint8_t v) { s.push_back(static_cast<char>(v)); }
+inline void put_u16(std::string& s, uint16_t v) { v = htons(v); s.append(reinterpret_cast<const char*>(&v), 2); }
+inline void put_u32(std::string& s, uint32_t v) { v = htonl(v); s.append(reinterpret_cast<const char*>(&v), 4); }
+
+inline uint16_t get_u16(const unsigned char* p) { uint16_t v; memcpy(&v, p, 2); return ntohs(v); }
+inline uint32_t get_u32(const unsigned char* p) { uint32_t v; memcpy(&v, p, 4); return ntohl(v); }
+
+// 先占 4 字节长度，写完内容后回填
+inline size_t begin_rec(std::string& s, uint8_t type) {
+    size_t at = s.size();
+    put_u32(s, 0);
+    put_u8(s, type);
+    return at;
+}
+
+inline void end_rec(std::string& s, size_t at) {
+    uint32_t n = htonl(static_cast<uint32_t>(s.size() - at - 4));
+    memcpy(s.data() + at, &n, 4);
+}
+
+std::string user_rec(uint8_t type, int node, std::string_view user) {
+    std::string s;
+    size_t at = begin_rec(s, type);
+    put_u16(s, static_cast<uint16_t>(node));
+    put_u16(s, static_cast<uint16_t>(user.size()));
+    s.append(user);
+    end_rec(s, at);
+    return s;
+}
+
+// 阻塞地收满 / 发完 n 字节，出错、超时或对端关闭返回 false
+bool read_full(int fd, unsigned char* p, size_t n) {
+    while (n > 0) {
+        ssize_t r = recv(fd, p, n, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r, n -= r;
+    }
+    return true;
+}
+
+bool write_full(int fd, const unsigned char* p, size_t n) {
+    while (n > 0) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r, n -= r;
+    }
+    return true;
+}
+
+void set_io_timeout(int fd, int sec) {
+    timeval tv{sec, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// role 区分双方的证明，防止把对方的证明原样发回来；两端的节点 id 也算进去，证明不能挪到别的链路上用
+void auth_mac(const std::string& secret, char role, int from_node, int to_node,
+              const unsigned char* nonce_c, const unsigned char* nonce_s, unsigned char* out) {
+    std::string m;
+    put_u8(m, static_cast<uint8_t>(role));
+    put_u16(m, static_cast<uint16_t>(from_node));
+    put_u16(m, static_cast<uint16_t>(to_node));
+    m.append(reinterpret_cast<const char*>(nonce_c), AUTH_NONCE_LEN);
+    m.append(reinterpret_cast<const char*>(nonce_s), AUTH_NONCE_LEN);
+    unsigned int len = AUTH_MAC_LEN;
+    if (!HMAC(EVP_sha256(), secret.data(), static_cast<int>(secret.size()),
+              reinterpret_cast<const unsigned char*>(m.data()), m.size(), out, &len)) {
+        throw std::runtime_error("HMAC failed");
+    }
+}
+
+// FNV-1a 64 位，再做一次混合，让相近的键在环上分散开
+uint64_t hash64(std::string_view s) {
+    uint64_t h = 1469598103934665603ull;
+    for (unsigned char c : s) h = (h ^ c) * 1099511628211ull;
+    h ^= h >> 33, h *= 0xff51afd7ed558ccdull, h ^= h >> 33;
+    return h;
+}
+
+} // namespace
+
+
+// ==================== 一致性哈希环 ====================
+void HashRing::build(const std::vector<NodeInfo>& nodes, int vnodes) {
+    ring.clear();
+    for (const NodeInfo& n : nodes) {
+        for (int v = 0; v < vnodes; ++v) ring.emplace_back(hash64(std::format("node-{}#{}", n.id, v)), n.id);
+    }
+    std::sort(ring.begin(), ring.end());
+}
+
+
+int HashRing::owner(std::string_view key) const {
+    if (ring.empty()) return -1;
+    uint64_t h = hash64(key);
+    auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(h, -1));
+    if (it == ring.end()) it = ring.begin();    // 绕回环首
+    return it->second;
+}
+
+
+// ==================== Cluster ====================
+Cluster::Cluster(int self_id, const std::string& conf_path) : self_id(self_id) {
+    std::ifstream fin(conf_path);
+    if (!fin) throw std::runtime_error(std::format("Cannot open cluster config {}", conf_path));
+
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream iss(line);
+        if (line.starts_with("secret")) {
+            if (!(iss >> secret >> secret)) throw std::runtime_error("Bad cluster config line: secret");    // 不回显密钥
+            continue;
+        }
+        NodeInfo n;
+        in_addr a;
+        if (!(iss >> n.id >> n.ip >> n.port) || inet_pton(AF_INET, n.ip.c_str(), &a) != 1) {
+            throw std::runtime_error(std::format("Bad cluster config line: {}", line));
+        }
+        nodes.push_back(n);
+    }
+
+    auto me = std::find_if(nodes.begin(), nodes.end(), [self_id](const NodeInfo& n) { return n.id == self_id; });
+    if (me == nodes.end()) throw std::runtime_error(std::format("Node {} not found in cluster config", self_id));
+    if (secret.size() < MIN_SECRET_LEN) {
+        throw std::runtime_error(std::format("Cluster config needs a \"secret <key>\" line of at least {} characters", MIN_SECRET_LEN));
+    }
+
+    ring.build(nodes);
+
+    for (const NodeInfo& n : nodes) {
+        if (n.id == self_id) continue;
+        auto link = std::make_unique<PeerLink>();
+        link->info = n;
+        peers[n.id] = std::move(link);
+    }
+
+    listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) throw std::runtime_error("Cluster socket failed");
+
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, me->ip.c_str(), &addr.sin_addr);    // 只绑在本节点的地址上，不对外网暴露
+    addr.sin_port = htons(me->port);
+    if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 64) < 0) {
+        close(listen_fd);
+        throw std::runtime_error(std::format("Cluster bind/listen on {}:{} failed: {}", me->ip, me->port, strerror(errno)));
+    }
+}
+
+
+Cluster::~Cluster() {
+    stop = true;
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    if (acceptor.joinable()) acceptor.join();
+    {
+        std::lock_guard<std::mutex> lock(readers_mtx);
+        for (const Reader& r : readers) if (r.fd >= 0) shutdown(r.fd, SHUT_RDWR);   // 让阻塞在 recv 上的读线程退出
+    }
+    for (Reader& r : readers) r.th.join();
+    OPENSSL_cleanse(secret.data(), secret.size());
+    for (auto& [id, link] : peers) {
+        {
+            std::lock_guard<std::mutex> lock(link->mtx);    // 与 wait 同步，避免丢失唤醒
+        }
+        link->cv.notify_all();
+        if (link->sender.joinable()) link->sender.join();
+    }
+}
+
+
+void Cluster::start(DeliverFn deliver_fn, NoUserFn nouser_fn, LocalUsersFn local_users_fn) {
+    deliver = std::move(deliver_fn);
+    nouser = std::move(nouser_fn);
+    local_users = std::move(local_users_fn);
+
+    for (auto& [id, link] : peers) {
+        PeerLink* lp = link.get();
+        link->sender = std::thread([this, lp] { sender_loop(*lp); });
+    }
+
+    acceptor = std::thread([this] {
+        while (!stop) {
+            sockaddr_in peer{};
+            socklen_t plen = sizeof(peer);
+            int fd = accept(listen_fd, (sockaddr*)&peer, &plen);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return;     // 析构时关闭了监听 socket
+            }
+            bool known = std::any_of(nodes.begin(), nodes.end(), [&](const NodeInfo& n) {
+                return n.id != self_id && inet_addr(n.ip.c_str()) == peer.sin_addr.s_addr;
+            });
+            if (!known) {
+                char ip[INET_ADDRSTRLEN] = "?";
+                inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+                std::cerr << std::format("Cluster: rejected connection from {}, not a cluster node", ip) << std::endl;
+                close(fd);
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(readers_mtx);
+            // 回收已结束的读线程，链路反复重连时不会越积越多
+            for (auto it = readers.begin(); it != readers.end();) {
+                if (!it->done) {
+                    ++it;
+                    continue;
+                }
+                it->th.join();
+                it = readers.erase(it);
+            }
+            readers.push_back({{}, fd});
+            readers.back().th = std::thread([this, fd, peer] { reader_loop(fd, peer); });   // 对端节点数很少，每条入站链路一个线程即可
+        }
+    });
+
+    std::cout << std::format("Cluster node {} started, {} nodes in total", self_id, nodes.size()) << std::endl;
+}
+
+
+void Cluster::enqueue(int node, const std::string& rec) {
+    auto it = peers.find(node);
+    if (it == peers.end()) return;
+    PeerLink& link = *it->second;
+    {
+        std::lock_guard<std::mutex> lock(link.mtx);
+        if (link.outq.size() + rec.size() > MAX_OUTQ) {
+            std::cerr << std::format("Cluster link to node {} overflowed, record dropped", node) << std::endl;
+            return;
+        }
+        link.outq += rec;
+    }
+    MemAccount::add(MEM_CLUSTER, -1, rec.size());
+    link.cv.notify_one();
+}
+
+
+void Cluster::sender_loop(PeerLink& link) {
+    // 从本节点配置的地址发起，对端按它检查来源
+    sockaddr_in src{};
+    src.sin_family = AF_INET;
+    for (const NodeInfo& n : nodes) {
+        if (n.id == self_id) src.sin_addr.s_addr = inet_addr(n.ip.c_str());
+    }
+
+    while (!stop) {
+        int fd = socket(PF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr(link.info.ip.c_str());
+        addr.sin_port = htons(link.info.port);
+
+        bool ok = fd >= 0 && bind(fd, (sockaddr*)&src, sizeof(src)) == 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+        if (ok && !auth_connect(fd, link.info.id)) {
+            std::cerr << std::format("Cluster link to node {}: authentication failed", link.info.id) << std::endl;
+            ok = false;
+        }
+        if (!ok) {
+            if (fd >= 0) close(fd);
+            // 连不上就当这个节点上的用户都下线了，稍后重试
+            {
+                std::lock_guard<std::mutex> lock(registry_mtx);
+                std::erase_if(registry, [&](const auto& kv) { return kv.second == link.info.id; });
+            }
+            std::unique_lock<std::mutex> lock(link.mtx);
+            link.cv.wait_for(lock, std::chrono::seconds(1), [this] { return stop.load(); });
+            continue;
+        }
+
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));    // 已经自己攒批了，不需要 Nagle
+        std::cout << std::format("Cluster link to node {} established", link.info.id) << std::endl;
+
+        // (重新) 连上后，把归属于对端的本地用户重新登记一遍，对端可能刚重启
+        std::string resync;
+        for (const std::string& u : local_users()) {
+            if (ring.owner(u) == link.info.id) resync += user_rec(REC_REG, self_id, u);
+        }
+        {
+            std::lock_guard<std::mutex> lock(link.mtx);
+            link.outq.insert(0, resync);
+        }
+        MemAccount::add(MEM_CLUSTER, -1, resync.size());
+
+        while (!stop) {
+            std::string batch;
+            {
+                std::unique_lock<std::mutex> lock(link.mtx);
+                link.cv.wait(lock, [&] { return stop || !link.outq.empty(); });
+                if (stop) break;
+                batch.swap(link.outq);  // 一次取走所有积压的记录，整批写出
+            }
+            bool ok = true;
+            try {
+                Send(fd, batch.data(), batch.size());
+            } catch (const std::exception& e) {
+                std::cerr << std::format("Cluster link to node {}: {}", link.info.id, e.what()) << std::endl;
+                ok = false;
+            }
+            MemAccount::add(MEM_CLUSTER, -1, -static_cast<int64_t>(batch.size()));     // 写出或丢弃，都不再占用
+            if (!ok) break;     // 这一批丢弃，重连
+        }
+        close(fd);
+    }
+}
+
+
+void Cluster::reader_loop(int fd, const sockaddr_in& peer) {
+    int node = auth_accept(fd, peer);
+
+    std::string buf;
+    std::vector<char> rbuf(LINK_BUFSZ);
+    bool bad = false;
+    while (node >= 0 && !stop && !bad) {
+        ssize_t n = recv(fd, rbuf.data(), rbuf.size(), 0);
+        if (n <= 0) break;
+        buf.append(rbuf.data(), n);
+        MemAccount::add(MEM_CLUSTER, -1, n);
+
+        size_t off = 0;
+        while (buf.size() - off >= 4) {
+            uint32_t len = get_u32(reinterpret_cast<const unsigned char*>(buf.data() + off));
+            if (len > MAX_REC_LEN) {
+                std::cerr << std::format("Cluster link from node {}: {}-byte record exceeds the limit, closing", node, len) << std::endl;
+                bad = true;
+                break;
+            }
+            if (buf.size() - off - 4 < len) break;
+            handle_record(node, reinterpret_cast<const unsigned char*>(buf.data() + off + 4), len);
+            off += 4 + len;
+        }
+        buf.erase(0, off);
+        MemAccount::add(MEM_CLUSTER, -1, -static_cast<int64_t>(off));
+    }
+    MemAccount::add(MEM_CLUSTER, -1, -static_cast<int64_t>(buf.size()));
+    {
+        std::lock_guard<std::mutex> lock(readers_mtx);
+        for (Reader& r : readers) {
+            if (r.fd == fd && !r.done) r.fd = -1, r.done = true;
+        }
+    }
+    close(fd);
+}
+
+
+int Cluster::auth_accept(int fd, const sockaddr_in& peer) {
+    char ip[INET_ADDRSTRLEN] = "?";
+    inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+    set_io_timeout(fd, AUTH_TIMEOUT_S);     // 不说话的连接不能一直占着读线程
+
+    unsigned char hello[2 + AUTH_NONCE_LEN];
+    if (!read_full(fd, hello, sizeof(hello))) {
+        std::cerr << std::format("Cluster: connection from {} closed before authenticating", ip) << std::endl;
+        return -1;
+    }
+    int node = get_u16(hello);
+    const unsigned char* nonce_c = hello + 2;
+
+    // 自称的节点须在配置中，且地址相符
+    bool match = std::any_of(nodes.begin(), nodes.end(), [&](const NodeInfo& n) {
+        return n.id == node && n.id != self_id && inet_addr(n.ip.c_str()) == peer.sin_addr.s_addr;
+    });
+    if (!match) {
+        std::cerr << std::format("Cluster: connection from {} claims to be node {}, rejected", ip, node) << std::endl;
+        return -1;
+    }
+
+    unsigned char reply[AUTH_NONCE_LEN + AUTH_MAC_LEN];
+    unsigned char proof[AUTH_MAC_LEN], expect[AUTH_MAC_LEN];
+    if (!RAND_bytes(reply, AUTH_NONCE_LEN)) return -1;
+    auth_mac(secret, 'S', self_id, node, nonce_c, reply, reply + AUTH_NONCE_LEN);
+    auth_mac(secret, 'C', node, self_id, nonce_c, reply, expect);
+    if (!write_full(fd, reply, sizeof(reply)) || !read_full(fd, proof, sizeof(proof))
+        || CRYPTO_memcmp(proof, expect, AUTH_MAC_LEN) != 0) {
+        std::cerr << std::format("Cluster: node {} at {} failed authentication", node, ip) << std::endl;
+        return -1;
+    }
+
+    set_io_timeout(fd, 0);      // 之后链路空闲多久都可以
+    std::cout << std::format("Cluster link from node {} established", node) << std::endl;
+    return node;
+}
+
+
+bool Cluster::auth_connect(int fd, int node) {
+    set_io_timeout(fd, AUTH_TIMEOUT_S);
+
+    unsigned char hello[2 + AUTH_NONCE_LEN];
+    uint16_t id = htons(static_cast<uint16_t>(self_id));
+    memcpy(hello, &id, 2);
+    const unsigned char* nonce_c = hello + 2;
+    if (!RAND_bytes(hello + 2, AUTH_NONCE_LEN)) return false;
+
+    unsigned char reply[AUTH_NONCE_LEN + AUTH_MAC_LEN];
+    unsigned char expect[AUTH_MAC_LEN], proof[AUTH_MAC_LEN];
+    if (!write_full(fd, hello, sizeof(hello)) || !read_full(fd, reply, sizeof(reply))) return false;
+
+    // 先确认对端知道密钥，再给出自己的证明
+    auth_mac(secret, 'S', node, self_id, nonce_c, reply, expect);
+    if (CRYPTO_memcmp(reply + AUTH_NONCE_LEN, expect, AUTH_MAC_LEN) != 0) return false;
+    auth_mac(secret, 'C', self_id, node, nonce_c, reply, proof);
+    if (!write_full(fd, proof, sizeof(proof))) return false;
+
+    set_io_timeout(fd, 0);
+    return true;
+}
+
+
+void Cluster::handle_record(int link_node, const unsigned char* p, size_t len) {
+    if (len < 1) return;
+    uint8_t type = p[0];
+    ++p, --len;
+
+    switch (type) {
+    case REC_REG:
+    case REC_UNREG: {
+        if (len < 4) return;
+        int node = get_u16(p);
+        size_t ulen = get_u16(p + 2);
+        if (4 + ulen > len) return;
+        std::string user(reinterpret_cast<const char*>(p + 4), ulen);
+        if (node != link_node) {
+            // 节点只能登记自己的用户
+            std::cerr << std::format("Cluster: node {} sent a registration for node {}, ignored", link_node, node) << std::endl;
+            return;
+        }
+        if (type == REC_REG) registry_set(user, node);
+        else registry_del(user, node);
+        break;
+    }
+    case REC_FWD: {
+        if (len < 11) return;
+        int origin = get_u16(p), hops = p[2];
+        size_t fromlen = get_u16(p + 3), tolen = get_u16(p + 5), msglen = get_u32(p + 7);
+        if (11 + fromlen + tolen + msglen > len) return;
+        std::string_view from(reinterpret_cast<const char*>(p + 11), fromlen);
+        std::string_view to(reinterpret_cast<const char*>(p + 11 + fromlen), tolen);
+        const unsigned char* msg = p + 11 + fromlen + tolen;
+
+        Buf m = BufPool::get(msglen);
+        memcpy(m.data(), msg, msglen);
+        if (deliver(from, to, std::move(m))) return;
+        forward(origin, hops, from, to, msg, msglen);   // 不在本地（比如刚下线），交给归属节点或回报找不到
+        break;
+    }
+    case REC_NOUSER: {
+        if (len < 4) return;
+        size_t fromlen = get_u16(p), tolen = get_u16(p + 2);
+        if (4 + fromlen + tolen > len) return;
+        nouser(std::string_view(reinterpret_cast<const char*>(p + 4), fromlen),
+               std::string_view(reinterpret_cast<const char*>(p + 4 + fromlen), tolen));
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+
+void Cluster::registry_set(const std::string& user, int node) {
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    registry[user] = node;      // 后登记者生效
+}
+
+
+void Cluster::registry_del(const std::string& user, int node) {
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    auto it = registry.find(user);
+    if (it != registry.end() && it->second == node) registry.erase(it);    // 只删自己登记的，避免删掉别处的新登记
+}
+
+
+int Cluster::registry_get(std::string_view user) {
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    auto it = registry.find(std::string(user));
+    return it == registry.end() ? -1 : it->second;
+}
+
+
+void Cluster::register_user(const std::string& user) {
+    int own = ring.owner(user);
+    if (own == self_id) registry_set(user, self_id);
+    else enqueue(own, user_rec(REC_REG, self_id, user));
+}
+
+
+void Cluster::unregister_user(const std::string& user) {
+    int own = ring.owner(user);
+    if (own == self_id) registry_del(user, self_id);
+    else enqueue(own, user_rec(REC_UNREG, self_id, user));
+}
+
+
+void Cluster::route(std::string_view from, std::string_view to, const unsigned char* msg, size_t msglen) {
+    forward(self_id, 0, from, to, msg, msglen);
+}
+
+
+void Cluster::forward(int origin, int hops, std::string_view from, std::string_view to, const unsigned char* msg, size_t msglen) {
+    int target = ring.owner(to);
+    if (target == self_id) target = registry_get(to);   // 本节点就是归属节点，直接查登记表
+
+    if (target < 0 || target == self_id || hops >= MAX_HOPS) {
+        // 找不到收件人，通知发件人所在节点
+        if (origin == self_id) {
+            nouser(from, to);
+            return;
+        }
+        std::string rec;
+        size_t at = begin_rec(rec, REC_NOUSER);
+        put_u16(rec, static_cast<uint16_t>(from.size()));
+        put_u16(rec, static_cast<uint16_t>(to.size()));
+        rec.append(from), rec.append(to);
+        end_rec(rec, at);
+        enqueue(origin, rec);
+        return;
+    }
+
+    std::string rec;
+    rec.reserve(16 + from.size() + to.size() + msglen);
+    size_t at = begin_rec(rec, REC_FWD);
+    put_u16(rec, static_cast<uint16_t>(origin));
+    put_u8(rec, static_cast<uint8_t>(hops + 1));
+    put_u16(rec, static_cast<uint16_t>(from.size()));
+    put_u16(rec, static_cast<uint16_t>(to.size()));
+    put_u32(rec, static_cast<uint32_t>(msglen));
+    rec.append(from), rec.append(to);
+    rec.append(reinterpret_cast<const char*>(msg), msglen);
+    end_rec(rec, at);
+    enqueue(target, rec);
+}
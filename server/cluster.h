@@ -0,0 +1,120 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "buf_pool.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <netinet/in.h>
+
+// ==================== 多节点集群 ====================
+// 用户名按一致性哈希划分给各节点，称为该用户的 “归属节点” 。归属节点记录 “用户当前连在哪个节点” 。
+// 用户连上任一节点后，该节点向归属节点登记；发给非本地用户的消息先转给归属节点，再由它转给用户所在节点。
+// 节点之间各保持一条长连接，出站记录先攒在队列里，由发送线程一次性整批写出。
+// 节点间通信端口只绑在本节点配置的 IP 上，只接受配置中节点地址的连接；链路建立时双方用配置中的共享密钥做 HMAC 质询，
+// 确认对端是集群成员、是它自称的节点，之后对端只能登记本节点上的用户。链路上的记录仍为明文，集群内网应不可被窃听。
+
+struct NodeInfo {
+    int id;
+    std::string ip;
+    int port;       // 节点间通信端口（不是客户端端口）
+};
+
+
+// 一致性哈希环，每个节点放若干虚拟节点
+class HashRing {
+  private:
+    std::vector<std::pair<uint64_t, int>> ring;     // (哈希值, 节点 id) ，按哈希值排序
+
+  public:
+    void build(const std::vector<NodeInfo>& nodes, int vnodes = 128);
+    int owner(std::string_view key) const;
+};
+
+
+class Cluster {
+  public:
+    // 由服务端提供：尝试投递给本地用户，不在本地返回 false
+    using DeliverFn = std::function<bool(std::string_view from, std::string_view to, Buf msg)>;
+    // 由服务端提供：通知本地用户 from ，他发给 to 的消息找不到收件人
+    using NoUserFn = std::function<void(std::string_view from, std::string_view to)>;
+    // 由服务端提供：列出本地所有在线用户，用于链路重连后重新登记
+    using LocalUsersFn = std::function<std::vector<std::string>()>;
+
+    // 读取配置文件，每行 "<id> <ip> <port>" ，另有一行 "secret <共享密钥>" ，'#' 开头为注释。失败抛异常
+    Cluster(int self_id, const std::string& conf_path);
+    ~Cluster();
+
+    Cluster(const Cluster &) = delete;
+    Cluster &operator=(const Cluster &) = delete;
+
+    void start(DeliverFn deliver, NoUserFn nouser, LocalUsersFn local_users);
+
+    void register_user(const std::string& user);      // 本地用户上线
+    void unregister_user(const std::string& user);    // 本地用户下线
+    void route(std::string_view from, std::string_view to, const unsigned char* msg, size_t msglen);  // 收件人不在本地
+
+    int self() const { return self_id; }
+    size_t size() const { return nodes.size(); }
+
+  private:
+    struct PeerLink {
+        NodeInfo info;
+        std::string outq;           // 待发送的记录，已按链路格式编码
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::thread sender;
+    };
+
+    struct Reader {
+        std::thread th;
+        int fd;                     // 链路关闭后为 -1
+        bool done = false;          // 线程已结束，下次 accept 时回收
+    };
+
+    int self_id;
+    std::string secret;             // 链路认证用的共享密钥
+    std::vector<NodeInfo> nodes;
+    HashRing ring;
+    std::unordered_map<int, std::unique_ptr<PeerLink>> peers;
+
+    std::unordered_map<std::string, int> registry;  // 归属于本节点的用户 -> 所在节点
+    std::mutex registry_mtx;
+
+    DeliverFn deliver;
+    NoUserFn nouser;
+    LocalUsersFn local_users;
+
+    int listen_fd = -1;
+    std::thread acceptor;
+    std::vector<Reader> readers;        // 每条入站链路一个线程
+    std::mutex readers_mtx;
+    std::atomic<bool> stop{false};
+
+    void enqueue(int node, const std::string& rec);
+    void sender_loop(PeerLink& link);
+    void reader_loop(int fd, const sockaddr_in& peer);
+    void handle_record(int link_node, const unsigned char* p, size_t len);
+
+    // 链路认证：发起方先报上自己的节点 id 和随机数，双方各用共享密钥对两个随机数做 HMAC 证明自己。
+    // auth_accept 成功返回对端节点 id ，失败返回 -1 ；auth_connect 失败返回 false
+    int auth_accept(int fd, const sockaddr_in& peer);
+    bool auth_connect(int fd, int node);
+
+    void registry_set(const std::string& user, int node);
+    void registry_del(const std::string& user, int node);
+    int registry_get(std::string_view user);
+
+    // 把 FWD 记录送往合适的节点，hops 用于防止路由环
+    void forward(int origin, int hops, std::string_view from, std::string_view to, const unsigned char* msg, size_t msglen);
+};
+
+#endif // CLUSTER_H
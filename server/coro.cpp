@@ -0,0 +1,253 @@
+#include "coro.h"
+#include "fd_table.h"
+
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define IO_TAG (1ull << 32)     // 协程登记的事件 data.u64 = IO_TAG | fd ，与主循环用 data.fd 登记的（高 32 位为 0 ）区分
+
+namespace coro {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// 每个 fd 上挂起的 I/O 。登记可以在任何线程上，取走（就绪或超时）只在主循环线程上，
+// 所以主循环看到的 IoOp 在它取走之前一直有效
+FdTable<std::atomic<IoOp*>> slots;
+int epfd = -1;
+std::function<void()> wake;
+std::thread::id reactor_tid;
+std::atomic<uint64_t> next_gen{1};
+std::atomic<size_t> io_waiting{0};
+
+// fd >= 0 为 I/O 的超时（ gen 对不上说明那次 I/O 已经结束）；fd < 0 为 sleep_for ，到期恢复 h
+struct Timer {
+    Clock::time_point at;
+    int fd;
+    uint64_t gen;
+    std::coroutine_handle<> h;
+    bool operator>(const Timer& o) const { return at > o.at; }
+};
+
+std::mutex timers_mtx;
+std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers;
+
+void add_timer(const Timer& t) {
+    bool earliest;
+    {
+        std::lock_guard<std::mutex> lock(timers_mtx);
+        earliest = timers.empty() || t.at < timers.top().at;
+        timers.push(t);
+    }
+    // 主循环可能正按更晚的超时睡着
+    if (earliest && wake && std::this_thread::get_id() != reactor_tid) wake();
+}
+
+bool arm_epoll(int fd, uint32_t events) {
+    epoll_event ev{};
+    ev.events = events | EPOLLONESHOT;
+    ev.data.u64 = IO_TAG | static_cast<uint32_t>(fd);
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0) return true;
+    return errno == ENOENT && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+}   // namespace
+
+
+std::atomic<int64_t>& detail::live_frames() {
+    static std::atomic<int64_t> n{0};
+    return n;
+}
+
+
+void detail::Detached::promise_type::unhandled_exception() noexcept {
+    try {
+        throw;
+    } catch (const std::exception& e) {
+        std::cerr << "Coroutine: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Coroutine: unknown exception" << std::endl;
+    }
+}
+
+
+// ==================== I/O ====================
+bool IoOp::await_suspend(std::coroutine_handle<> h) noexcept {
+    std::atomic<IoOp*>* slot = slots.get(fd);
+    if (!slot) {
+        err = EBADF;
+        return false;
+    }
+    waiter = h;
+    gen = next_gen.fetch_add(1, std::memory_order_relaxed);
+    io_waiting.fetch_add(1, std::memory_order_relaxed);
+    slot->store(this, std::memory_order_release);
+
+    // 登记成功之后主循环随时可能恢复协程，不能再碰 this 。定时器后加，就绪得早的 I/O 留下的超时按 gen 作废
+    Timer t{Clock::now() + timeout, fd, gen, {}};
+    bool timed = timeout.count() > 0;
+    if (arm_epoll(fd, events)) {
+        if (timed) add_timer(t);
+        return true;
+    }
+
+    slot->store(nullptr, std::memory_order_relaxed);    // 还没登记进 epoll 也没有定时器，没人能取走它
+    io_waiting.fetch_sub(1, std::memory_order_relaxed);
+    err = errno;
+    return false;
+}
+
+
+bool ReadExact::step() noexcept {
+    while (done < n) {
+        ssize_t r = recv(fd, p + done, n - done, 0);
+        if (r > 0) {
+            done += r;
+        } else if (r == 0) {
+            eof = true;
+            return true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+        } else {
+            err = errno;
+            return true;
+        }
+    }
+    return true;
+}
+
+
+ssize_t ReadExact::await_resume() noexcept {
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return eof ? 0 : static_cast<ssize_t>(n);
+}
+
+
+bool WriteAll::step() noexcept {
+    while (done < n) {
+        ssize_t r = send(fd, p + done, n - done, MSG_NOSIGNAL);
+        if (r >= 0) {
+            done += r;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+        } else {
+            err = errno;
+            return true;
+        }
+    }
+    return true;
+}
+
+
+ssize_t WriteAll::await_resume() noexcept {
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return static_cast<ssize_t>(n);
+}
+
+
+void Sleep::await_suspend(std::coroutine_handle<> h) {
+    add_timer({Clock::now() + d, -1, 0, h});
+}
+
+
+// ==================== 与主循环的接口 ====================
+void init(int fd, size_t max_fds, std::function<void()> w) {
+    epfd = fd;
+    slots.init(max_fds);
+    wake = std::move(w);
+    reactor_tid = std::this_thread::get_id();
+}
+
+
+bool dispatch(const epoll_event& ev) {
+    if (!(ev.data.u64 >> 32)) return false;
+
+    std::atomic<IoOp*>* slot = slots.get(static_cast<int>(static_cast<uint32_t>(ev.data.u64)));
+    IoOp* op = slot ? slot->exchange(nullptr, std::memory_order_acquire) : nullptr;
+    if (!op) return true;   // 已经超时
+
+    // 没做完（如只到了一部分数据）就再登记一次，超时沿用原来的
+    if (!op->step()) {
+        slot->store(op, std::memory_order_release);
+        if (arm_epoll(op->fd, op->events)) return true;
+        slot->store(nullptr, std::memory_order_relaxed);
+        op->err = errno;
+    }
+    io_waiting.fetch_sub(1, std::memory_order_relaxed);
+    op->waiter.resume();
+    return true;
+}
+
+
+int timeout_ms(int ms) {
+    std::lock_guard<std::mutex> lock(timers_mtx);
+    if (timers.empty()) return ms;
+    auto left = std::chrono::ceil<std::chrono::milliseconds>(timers.top().at - Clock::now()).count();
+    return static_cast<int>(std::clamp<int64_t>(left, 0, ms));
+}
+
+
+void run_timers() {
+    static std::vector<Timer> due;
+    due.clear();
+    auto now = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(timers_mtx);
+        while (!timers.empty() && timers.top().at <= now) {
+            due.push_back(timers.top());
+            timers.pop();
+        }
+    }
+
+    for (const Timer& t : due) {
+        if (t.fd < 0) {
+            t.h.resume();
+            continue;
+        }
+        // 只有主循环会取走 IoOp ，读到的指针在这里一直有效；登记线程只会放进新的，用 gen 区分
+        std::atomic<IoOp*>* slot = slots.get(t.fd);
+        IoOp* op = slot ? slot->load(std::memory_order_acquire) : nullptr;
+        if (!op || op->gen != t.gen || !slot->compare_exchange_strong(op, nullptr)) continue;
+
+        epoll_event ev{};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, t.fd, &ev);  // 停掉还在等的事件
+        io_waiting.fetch_sub(1, std::memory_order_relaxed);
+        op->err = ETIMEDOUT;
+        op->waiter.resume();
+    }
+}
+
+
+void release(int fd) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+
+Stats stats() {
+    size_t ntimers;
+    {
+        std::lock_guard<std::mutex> lock(timers_mtx);
+        ntimers = timers.size();
+    }
+    return {detail::live_frames().load(std::memory_order_relaxed), io_waiting.load(std::memory_order_relaxed), ntimers};
+}
+
+}   // namespace coro
@@ -0,0 +1,240 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include "buf_pool.h"
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/epoll.h>
+
+// ==================== 协程 ====================
+// 建在主循环（Reactor）之上的轻量协程，把握手这类 “收一段、算一下、发一段、再收一段” 的流程写成顺序代码，
+// 等对端的时候挂起，不占线程：
+//   Task<T>      惰性启动，被 co_await 时才开始执行，结束后直接转回等待它的协程（对称转移，不增长调用栈）；
+//   spawn        把一个 Task<void> 作为独立的协程启动，结束时自己销毁，其中漏出的异常打印后丢弃；
+//   read_exact / write_all   非阻塞 fd 上的读写，数据没就绪时向 epoll 登记（EPOLLONESHOT）并挂起，可带超时；
+//   sleep_for    定时器；resume_on 把协程转到线程池上继续执行（如计算密集的密钥交换）。
+// 就绪事件和定时器都由主循环分发（dispatch / run_timers），恢复的协程先在主循环线程上继续执行，
+// 所以只能做轻量的工作，重活先 resume_on 到线程池。协程帧从 BufPool 分配，十万个并发的协程也只是十万块池化内存。
+
+namespace coro {
+
+namespace detail {
+
+std::atomic<int64_t>& live_frames();
+
+// 所有协程帧的分配都走 BufPool
+struct PooledFrame {
+    static void* operator new(size_t n) {
+        live_frames().fetch_add(1, std::memory_order_relaxed);
+        return BufPool::alloc(n);
+    }
+    static void operator delete(void* p, size_t n) noexcept {
+        live_frames().fetch_sub(1, std::memory_order_relaxed);
+        BufPool::free(p, n);
+    }
+};
+
+struct PromiseBase : PooledFrame {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    struct Final {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            return h.promise().continuation ? h.promise().continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    Final final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value;
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T result() {
+        if (error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    void return_void() noexcept {}
+    void result() {
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+// spawn 的外壳：立即开始，结束时帧自动销毁
+struct Detached {
+    struct promise_type : PooledFrame {
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept;
+    };
+};
+
+}   // namespace detail
+
+
+template <typename T = void>
+class [[nodiscard]] Task {
+  public:
+    struct promise_type : detail::Promise<T> {
+        Task get_return_object() noexcept { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    Task(Task&& o) noexcept : h(std::exchange(o.h, {})) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { if (h) h.destroy(); }
+
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> h;
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) noexcept {
+                h.promise().continuation = waiter;
+                return h;
+            }
+            T await_resume() { return h.promise().result(); }
+        };
+        return Awaiter{h};
+    }
+
+  private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h(h) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+
+inline detail::Detached run_detached(Task<> t) { co_await std::move(t); }
+
+// 启动一个独立的协程，调用者不等它结束
+inline void spawn(Task<> t) { run_detached(std::move(t)); }
+
+
+// ==================== I/O 与定时器 ====================
+// 挂起在 fd 上的一次读或写。step 尽量推进，完成或出错返回 true ，还要等返回 false
+struct IoOp {
+    int fd;
+    uint32_t events;                    // EPOLLIN 或 EPOLLOUT
+    std::chrono::milliseconds timeout;  // 0 表示不限时
+    uint64_t gen = 0;                   // 每次登记一个新的序号，过期的超时凭它认出来
+    int err = 0;                        // 出错时的 errno ，超时为 ETIMEDOUT
+    std::coroutine_handle<> waiter;
+
+    IoOp(int fd, uint32_t events, std::chrono::milliseconds timeout) : fd(fd), events(events), timeout(timeout) {}
+    IoOp(const IoOp&) = delete;
+    IoOp& operator=(const IoOp&) = delete;
+
+    virtual bool step() noexcept = 0;
+
+    bool await_ready() noexcept { return step(); }
+    bool await_suspend(std::coroutine_handle<> h) noexcept;     // 登记失败时不挂起，err 为原因
+};
+
+struct ReadExact : IoOp {
+    unsigned char* p;
+    size_t n, done = 0;
+    bool eof = false;
+
+    ReadExact(int fd, void* p, size_t n, std::chrono::milliseconds timeout)
+        : IoOp(fd, EPOLLIN, timeout), p(static_cast<unsigned char*>(p)), n(n) {}
+    bool step() noexcept override;
+    // 读满返回 n ；对端先关闭返回 0 ；出错或超时返回 -1 ，errno 为原因
+    ssize_t await_resume() noexcept;
+};
+
+struct WriteAll : IoOp {
+    const unsigned char* p;
+    size_t n, done = 0;
+
+    WriteAll(int fd, const void* p, size_t n, std::chrono::milliseconds timeout)
+        : IoOp(fd, EPOLLOUT, timeout), p(static_cast<const unsigned char*>(p)), n(n) {}
+    bool step() noexcept override;
+    // 写完返回 n ；出错或超时返回 -1 ，errno 为原因
+    ssize_t await_resume() noexcept;
+};
+
+inline ReadExact read_exact(int fd, void* p, size_t n, std::chrono::milliseconds timeout = {}) {
+    return ReadExact(fd, p, n, timeout);
+}
+
+inline WriteAll write_all(int fd, const void* p, size_t n, std::chrono::milliseconds timeout = {}) {
+    return WriteAll(fd, p, n, timeout);
+}
+
+struct Sleep {
+    std::chrono::milliseconds d;
+    bool await_ready() noexcept { return d.count() <= 0; }
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() noexcept {}
+};
+
+inline Sleep sleep_for(std::chrono::milliseconds d) { return Sleep{d}; }
+
+// 转到线程池 pool 的 key 分片上继续执行。入队失败（线程池已停止）时就地继续
+template <typename Pool>
+struct ResumeOn {
+    Pool& pool;
+    size_t key;
+    bool await_ready() noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+        try {
+            pool.enqueue(key, [h]() { h.resume(); });
+        } catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+    void await_resume() noexcept {}
+};
+
+template <typename Pool>
+ResumeOn<Pool> resume_on(Pool& pool, size_t key) { return ResumeOn<Pool>{pool, key}; }
+
+
+// ==================== 与主循环的接口 ====================
+// init 在主循环线程上、进入循环之前调用一次。wake 用来在其他线程加了更早的定时器时叫醒主循环
+void init(int epfd, size_t max_fds, std::function<void()> wake);
+
+// 属于协程的就绪事件（ data.u64 高 32 位非 0 ）：恢复等待的协程并返回 true ；普通事件返回 false
+bool dispatch(const epoll_event& ev);
+
+// 把 epoll_wait 的超时 ms 缩短到最早的定时器
+int timeout_ms(int ms);
+
+// 恢复到期的定时器，超时的 I/O 以 ETIMEDOUT 结束
+void run_timers();
+
+// 协程不再在 fd 上等待：从 epoll 中删掉，之后可以按普通连接登记
+void release(int fd);
+
+struct Stats {
+    int64_t frames;     // 存活的协程帧
+    size_t io_waiting;  // 挂起在 I/O 上的
+    size_t timers;      // 未到期的定时器（包括 I/O 的超时）
+};
+
+Stats stats();
+
+}   // namespace coro
+
+#endif // CORO_H
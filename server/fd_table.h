@@ -0,0 +1,56 @@
+#ifndef FD_TABLE_H
+#define FD_TABLE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <cstddef>
+
+// ==================== 按 fd 下标的连接表 ====================
+// fd 是内核分配的小整数，直接当下标比哈希表省得多：没有节点、桶和哈希，每个连接只占一个 T 。
+// 表按块（Chunk 个）懒分配，只有用到的 fd 段才占内存；块一旦分配就不再移动，取到的指针一直有效，
+// 所以查表本身不用加锁，T 的字段由调用者自己的锁保护
+
+template <typename T, size_t Chunk = 1024>
+class FdTable {
+  private:
+    std::unique_ptr<std::atomic<T*>[]> chunks;
+    size_t nchunks = 0;
+    std::mutex grow_mtx;
+
+  public:
+    FdTable() = default;
+    FdTable(const FdTable&) = delete;
+    FdTable& operator=(const FdTable&) = delete;
+
+    ~FdTable() {
+        for (size_t i = 0; i < nchunks; ++i) delete[] chunks[i].load(std::memory_order_relaxed);
+    }
+
+    // 按进程能打开的 fd 上限确定表的大小，只能在开始用之前调用一次
+    void init(size_t max_fds) {
+        nchunks = (max_fds + Chunk - 1) / Chunk;
+        chunks = std::make_unique<std::atomic<T*>[]>(nchunks);
+        for (size_t i = 0; i < nchunks; ++i) chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const { return nchunks * Chunk; }
+
+    // fd 对应的项，所在的块还没分配就分配。fd 越界返回 nullptr
+    T* get(int fd) {
+        if (fd < 0 || static_cast<size_t>(fd) >= capacity()) return nullptr;
+        std::atomic<T*>& slot = chunks[fd / Chunk];
+        T* chunk = slot.load(std::memory_order_acquire);
+        if (!chunk) {
+            std::lock_guard<std::mutex> lock(grow_mtx);
+            chunk = slot.load(std::memory_order_relaxed);
+            if (!chunk) {
+                chunk = new T[Chunk];
+                slot.store(chunk, std::memory_order_release);
+            }
+        }
+        return &chunk[fd % Chunk];
+    }
+};
+
+#endif // FD_TABLE_H
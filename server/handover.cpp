@@ -0,0 +1,351 @@
+#include "handover.h"
+#include "proto.h"
+
+#include <iostream>
+#include <deque>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <openssl/crypto.h>
+
+#define HANDOVER_MAGIC 0x484f5631u  // "HOV1" ，记录格式改动时递增，新旧进程对不上就不交接
+#define HANDOVER_CHUNK (64 << 10)   // 一条消息最多带这么多字节的记录，远小于默认的 socket 发送缓冲区
+#define HANDOVER_FDS 128            // 一条消息最多带这么多个 fd （内核上限 SCM_MAX_FD 为 253）
+#define HANDOVER_TIMEOUT_S 30       // 交接途中等对方的最长时间
+
+namespace {
+
+enum : uint8_t { REC_HDR = 1, REC_CONN = 2, REC_END = 3 };
+constexpr uint8_t HDR_LISTEN = 1, HDR_UNIX = 2;         // 头记录之后依次带着哪些监听 socket
+constexpr uint8_t CONN_PLAIN = 1, CONN_KU_PENDING = 2;
+
+// 按 [u32 len][u8 类型][内容] 编码一条记录
+struct Writer {
+    std::string out;
+    size_t start = 0;
+
+    void begin(uint8_t type) {
+        start = out.size();
+        out.append(4, '\0');
+        u8(type);
+    }
+    void end() { put_u32(reinterpret_cast<unsigned char*>(out.data() + start), static_cast<uint32_t>(out.size() - start - 4)); }
+
+    void u8(uint8_t v) { out.push_back(static_cast<char>(v)); }
+    void u16(uint16_t v) { unsigned char b[2]; put_u16(b, v); out.append(reinterpret_cast<char*>(b), 2); }
+    void u32(uint32_t v) { unsigned char b[4]; put_u32(b, v); out.append(reinterpret_cast<char*>(b), 4); }
+    void u64(uint64_t v) { unsigned char b[8]; put_u64(b, v); out.append(reinterpret_cast<char*>(b), 8); }
+    void bytes(const void* p, size_t n) {
+        u32(static_cast<uint32_t>(n));
+        out.append(static_cast<const char*>(p), n);
+    }
+
+    // 记录里有密钥，用完擦掉
+    void clear() {
+        OPENSSL_cleanse(out.data(), out.size());
+        out.clear();
+    }
+};
+
+// 解码一条记录的内容，越界抛异常
+struct Reader {
+    const unsigned char* p;
+    size_t n, off = 0;
+
+    const unsigned char* take(size_t k) {
+        if (n - off < k) throw std::runtime_error("truncated record");
+        off += k;
+        return p + off - k;
+    }
+    uint8_t u8() { return *take(1); }
+    uint16_t u16() { return get_u16(take(2)); }
+    uint32_t u32() { return get_u32(take(4)); }
+    uint64_t u64() { return get_u64(take(8)); }
+    std::string str() {
+        uint32_t k = u32();
+        return std::string(reinterpret_cast<const char*>(take(k)), k);
+    }
+    std::vector<unsigned char> vec() {
+        uint32_t k = u32();
+        const unsigned char* s = take(k);
+        return std::vector<unsigned char>(s, s + k);
+    }
+};
+
+// 一条消息：记录的一段，外加若干 fd
+bool send_msg(int sock, const char* p, size_t n, const int* fds, size_t nfds) {
+    iovec iov{const_cast<char*>(p), n};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int) * HANDOVER_FDS)];
+    if (nfds) {
+        msg.msg_control = ctrl;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+    }
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno == EINTR) continue;
+        perror("handover sendmsg");
+        return false;
+    }
+    return true;
+}
+
+// 把记录攒成消息发出。一条记录和它的 fd 总在同一批里；超过 HANDOVER_CHUNK 的批切成几条消息，fd 随第一条
+struct Sender {
+    int sock;
+    Writer batch;
+    std::vector<int> fds;
+
+    bool add(const std::string& rec, const int* rfds, size_t k) {
+        if ((!batch.out.empty() && batch.out.size() + rec.size() > HANDOVER_CHUNK) || fds.size() + k > HANDOVER_FDS) {
+            if (!flush()) return false;
+        }
+        batch.out += rec;
+        fds.insert(fds.end(), rfds, rfds + k);
+        return true;
+    }
+
+    bool flush() {
+        const std::string& s = batch.out;
+        for (size_t off = 0; off < s.size(); off += HANDOVER_CHUNK) {
+            bool first = off == 0;
+            if (!send_msg(sock, s.data() + off, std::min<size_t>(HANDOVER_CHUNK, s.size() - off),
+                          first ? fds.data() : nullptr, first ? fds.size() : 0)) return false;
+        }
+        batch.clear();
+        fds.clear();
+        return true;
+    }
+};
+
+void encode_conn(Writer& w, const HandoverConn& c) {
+    w.begin(REC_CONN);
+    w.bytes(c.user.data(), c.user.size());
+    w.u8((c.plain ? CONN_PLAIN : 0) | (c.key_update_pending ? CONN_KU_PENDING : 0));
+    w.u32(c.key_gen);
+    w.u64(c.key_uses);
+    w.bytes(c.aeskey.data(), c.aeskey.size());
+    w.bytes(c.prev_aeskey.data(), c.prev_aeskey.size());
+    w.u32(c.expected);
+    w.bytes(c.recv.data(), c.recv.size());
+    w.u16(static_cast<uint16_t>(c.groups.size()));
+    for (const std::string& g : c.groups) w.bytes(g.data(), g.size());
+    w.u32(static_cast<uint32_t>(c.paused.size()));
+    for (const std::string& f : c.paused) w.bytes(f.data(), f.size());
+    w.end();
+}
+
+HandoverConn decode_conn(Reader& r, int fd) {
+    HandoverConn c;
+    c.fd = fd;
+    c.user = r.str();
+    uint8_t flags = r.u8();
+    c.plain = flags & CONN_PLAIN;
+    c.key_update_pending = flags & CONN_KU_PENDING;
+    c.key_gen = r.u32();
+    c.key_uses = r.u64();
+    c.aeskey = r.vec();
+    c.prev_aeskey = r.vec();
+    c.expected = r.u32();
+    c.recv = r.str();
+    for (uint16_t n = r.u16(); n; --n) c.groups.push_back(r.str());
+    for (uint32_t n = r.u32(); n; --n) c.paused.push_back(r.str());
+    return c;
+}
+
+void set_timeout(int sock, int secs) {
+    timeval tv{secs, 0};
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+}   // namespace
+
+
+int handover_listen(const std::string& path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path.c_str());
+
+    int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s < 0) return -1;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    if (bind(s, (sockaddr*)&addr, sizeof(addr)) < 0 || chmod(path.c_str(), 0600) < 0 || listen(s, 1) < 0) {
+        int e = errno;
+        close(s);
+        errno = e;
+        return -1;
+    }
+    return s;
+}
+
+
+bool handover_send(int sock, int listen_sock, int unix_sock, const std::vector<HandoverConn>& conns) {
+    set_timeout(sock, HANDOVER_TIMEOUT_S);
+    Sender sender{sock, {}, {}};
+    Writer w;
+
+    int lfds[2];
+    size_t nl = 0;
+    uint8_t flags = 0;
+    if (listen_sock >= 0) lfds[nl++] = listen_sock, flags |= HDR_LISTEN;
+    if (unix_sock >= 0) lfds[nl++] = unix_sock, flags |= HDR_UNIX;
+    w.begin(REC_HDR);
+    w.u32(HANDOVER_MAGIC);
+    w.u8(flags);
+    w.end();
+    if (!sender.add(w.out, lfds, nl)) return false;
+
+    for (const HandoverConn& c : conns) {
+        w.clear();
+        encode_conn(w, c);
+        if (!sender.add(w.out, &c.fd, 1)) return false;
+    }
+    w.clear();
+    w.begin(REC_END);
+    w.u32(static_cast<uint32_t>(conns.size()));
+    w.end();
+    if (!sender.add(w.out, nullptr, 0) || !sender.flush()) return false;
+
+    char ack = 0;
+    ssize_t n;
+    while ((n = recv(sock, &ack, 1, 0)) < 0 && errno == EINTR) {}
+    if (n != 1 || ack != 'A') {
+        std::cerr << "Handover: no confirmation from the new server" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+int handover_connect(const std::string& path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s < 0) {
+        perror("socket");
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    if (connect(s, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (errno != ENOENT && errno != ECONNREFUSED) perror(path.c_str());
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+
+bool handover_receive(int sock, HandoverState& st) {
+    set_timeout(sock, HANDOVER_TIMEOUT_S);
+    std::string stream;
+    size_t parsed = 0;
+    std::deque<int> fds;
+    std::vector<char> buf(HANDOVER_CHUNK);
+    alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int) * HANDOVER_FDS)];
+    uint32_t total = 0;
+    bool done = false;
+
+    auto next_fd = [&fds]() {
+        if (fds.empty()) throw std::runtime_error("record without fd");
+        int fd = fds.front();
+        fds.pop_front();
+        return fd;
+    };
+
+    try {
+        while (!done) {
+            iovec iov{buf.data(), buf.size()};
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = ctrl;
+            msg.msg_controllen = sizeof(ctrl);
+            ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throw std::runtime_error(std::string("recvmsg: ") + strerror(errno));
+            if (n == 0) throw std::runtime_error("closed by the old server");
+
+            for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+                if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+                size_t k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const unsigned char* d = CMSG_DATA(c);
+                for (size_t i = 0; i < k; ++i) {
+                    int fd;
+                    memcpy(&fd, d + i * sizeof(int), sizeof(int));
+                    fds.push_back(fd);
+                }
+            }
+            // fd 超过 RLIMIT_NOFILE 时内核丢掉放不下的，只留下 MSG_CTRUNC
+            if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) throw std::runtime_error("message truncated, fd limit too low?");
+            stream.append(buf.data(), n);
+
+            // 取出收齐了的记录
+            while (!done && stream.size() - parsed >= 4) {
+                uint32_t len = get_u32(reinterpret_cast<const unsigned char*>(stream.data() + parsed));
+                if (stream.size() - parsed - 4 < len) break;
+                Reader r{reinterpret_cast<const unsigned char*>(stream.data() + parsed + 4), len};
+                parsed += 4 + len;
+
+                switch (r.u8()) {
+                case REC_HDR: {
+                    if (r.u32() != HANDOVER_MAGIC) throw std::runtime_error("incompatible handover version");
+                    uint8_t flags = r.u8();
+                    if (flags & HDR_LISTEN) st.listen_sock = next_fd();
+                    if (flags & HDR_UNIX) st.unix_sock = next_fd();
+                    break;
+                }
+                case REC_CONN:
+                    st.conns.push_back(decode_conn(r, next_fd()));
+                    break;
+                case REC_END:
+                    total = r.u32();
+                    done = true;
+                    break;
+                default:
+                    throw std::runtime_error("unknown record");
+                }
+            }
+            if (parsed == stream.size()) {
+                OPENSSL_cleanse(stream.data(), stream.size());
+                stream.clear();
+                parsed = 0;
+            }
+        }
+        if (total != st.conns.size()) throw std::runtime_error("connection count mismatch");
+    } catch (const std::exception& e) {
+        std::cerr << "Handover: " << e.what() << std::endl;
+        return false;
+    }
+
+    char ack = 'A';
+    if (send(sock, &ack, 1, MSG_NOSIGNAL) != 1) {
+        perror("handover ack");
+        return false;
+    }
+
+    // 旧进程退出时关闭交接 socket 。它退出前要做完剩下的任务、写完文件，等多久都行
+    set_timeout(sock, 0);
+    char c;
+    while (recv(sock, &c, 1, 0) < 0 && errno == EINTR) {}
+    return true;
+}
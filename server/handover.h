@@ -0,0 +1,49 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// ==================== 不停机升级 ====================
+// 新的 srv 进程连上旧进程的交接 socket （Unix 域，SOCK_SEQPACKET），旧进程用 SCM_RIGHTS 把监听 socket 和所有已登录连接的 fd 传过去，
+// 连同每个连接的会话状态：用户名、AES 密钥和密钥更新的进度、收了一半的帧、所在的群、被限速压着的帧。
+// TCP 连接和密钥都原样沿用，客户端看不到断线，也不用重新握手。
+// 状态编成一串 [u32 len][u8 类型][内容] 的记录，按大小切成若干条消息；每个 fd 与它的记录开头同一条（或更早的）消息到达，
+// 接收方按记录的顺序依次取 fd 配对
+
+// 一个连接的会话状态
+struct HandoverConn {
+    int fd = -1;
+    std::string user;
+    bool plain = false;                     // 不加密的连接（见 Crypto::use_plaintext）
+    std::vector<unsigned char> aeskey, prev_aeskey;
+    uint32_t key_gen = 0;
+    bool key_update_pending = false;
+    uint64_t key_uses = 0;
+    uint32_t expected = 0;                  // 收了一半的帧的长度，0 表示帧头还没收齐
+    std::string recv;                       // 收了一半的帧
+    std::vector<std::string> groups;        // 所在的群
+    std::vector<std::string> paused;        // 被限速压着、还没处理的完整帧
+};
+
+struct HandoverState {
+    int listen_sock = -1;
+    int unix_sock = -1;
+    std::vector<HandoverConn> conns;
+};
+
+// 旧进程：在 path 上监听交接请求（非阻塞，只有本用户能连），先删掉上次遗留的 socket 文件。失败返回 -1
+int handover_listen(const std::string& path);
+
+// 旧进程：把监听 socket 和 conns 发给已连上的新进程，等它确认收齐。返回 true 之后这些连接归新进程，本进程不能再读写
+bool handover_send(int sock, int listen_sock, int unix_sock, const std::vector<HandoverConn>& conns);
+
+// 新进程：连上 path 上的旧进程。没有旧进程（路径不存在或没人监听）返回 -1
+int handover_connect(const std::string& path);
+
+// 新进程：收下全部状态并确认，然后等旧进程退出（交接 socket 被关闭），它的离线消息、聊天记录等文件都已写完关闭。
+// 失败返回 false ，此时旧进程没收到确认，会继续服务
+bool handover_receive(int sock, HandoverState& st);
+
+#endif // HANDOVER_H
@@ -0,0 +1,379 @@
+#include "history.h"
+#include "mem_account.h"
+#include "util.h"
+#include "proto.h"
+
+#include <iostream>
+#include <format>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HIST_MAGIC 0x48495354u              // "HIST"
+#define HIST_BLK_HDR_LEN 32
+#define HIST_REC_HDR_LEN 14                 // [u64][u16][u32]
+#define HIST_PEND_HDR_LEN 16                // 待写缓冲区中每条的头部 [u64][u16][u16][u32]
+#define HIST_FLUSH_MS 200                   // 最长多久提交一次
+#define HIST_BLOCK_MAX (64u << 10)          // 一块超过这么大就另起一块
+#define HIST_MAX_QUERIES 256                // 最多排队的查询数
+
+// 会话键与两人的顺序无关： [u16 较小者的长度][较小者][较大者]
+static std::string conv_key(std::string_view a, std::string_view b) {
+    if (b < a) std::swap(a, b);
+    std::string key(2, '\0');
+    put_u16(reinterpret_cast<unsigned char*>(key.data()), static_cast<uint16_t>(a.size()));
+    key.append(a).append(b);
+    return key;
+}
+
+
+HistoryStore::HistoryStore(const std::string& dir, size_t seg_bytes) : dir(dir), seg_bytes(seg_bytes) {
+    if (seg_bytes < 2 * HIST_BLOCK_MAX || seg_bytes > UINT32_MAX) throw std::runtime_error("Segment size must be between 128 KB and 4 GB");
+    if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+        throw std::runtime_error(std::format("Cannot create {}: {}", dir, strerror(errno)));
+    }
+    scan();
+    writer = std::thread([this] { writer_loop(); });
+    querier = std::thread([this] { query_loop(); });
+}
+
+
+HistoryStore::~HistoryStore() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+    }
+    query_cv.notify_one();
+    querier.join();     // 查询可能在等写线程，先停查询线程
+    cv.notify_one();
+    writer.join();
+    for (auto& [seg, s] : segs) {
+        if (s.base) munmap(const_cast<unsigned char*>(s.base), seg_bytes);
+        if (s.fd >= 0) close(s.fd);
+    }
+}
+
+
+std::string HistoryStore::seg_path(uint32_t seg) const {
+    return std::format("{}/hist-{:08}.dat", dir, seg);
+}
+
+
+HistoryStore::Segment& HistoryStore::map_segment(uint32_t seg, bool create) {
+    Segment& s = segs[seg];
+    // 写用 pwrite ，读走这个只读映射（同一份页缓存，写完即可见）
+    if (!s.base) s.base = map_segment_file(seg_path(seg), seg_bytes, create, false, s.fd);
+    return s;
+}
+
+
+// 只读块头重建索引；最后一块可能没写完，逐条校验
+void HistoryStore::scan() {
+    std::vector<uint32_t> found = list_segments(dir, "hist-%u.dat");
+
+    for (uint32_t seg : found) {
+        const unsigned char* base = map_segment(seg, false).base;
+        size_t off = 0;
+        while (off + HIST_BLK_HDR_LEN <= seg_bytes && get_u32(base + off) == HIST_MAGIC) {
+            const unsigned char* p = base + off;
+            size_t len = get_u32(p + 4), keylen = get_u16(p + 28);
+            if (len < HIST_BLK_HDR_LEN + keylen || off + len > seg_bytes) break;
+
+            bool ok = true;
+            if (seg == found.back()) {
+                size_t at = HIST_BLK_HDR_LEN + keylen;
+                for (uint32_t k = get_u32(p + 8); ok && k; --k) {
+                    ok = at + HIST_REC_HDR_LEN <= len;
+                    if (ok) at += HIST_REC_HDR_LEN + get_u16(p + at + 8) + get_u32(p + at + 10);
+                }
+                ok = ok && at == len;
+            }
+            if (!ok) break;
+
+            std::string key(reinterpret_cast<const char*>(p + HIST_BLK_HDR_LEN), keylen);
+            index[key].push_back(BlockRef{make_pos(seg, static_cast<uint32_t>(off)), get_u64(p + 12), get_u64(p + 20), get_u32(p + 8)});
+            last_ts = std::max(last_ts, get_u64(p + 20));
+            ++nblocks;
+            off += len;
+        }
+        tail = make_pos(seg, static_cast<uint32_t>(off));
+    }
+
+    if (nblocks) std::cout << std::format("History store: {} blocks for {} conversations in {} segments", nblocks, index.size(), segs.size()) << std::endl;
+}
+
+
+void HistoryStore::record(std::string_view from, std::string_view to, const unsigned char* msg, size_t len) {
+    bool notify;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (pending.size() > WRITER_MAX_PENDING || from.size() > UINT16_MAX || to.size() > UINT16_MAX || len > UINT32_MAX) {
+            ++dropped;
+            return;
+        }
+        uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        last_ts = std::max(last_ts, now);
+
+        size_t at = pending.size();
+        pending.resize(at + HIST_PEND_HDR_LEN + from.size() + to.size() + len);
+        unsigned char* p = reinterpret_cast<unsigned char*>(pending.data() + at);
+        put_u64(p, last_ts);
+        put_u16(p + 8, static_cast<uint16_t>(from.size()));
+        put_u16(p + 10, static_cast<uint16_t>(to.size()));
+        put_u32(p + 12, static_cast<uint32_t>(len));
+        p += HIST_PEND_HDR_LEN;
+        memcpy(p, from.data(), from.size()), p += from.size();
+        memcpy(p, to.data(), to.size()), p += to.size();
+        if (len) memcpy(p, msg, len);
+
+        ++pending_msgs;
+        MemAccount::add(MEM_HISTORY, -1, HIST_PEND_HDR_LEN + from.size() + to.size() + len);
+        notify = pending.size() >= WRITER_FLUSH_BYTES;
+    }
+    if (notify) cv.notify_one();
+}
+
+
+void HistoryStore::writer_loop() {
+    std::string batch;
+    while (1) {
+        bool done;
+        uint64_t ticket;
+        size_t nmsgs;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait_for(lock, std::chrono::milliseconds(HIST_FLUSH_MS), [this] { return stop || flush_now || pending.size() >= WRITER_FLUSH_BYTES; });
+            batch.swap(pending);
+            nmsgs = pending_msgs;
+            pending_msgs = 0;
+            flush_now = false;
+            if (!batch.empty()) ++batches;
+            ticket = batches;
+            done = stop;
+        }
+
+        if (!batch.empty()) {
+            // 按会话分组，组内保持先后顺序
+            std::unordered_map<std::string, std::vector<size_t>> convs;
+            std::vector<const std::string*> order;      // 会话第一次出现的顺序，写出的块也按这个顺序
+            for (size_t at = 0; at < batch.size(); ) {
+                const unsigned char* p = reinterpret_cast<const unsigned char*>(batch.data() + at);
+                size_t flen = get_u16(p + 8), tlen = get_u16(p + 10), mlen = get_u32(p + 12);
+                std::string_view from(batch.data() + at + HIST_PEND_HDR_LEN, flen), to(from.data() + flen, tlen);
+                auto [it, fresh] = convs.try_emplace(conv_key(from, to));
+                if (fresh) order.push_back(&it->first);
+                it->second.push_back(at);
+                at += HIST_PEND_HDR_LEN + flen + tlen + mlen;
+            }
+
+            // 组装块，排好位置，同一段里相邻的块拼成一次 pwrite
+            struct Write { uint64_t pos; std::string data; };
+            std::vector<Write> writes;
+            std::vector<std::pair<const std::string*, BlockRef>> refs;
+            uint64_t pos = 0;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                pos = tail;
+            }
+            std::string blk;
+            auto seal = [&](const std::string* key, uint32_t count, uint64_t first, uint64_t last) {
+                unsigned char* h = reinterpret_cast<unsigned char*>(blk.data());
+                put_u32(h, HIST_MAGIC);
+                put_u32(h + 4, static_cast<uint32_t>(blk.size()));
+                put_u32(h + 8, count);
+                put_u64(h + 12, first);
+                put_u64(h + 20, last);
+                put_u16(h + 28, static_cast<uint16_t>(key->size()));
+                put_u16(h + 30, 0);
+                if (blk.size() > seg_bytes) {
+                    std::cerr << std::format("History: message too large for a segment, dropped {} msgs", count) << std::endl;
+                    return;
+                }
+                if (off_of(pos) + blk.size() > seg_bytes) pos = make_pos(seg_of(pos) + 1, 0);
+                if (writes.empty() || writes.back().pos + writes.back().data.size() != pos) writes.push_back(Write{pos, {}});
+                writes.back().data += blk;
+                refs.emplace_back(key, BlockRef{pos, first, last, count});
+                pos += blk.size();
+            };
+            for (const std::string* key : order) {
+                uint32_t count = 0;
+                uint64_t first = 0, last = 0;
+                for (size_t at : convs[*key]) {
+                    if (!count) blk.assign(HIST_BLK_HDR_LEN, '\0'), blk += *key;
+                    const unsigned char* p = reinterpret_cast<const unsigned char*>(batch.data() + at);
+                    size_t flen = get_u16(p + 8), tlen = get_u16(p + 10), mlen = get_u32(p + 12);
+                    uint64_t ts = get_u64(p);
+                    unsigned char rh[HIST_REC_HDR_LEN];
+                    put_u64(rh, ts);
+                    put_u16(rh + 8, static_cast<uint16_t>(flen));
+                    put_u32(rh + 10, static_cast<uint32_t>(mlen));
+                    blk.append(reinterpret_cast<const char*>(rh), sizeof(rh));
+                    blk.append(batch, at + HIST_PEND_HDR_LEN, flen);
+                    blk.append(batch, at + HIST_PEND_HDR_LEN + flen + tlen, mlen);
+                    if (!count++) first = ts;
+                    last = ts;
+                    if (blk.size() >= HIST_BLOCK_MAX) seal(key, count, first, last), count = 0;
+                }
+                if (count) seal(key, count, first, last);
+            }
+
+            // 新的段在锁内建好（要改 segs ；很少发生），写和落盘在锁外
+            std::vector<int> fds;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                for (const Write& w : writes) {
+                    try {
+                        fds.push_back(map_segment(seg_of(w.pos), true).fd);
+                    } catch (const std::exception& e) {
+                        std::cerr << "History: " << e.what() << std::endl;
+                        fds.push_back(-1);
+                    }
+                }
+            }
+            std::vector<bool> ok(writes.size());
+            for (size_t i = 0; i < writes.size(); ++i) {
+                if (fds[i] < 0) continue;
+                const std::string& d = writes[i].data;
+                ok[i] = pwrite(fds[i], d.data(), d.size(), off_of(writes[i].pos)) == static_cast<ssize_t>(d.size());
+                if (!ok[i]) std::cerr << std::format("History write: {}", strerror(errno)) << std::endl;
+                if (i + 1 == writes.size() || fds[i + 1] != fds[i]) fdatasync(fds[i]);     // 每段一次落盘
+            }
+
+            std::lock_guard<std::mutex> lock(mtx);
+            for (const auto& [key, ref] : refs) {
+                auto w = std::upper_bound(writes.begin(), writes.end(), ref.pos, [](uint64_t p, const Write& w) { return p < w.pos; });
+                if (!ok[w - writes.begin() - 1]) continue;
+                index[*key].push_back(ref);
+                ++nblocks;
+            }
+            tail = pos;
+            stored += nmsgs;
+            MemAccount::add(MEM_HISTORY, -1, -static_cast<int64_t>(batch.size()));
+            batch.clear();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            committed = ticket;
+        }
+        commit_cv.notify_all();
+        if (done) return;
+    }
+}
+
+
+bool HistoryStore::query(std::string_view self, std::string_view peer, uint32_t limit, uint64_t since_us, uint64_t until_us, Reply reply) {
+    if (!limit || limit > HIST_MAX_LIMIT) limit = HIST_MAX_LIMIT;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (stop || jobs.size() >= HIST_MAX_QUERIES) return false;
+        jobs.emplace_back([this, key = conv_key(self, peer), limit, since_us, until_us, reply = std::move(reply)] {
+            run_query(key, limit, since_us, until_us, reply);
+        });
+        ++queries;
+    }
+    query_cv.notify_one();
+    return true;
+}
+
+
+void HistoryStore::query_loop() {
+    while (1) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            query_cv.wait(lock, [this] { return stop || (!held && !jobs.empty()); });
+            if (jobs.empty() || held) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            querying = true;
+        }
+        try {
+            job();
+        } catch (const std::exception& e) {
+            std::cerr << "History query: " << e.what() << std::endl;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            querying = false;
+        }
+        idle_cv.notify_all();
+    }
+}
+
+
+void HistoryStore::hold(bool on) {
+    std::unique_lock<std::mutex> lock(mtx);
+    held = on;
+    if (on) idle_cv.wait(lock, [this] { return !querying; });
+    else query_cv.notify_one();
+}
+
+
+void HistoryStore::run_query(const std::string& key, uint32_t limit, uint64_t since, uint64_t until, const Reply& reply) {
+    if (!until) until = UINT64_MAX;
+    std::vector<std::pair<const unsigned char*, BlockRef>> blocks;
+    {
+        // 先让写线程把查询之前记下的消息写出去，最近的消息也能查到
+        std::unique_lock<std::mutex> lock(mtx);
+        uint64_t target = batches + (pending.empty() ? 0 : 1);
+        if (committed < target) {
+            flush_now = true;
+            cv.notify_one();
+            commit_cv.wait(lock, [&] { return committed >= target || stop; });
+        }
+
+        // 稀疏索引上二分出时间段内的块，再从最新的往前取，条数够了就停
+        auto it = index.find(key);
+        if (it != index.end()) {
+            const auto& refs = it->second;
+            auto lo = std::partition_point(refs.begin(), refs.end(), [&](const BlockRef& r) { return r.last_ts < since; });
+            auto hi = std::partition_point(lo, refs.end(), [&](const BlockRef& r) { return r.first_ts < until; });
+            uint64_t n = 0;
+            while (hi != lo && n < limit) {
+                --hi;
+                blocks.emplace_back(segs[seg_of(hi->pos)].base + off_of(hi->pos), *hi);
+                n += hi->count;
+            }
+        }
+    }
+
+    // 段只增不删，出锁后可以直接读映射。块从旧到新扫，只留最后 limit 条
+    std::vector<HistoryStore::Rec> recs;
+    for (auto b = blocks.rbegin(); b != blocks.rend(); ++b) {
+        const unsigned char* p = b->first;
+        size_t len = get_u32(p + 4), at = HIST_BLK_HDR_LEN + get_u16(p + 28);
+        for (uint32_t k = 0; k < b->second.count && at + HIST_REC_HDR_LEN <= len; ++k) {
+            uint64_t ts = get_u64(p + at);
+            size_t flen = get_u16(p + at + 8), mlen = get_u32(p + at + 10);
+            if (at + HIST_REC_HDR_LEN + flen + mlen > len) break;
+            if (ts >= since && ts < until) {
+                recs.push_back(Rec{ts, std::string_view(reinterpret_cast<const char*>(p + at + HIST_REC_HDR_LEN), flen),
+                                       std::string_view(reinterpret_cast<const char*>(p + at + HIST_REC_HDR_LEN + flen), mlen)});
+            }
+            at += HIST_REC_HDR_LEN + flen + mlen;
+        }
+    }
+    if (recs.size() > limit) recs.erase(recs.begin(), recs.end() - limit);
+    reply(recs);
+}
+
+
+HistoryStats HistoryStore::stats() {
+    std::lock_guard<std::mutex> lock(mtx);
+    HistoryStats st;
+    st.stored = stored;
+    st.dropped = dropped;
+    st.blocks = nblocks;
+    st.queries = queries;
+    st.conversations = index.size();
+    st.segments = segs.size();
+    return st;
+}
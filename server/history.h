@@ -0,0 +1,111 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "util.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+
+// ==================== 聊天记录 ====================
+// 按会话（两个用户名组成的无序对）保存一对一消息，供用户重连后查最近 N 条或某个时间段。
+//   块：    同一会话在一次提交里的消息打包成一块，块内记录紧挨着、按时间先后排列，查询时顺序扫过即可：
+//           [u32 HIST_MAGIC][u32 块长][u32 条数][u64 首条时间][u64 末条时间][u16 keylen][u16 0][会话键]
+//           之后每条 [u64 时间戳][u16 fromlen][u32 msglen][from][msg] ，整数为网络字节序，时间戳为 Unix 微秒。
+//   日志段：固定大小的文件 hist-<编号>.dat ，块顺序追加（pwrite），写满换下一个；只读 mmap 供查询。
+//   索引：  内存里每个会话一个块列表（位置、首末时间、条数），即每块一项的稀疏时间索引，启动时扫描块头重建。
+// 工作线程只把消息拷进待写缓冲区；写线程定期整批按会话分块、一次写出并落盘；查询在单独的线程上执行，
+// 不占用主循环和工作线程。暂不删除旧记录
+
+struct HistoryStats {
+    uint64_t stored = 0;        // 累计写入的消息数
+    uint64_t dropped = 0;       // 写不过来而丢弃的消息数
+    uint64_t blocks = 0;        // 当前的块数
+    uint64_t queries = 0;       // 累计查询数
+    size_t conversations = 0;
+    size_t segments = 0;
+};
+
+class HistoryStore {
+  public:
+    struct Rec {
+        uint64_t ts_us;
+        std::string_view from, msg;     // 指向 mmap ，回调返回前有效
+    };
+    using Reply = std::function<void(const std::vector<Rec>& recs)>;
+
+  private:
+    struct BlockRef {
+        uint64_t pos;                   // 高 32 位为段号，低 32 位为段内偏移
+        uint64_t first_ts, last_ts;
+        uint32_t count;
+    };
+
+    struct Segment {
+        int fd = -1;
+        const unsigned char* base = nullptr;
+    };
+
+    std::string dir;
+    size_t seg_bytes;
+
+    std::mutex mtx;
+    std::unordered_map<std::string, std::vector<BlockRef>, StrHash, std::equal_to<>> index;    // 会话键 -> 块，按时间先后
+    std::map<uint32_t, Segment> segs;
+    uint64_t tail = 0;                  // 下一块的位置
+    std::string pending;                // 待写的消息： [u64 时间戳][u16 alen][u16 blen][u32 msglen][a][b][msg]
+    size_t pending_msgs = 0;
+    uint64_t batches = 0, committed = 0;    // 已交给写线程的批次、已写完的批次
+    bool flush_now = false;
+    uint64_t last_ts = 0;               // 保证时间戳单调不减，时间索引才能二分
+    uint64_t stored = 0, dropped = 0, nblocks = 0, queries = 0;
+
+    std::condition_variable cv;         // 唤醒写线程
+    std::condition_variable commit_cv;  // 通知等待落盘的查询
+    std::thread writer;
+
+    std::deque<std::function<void()>> jobs;     // 待执行的查询
+    std::condition_variable query_cv;
+    std::condition_variable idle_cv;            // 通知 hold() 正在执行的查询做完了
+    std::thread querier;
+    bool held = false, querying = false;
+    bool stop = false;
+
+    std::string seg_path(uint32_t seg) const;
+    Segment& map_segment(uint32_t seg, bool create);    // 调用时已上锁
+    void scan();
+    void writer_loop();
+    void query_loop();
+    void run_query(const std::string& key, uint32_t limit, uint64_t since, uint64_t until, const Reply& reply);
+
+  public:
+    // 打开（或创建）目录，扫描已有的日志段，失败抛异常
+    HistoryStore(const std::string& dir, size_t seg_bytes);
+    ~HistoryStore();    // 写完剩余消息、执行完已排队的查询再关闭
+
+    HistoryStore(const HistoryStore &) = delete;
+    HistoryStore &operator=(const HistoryStore &) = delete;
+
+    // 工作线程调用：记一条 from 发给 to 的消息
+    void record(std::string_view from, std::string_view to, const unsigned char* msg, size_t len);
+
+    // 查询 self 与 peer 的会话，结果按时间先后交给 reply （在查询线程上调用）。排队的查询太多时返回 false
+    bool query(std::string_view self, std::string_view peer, uint32_t limit, uint64_t since_us, uint64_t until_us, Reply reply);
+
+    // hold(true) 等正在执行的查询做完才返回，之后新的查询只排队、不执行；hold(false) 恢复执行。
+    // 不停机升级时用：交接期间不会再有查询结果提交给线程池。停住时析构，排队的查询直接丢弃
+    void hold(bool on);
+
+    HistoryStats stats();
+};
+
+#endif // HISTORY_H
@@ -0,0 +1,55 @@
+#include "mem_account.h"
+
+#include <memory>
+#include <algorithm>
+#include <sys/resource.h>
+
+#define MAX_TRACKED_FDS (1 << 22)   // fd 上限不限或特别大时，只跟踪这么多个
+
+namespace {
+
+// 各计数器独占缓存行，避免工作线程互相干扰
+struct alignas(64) Counter {
+    std::atomic<int64_t> v{0};
+};
+
+size_t limit_bytes = 0;
+Counter total_bytes;
+Counter cat_bytes[MEM_NCAT];
+std::unique_ptr<std::atomic<int64_t>[]> fd_bytes;   // 按 fd 下标，连接级别的计数不必独占缓存行
+int nfds = 0;
+
+}   // namespace
+
+
+void MemAccount::init(size_t limit) {
+    limit_bytes = limit;
+
+    rlimit rl;
+    rlim_t n = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) n = rl.rlim_cur;
+    nfds = static_cast<int>(std::min<rlim_t>(n, MAX_TRACKED_FDS));
+    fd_bytes = std::make_unique<std::atomic<int64_t>[]>(nfds);
+}
+
+
+void MemAccount::add(MemCat cat, int fd, int64_t n) {
+    total_bytes.v.fetch_add(n, std::memory_order_relaxed);
+    cat_bytes[cat].v.fetch_add(n, std::memory_order_relaxed);
+    if (fd >= 0 && fd < nfds) fd_bytes[fd].fetch_add(n, std::memory_order_relaxed);
+}
+
+
+int64_t MemAccount::total() { return total_bytes.v.load(std::memory_order_relaxed); }
+int64_t MemAccount::by_cat(MemCat cat) { return cat_bytes[cat].v.load(std::memory_order_relaxed); }
+int64_t MemAccount::by_fd(int fd) { return fd >= 0 && fd < nfds ? fd_bytes[fd].load(std::memory_order_relaxed) : 0; }
+size_t MemAccount::limit() { return limit_bytes; }
+
+bool MemAccount::pressure() { return limit_bytes && total() >= static_cast<int64_t>(limit_bytes * MEM_SOFT_RATIO); }
+bool MemAccount::over() { return limit_bytes && total() >= static_cast<int64_t>(limit_bytes); }
+
+
+const char* MemAccount::cat_name(MemCat cat) {
+    static const char* names[MEM_NCAT] = {"recv", "queue", "send", "crypto", "cluster", "capture", "offline", "history"};
+    return names[cat];
+}
@@ -0,0 +1,74 @@
+#ifndef MEM_ACCOUNT_H
+#define MEM_ACCOUNT_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+// ==================== 内存记账 ====================
+// 给服务端主要的几类缓冲区和队列记账：总量、按类别、按连接 (fd) 。
+// 只统计数据本身的字节数，不含容器和分配器的额外开销，所以是下限估计。
+// 设置上限后，主线程据此拒绝新握手、限制帧长、断开占用最多的连接（见 server.cpp）
+
+enum MemCat {
+    MEM_RECV,       // 各连接接收缓冲区中未拼完整的数据
+    MEM_QUEUE,      // 已拆出、排队等待路由的帧（含被限速暂存的）
+    MEM_SEND,       // 排队等待发送的消息，及正在组装的发送包
+    MEM_CRYPTO,     // 每个连接的 Crypto 对象（估算）
+    MEM_CLUSTER,    // 集群链路的发送积压和收了一半的记录
+    MEM_CAPTURE,    // 抓包的写盘积压
+    MEM_OFFLINE,    // 离线消息的写盘积压
+    MEM_HISTORY,    // 聊天记录的写盘积压
+    MEM_NCAT
+};
+
+#define MEM_SOFT_RATIO 0.8          // 用量超过上限的这个比例即视为有压力
+#define CRYPTO_CONN_BYTES 256       // 每个连接的状态估算大小：连接表的一项 + AES 密钥（ECC 密钥握手后即释放）
+
+
+class MemAccount {
+  public:
+    // 设置上限（0 表示不限，仍然记账）并按 fd 上限分配每个连接的计数器
+    static void init(size_t limit_bytes);
+
+    // 记账，n 可为负。fd < 0 表示不属于某个连接
+    static void add(MemCat cat, int fd, int64_t n);
+
+    static int64_t total();
+    static int64_t by_cat(MemCat cat);
+    static int64_t by_fd(int fd);
+    static size_t limit();
+
+    static bool pressure();     // 超过上限的 MEM_SOFT_RATIO
+    static bool over();         // 超过上限
+
+    static const char* cat_name(MemCat cat);
+};
+
+
+// RAII 记账：构造时记入，析构时扣除。跟着数据一起移动（比如放进任务 lambda），数据释放时自动结清
+class MemCharge {
+  private:
+    MemCat cat = MEM_QUEUE;
+    int fd = -1;
+    int64_t n = 0;
+
+  public:
+    MemCharge() = default;
+    MemCharge(MemCat cat, int fd, int64_t n) : cat(cat), fd(fd), n(n) { if (n) MemAccount::add(cat, fd, n); }
+    ~MemCharge() { if (n) MemAccount::add(cat, fd, -n); }
+
+    MemCharge(MemCharge&& o) noexcept : cat(o.cat), fd(o.fd), n(std::exchange(o.n, 0)) {}
+    MemCharge& operator=(MemCharge&& o) noexcept {
+        if (this != &o) {
+            if (n) MemAccount::add(cat, fd, -n);
+            cat = o.cat, fd = o.fd, n = std::exchange(o.n, 0);
+        }
+        return *this;
+    }
+    MemCharge(const MemCharge&) = delete;
+    MemCharge& operator=(const MemCharge&) = delete;
+};
+
+#endif // MEM_ACCOUNT_H
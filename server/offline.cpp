@@ -0,0 +1,341 @@
+#include "offline.h"
+#include "mem_account.h"
+#include "util.h"
+#include "proto.h"
+
+#include <iostream>
+#include <format>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define OFF_MAGIC 0xa5
+#define OFF_HDR_LEN 10                      // [u8 magic][u8 类型][u16][u16][u32]
+#define OFF_FLUSH_MS 20                     // 最长多久提交一次
+#define OFF_MAX_PER_USER 10000              // 每个用户最多保存多少条
+
+// 记录类型
+#define REC_MSG 1
+#define REC_DONE 2
+
+
+OfflineStore::OfflineStore(const std::string& dir, size_t seg_bytes) : dir(dir), seg_bytes(seg_bytes) {
+    if (seg_bytes < 4096 || seg_bytes > UINT32_MAX) throw std::runtime_error("Segment size must be between 4 KB and 4 GB");
+    if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+        throw std::runtime_error(std::format("Cannot create {}: {}", dir, strerror(errno)));
+    }
+
+    // 登记过的用户单独存一个文件，每行一个。日志段会被删除，用户不能跟着丢
+    users_fd = open((dir + "/users").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (users_fd < 0) throw std::runtime_error(std::format("Cannot open {}/users: {}", dir, strerror(errno)));
+    std::string all;
+    char rbuf[65536];
+    for (ssize_t n; (n = read(users_fd, rbuf, sizeof(rbuf))) > 0; ) all.append(rbuf, n);
+    for (size_t at = 0, nl; (nl = all.find('\n', at)) != std::string::npos; at = nl + 1) {
+        if (nl > at) users.emplace(all, at, nl - at);
+    }
+
+    scan();
+    writer = std::thread([this] { writer_loop(); });
+}
+
+
+OfflineStore::~OfflineStore() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+    }
+    cv.notify_one();
+    writer.join();
+    for (auto& [seg, s] : segs) {
+        if (s.base) munmap(s.base, seg_bytes);
+        if (s.fd >= 0) close(s.fd);
+    }
+    close(users_fd);
+}
+
+
+std::string OfflineStore::seg_path(uint32_t seg) const {
+    return std::format("{}/seg-{:08}.log", dir, seg);
+}
+
+
+OfflineStore::Segment& OfflineStore::map_segment(uint32_t seg, bool create) {
+    Segment& s = segs[seg];
+    if (!s.base) s.base = map_segment_file(seg_path(seg), seg_bytes, create, true, s.fd);      // 之后的追加只是写内存
+    return s;
+}
+
+
+// 按段号顺序重放所有记录，重建索引和每段的未投递计数
+void OfflineStore::scan() {
+    for (uint32_t seg : list_segments(dir, "seg-%u.log")) {
+        Segment& s = map_segment(seg, false);
+        size_t off = 0;
+        while (off + OFF_HDR_LEN <= seg_bytes && s.base[off] == OFF_MAGIC) {
+            const unsigned char* p = s.base + off;
+            size_t ulen = get_u16(p + 2), flen = get_u16(p + 4), mlen = get_u32(p + 6);
+            size_t len = OFF_HDR_LEN + ulen + flen + mlen;
+            if (off + len > seg_bytes) break;
+            std::string user(reinterpret_cast<const char*>(p + OFF_HDR_LEN), ulen);
+            uint64_t pos = make_pos(seg, static_cast<uint32_t>(off));
+
+            if (p[1] == REC_MSG) {
+                index[user].push_back(Loc{pos, static_cast<uint32_t>(len)});
+                ++s.live;
+            } else if (p[1] == REC_DONE && mlen == 8) {
+                uint64_t upto = (static_cast<uint64_t>(get_u32(p + len - 8)) << 32) | get_u32(p + len - 4);
+                auto it = index.find(user);
+                while (it != index.end() && !it->second.empty() && it->second.front().pos < upto) {
+                    --segs[seg_of(it->second.front().pos)].live;
+                    it->second.pop_front();
+                }
+                if (it != index.end() && it->second.empty()) index.erase(it);
+            }
+            off += len;
+        }
+        // 崩溃时写到一半的记录：清掉它的头部，免得之后追加的记录后面又接上它的残余
+        if (off + OFF_HDR_LEN <= seg_bytes && s.base[off] == OFF_MAGIC) memset(s.base + off, 0, OFF_HDR_LEN);
+        tail = make_pos(seg, static_cast<uint32_t>(off));
+    }
+    committed = tail;
+
+    // 除了最后一段，开头那些没有未投递消息的段直接删掉
+    while (segs.size() > 1 && segs.begin()->second.live == 0) {
+        auto it = segs.begin();
+        munmap(it->second.base, seg_bytes);
+        close(it->second.fd);
+        unlink(seg_path(it->first).c_str());
+        segs.erase(it);
+    }
+
+    size_t n = 0;
+    for (const auto& [user, locs] : index) n += locs.size();
+    if (n) std::cout << std::format("Offline store: {} msgs for {} users in {} segments", n, index.size(), segs.size()) << std::endl;
+}
+
+
+void OfflineStore::add_user(std::string_view user) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (users.contains(user)) return;
+    users.emplace(user);
+    pending_users.append(user).push_back('\n');
+}
+
+
+uint64_t OfflineStore::append_locked(uint8_t type, std::string_view user, std::string_view from, const unsigned char* msg, size_t len) {
+    size_t total = OFF_HDR_LEN + user.size() + from.size() + len;
+    if (total > seg_bytes) return UINT64_MAX;
+    if (off_of(tail) + total > seg_bytes) tail = make_pos(seg_of(tail) + 1, 0);    // 这一段放不下，换下一段
+    uint64_t pos = tail;
+    tail += total;
+
+    if (pending.empty() || pending.back().pos + pending.back().data.size() != pos) pending.push_back(Chunk{pos, {}});
+    std::string& out = pending.back().data;
+    size_t at = out.size();
+    out.resize(at + total);
+    unsigned char* p = reinterpret_cast<unsigned char*>(out.data() + at);
+    p[0] = OFF_MAGIC;
+    p[1] = type;
+    put_u16(p + 2, static_cast<uint16_t>(user.size()));
+    put_u16(p + 4, static_cast<uint16_t>(from.size()));
+    put_u32(p + 6, static_cast<uint32_t>(len));
+    p += OFF_HDR_LEN;
+    memcpy(p, user.data(), user.size()), p += user.size();
+    memcpy(p, from.data(), from.size()), p += from.size();
+    if (len) memcpy(p, msg, len);
+
+    pending_bytes += total;
+    MemAccount::add(MEM_OFFLINE, -1, total);
+    return pos;
+}
+
+
+bool OfflineStore::append(std::string_view to, std::string_view from, const unsigned char* msg, size_t len, bool& known) {
+    bool notify;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        known = users.contains(to);
+        if (!known || pending_bytes > WRITER_MAX_PENDING || to.size() > UINT16_MAX || from.size() > UINT16_MAX) return false;
+        auto& locs = index[std::string(to)];
+        if (locs.size() >= OFF_MAX_PER_USER) return false;
+
+        uint64_t pos = append_locked(REC_MSG, to, from, msg, len);
+        if (pos == UINT64_MAX) return false;
+        locs.push_back(Loc{pos, static_cast<uint32_t>(tail - pos)});
+        ++segs[seg_of(pos)].live;
+        ++stored;
+        notify = pending_bytes >= WRITER_FLUSH_BYTES;
+    }
+    if (notify) cv.notify_one();
+    return true;
+}
+
+
+void OfflineStore::release_locked(const std::vector<Loc>& locs) {
+    for (const Loc& l : locs) --segs[seg_of(l.pos)].live;
+
+    // 只删开头的段：这样留下来的段里已投递的消息，其 REC_DONE 一定在更靠后、同样留下来的段里
+    while (segs.size() > 1 && segs.begin()->second.live == 0 && segs.begin()->first < seg_of(committed)) {
+        auto it = segs.begin();
+        if (it->second.base) munmap(it->second.base, seg_bytes);
+        if (it->second.fd >= 0) close(it->second.fd);
+        unlink(seg_path(it->first).c_str());
+        segs.erase(it);
+    }
+}
+
+
+const unsigned char* OfflineStore::unwritten_locked(uint64_t pos) const {
+    for (const std::vector<Chunk>* v : {&inflight, &pending}) {
+        for (const Chunk& c : *v) {
+            if (pos >= c.pos && pos < c.pos + c.data.size()) return reinterpret_cast<const unsigned char*>(c.data.data() + (pos - c.pos));
+        }
+    }
+    return nullptr;
+}
+
+
+size_t OfflineStore::drain(std::string_view user, size_t max_batch,
+                           const std::function<bool(const std::vector<std::string_view>&, const std::vector<std::string_view>&)>& on_batch) {
+    std::deque<Loc> locs;
+    std::vector<const unsigned char*> recs;
+    std::string copies;                         // 还没写进 mmap 的记录，在锁内拷出来
+    std::vector<std::pair<size_t, size_t>> copied;  // (recs 下标, 在 copies 中的偏移)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = index.find(user);
+        if (it == index.end()) return 0;
+        locs.swap(it->second);
+        index.erase(it);
+        if (locs.empty()) return 0;
+
+        // 已提交的记录所在的段在 live 归零前不会被删除，出锁后可以直接读；没提交的不等写线程落盘，拷一份
+        recs.reserve(locs.size());
+        for (const Loc& l : locs) {
+            if (l.pos >= committed) {
+                const unsigned char* p = unwritten_locked(l.pos);
+                if (p) {
+                    copied.emplace_back(recs.size(), copies.size());
+                    copies.append(reinterpret_cast<const char*>(p), l.len);
+                }
+                recs.push_back(nullptr);
+                continue;
+            }
+            auto sit = segs.find(seg_of(l.pos));
+            recs.push_back(sit != segs.end() && sit->second.base ? sit->second.base + off_of(l.pos) : nullptr);
+        }
+    }
+    for (auto [k, at] : copied) recs[k] = reinterpret_cast<const unsigned char*>(copies.data() + at);
+
+    size_t done = 0;
+    std::vector<std::string_view> froms, msgs;
+    while (done < locs.size()) {
+        froms.clear(), msgs.clear();
+        size_t end = std::min(done + max_batch, locs.size());
+        for (size_t k = done; k < end; ++k) {
+            const unsigned char* p = recs[k];
+            if (!p || p[0] != OFF_MAGIC) continue;      // 没能写进日志的记录（比如磁盘满），跳过
+            size_t ulen = get_u16(p + 2), flen = get_u16(p + 4), mlen = get_u32(p + 6);
+            froms.emplace_back(reinterpret_cast<const char*>(p + OFF_HDR_LEN + ulen), flen);
+            msgs.emplace_back(reinterpret_cast<const char*>(p + OFF_HDR_LEN + ulen + flen), mlen);
+        }
+        if (!froms.empty() && !on_batch(froms, msgs)) break;
+        done = end;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<Loc> released(locs.begin(), locs.begin() + done);
+        // 没投出去的放回最前面，下次登录再发
+        if (done < locs.size()) {
+            auto& rest = index[std::string(user)];
+            rest.insert(rest.begin(), locs.begin() + done, locs.end());
+        }
+        if (done) {
+            // 记下投递到了哪里，重启后不再重发
+            uint64_t upto = done < locs.size() ? locs[done].pos : locs[done - 1].pos + 1;
+            unsigned char mark[8];
+            put_u32(mark, seg_of(upto));
+            put_u32(mark + 4, off_of(upto));
+            append_locked(REC_DONE, user, {}, mark, sizeof(mark));
+            delivered += done;
+        }
+        release_locked(released);
+    }
+    return done;
+}
+
+
+void OfflineStore::writer_loop() {
+    std::vector<unsigned char*> bases;
+    std::string ubatch;
+    long page = sysconf(_SC_PAGESIZE);
+    while (1) {
+        bool done;
+        uint64_t end;
+        size_t bytes = 0;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait_for(lock, std::chrono::milliseconds(OFF_FLUSH_MS), [this] { return stop || pending_bytes >= WRITER_FLUSH_BYTES; });
+            inflight.swap(pending);
+            ubatch.swap(pending_users);
+            bytes = pending_bytes;
+            pending_bytes = 0;
+            end = tail;
+            done = stop;
+
+            // 新的段在这里建好、映射好（锁内，因为要改 segs ；很少发生）
+            bases.clear();
+            for (const Chunk& c : inflight) {
+                try {
+                    bases.push_back(map_segment(seg_of(c.pos), true).base);
+                } catch (const std::exception& e) {
+                    std::cerr << "Offline store: " << e.what() << std::endl;
+                    bases.push_back(nullptr);
+                }
+            }
+        }
+
+        // 整批顺序拷进 mmap ，每段一次 msync ，整批共用一次落盘等待。inflight 只在锁内改动，这里只读
+        for (size_t i = 0; i < inflight.size(); ++i) {
+            if (!bases[i]) continue;
+            size_t off = off_of(inflight[i].pos);
+            memcpy(bases[i] + off, inflight[i].data.data(), inflight[i].data.size());
+            size_t from = off / page * page;
+            if (msync(bases[i] + from, off + inflight[i].data.size() - from, MS_SYNC) < 0) {
+                std::cerr << std::format("Offline store msync: {}", strerror(errno)) << std::endl;
+            }
+        }
+        if (!ubatch.empty()) {
+            if (write(users_fd, ubatch.data(), ubatch.size()) != static_cast<ssize_t>(ubatch.size()) || fdatasync(users_fd) < 0) {
+                std::cerr << std::format("Offline store users: {}", strerror(errno)) << std::endl;
+            }
+            ubatch.clear();
+        }
+        if (bytes) MemAccount::add(MEM_OFFLINE, -1, -static_cast<int64_t>(bytes));
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            committed = end;
+            inflight.clear();
+        }
+        if (done) return;
+    }
+}
+
+
+OfflineStats OfflineStore::stats() {
+    std::lock_guard<std::mutex> lock(mtx);
+    OfflineStats st;
+    st.stored = stored;
+    st.delivered = delivered;
+    for (const auto& [user, locs] : index) st.backlog += locs.size();
+    st.segments = segs.size();
+    return st;
+}
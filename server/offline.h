@@ -0,0 +1,109 @@
+#ifndef OFFLINE_H
+#define OFFLINE_H
+
+#include "util.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+
+// ==================== 离线消息 ====================
+// 发给 “登录过但不在线” 的用户的消息追加到目录下的日志段里，用户下次登录时一次性取走。
+//   日志段：固定大小的文件 seg-<编号>.log ，mmap 后顺序追加，写满换下一个；段内的记录都已投递后整段删除。
+//   记录：  [u8 OFF_MAGIC][u8 类型][u16 userlen][u16 fromlen][u32 msglen][user][from][msg] ，整数为网络字节序，
+//           类型有消息、已投递（msg 为 u64 位置，表示该用户此位置之前的消息都已取走）两种；
+//           段尾全 0 ，读到 magic 不对即为结尾。
+//   索引：  内存里每个用户一个待投递记录的位置列表，启动时扫描所有段重建。
+//   用户：  登记过的用户名另存在 users 文件里，每行一个（日志段会被删除，用户不能跟着丢）。
+// 工作线程追加时只在锁内分配位置、把记录拷进待写缓冲区，由单独的线程整批拷进 mmap 并 msync （组提交），不阻塞路由。
+// 登录时取消息也不等落盘：还没写进 mmap 的记录直接从待写缓冲区拷出来。
+// 消息以明文保存，目录应只有服务端可读
+
+struct OfflineStats {
+    uint64_t stored = 0;        // 累计保存的消息数
+    uint64_t delivered = 0;     // 累计投递的消息数
+    size_t backlog = 0;         // 当前待投递的消息数
+    size_t segments = 0;        // 当前的日志段数
+};
+
+class OfflineStore {
+  public:
+    // 记录在日志中的位置：高 32 位为段号，低 32 位为段内偏移
+    struct Loc {
+        uint64_t pos;
+        uint32_t len;
+    };
+
+  private:
+    struct Segment {
+        int fd = -1;
+        unsigned char* base = nullptr;
+        size_t live = 0;    // 尚未投递的消息数
+    };
+
+    struct Chunk {          // 待写缓冲区中落在同一段里的一段连续记录
+        uint64_t pos;
+        std::string data;
+    };
+
+    std::string dir;
+    size_t seg_bytes;
+
+    std::mutex mtx;
+    std::unordered_map<std::string, std::deque<Loc>, StrHash, std::equal_to<>> index;
+    std::unordered_set<std::string, StrHash, std::equal_to<>> users;     // 登记过的用户
+    int users_fd = -1;
+    std::string pending_users;                  // 待写进 users 文件的新用户
+    std::map<uint32_t, Segment> segs;
+    uint64_t tail = 0;                          // 下一条记录的位置
+    std::vector<Chunk> pending;
+    std::vector<Chunk> inflight;                // 写线程正在拷进 mmap 的那一批，提交前仍可在锁内读
+    size_t pending_bytes = 0;
+
+    std::condition_variable cv;                 // 唤醒写线程
+    uint64_t committed = 0;                     // 此位置之前的记录都已写进 mmap
+    uint64_t stored = 0, delivered = 0;
+    std::thread writer;
+    bool stop = false;
+
+    std::string seg_path(uint32_t seg) const;
+    Segment& map_segment(uint32_t seg, bool create);    // 调用时已上锁
+    void scan();
+    uint64_t append_locked(uint8_t type, std::string_view user, std::string_view from, const unsigned char* msg, size_t len);
+    void release_locked(const std::vector<Loc>& locs);
+    const unsigned char* unwritten_locked(uint64_t pos) const;     // 还没写进 mmap 的记录在待写缓冲区中的位置
+    void writer_loop();
+
+  public:
+    // 打开（或创建）目录，扫描已有的日志段，失败抛异常
+    OfflineStore(const std::string& dir, size_t seg_bytes);
+    ~OfflineStore();    // 写完剩余记录再关闭
+
+    OfflineStore(const OfflineStore &) = delete;
+    OfflineStore &operator=(const OfflineStore &) = delete;
+
+    // 登记用户。只有登记过的用户才会保存离线消息
+    void add_user(std::string_view user);
+
+    // 保存一条离线消息。收件人未登记、积压超过上限或写不过来时返回 false ，known 表示收件人是否登记过
+    bool append(std::string_view to, std::string_view from, const unsigned char* msg, size_t len, bool& known);
+
+    // 取走 user 的全部离线消息，按追加顺序交给 on_batch(from[], msg[]) ，每批最多 max_batch 条。不等磁盘，可在工作线程上调用。
+    // on_batch 返回 false （比如连接已断）时，这一批及之后的消息留待下次登录。返回已投递的条数
+    size_t drain(std::string_view user, size_t max_batch,
+                 const std::function<bool(const std::vector<std::string_view>& from, const std::vector<std::string_view>& msg)>& on_batch);
+
+    OfflineStats stats();
+};
+
+#endif // OFFLINE_H
@@ -0,0 +1,78 @@
+#include "rate_limit.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+void TokenBucket::refill(std::chrono::steady_clock::time_point now) {
+    if (now <= last) return;
+    tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last).count());
+    last = now;
+}
+
+
+bool TokenBucket::take(double n, std::chrono::steady_clock::time_point now) {
+    if (rate <= 0) return true;
+    refill(now);
+    if (tokens < std::min(n, burst)) return false;
+    tokens -= n;
+    return true;
+}
+
+
+int TokenBucket::wait_ms(double n, std::chrono::steady_clock::time_point now) {
+    if (rate <= 0) return 0;
+    refill(now);
+    double need = std::min(n, burst) - tokens;
+    if (need <= 0) return 0;
+    return std::max(1, static_cast<int>(std::ceil(need / rate * 1000)));
+}
+
+
+bool TokenBucket::full(std::chrono::steady_clock::time_point now) {
+    if (rate <= 0) return true;
+    refill(now);
+    return tokens >= burst;
+}
+
+
+RateLimiter::Buckets RateLimiter::make_buckets(double msgs, double bytes, std::chrono::steady_clock::time_point now) const {
+    // 桶容量至少 1 条消息
+    return Buckets{TokenBucket(msgs, std::max(1.0, msgs * burst_secs), now),
+                   TokenBucket(bytes, std::max(1.0, bytes * burst_secs), now)};
+}
+
+
+int RateLimiter::admit(int fd, std::string_view user, size_t bytes, std::chrono::steady_clock::time_point now) {
+    auto it = users.find(user);
+    if (it == users.end()) it = users.emplace(std::string(user), make_buckets(msgs_per_sec, bytes_per_sec, now)).first;
+    Buckets& ub = it->second;
+
+    auto cit = conns.find(fd);
+    if (cit == conns.end() || cit->second.user != user) {
+        cit = conns.insert_or_assign(fd, ConnBuckets{std::string(user), make_buckets(conn_msgs_per_sec, conn_bytes_per_sec, now)}).first;
+    }
+    Buckets& cb = cit->second.b;
+
+    // 四个桶都够才一起扣，避免只扣了一部分
+    double n = static_cast<double>(bytes);
+    int wait = std::max({ub.msgs.wait_ms(1, now), ub.bytes.wait_ms(n, now), cb.msgs.wait_ms(1, now), cb.bytes.wait_ms(n, now)});
+    if (wait) return wait;
+    ub.msgs.take(1, now);
+    ub.bytes.take(n, now);
+    cb.msgs.take(1, now);
+    cb.bytes.take(n, now);
+    return 0;
+}
+
+
+void RateLimiter::gc(std::chrono::steady_clock::time_point now) {
+    for (auto it = users.begin(); it != users.end(); ) {
+        if (it->second.msgs.full(now) && it->second.bytes.full(now)) it = users.erase(it);
+        else ++it;
+    }
+    for (auto it = conns.begin(); it != conns.end(); ) {
+        if (it->second.b.msgs.full(now) && it->second.b.bytes.full(now)) it = conns.erase(it);
+        else ++it;
+    }
+}
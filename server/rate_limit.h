@@ -0,0 +1,80 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include "util.h"
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+// ==================== 限速 ====================
+// 每个用户两个令牌桶：消息数/秒、字节数/秒。用户名作键，断线重连不会重置额度。
+// 每个连接另有一对桶，可以设得与用户的不同（如更低的突发），连接关闭即重置。一帧要两对桶都放行才算放行。
+// 只在主线程（Reactor）使用，在解密之前检查，超额的帧不会占用工作线程
+
+enum class RateAction {
+    Delay,          // 暂停读这个连接，等令牌攒够再继续，压力经 TCP 传回客户端
+    Drop,           // 丢弃超额的帧（扩展帧回复 NACK）
+    Disconnect,     // 断开连接
+};
+
+
+class TokenBucket {
+  private:
+    double rate, burst, tokens;
+    std::chrono::steady_clock::time_point last;
+
+    void refill(std::chrono::steady_clock::time_point now);
+
+  public:
+    TokenBucket(double rate, double burst, std::chrono::steady_clock::time_point now)
+        : rate(rate), burst(burst), tokens(burst), last(now) {}
+
+    // 取 n 个令牌。n 超过桶容量时只要求桶是满的，余额可以变成负数，之后慢慢还上
+    bool take(double n, std::chrono::steady_clock::time_point now);
+    // 还要等多少毫秒才能取 n 个令牌
+    int wait_ms(double n, std::chrono::steady_clock::time_point now);
+    bool full(std::chrono::steady_clock::time_point now);
+};
+
+
+class RateLimiter {
+  private:
+    struct Buckets {
+        TokenBucket msgs, bytes;
+    };
+    struct ConnBuckets {
+        std::string user;       // fd 被工作线程关闭、又分给了别的用户时，凭它认出是新连接
+        Buckets b;
+    };
+
+    double msgs_per_sec, bytes_per_sec, conn_msgs_per_sec, conn_bytes_per_sec, burst_secs;
+    std::unordered_map<std::string, Buckets, StrHash, std::equal_to<>> users;
+    std::unordered_map<int, ConnBuckets> conns;
+
+    Buckets make_buckets(double msgs, double bytes, std::chrono::steady_clock::time_point now) const;
+
+  public:
+    RateAction action;
+    uint64_t delayed = 0, dropped = 0, disconnected = 0;    // 触发限速的帧数，按处理方式统计
+
+    // 速率为 0 表示该项不限；桶容量为 burst_secs 秒的额度
+    RateLimiter(double msgs_per_sec, double bytes_per_sec, double conn_msgs_per_sec, double conn_bytes_per_sec,
+                double burst_secs, RateAction action)
+        : msgs_per_sec(msgs_per_sec), bytes_per_sec(bytes_per_sec), conn_msgs_per_sec(conn_msgs_per_sec),
+          conn_bytes_per_sec(conn_bytes_per_sec), burst_secs(burst_secs), action(action) {}
+
+    // 连接 fd 上的 user 再收一个 bytes 字节的帧。放行返回 0 并扣除令牌；否则不扣，返回还要等的毫秒数（至少 1）
+    int admit(int fd, std::string_view user, size_t bytes, std::chrono::steady_clock::time_point now);
+
+    // 连接关闭，丢掉它的桶
+    void forget(int fd) { conns.erase(fd); }
+
+    // 丢掉已经攒满的桶（和新建的一样），防止离线用户越积越多
+    void gc(std::chrono::steady_clock::time_point now);
+};
+
+#endif // RATE_LIMIT_H
@@ -0,0 +1,2260 @@
+#include "server.h"
+#include "crypto.h"
+#include "buf_pool.h"
+#include "cluster.h"
+#include "capture.h"
+#include "offline.h"
+#include "history.h"
+#include "proto.h"
+#include "rate_limit.h"
+#include "mem_account.h"
+#include "topology.h"
+#include "fd_table.h"
+#include "util.h"
+#include "coro.h"
+
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <array>
+#include <vector>
+#include <queue>
+#include <format>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <iterator>
+#include <csignal>
+#include <sys/eventfd.h>
+#include <chrono>
+#include <algorithm>
+#include <tuple>
+#include <pthread.h>
+#include <ctime>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <cstdio>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#define BUFSZ 1024          // 单次收发消息最大长度
+#define MAX_EVENTS 1024     // epoll 最大事件数
+#define TICK_MS 1000        // 主循环至少每隔这么久醒来一次，处理统计和恢复 accept
+#define MEM_PRESSURE_FRAME_CAP (64u << 10)  // 内存有压力时允许的最大帧长，超过的连接直接断开
+#define MEM_SHED_INTERVAL_MS 100            // 超过内存上限时，两次断开连接之间至少间隔这么久，等已断开的连接释放内存
+#define FANOUT_BATCH 64     // 群发时一个任务最多给这么多个收件人加密发送，然后让出工作线程
+#define OFFLINE_BATCH 256   // 登录时离线消息每攒这么多条一次写出
+#define MAX_CONN_FDS (1 << 22)  // 连接表最多容纳的 fd 数，fd 上限不限或特别大时以此为准
+#define HS_TIMEOUT_MS 5000      // 握手时等待对端每一段数据的最长时间
+#define HS_MAX_LEN 65536        // 握手数据的长度上限
+#define HS_INFLIGHT_PER_THREAD 16   // 默认每个握手线程同时进行的握手数。等对端时握手挂起、不占线程，名额可以比线程多
+
+// epoll 的忙轮询参数（Linux 6.9 起）。较旧的 glibc 的 <sys/epoll.h> 没有，自己定义，与内核的 uapi/linux/eventpoll.h 一致
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;      // 0 表示内核默认值
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+
+// 忙等循环里让出流水线，降低功耗、让超线程的另一半跑得动
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+
+// ==================== 线程池 ====================
+// 按 key 分片的线程池：每个工作线程有自己的任务队列，同一个 key （即同一个 fd）的任务总是进同一个分片。
+// 于是同一连接的任务严格按提交顺序串行执行：同一发送者的消息按序路由，对同一 fd 的 send 也不会并发，无需每个 fd 一把锁。
+// 每个分片按优先级分成几条车道，工作线程总是先取高优先级车道的任务；顺序只在同一车道内保证。
+// 加密都在任务执行时按当时的密钥进行，所以不同车道之间的先后对密文没有影响
+enum Lane {
+    LANE_CONTROL,   // 服务端的提示、拒绝确认等：很便宜，不该排在大批路由后面
+    LANE_ROUTE,     // 路由、发送、群发、关闭 fd ：对同一 fd 的关闭必须排在它的发送之后，所以与发送同车道
+    LANE_N
+};
+
+// 一条车道累计的任务数和排队时间
+struct LaneStats {
+    uint64_t tasks = 0;
+    uint64_t wait_sum_us = 0;
+    uint64_t wait_max_us = 0;   // 上次取统计以来的最大值
+};
+
+class ThreadPool {
+  private:
+    struct Task {
+        std::move_only_function<void()> fn;     // 允许只能移动的任务（如持有 Buf 的 lambda）
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    struct Shard {
+        std::queue<Task> lanes[LANE_N];
+        std::atomic<size_t> pending{0};     // 在锁内修改；忙轮询时在锁外读
+        std::mutex queue_mtx;
+        std::condition_variable cv;
+    };
+
+    struct LaneCounters {
+        std::atomic<uint64_t> tasks{0}, wait_sum_us{0}, wait_max_us{0};
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Shard>> shards;
+    LaneCounters counters[LANE_N];
+    std::atomic<uint64_t> spun{0}, slept{0};    // 取任务时无需睡眠、需要睡眠的次数
+    std::atomic<bool> stop;
+
+  public:
+    // 启动 thread_num 个工作线程。on_start(i) 在第 i 个工作线程开始取任务之前调用，用于设置线程的优先级、绑核等。
+    // spin 不为 0 时，队列空了先忙等这么久，仍没有任务才睡眠：省掉条件变量唤醒的几十微秒，代价是空闲时也占着 CPU
+    explicit ThreadPool(size_t thread_num, std::function<void(size_t)> on_start = nullptr, std::chrono::microseconds spin = {})
+        : stop(false) {
+        if (!thread_num) thread_num = 1;
+        for (size_t i = 0; i < thread_num; ++i) shards.push_back(std::make_unique<Shard>());
+        for (size_t i = 0; i < thread_num; ++i) {
+            workers.emplace_back([this, on_start, spin, i, &sh = *shards[i]] {
+                if (on_start) on_start(i);
+                while (1) {
+                    Task task;
+                    int lane = 0;
+                    if (spin.count() && !sh.pending.load(std::memory_order_relaxed)) {
+                        auto until = std::chrono::steady_clock::now() + spin;
+                        while (!sh.pending.load(std::memory_order_relaxed) && !this->stop && std::chrono::steady_clock::now() < until) cpu_relax();
+                    }
+                    {
+                        std::unique_lock<std::mutex> lock(sh.queue_mtx);
+                        (sh.pending ? spun : slept).fetch_add(1, std::memory_order_relaxed);
+                        sh.cv.wait(lock, [this, &sh] { return this->stop || sh.pending; });   // 等待，要退出了或者有任务时才唤醒
+                        if (this->stop && !sh.pending) return;                               // 执行完所有任务才能退出
+                        while (sh.lanes[lane].empty()) ++lane;                                 // 高优先级车道先取
+                        task = std::move(sh.lanes[lane].front());
+                        sh.lanes[lane].pop();
+                        --sh.pending;
+                    }
+                    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - task.queued).count();
+                    LaneCounters& c = counters[lane];
+                    c.tasks.fetch_add(1, std::memory_order_relaxed);
+                    c.wait_sum_us.fetch_add(us, std::memory_order_relaxed);
+                    uint64_t mx = c.wait_max_us.load(std::memory_order_relaxed);
+                    while (us > mx && !c.wait_max_us.compare_exchange_weak(mx, us, std::memory_order_relaxed)) {}
+                    task.fn();
+                }
+            });
+        }
+    }
+
+    // 将任意可调用对象加入 key 对应分片的 lane 车道
+    template<class F>
+    void enqueue(size_t key, F&& f, Lane lane = LANE_ROUTE) {
+        Shard& sh = *shards[key % shards.size()];
+        {
+            std::unique_lock<std::mutex> lock(sh.queue_mtx);
+            if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
+            sh.lanes[lane].push(Task{std::forward<F>(f), std::chrono::steady_clock::now()});    // 完美转发
+            ++sh.pending;
+        }
+        sh.cv.notify_one();
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // 等到已提交的任务（连同执行时又提交的）全部做完：每个分片排一个屏障，一轮下来只执行了屏障、队列也都空着才算完。
+    // 调用者须保证不再有新任务源源不断地进来
+    void quiesce() {
+        auto executed = [this] {
+            uint64_t n = 0;
+            for (const LaneCounters& c : counters) n += c.tasks.load();
+            return n;
+        };
+        while (1) {
+            uint64_t before = executed();
+            std::mutex m;
+            std::condition_variable done;
+            size_t left = shards.size();
+            for (size_t i = 0; i < shards.size(); ++i) {
+                enqueue(i, [&]() {
+                    std::lock_guard<std::mutex> lock(m);
+                    if (--left == 0) done.notify_one();
+                });
+            }
+            std::unique_lock<std::mutex> lock(m);
+            done.wait(lock, [&] { return left == 0; });
+
+            bool idle = executed() - before == shards.size();
+            for (const auto& sh : shards) idle = idle && !sh->pending.load();
+            if (idle) return;
+        }
+    }
+
+    // 取任务时无需睡眠、需要睡眠的累计次数
+    std::pair<uint64_t, uint64_t> wakeups() const { return {spun.load(), slept.load()}; }
+
+    // 车道的累计统计，取完清零最大值
+    LaneStats lane_stats(Lane lane) {
+        LaneCounters& c = counters[lane];
+        return LaneStats{c.tasks.load(), c.wait_sum_us.load(), c.wait_max_us.exchange(0)};
+    }
+
+    // 各工作线程的 CPU 时钟，用于统计服务端的 CPU 开销
+    std::vector<clockid_t> cpu_clocks() {
+        std::vector<clockid_t> clocks;
+        for (std::thread& worker : workers) {
+            clockid_t cid;
+            if (pthread_getcpuclockid(worker.native_handle(), &cid) == 0) clocks.push_back(cid);
+        }
+        return clocks;
+    }
+
+    ~ThreadPool() {
+        stop = true;
+        for (auto& sh : shards) {
+            std::lock_guard<std::mutex> lock(sh->queue_mtx);    // 与等待中的 wait 同步，避免丢失唤醒
+            sh->cv.notify_all();    // 唤醒所有等待中的工作线程，让它们检测 stop 并退出
+        }
+        for (std::thread& worker : workers) worker.join();
+    }
+};
+
+
+// ==================== 配置 ====================
+SrvConf conf;
+
+
+// ==================== 全局变量 ====================
+std::unordered_map<std::string, int, StrHash, std::equal_to<>> usr2sock;
+std::unordered_map<int, std::string> sock2usr;
+std::mutex cli_map_mtx;
+
+// 群组，同样由 cli_map_mtx 保护
+std::unordered_map<std::string, std::unordered_set<int>, StrHash, std::equal_to<>> groups;   // 群名 -> 成员 fd
+std::unordered_map<int, std::vector<std::string>> sock_groups;                               // fd -> 所在的群
+uint64_t next_conn_id = 1;
+
+std::mutex pcks_mtx;            // 保护 ConnState 的接收状态
+std::mutex clicrypts_mtx;       // 保护 ConnState 的密钥
+
+thread_local char buf[BUFSZ];   // 每个线程一份，收发消息的缓冲区
+
+// 每个连接的状态，按 fd 下标存放（见 fd_table.h），不再分散在几个哈希表里：空闲连接只占表里的一项和一把 32 字节的密钥。
+// 各字段仍由原来的锁分别保护，锁的顺序不变
+struct ConnState {
+    // 以下由 pcks_mtx 保护
+    bool receiving = false;     // 已登录，主循环在为它收数据
+    size_t expected = 0;        // 正在收的帧的长度，0 表示帧头还没收齐
+    std::string recv;           // 没收齐的半截帧。只在有半截帧时分配，收齐即释放
+    // 由 cli_map_mtx 保护
+    uint64_t conn_id = 0;       // 每个登录的连接一个递增的代号，0 表示未登录。群发排队期间 fd 可能被新连接复用，据此识别
+    // 以下由 clicrypts_mtx 保护
+    bool has_crypto = false;
+    Crypto crypto;              // Crypto 类不是线程安全的，故为每个连接创建一个
+};
+FdTable<ConnState> conns;
+
+// fd 的密钥，没有（还没握手完或已断开）返回 nullptr 。调用时 clicrypts_mtx 已上锁
+inline Crypto* find_crypto(int fd) {
+    ConnState* cs = conns.get(fd);
+    return cs && cs->has_crypto ? &cs->crypto : nullptr;
+}
+
+// 擦除 fd 的密钥，原来有则返回 true 。调用时 clicrypts_mtx 已上锁
+inline bool erase_crypto(int fd) {
+    ConnState* cs = conns.get(fd);
+    if (!cs || !cs->has_crypto) return false;
+    std::exchange(cs->crypto, Crypto{});    // 换出的旧对象析构时擦除密钥
+    cs->has_crypto = false;
+    return true;
+}
+
+// fd 上登录的连接的代号，未登录为 0 。调用时 cli_map_mtx 已上锁
+inline uint64_t conn_id(int fd) {
+    ConnState* cs = conns.get(fd);
+    return cs ? cs->conn_id : 0;
+}
+
+long rss_base_kb = 0;   // 启动时的 RSS ，统计每连接开销时减去
+
+// 本进程当前的 RSS ，单位 KB ，读不到返回 0
+long self_rss_kb() {
+    long pages = 0;
+    if (FILE* f = fopen("/proc/self/statm", "r")) {
+        long size;
+        if (fscanf(f, "%ld %ld", &size, &pages) != 2) pages = 0;
+        fclose(f);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+std::unique_ptr<Cluster> cluster;           // 未启用集群时为空
+std::unique_ptr<Capture> capture;           // 未启用抓包时为空
+std::unique_ptr<OfflineStore> offline;      // 未启用离线消息时为空
+std::unique_ptr<HistoryStore> history;      // 未启用聊天记录时为空
+std::unique_ptr<RateLimiter> limiter;       // 未启用限速时为空，只在主线程使用
+
+// 被限速暂停读的连接：尚未放行的帧，以及何时再试。只在主线程使用
+struct PausedConn {
+    std::string from;
+    std::vector<Buf> frames;
+    MemCharge charge;               // 这些帧的记账
+    std::chrono::steady_clock::time_point resume_at;
+};
+std::unordered_map<int, PausedConn> paused_conns;
+
+// 接入控制：握手占满时暂停 accept ，新连接留在内核队列里，握手完成后由 wake_fd 唤醒主循环恢复
+std::atomic<int> pending_handshakes{0};
+std::atomic<bool> accept_paused{false};
+int wake_fd = -1;
+std::atomic<uint64_t> accepted_conns{0};
+std::atomic<uint64_t> unix_conns{0}, plain_conns{0};       // 经 Unix 域 socket 接入的连接数，其中不加密的
+
+std::atomic<uint64_t> routed_msgs{0};       // 已路由的消息数，用于统计每条消息的分配次数
+std::atomic<uint64_t> fanout_msgs{0}, fanout_rcpts{0};     // 群发的消息数和收件人数
+std::atomic<uint64_t> rekeys_srv{0}, rekeys_cli{0};         // 服务端、客户端发起的密钥更新数
+// 内存保护的计数，只在主线程使用
+uint64_t mem_rejected = 0, mem_oversized = 0, mem_shed = 0;
+uint64_t reactor_spun = 0, reactor_slept = 0;   // 忙轮询时主循环等到事件、转入睡眠的次数，只在主线程使用
+
+volatile sig_atomic_t stats_requested = 0;  // server_request_stats() 置位，主循环打印统计
+volatile sig_atomic_t stop_requested = 0;   // server_stop() 置位，主循环退出
+
+std::vector<int> adopted_fds;               // server_adopt() 交来、等主循环接手的连接
+std::mutex adopted_mtx;
+
+// 不停机升级（见 handover.h）。交接时停止 accept ，等进行中的握手结束、工作线程做完已提交的任务，再把连接交给新进程
+int handover_listen_fd = -1;                // 等新进程来接手的 socket ，未启用为 -1
+int handover_fd = -1;                       // 正在接手的新进程，没有为 -1 。只在主线程使用
+bool handed_over = false;
+std::vector<HandoverConn> resumed_conns;    // server_resume() 交来、主循环启动时恢复的连接
+
+// 主循环和工作线程的 CPU 时钟，主循环运行期间有效
+std::atomic<bool> running{false};
+clockid_t reactor_clock;
+std::vector<clockid_t> worker_clocks;
+std::mutex clocks_mtx;
+
+
+// ==================== 绑核 ====================
+// --pin 时按拓扑安排各线程：主循环放在网卡所在的节点（知道网卡中断的 CPU 时就放在其中一个上，收包的软中断和 epoll 共享缓存），
+// 工作线程各占一个 CPU ，从网卡所在的节点开始逐个节点排开，尽量避开主循环的 CPU ；握手线程按节点分组，只在本节点的 CPU 上运行。
+// 一个连接的握手交给与它的工作线程同节点的握手线程，于是它的密钥、收发状态都在这个节点上首次写入，按 Linux 的首次访问策略分配在本地内存
+struct Placement {
+    bool on = false;
+    Topology topo;
+    int reactor_cpu = -1;
+    std::vector<int> worker_cpu;                    // 工作线程 i 的 CPU
+    std::vector<int> hs_node;                       // 握手线程 j 所在的节点
+    std::vector<std::vector<size_t>> hs_by_node;    // 节点 -> 该节点上的握手线程
+
+    // 按 conf 和拓扑安排 nworkers 个工作线程、nhs 个握手线程
+    void plan(size_t nworkers, size_t nhs);
+
+    // fd 的握手该交给哪个握手线程（作为握手线程池的 key）
+    size_t hs_key(int fd) const;
+};
+Placement placement;
+
+
+// ==================== 群发 ====================
+// 发给群或广播的消息只解密一次，收件人按所在分片拆开：每个分片一个待办队列，由一个任务按顺序处理，
+// 每次最多 FANOUT_BATCH 个收件人（一次加锁取整批密钥、一次生成整批 IV），处理完把自己重新排到队尾。
+// 于是大群发不会独占工作线程，同一分片上的群消息保持先后顺序，发送也仍在收件人所属的分片上
+struct FanoutMsg {
+    std::string from;       // 收件人看到的发送者，如 alice@#room
+    Buf msg;
+    MemCharge charge;
+};
+
+struct FanoutJob {
+    std::shared_ptr<FanoutMsg> m;                   // 各分片共享同一份明文
+    std::vector<std::pair<int, uint64_t>> rcpts;    // (fd, 连接代号)
+    size_t next = 0;
+};
+
+struct FanoutShard {
+    std::mutex mtx;
+    std::deque<FanoutJob> jobs;
+    bool scheduled = false;     // 是否已有处理任务在线程池中
+};
+
+std::unique_ptr<FanoutShard[]> fanout_shards;   // 与线程池的分片一一对应
+size_t fanout_nshards = 0;
+
+// 把一条消息交给群发。rcpts 中的连接此时都已登录
+void submit_fanout(ThreadPool& pool, std::string from, const Buf& msg, std::vector<std::pair<int, uint64_t>> rcpts);
+
+// 在分片 s 上处理一批，还有剩余则重新排队
+void fanout_drain(ThreadPool& pool, size_t s);
+void schedule_fanout(ThreadPool& pool, size_t s);
+
+
+// ==================== 工具函数 ====================
+// 提交发送任务到线程池。服务端的提示走 LANE_CONTROL ，不排在大批路由后面
+void submit_send_task(ThreadPool& pool, int fd, const std::string& from, const std::string& msg, Lane lane = LANE_ROUTE);
+void submit_send_task(ThreadPool& pool, int fd, const std::string& from, Buf msg);
+
+// 和 submit_send_task() 几乎一样 ([2]) ，专用于拒绝用户名已使用的连接
+void submit_send_task_reject(ThreadPool& pool, int fd, const std::string& from, const std::string& msg);
+
+// 组装并发送消息
+void send_msg(int fd, std::string_view from, const unsigned char* msg, size_t msglen);
+
+// 循环发送任意长字符串
+void Send(int sock, const char* sp, int len);
+
+// 解密已解析的消息（普通帧或扩展帧 FT_MSG），结果放进池化缓冲区。失败返回 false
+bool process_msg(int fd, const FrameView& f, Buf& to, Buf& msg);
+
+// 回复扩展帧的确认。只能在 fd 所属的工作线程上调用
+inline void send_ack(int fd, uint32_t seq, uint8_t status);
+
+// 当前密钥用满 conf.rekey_after 帧时发起密钥更新，FT_KEY_UPDATE 写进 ku （KEY_UPDATE_FRAME_LEN 字节），返回是否发起。
+// 调用时 clicrypts_mtx 已上锁；调用者须在 fd 所属的工作线程上、在用新密钥加密的帧之前发出 ku
+bool rekey_if_due(Crypto& c, unsigned char* ku);
+
+// 处理客户端发来的 FT_KEY_UPDATE ，是客户端发起的则回一个。只能在 fd 所属的工作线程上调用
+void handle_key_update(int fd, const std::string& from, const FrameView& f);
+
+// 把一个完整的帧交给 fd 所属的工作线程：解密、路由、回确认
+void submit_route_task(ThreadPool& pool, int fd, const std::string& from, Buf pck);
+
+// 发给群或广播：处理加入 / 退出，或者找出收件人交给群发。返回给发送者的确认状态，nrecv 为收件人数
+uint8_t route_group(ThreadPool& pool, int fd, const std::string& from, std::string_view to, const Buf& msg, size_t& nrecv);
+
+// 退出一个群，最后一个成员离开时解散。调用时 cli_map_mtx 已上锁
+bool leave_group(int fd, std::string_view name);
+
+// 主线程调用：按限速放行 frames 中的帧，超额时按配置的方式处理（见 rate_limit.h）
+void admit_frames(ThreadPool& pool, int epfd, int fd, const std::string& from, std::vector<Buf>& frames);
+
+// 主线程调用：服务端主动断开一个已登录的连接，reason 写进日志
+void kick_conn(ThreadPool& pool, int epfd, int fd, const std::string& usr, const char* reason);
+
+// 主线程调用：超过内存上限时，从占用最多的连接开始断开，直到回到 MEM_SOFT_RATIO 以下
+void shed_connections(ThreadPool& pool, int epfd);
+
+// 打印路由消息数和分配计数，以及各车道的排队时间
+void print_stats(ThreadPool& pool, ThreadPool& hs_pool);
+
+// 把 user 的离线消息整批加密、发给刚登录的 fd 。只能在 fd 所属的工作线程上调用
+void deliver_offline(int fd, const std::string& user);
+
+// 处理 FT_HIST 查询：交给聊天记录的查询线程，结果整批加密后由 fd 所属的工作线程发出
+void query_history(ThreadPool& pool, int fd, uint32_t seq, const std::string& from, std::string_view peer, const Buf& q);
+
+// 给 build_frame / build_msg 用的加密函数：用同一个密钥加密一批密文，IV 一次生成，第一段之后沿用已扩展好的密钥。
+// IV 放在线程本地的缓冲区里，对象只能在构造它的线程上使用
+struct BulkEncryptor {
+    const unsigned char* key;
+    size_t seg = 0;
+
+    BulkEncryptor(const unsigned char* key, size_t nseg);   // 生成 nseg 段的 IV ，失败抛异常。key 为 nullptr 表示不加密的连接
+    size_t operator()(const unsigned char* plain, size_t len, unsigned char* out);
+
+    static std::vector<unsigned char>& ivs() { thread_local std::vector<unsigned char> v; return v; }
+};
+
+// 主线程调用：为新连接占一个握手名额，启动握手协程。收发在主循环上挂起等待，密钥计算转到握手线程池，登记交给 cli_sock 所属的工作线程
+void start_handshake(ThreadPool& hs_pool, ThreadPool& pool, int epfd, int cli_sock, const sockaddr_in& cli_addr, bool plain_ok = false);
+coro::Task<> handshake(ThreadPool& hs_pool, ThreadPool& pool, int epfd, int cli_sock, sockaddr_in cli_addr, bool plain_ok);
+
+// 协程版的 recv_for_ka / send_for_ka 。recv_ka 返回内容长度，对端关闭返回 0 ，出错或超时返回 -1
+coro::Task<int> recv_ka(int sock, vecuc& out);
+coro::Task<bool> send_ka(int sock, const unsigned char* p, size_t n);
+bool peer_trusted(int sock);    // Unix 域 socket 的对端进程与服务端同一用户（或为 root），可以不加密
+
+// 密钥已交换好：登记用户名、注册 epoll 、发欢迎语和离线消息。只能在 cli_sock 所属的工作线程上调用
+void finish_login(ThreadPool& pool, int epfd, int cli_sock, const sockaddr_in& cli_addr, const std::string& username);
+
+// 一次握手结束（无论成败），释放接入名额
+inline void handshake_done();
+
+// 移除一个用户。fd 的关闭交给它所在的工作线程，排在已提交的任务之后
+inline void rm_usr(ThreadPool& pool, int sock, const std::string& usr);
+
+// 主线程调用：把监听 socket 和所有已登录连接的会话状态交给 handover_fd 上的新进程。成功后本进程不再读写这些连接
+bool hand_over(ThreadPool& pool, int epfd, int listen_sock, int unix_sock);
+
+// 主循环启动前调用：按会话状态恢复 resumed_conns 中的连接
+void resume_conns(ThreadPool& pool, int epfd);
+
+
+// ==================== 主循环 ====================
+int server_run(int listen_sock, int unix_sock) {
+    rss_base_kb = self_rss_kb();
+    {
+        rlimit rl;
+        rlim_t n = 65536;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) n = rl.rlim_cur;
+        conns.init(std::min<rlim_t>(n, MAX_CONN_FDS));
+    }
+
+    if (!conf.cluster_conf.empty()) {
+        try {
+            cluster = std::make_unique<Cluster>(conf.node_id, conf.cluster_conf);
+        } catch (const std::exception& e) {
+            std::cerr << "Cluster: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (cluster && !conf.handover_path.empty()) {
+        // 交接时其他节点转来的消息仍在提交给线程池，已确认转发的会丢，连接的状态也会在交出之后改变
+        std::cerr << "Handover is not supported in cluster mode" << std::endl;
+        return 1;
+    }
+
+    if (!conf.capture_file.empty()) {
+        try {
+            capture = std::make_unique<Capture>(conf.capture_file, conf.capture_payload);
+        } catch (const std::exception& e) {
+            std::cerr << "Capture: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (!conf.offline_dir.empty()) {
+        if (cluster) {
+            std::cerr << "Offline messages are not supported in cluster mode" << std::endl;
+            return 1;
+        }
+        try {
+            offline = std::make_unique<OfflineStore>(conf.offline_dir, conf.offline_seg);
+        } catch (const std::exception& e) {
+            std::cerr << "Offline store: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (!conf.history_dir.empty()) {
+        if (cluster) {
+            std::cerr << "Chat history is not supported in cluster mode" << std::endl;
+            return 1;
+        }
+        try {
+            history = std::make_unique<HistoryStore>(conf.history_dir, conf.history_seg);
+        } catch (const std::exception& e) {
+            std::cerr << "History store: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    MemAccount::init(conf.mem_limit);
+
+    if (conf.rate_msgs > 0 || conf.rate_bytes > 0 || conf.rate_conn_msgs > 0 || conf.rate_conn_bytes > 0) {
+        limiter = std::make_unique<RateLimiter>(conf.rate_msgs, conf.rate_bytes, conf.rate_conn_msgs, conf.rate_conn_bytes,
+                                                conf.rate_burst, conf.rate_action);
+    }
+
+    int epfd = epoll_create1(0);    // 创建 epoll 实例
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;        // 关注可读数据
+    ev.data.fd = listen_sock;   // 简单地用 fd 作为用户数据
+
+    // 注册监听 socket 到 epoll
+    if (listen_sock >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+        perror("epoll_ctl add listen_sock");
+        close(epfd);
+        return 1;
+    }
+    ev.data.fd = unix_sock;
+    if (unix_sock >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, unix_sock, &ev) < 0) {
+        perror("epoll_ctl add unix_sock");
+        close(epfd);
+        return 1;
+    }
+
+    // 工作线程、其他线程和信号处理函数通知主循环用的 eventfd 。server_stop() 可能在此之前就被调用，所以先建好它再检查
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fd;
+    if (wake_fd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+        perror("eventfd");
+        close(epfd);
+        return 1;
+    }
+    coro::init(epfd, conns.capacity(), []() { eventfd_write(wake_fd, 1); });
+
+    // 等下一个版本来接手。从旧进程接手时，它已退出，留下的 socket 文件在这里删掉重建
+    if (!conf.handover_path.empty()) {
+        handover_listen_fd = handover_listen(conf.handover_path);
+        ev.events = EPOLLIN;
+        ev.data.fd = handover_listen_fd;
+        if (handover_listen_fd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, handover_listen_fd, &ev) < 0) {
+            perror(conf.handover_path.c_str());
+            close(epfd);
+            return 1;
+        }
+    }
+
+    // 忙轮询时也让内核在 epoll_wait 里直接轮询网卡队列（Linux 6.9 起），旧内核不支持时只在用户态忙等
+    if (conf.busy_poll_us) {
+        epoll_params ep{};
+        ep.busy_poll_usecs = conf.busy_poll_us;
+        if (ioctl(epfd, EPIOCSPARAMS, &ep) < 0) perror("epoll busy poll (user-space spinning only)");
+    }
+
+    if (listen_sock >= 0) std::cout << std::format("Server started on port {}", conf.port) << std::endl;
+    if (unix_sock >= 0) std::cout << std::format("Listening on {}{}", conf.unix_path, conf.unix_plain ? " (plaintext for local peers)" : "") << std::endl;
+
+    // 其他线程屏蔽这些信号，保证信号总是打断主线程的 epoll_wait 。新线程继承创建时的信号掩码
+    sigset_t sig_set, old_set;
+    sigemptyset(&sig_set);
+    sigaddset(&sig_set, SIGUSR1);
+    sigaddset(&sig_set, SIGINT);
+    sigaddset(&sig_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sig_set, &old_set);
+
+    size_t nworkers = std::max<size_t>(1, conf.threads > 0 ? conf.threads : std::thread::hardware_concurrency());  // 默认使用硬件支持的并发数
+    size_t nhs = conf.handshake_threads > 0 ? conf.handshake_threads : std::max<size_t>(1, nworkers / 2);
+    if (conf.pin) placement.plan(nworkers, nhs);
+
+    // 忙等的线程各要一个专用的 CPU ，否则它空转的时间片正是产生任务的线程（以及同机的客户端）需要的
+    cpu_set_t allowed;
+    if (conf.busy_poll_us && sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && static_cast<size_t>(CPU_COUNT(&allowed)) <= nworkers) {
+        std::cerr << std::format("Warning: busy poll with {} workers + reactor on {} cpus will hurt latency, consider fewer --threads", 
+            nworkers, CPU_COUNT(&allowed)) << std::endl;
+    }
+
+    ThreadPool pool(nworkers, [](size_t i) {
+        if (placement.on && !pin_self({placement.worker_cpu[i]})) perror("pin worker");
+    }, std::chrono::microseconds(conf.busy_poll_us));
+    fanout_nshards = pool.size();
+    fanout_shards = std::make_unique<FanoutShard[]>(fanout_nshards);
+
+    // 握手线程池：密钥交换又贵又会阻塞，放在自己的线程上，并调低它们的调度优先级，
+    // 连接风暴时 CPU 先让给已登录用户的路由。它先于 pool 析构，排队中的握手交给 pool 的登记任务仍然有效
+    ThreadPool hs_pool(nhs, [](size_t i) {
+        if (conf.handshake_nice && setpriority(PRIO_PROCESS, static_cast<id_t>(gettid()), conf.handshake_nice) < 0) {
+            perror("setpriority");
+        }
+        if (placement.on && !pin_self(placement.topo.node_cpus[placement.hs_node[i]])) perror("pin handshake thread");
+    });
+    if (!conf.max_handshakes) conf.max_handshakes = static_cast<int>(hs_pool.size() * HS_INFLIGHT_PER_THREAD);
+
+    // 暂停 / 恢复监听 socket 的可读事件。交接开始后不再恢复
+    auto set_accepting = [&](bool on) {
+        on = on && handover_fd < 0;
+        for (int lfd : {listen_sock, unix_sock}) {
+            if (lfd < 0) continue;
+            epoll_event lev{};
+            lev.events = on ? static_cast<uint32_t>(EPOLLIN) : 0u;
+            lev.data.fd = lfd;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, lfd, &lev);
+        }
+        accept_paused = !on;
+    };
+
+    auto last_tick = std::chrono::steady_clock::now();
+    uint64_t last_accepted = 0;
+
+    if (cluster) {
+        cluster->start(
+            // 其他节点转来的消息，投递给本地用户
+            [&pool](std::string_view from, std::string_view to, Buf msg) {
+                int tofd = -1;
+                {
+                    std::lock_guard<std::mutex> lock(cli_map_mtx);
+                    auto it = usr2sock.find(to);
+                    if (it != usr2sock.end()) tofd = it->second;
+                }
+                if (tofd == -1) return false;
+                submit_send_task(pool, tofd, std::string(from), std::move(msg));
+                return true;
+            },
+            // 整个集群都找不到收件人
+            [&pool](std::string_view from, std::string_view) {
+                int fromfd = -1;
+                {
+                    std::lock_guard<std::mutex> lock(cli_map_mtx);
+                    auto it = usr2sock.find(from);
+                    if (it != usr2sock.end()) fromfd = it->second;
+                }
+                if (fromfd != -1) submit_send_task(pool, fromfd, "Server", "No such user.", LANE_CONTROL);
+            },
+            []() {
+                std::lock_guard<std::mutex> lock(cli_map_mtx);
+                std::vector<std::string> users;
+                users.reserve(usr2sock.size());
+                for (const auto& kv : usr2sock) users.push_back(kv.first);
+                return users;
+            });
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+
+    // 主循环最后绑核：之后创建的线程会继承它的亲和掩码，而各线程池和集群的线程都已建好
+    if (placement.on && !pin_self({placement.reactor_cpu})) perror("pin reactor");
+
+    {
+        std::lock_guard<std::mutex> lock(clocks_mtx);
+        pthread_getcpuclockid(pthread_self(), &reactor_clock);
+        worker_clocks = pool.cpu_clocks();
+        for (clockid_t cid : hs_pool.cpu_clocks()) worker_clocks.push_back(cid);
+    }
+    if (!resumed_conns.empty()) resume_conns(pool, epfd);
+    running = true;
+
+    std::vector<epoll_event> events(MAX_EVENTS);    // 为就绪事件准备的缓冲区
+
+    while (!stop_requested) {
+        // 最多等一个 tick ；有被限速暂停的连接时，等到最早的那个该恢复
+        int timeout = TICK_MS;
+        auto before = std::chrono::steady_clock::now();
+        for (const auto& [pfd, pc] : paused_conns) {
+            int ms = static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(pc.resume_at - before).count());
+            timeout = std::clamp(ms, 0, timeout);
+        }
+        timeout = coro::timeout_ms(timeout);    // 以及最早的协程定时器
+        // 忙轮询：先不阻塞地反复检查一段时间，仍没有事件才睡
+        int nfds = 0;
+        if (conf.busy_poll_us) {
+            auto until = before + std::chrono::microseconds(conf.busy_poll_us);
+            while ((nfds = epoll_wait(epfd, events.data(), MAX_EVENTS, 0)) == 0 && !stop_requested && !stats_requested
+                   && std::chrono::steady_clock::now() < until) {
+                cpu_relax();
+            }
+            ++(nfds ? reactor_spun : reactor_slept);
+        }
+        if (!nfds) nfds = epoll_wait(epfd, events.data(), MAX_EVENTS, timeout); // 等待事件到来
+        coro::run_timers();
+
+        // 每秒报告一次接入速率；因 fd 耗尽暂停的 accept 也在这里恢复
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_tick >= std::chrono::milliseconds(TICK_MS)) {
+            double secs = std::chrono::duration<double>(now - last_tick).count();
+            uint64_t acc = accepted_conns.load(std::memory_order_relaxed);
+            if (acc != last_accepted) {
+                std::cout << std::format("[accept] {:.0f} conn/s, pending handshakes: {}{}", (acc - last_accepted) / secs, 
+                    pending_handshakes.load(), accept_paused ? " (paused)" : "") << std::endl;
+            }
+            last_tick = now, last_accepted = acc;
+            if (accept_paused && pending_handshakes < conf.max_handshakes) set_accepting(true);
+            if (limiter) limiter->gc(now);
+            if (MemAccount::pressure()) {
+                std::cout << std::format("[mem] {:.1f} / {:.1f} MB, rejecting new connections{}", MemAccount::total() / 1048576.0, 
+                    conf.mem_limit / 1048576.0, MemAccount::over() ? ", shedding" : "") << std::endl;
+            }
+        }
+
+        // 超过内存上限，断开占用最多的连接
+        static auto last_shed = now;
+        if (MemAccount::over() && now - last_shed >= std::chrono::milliseconds(MEM_SHED_INTERVAL_MS)) {
+            shed_connections(pool, epfd);
+            last_shed = now;
+        }
+
+        // 到时间的暂停连接：放行攒下的帧，全部放行后恢复读
+        if (!paused_conns.empty()) {
+            static std::vector<int> due;
+            due.clear();
+            for (const auto& [pfd, pc] : paused_conns) if (pc.resume_at <= now) due.push_back(pfd);
+            for (int pfd : due) {
+                auto it = paused_conns.find(pfd);
+                std::string from = std::move(it->second.from);
+                std::vector<Buf> rest = std::move(it->second.frames);
+                paused_conns.erase(it);
+
+                admit_frames(pool, epfd, pfd, from, rest);
+                if (!paused_conns.contains(pfd)) {
+                    epoll_event cev{};
+                    cev.events = EPOLLIN | EPOLLRDHUP;
+                    cev.data.fd = pfd;
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, pfd, &cev);
+                }
+            }
+        }
+
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats(pool, hs_pool);
+        }
+
+        if (nfds < 0) {
+            if (errno == EINTR) continue;   // 被信号中断，重试
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nfds; ++i) {
+            if (coro::dispatch(events[i])) continue;    // 挂起在 fd 上的协程（握手）
+
+            int fd = events[i].data.fd;
+            uint32_t evs = events[i].events;
+
+            // 0. 其他线程的通知：有握手结束，检查能否恢复 accept ；或者有交来的连接
+            if (fd == wake_fd) {
+                eventfd_t val;
+                eventfd_read(wake_fd, &val);
+                if (accept_paused && pending_handshakes < conf.max_handshakes) set_accepting(true);
+
+                // 交来的连接由调用者控制节奏，不受握手名额限制
+                static std::vector<int> adopted;
+                adopted.clear();
+                {
+                    std::lock_guard<std::mutex> lock(adopted_mtx);
+                    adopted.swap(adopted_fds);
+                }
+                for (int afd : adopted) start_handshake(hs_pool, pool, epfd, afd, sockaddr_in{});
+                continue;
+            }
+
+            // 新的版本来接手：停止 accept ，等进行中的握手结束后交接（见循环末尾）
+            if (fd == handover_listen_fd) {
+                int hfd = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (hfd < 0) continue;
+                if (handover_fd >= 0 || !peer_trusted(hfd)) {
+                    close(hfd);
+                    continue;
+                }
+                handover_fd = hfd;
+                set_accepting(false);
+                std::cout << std::format("Handover requested, waiting for {} handshakes", pending_handshakes.load()) << std::endl;
+                continue;
+            }
+
+            // 1. 如果有新连接。一直 accept 到队列为空或握手名额用完
+            if (fd == listen_sock || fd == unix_sock) {
+                while (handover_fd < 0) {
+                    if (pending_handshakes >= conf.max_handshakes) {
+                        set_accepting(false);   // 剩下的连接留在内核队列中，等握手名额
+                        if (pending_handshakes >= conf.max_handshakes) break;
+                        set_accepting(true);    // 暂停的同时恰好有握手结束，它看不到暂停标志，这里自己恢复
+                    }
+
+                    // Unix 域的连接没有 IP 地址，日志里显示为 0.0.0.0:0
+                    sockaddr_in cli_addr{};
+                    socklen_t cli_addr_len = sizeof(cli_addr);
+                    bool local = fd == unix_sock;
+                    int cli_sock = local ? accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)
+                                         : accept4(fd, (sockaddr*)&cli_addr, &cli_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (cli_sock < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                        if (errno == EINTR || errno == ECONNABORTED) continue;
+                        perror("accept4");
+                        if (errno == EMFILE || errno == ENFILE) set_accepting(false);  // fd 耗尽，等下一个 tick 再试，避免空转
+                        break;
+                    }
+                    // 内存有压力时不再接受新连接。直接关闭，让客户端尽快失败，而不是在队列里等
+                    if (MemAccount::pressure()) {
+                        close(cli_sock);
+                        ++mem_rejected;
+                        continue;
+                    }
+
+                    if (local) {
+                        unix_conns.fetch_add(1, std::memory_order_relaxed);
+                        start_handshake(hs_pool, pool, epfd, cli_sock, cli_addr, conf.unix_plain && peer_trusted(cli_sock));
+                        continue;
+                    }
+
+                    // 路由后要先回确认再投递，两次小的写入会被 Nagle 算法和对端的延迟确认卡住几十毫秒
+                    int nodelay = 1;
+                    setsockopt(cli_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+                    // 调高到 net.core.busy_read 以上需要 CAP_NET_ADMIN ，没有权限时只报一次
+                    static bool busy_poll_warned = false;
+                    int busy = static_cast<int>(conf.busy_poll_us);
+                    if (busy && setsockopt(cli_sock, SOL_SOCKET, SO_BUSY_POLL, &busy, sizeof(busy)) < 0 && !busy_poll_warned) {
+                        perror("SO_BUSY_POLL");
+                        busy_poll_warned = true;
+                    }
+                    start_handshake(hs_pool, pool, epfd, cli_sock, cli_addr);
+                }
+                continue;
+            }
+
+            // 2. 如果对端发生错误 / 挂起 / 写端关闭
+            if (evs & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                std::string usr;
+                {
+                    std::lock_guard<std::mutex> lock(cli_map_mtx);
+                    auto it = sock2usr.find(fd);
+                    if (it != sock2usr.end()) {
+                        usr = it->second;
+                        rm_usr(pool, fd, usr);                  // [1]
+                    } else {
+                        close(fd);
+                        continue;
+                    }
+                }
+                if (!usr.empty() && !conf.quiet) {
+                    if (evs & EPOLLRDHUP) {
+                        std::cout << std::format("Client {} closed connection", usr) << std::endl;
+                    } else {
+                        std::cerr << std::format("Client {} error or hangup", usr) << std::endl;
+                    }
+                }
+
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);    // [1] 处的 close 是延后的，必须先从 epoll 移除
+                paused_conns.erase(fd);
+                if (limiter) limiter->forget(fd);
+                continue;
+            }
+
+            // 3. 如果有可读数据
+            if (evs & EPOLLIN) {
+                int len = recv(fd, buf, BUFSZ - 1, 0);  // 读写缓冲区分离，主线程 recv 不用加锁
+
+                // 理论上 len = 0 已经被上面 EPOLLRDHUP 检测到
+                if (len <= 0) {
+                    std::string usr;
+                    {
+                        std::lock_guard<std::mutex> lock(cli_map_mtx);
+                        auto it = sock2usr.find(fd);
+                        if (it != sock2usr.end()) {
+                            usr = it->second;
+                            rm_usr(pool, fd, usr);
+                        } else {
+                            close(fd);
+                        }
+                    }
+                    if (len == 0 && !usr.empty() && !conf.quiet) {
+                        std::cout << std::format("Client {} closed connection", usr) << std::endl;
+                    }
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                    paused_conns.erase(fd);
+                    if (limiter) limiter->forget(fd);
+                    continue;
+                }
+
+                buf[len] = '\0';
+
+                // 一次 recv 可能带来多个完整的包，全部取出。每个包拷进池化缓冲区，交给工作线程后由它归还
+                static std::vector<Buf> frames;     // 只在主线程使用，反复复用
+                frames.clear();
+                bool oversized = false, bad_len = false;
+                {
+                    std::lock_guard<std::mutex> lock(pcks_mtx);
+                    
+                    // 检查 fd 是否还存在
+                    ConnState* cs = conns.get(fd);
+                    if (!cs || !cs->receiving) continue;    // 连接已关闭，丢弃数据
+
+                    // 没有攒着的半截帧时直接从 buf 里取，只有剩下的半截才拷进连接自己的缓冲区，
+                    // 所以绝大多数连接（尤其是空闲的）根本不分配接收缓冲区
+                    std::string& rb = cs->recv;
+                    bytes_view data(reinterpret_cast<const unsigned char*>(buf), len);
+                    if (!rb.empty()) {
+                        rb.append(buf, len);
+                        MemAccount::add(MEM_RECV, fd, len);
+                        data = to_bytes(rb);
+                    }
+
+                    size_t off = 0;
+                    while (1) {
+                        // 设置期望长度
+                        if (!cs->expected && data.size() - off >= FRAME_HDR_LEN) {
+                            cs->expected = peek_frame_len(data.subspan(off));
+                            // 长度不合法的帧不可能是正常客户端发的，也不能为它攒数据
+                            if (cs->expected < MIN_FRAME_LEN || cs->expected > MAX_FRAME_LEN) {
+                                bad_len = true;
+                                break;
+                            }
+                        }
+
+                        // 内存有压力时拒绝大帧，免得为它攒下整帧数据
+                        if (cs->expected > MEM_PRESSURE_FRAME_CAP && MemAccount::pressure()) {
+                            oversized = true;
+                            break;
+                        }
+
+                        // 已经存在一个完整的包，就取出
+                        if (!cs->expected || data.size() - off < cs->expected) break;
+                        Buf pck = BufPool::get(cs->expected);
+                        memcpy(pck.data(), data.data() + off, cs->expected);
+                        frames.push_back(std::move(pck));
+                        off += cs->expected;
+                        cs->expected = 0;
+                    }
+                    if (rb.empty()) {
+                        if (off < data.size() && !oversized && !bad_len) {
+                            rb.assign(buf + off, len - off);
+                            MemAccount::add(MEM_RECV, fd, len - off);
+                        }
+                    } else if (off) {
+                        rb.erase(0, off);
+                        MemAccount::add(MEM_RECV, fd, -static_cast<int64_t>(off));
+                        if (rb.empty()) std::string().swap(rb);     // 半截帧收齐了，连同容量一起释放
+                    }
+                }
+
+                if (oversized || bad_len) {
+                    if (oversized) ++mem_oversized;
+                    std::string usr;
+                    {
+                        std::lock_guard<std::mutex> lock(cli_map_mtx);
+                        auto it = sock2usr.find(fd);
+                        if (it != sock2usr.end()) usr = it->second;
+                    }
+                    kick_conn(pool, epfd, fd, usr, bad_len ? "invalid frame length" : "frame too large under memory pressure");
+                    continue;
+                }
+                if (frames.empty()) continue;
+
+                // 查找发送方用户名
+                std::string from;
+                {
+                    std::lock_guard<std::mutex> lock(cli_map_mtx);
+                    auto it = sock2usr.find(fd);
+                    if (it == sock2usr.end()) {
+                        close(fd);
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                        continue;
+                    }
+                    from = it->second;
+                }
+
+                // 限速检查在解密之前，超额的帧不会占用工作线程
+                admit_frames(pool, epfd, fd, from, frames);
+            }
+        }
+
+        // 握手都结束了，交给新进程后退出；交接失败则继续服务
+        if (handover_fd >= 0 && pending_handshakes == 0) {
+            if (hand_over(pool, epfd, listen_sock, unix_sock)) break;
+            close(handover_fd);
+            handover_fd = -1;
+            set_accepting(true);
+        }
+    }
+
+    std::cout << "Server stopping..." << std::endl;
+    running = false;
+    {
+        std::lock_guard<std::mutex> lock(clocks_mtx);
+        worker_clocks.clear();
+    }
+    cluster.reset();    // 集群线程会向线程池提交任务，必须先于线程池停下
+    close(epfd);
+    if (handover_listen_fd >= 0) {
+        close(handover_listen_fd);
+        unlink(conf.handover_path.c_str());
+    }
+    // 交接成功时 handover_fd 留到进程退出才关闭：新进程以此为信号，在本进程写完文件之后才打开它们
+    return 0;   // 线程池随后析构，执行完剩余任务；抓包文件在此之后写完关闭
+}
+
+
+// ==================== 工具函数实现 ====================
+void start_handshake(ThreadPool& hs_pool, ThreadPool& pool, int epfd, int cli_sock, const sockaddr_in& cli_addr, bool plain_ok) {
+    accepted_conns.fetch_add(1, std::memory_order_relaxed);
+    pending_handshakes.fetch_add(1);
+    try {
+        coro::spawn(handshake(hs_pool, pool, epfd, cli_sock, cli_addr, plain_ok));
+    } catch (const std::exception& e) {
+        std::cerr << "Handshake: " << e.what() << std::endl;
+        close(cli_sock);    // 对端自然会显示 Server closed ，无需额外处理
+        handshake_done();
+    }
+}
+
+
+// 握手写成顺序的协程：等对端数据时挂起在主循环上，不占任何线程，慢吞吞或不说话的客户端只占一个协程帧；
+// 生成密钥对和派生共享密钥转到握手线程池（以较低的优先级运行），连接风暴时不会堵住已登录用户的路由。
+// cli_sock 还没加入 map ，握手结束前不会有其他线程 send/recv 它
+coro::Task<> handshake(ThreadPool& hs_pool, ThreadPool& pool, int epfd, int cli_sock, sockaddr_in cli_addr, bool plain_ok) {
+    struct Guard { ~Guard() { handshake_done(); } } guard;    // 任何一条返回路径都释放名额，之后的登录很便宜，不占名额
+    size_t hs_key = placement.on ? placement.hs_key(cli_sock) : cli_sock;
+
+    vecuc username_vec;
+    int len = co_await recv_ka(cli_sock, username_vec);
+    // 用户名之前的 KA_PLAIN 是请求不加密，用户名紧随其后
+    bool want_plain = len == sizeof(KA_PLAIN) && username_vec[0] == KA_PLAIN[0];
+    if (want_plain) len = co_await recv_ka(cli_sock, username_vec);
+    if (len <= 0) {
+        if (!conf.quiet) {
+            std::cout << std::format("New connection closed on accepting: {}:{}", 
+                inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port)) << std::endl;
+        }
+        close(cli_sock);
+        co_return;
+    }
+    std::string username(username_vec.begin(), username_vec.end());
+
+    try {
+        Crypto server_crypto{};
+        if (want_plain && plain_ok) {
+            // 本机可信的对端：以 KA_PLAIN 代替公钥回复，不做密钥交换
+            if (!co_await send_ka(cli_sock, KA_PLAIN, sizeof(KA_PLAIN))) throw std::runtime_error("send KA_PLAIN failed");
+            server_crypto.use_plaintext();
+            plain_conns.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            // 为每个连接生成临时的 ECC 密钥对（标准 ECDHE 模式，勿动，借助 main_crypto 的方案不如这个）
+            co_await coro::resume_on(hs_pool, hs_key);
+            server_crypto.generate_ecdh_keypr();
+
+            vecuc server_pubkey = server_crypto.get_ecdh_pubkey();
+            if (!co_await send_ka(cli_sock, server_pubkey.data(), server_pubkey.size())) throw std::runtime_error("send pubkey failed");
+
+            vecuc cli_pubkey;
+            if (co_await recv_ka(cli_sock, cli_pubkey) <= 0) {
+                if (!conf.quiet) {
+                    std::cout << std::format("New connection closed after sending server pubkey: {}:{}", 
+                        inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port)) << std::endl;
+                }
+                close(cli_sock);
+                co_return;
+            }
+
+            co_await coro::resume_on(hs_pool, hs_key);     // 收到公钥时在主循环上，派生回到握手线程
+            server_crypto.set_peer_ecdh_pubkey(cli_pubkey);                 // 设置客户端的 ECC 公钥
+
+            // 使用固定盐值确保服务器和客户端派生相同的 AES 密钥。另一种方案是发送盐值
+            static const vecuc fixed_salt = {0x11, 0x45, 0x14, 0x19, 0x19, 0x81, 0x0f, 0x91, 
+                                            0x0d, 0x00, 0x07, 0x21, 0xc1, 0x2a, 0xc1, 0x01};
+            server_crypto.derive_shared_secret(&fixed_salt);                // 计算共享密钥并派生 AES 密钥
+        }
+
+        ConnState* cs = conns.get(cli_sock);
+        if (!cs) throw std::runtime_error(std::format("fd {} beyond connection table", cli_sock));
+        std::lock_guard<std::mutex> lock(clicrypts_mtx);
+        cs->crypto = std::move(server_crypto);
+        cs->has_crypto = true;
+        MemAccount::add(MEM_CRYPTO, cli_sock, CRYPTO_CONN_BYTES);
+    } catch (const std::exception& e) {
+        if (!conf.quiet) {
+            std::cerr << "ECDH derive: " << e.what() << std::endl;
+            std::cerr << "Set AES key failed" << std::endl;
+        }
+        close(cli_sock);    // 仅仅是这个客户端的问题，断开该连接即可
+        co_return;
+    }
+
+    // 登记和欢迎语交给 cli_sock 所属的工作线程：登记之后路由给它的消息一定排在欢迎语和离线消息后面。
+    // 握手期间协程在 epoll 里登记过 cli_sock ，先删掉，由 finish_login 按普通连接重新登记
+    coro::release(cli_sock);
+    try {
+        pool.enqueue(cli_sock, [cli_sock, cli_addr, epfd, &pool, username = std::move(username)]() {
+            finish_login(pool, epfd, cli_sock, cli_addr, username);
+        });
+    } catch (const std::exception& e) {
+        std::cerr << "Enqueue: " << e.what() << std::endl;
+        {
+            std::lock_guard<std::mutex> lock(clicrypts_mtx);
+            if (erase_crypto(cli_sock)) MemAccount::add(MEM_CRYPTO, cli_sock, -CRYPTO_CONN_BYTES);
+        }
+        close(cli_sock);
+    }
+}
+
+
+coro::Task<int> recv_ka(int sock, vecuc& out) {
+    unsigned char hdr[KA_HDR_LEN];
+    ssize_t rlen = co_await coro::read_exact(sock, hdr, KA_HDR_LEN, std::chrono::milliseconds(HS_TIMEOUT_MS));
+    if (rlen <= 0) co_return static_cast<int>(rlen);
+
+    uint32_t expected = get_u32(hdr);
+    if (expected > HS_MAX_LEN) co_return -1;     // 握手数据只有用户名和公钥，过长的一定不对
+    out.resize(expected);
+    rlen = co_await coro::read_exact(sock, out.data(), expected, std::chrono::milliseconds(HS_TIMEOUT_MS));
+    co_return rlen <= 0 ? static_cast<int>(rlen) : static_cast<int>(expected);
+}
+
+
+coro::Task<bool> send_ka(int sock, const unsigned char* p, size_t n) {
+    vecuc s(KA_HDR_LEN + n);
+    ka_hdr(s.data(), n);
+    memcpy(s.data() + KA_HDR_LEN, p, n);
+    co_return co_await coro::write_all(sock, s.data(), s.size(), std::chrono::milliseconds(HS_TIMEOUT_MS)) >= 0;
+}
+
+
+void finish_login(ThreadPool& pool, int epfd, int cli_sock, const sockaddr_in& cli_addr, const std::string& username) {
+    bool dupf = false, badname = is_group_name(username);     // 和群名、广播冲突的用户名也不接受
+    if (!badname) {
+        std::lock_guard<std::mutex> lock(cli_map_mtx);
+        if (usr2sock.find(username) != usr2sock.end()) {
+            dupf = true;
+        } else {
+            usr2sock[username] = cli_sock;                  // 未占用则记录
+            sock2usr[cli_sock] = username;
+            ConnState* cs = conns.get(cli_sock);     // 握手时已确认在表内
+            cs->conn_id = next_conn_id++;
+            if (offline) offline->add_user(username);
+            {
+                std::lock_guard<std::mutex> lock2(pcks_mtx);     // 加锁清空已有消息
+                cs->receiving = true;
+                cs->expected = 0;
+                cs->recv.clear();
+            }
+        }
+    }
+
+    if (dupf) {
+        submit_send_task_reject(pool, cli_sock, "Server", 
+            std::format("Username {} already in use.", username));          // 如果用户名已被占用，通知用户
+        if (!conf.quiet) {
+            std::cout << std::format("Rejected {}:{}, Duplicate username {}", 
+                inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), username) << std::endl;
+        }
+        return;
+    }
+    if (badname) {
+        submit_send_task_reject(pool, cli_sock, "Server", std::format("Invalid username {}.", username));
+        if (!conf.quiet) {
+            std::cout << std::format("Rejected {}:{}, Invalid username {}", 
+                inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), username) << std::endl;
+        }
+        return;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP;   // 对于客户 socket ，关注可读 + 对端关闭写端
+    ev.data.fd = cli_sock;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, cli_sock, &ev) < 0) {
+        perror("epoll_ctl add client");
+        {
+            std::lock_guard<std::mutex> lock(cli_map_mtx);
+            rm_usr(pool, cli_sock, username);
+        }
+        return;
+    }
+
+    if (cluster) cluster->register_user(username);     // 向归属节点登记
+
+    // 通知用户：已连接。本任务就在 cli_sock 所属的工作线程上，直接发送，
+    // 于是欢迎语和离线消息一定排在登记之后路由过来的新消息前面
+    static const std::string welcome = 
+        "\tConnected to server.\n"
+        "\tUsage: <Target user>(Line 1) + <Message>(Line 2)\n"
+        "\tGroups: send \".join\" or \".leave\" to #<Group name>, then messages to #<Group name> reach all members.\n"
+        "\tInput \".exit\"(without quotes) at any time to exit.";
+    send_msg(cli_sock, "Server", reinterpret_cast<const unsigned char*>(welcome.data()), welcome.size());
+    if (offline) deliver_offline(cli_sock, username);
+    if (!conf.quiet) {
+        std::cout << std::format("New connection: {}:{}, Username: {}", 
+            inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), username) << std::endl;
+    }
+}
+
+
+inline void handshake_done() {
+    pending_handshakes.fetch_sub(1);
+    if (accept_paused) eventfd_write(wake_fd, 1);
+}
+
+
+void submit_send_task(ThreadPool& pool, int fd, const std::string& from, const std::string& msg, Lane lane) {
+    try {
+        MemCharge charge(MEM_SEND, fd, from.size() + msg.size());
+        pool.enqueue(fd, [fd, from = std::move(from), msg = std::move(msg), charge = std::move(charge)]() {     // 按接收者分片，对同一 fd 的 send 不会并发
+            send_msg(fd, from, reinterpret_cast<const unsigned char*>(msg.data()), msg.length());
+        }, lane);
+    } catch (const std::exception& e) {
+        std::cerr << "Enqueue: " << e.what() << std::endl;
+    }
+}
+
+
+void submit_send_task(ThreadPool& pool, int fd, const std::string& from, Buf msg) {
+    try {
+        MemCharge charge(MEM_SEND, fd, from.size() + msg.size());
+        pool.enqueue(fd, [fd, from, msg = std::move(msg), charge = std::move(charge)]() {
+            send_msg(fd, from, msg.data(), msg.size());
+        });
+    } catch (const std::exception& e) {
+        std::cerr << "Enqueue: " << e.what() << std::endl;
+    }
+}
+
+
+void submit_send_task_reject(ThreadPool& pool, int fd, const std::string& from, const std::string& msg) {
+    try {
+        pool.enqueue(fd, [fd, from = std::move(from), msg = std::move(msg)]() {
+            send_msg(fd, from, reinterpret_cast<const unsigned char*>(msg.data()), msg.length());
+            // [2] 仅在这里追加
+            {
+                std::lock_guard<std::mutex> lock(clicrypts_mtx);    // 被拒绝的连接没有登录，也没有读过数据
+                if (erase_crypto(fd)) MemAccount::add(MEM_CRYPTO, fd, -CRYPTO_CONN_BYTES);
+            }
+            close(fd);
+        }, LANE_CONTROL);
+    } catch (const std::exception& e) {
+        std::cerr << "Enqueue: " << e.what() << std::endl;
+    }
+}
+
+
+void send_msg(int fd, std::string_view from, const unsigned char* msg, size_t msglen) {
+    // 加锁复制密钥，避免在计算密集的加密操作上上锁
+    unsigned char key[32], ku[KEY_UPDATE_FRAME_LEN];
+    bool rekey, plain;
+    {
+        std::lock_guard<std::mutex> lock(clicrypts_mtx);
+        Crypto* c = find_crypto(fd);
+        if (!c || c->aeskey.size() != 32) {
+            return;
+        }
+        ++c->key_uses;
+        rekey = rekey_if_due(*c, ku);   // 先换密钥，这条消息就用新密钥加密
+        memcpy(key, c->aeskey.data(), 32);
+        plain = c->plain;
+    }
+    if (rekey) {
+        try {
+            Send(fd, reinterpret_cast<const char*>(ku), sizeof(ku));
+        } catch (const std::exception& e) {
+            std::cerr << "Send: " << e.what() << std::endl;
+        }
+    }
+
+    // 头部和两段密文直接写进同一块池化缓冲区
+    Buf pck = BufPool::get(frame_len(from.length(), msglen));
+    MemCharge charge(MEM_SEND, fd, pck.size());
+    try {
+        build_frame(pck.data(), to_bytes(from), bytes_view(msg, msglen), [&key, plain](const unsigned char* p, size_t len, unsigned char* out) {
+            return plain ? Crypto::plain_seal(p, len, out) : Crypto::aes_encrypt_with(key, p, len, out);
+        });
+    } catch (const std::exception& e) {
+        OPENSSL_cleanse(key, sizeof(key));
+        std::cerr << "AES encrypt: " << e.what() << std::endl;
+        return;     // 发送前出错，不发即可
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+
+    try {
+        Send(fd, pck.c_str(), pck.size());      // 只会在 fd 所属的工作线程上执行
+    } catch (const std::exception& e) {
+        std::cerr << "Send: " << e.what() << std::endl;
+    }
+}
+
+
+bool process_msg(int fd, const FrameView& f, Buf& to, Buf& msg) {
+    // 密钥更新后的一段时间里，客户端在收到更新前发出的帧还是旧密钥加密的，所以上一代密钥也要带上
+    unsigned char key[32], prev[32], ku[KEY_UPDATE_FRAME_LEN];
+    bool has_prev, rekey, plain;
+    {
+        std::lock_guard<std::mutex> lock(clicrypts_mtx);
+        Crypto* c = find_crypto(fd);
+        if (!c || c->aeskey.size() != 32) return false;
+        plain = c->plain;
+        memcpy(key, c->aeskey.data(), 32);
+        has_prev = c->prev_aeskey.size() == 32;
+        if (has_prev) memcpy(prev, c->prev_aeskey.data(), 32);
+        ++c->key_uses;
+        rekey = rekey_if_due(*c, ku);
+    }
+
+    // 直接从接收缓冲区解密到池化缓冲区，不再构造中间字符串
+    bool ok = true;
+    try {
+        to = BufPool::get(f.c_a.size() - AES_OVERHEAD);
+        msg = BufPool::get(f.c_b.size() - AES_OVERHEAD);
+        if (plain) {
+            to.resize(Crypto::plain_open(f.c_a.data(), f.c_a.size(), to.data()));
+            msg.resize(Crypto::plain_open(f.c_b.data(), f.c_b.size(), msg.data()));
+        } else {
+            to.resize(Crypto::aes_decrypt_either(key, has_prev ? prev : nullptr, f.c_a.data(), f.c_a.size(), to.data()));
+            msg.resize(Crypto::aes_decrypt_either(key, has_prev ? prev : nullptr, f.c_b.data(), f.c_b.size(), msg.data()));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "AES decrypt: " << e.what() << std::endl;
+        ok = false;
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(prev, sizeof(prev));
+
+    if (rekey) {
+        try {
+            Send(fd, reinterpret_cast<const char*>(ku), sizeof(ku));   // 路由任务就在 fd 所属的分片上
+        } catch (const std::exception& e) {
+            std::cerr << "Send: " << e.what() << std::endl;
+        }
+    }
+    return ok;
+}
+
+
+bool rekey_if_due(Crypto& c, unsigned char* ku) {
+    if (!conf.rekey_after || c.plain || c.key_uses < conf.rekey_after || c.key_update_pending) return false;
+    try {
+        uint32_t gen = c.start_key_update();
+        build_key_update(ku, gen, [&c](const unsigned char* plain, size_t len, unsigned char* out) {
+            return Crypto::aes_encrypt_with(c.aeskey.data(), plain, len, out);
+        });
+    } catch (const std::exception& e) {
+        std::cerr << "Key update: " << e.what() << std::endl;
+        return false;
+    }
+    rekeys_srv.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+
+void handle_key_update(int fd, const std::string& from, const FrameView& f) {
+    unsigned char ku[KEY_UPDATE_FRAME_LEN];
+    Crypto::KeyUpdate r;
+    {
+        std::lock_guard<std::mutex> lock(clicrypts_mtx);
+        Crypto* cp = find_crypto(fd);
+        if (!cp) return;
+        Crypto& c = *cp;
+        try {
+            r = c.on_key_update(f.seq, f.c_a.data(), f.c_a.size());
+            if (r == Crypto::KeyUpdate::Reply) {
+                build_key_update(ku, f.seq, [&c](const unsigned char* plain, size_t len, unsigned char* out) {
+                    return Crypto::aes_encrypt_with(c.aeskey.data(), plain, len, out);
+                });
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Key update: " << e.what() << std::endl;
+            return;
+        }
+    }
+
+    if (r == Crypto::KeyUpdate::Invalid) {
+        if (!conf.quiet) std::cerr << std::format("Client {}: invalid key update (generation {})", from, f.seq) << std::endl;
+        return;
+    }
+    if (r == Crypto::KeyUpdate::Reply) {
+        rekeys_cli.fetch_add(1, std::memory_order_relaxed);
+        try {
+            Send(fd, reinterpret_cast<const char*>(ku), sizeof(ku));
+        } catch (const std::exception& e) {
+            std::cerr << "Send: " << e.what() << std::endl;
+        }
+    }
+}
+
+
+void submit_route_task(ThreadPool& pool, int fd, const std::string& from, Buf pck) {
+    try {
+        MemCharge charge(MEM_QUEUE, fd, pck.size());
+        pool.enqueue(fd, [pck = std::move(pck), charge = std::move(charge), from, fd, &pool]() {     // 按发送者分片，保证同一发送者的消息按序路由
+            // 扩展帧路由后要回确认。解析失败的扩展帧也尽量回一个
+            FrameView f;
+            uint32_t seq = 0;
+            bool ext = peek_seq(bytes_view(pck.data(), pck.size()), seq);
+
+            Buf to, msg;
+            bool parsed = parse_frame(bytes_view(pck.data(), pck.size()), f);
+            if (parsed && f.type == FT_KEY_UPDATE) {
+                handle_key_update(fd, from, f);     // 与前后的帧按到达顺序处理，之前的帧已用旧密钥解密完
+                return;
+            }
+            if (!parsed || f.type == FT_ACK || !process_msg(fd, f, to, msg)) {
+                if (ext) send_ack(fd, seq, NACK_BAD_FRAME);
+                return;
+            }
+            std::string_view tosv(to.c_str(), to.size()), msgsv(msg.c_str(), msg.size());
+
+            if (f.type == FT_HIST) {
+                query_history(pool, fd, seq, from, tosv, msg);
+                return;
+            }
+
+            // 发给群或广播：只解密了一次，加密交给各收件人所在的分片分批完成
+            if (is_group_name(tosv)) {
+                size_t nrecv = 0;
+                uint8_t status = route_group(pool, fd, from, tosv, msg, nrecv);
+                if (ext) send_ack(fd, seq, status);
+                else if (status != ACK_OK) submit_send_task(pool, fd, "Server", std::format("{}.", ack_status_str(status)), LANE_CONTROL);
+                if (capture && status == ACK_OK) capture->record(from, tosv, msg.data(), msg.size());
+                if (!conf.quiet) {
+                    std::cout << std::format("\nFrom: {}\nTo: {} ({}, {} recipients)\nContent: {}\n", 
+                        from, tosv, ack_status_str(status), nrecv, msgsv) << std::endl;
+                }
+                routed_msgs.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            // 收件人不在线时，在同一把锁里存为离线消息：这样它要么在登录前存好、登录时取走，要么登录后直接投递
+            int tofd = -1;
+            bool stored = false, known = false;
+            {
+                std::lock_guard<std::mutex> lock(cli_map_mtx);
+                auto it = usr2sock.find(tosv);
+                if (it != usr2sock.end()) tofd = it->second;
+                else if (offline) stored = offline->append(tosv, from, msg.data(), msg.size(), known);
+            }
+
+            if (capture) capture->record(from, tosv, msg.data(), msg.size());
+            if (history && (tofd != -1 || stored)) history->record(from, tosv, msg.data(), msg.size());   // 送达或存为离线的才记
+
+            // 日志行复用线程本地的缓冲区
+            thread_local std::string logbuf;
+            logbuf.clear();
+            if (tofd == -1 && cluster) {
+                // 不在本节点，交给集群转发。找不到时由集群回调通知发件人
+                cluster->route(from, tosv, msg.data(), msg.size());
+                if (ext) send_ack(fd, seq, ACK_FORWARDED);
+                std::format_to(std::back_inserter(logbuf), "\nFrom: {}\nTo: {} (Forwarded)\nContent: {}\n", 
+                    from, tosv, msgsv);
+            } else if (stored) {
+                if (ext) send_ack(fd, seq, ACK_STORED);
+                std::format_to(std::back_inserter(logbuf), "\nFrom: {}\nTo: {} (Stored)\nContent: {}\n", 
+                    from, tosv, msgsv);
+            } else if (tofd == -1) {
+                // 其实单线程 Reactor 最好将 send 和 recv 全部放到主线程，但已经用线程池实现了，且逻辑正确
+                uint8_t status = known ? NACK_MAILBOX_FULL : NACK_NO_USER;
+                if (ext) send_ack(fd, seq, status);     // 扩展帧用确认代替文本通知
+                else submit_send_task(pool, fd, "Server", known ? "Mailbox full." : "No such user.", LANE_CONTROL);
+                std::format_to(std::back_inserter(logbuf), "\nFrom: {}\nTo: {} ({})\nContent: {}\n", 
+                    from, tosv, ack_status_str(status), msgsv);
+            } else {
+                std::format_to(std::back_inserter(logbuf), "\nFrom: {}\nTo: {}\nContent: {}\n", 
+                    from, tosv, msgsv);
+                submit_send_task(pool, tofd, from, std::move(msg));
+                if (ext) send_ack(fd, seq, ACK_OK);
+            }
+            if (!conf.quiet) std::cout << logbuf << std::endl;
+            routed_msgs.fetch_add(1, std::memory_order_relaxed);
+        });
+    } catch (const std::exception& e) {
+        std::cerr << "Enqueue: " << e.what() << std::endl;
+    }
+}
+
+
+inline void send_ack(int fd, uint32_t seq, uint8_t status) {
+    unsigned char pck[ACK_FRAME_LEN];
+    make_ack(pck, seq, status);
+    try {
+        Send(fd, reinterpret_cast<const char*>(pck), sizeof(pck));     // 确认不加密，只含序号和状态
+    } catch (const std::exception& e) {
+        std::cerr << "Send: " << e.what() << std::endl;
+    }
+}
+
+
+void admit_frames(ThreadPool& pool, int epfd, int fd, const std::string& from, std::vector<Buf>& frames) {
+    auto now = std::chrono::steady_clock::now();
+    for (size_t k = 0; k < frames.size(); ++k) {
+        // 密钥更新不限速：丢掉它会让之后的帧都解不开
+        bool ku = peek_type(bytes_view(frames[k].data(), frames[k].size())) == FT_KEY_UPDATE;
+        int wait = limiter && !ku ? limiter->admit(fd, from, frames[k].size(), now) : 0;
+        if (!wait) {
+            submit_route_task(pool, fd, from, std::move(frames[k]));
+            continue;
+        }
+
+        switch (limiter->action) {
+        case RateAction::Delay: {
+            // 剩下的帧按原顺序存起来，停止读这个连接。内核缓冲区满了之后，客户端的发送自然被 TCP 挡住
+            ++limiter->delayed;
+            PausedConn& pc = paused_conns[fd];
+            pc.from = from;
+            pc.frames.assign(std::make_move_iterator(frames.begin() + k), std::make_move_iterator(frames.end()));
+            int64_t bytes = 0;
+            for (const Buf& f : pc.frames) bytes += f.size();
+            pc.charge = MemCharge(MEM_QUEUE, fd, bytes);
+            pc.resume_at = now + std::chrono::milliseconds(wait);
+
+            epoll_event ev{};
+            ev.events = EPOLLRDHUP;     // 仍然要知道对端是否关闭
+            ev.data.fd = fd;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+            return;
+        }
+        case RateAction::Drop: {
+            ++limiter->dropped;
+            uint32_t seq;
+            if (peek_seq(bytes_view(frames[k].data(), frames[k].size()), seq)) {
+                try {
+                    pool.enqueue(fd, [fd, seq]() { send_ack(fd, seq, NACK_RATE_LIMITED); }, LANE_CONTROL);
+                } catch (const std::exception& e) {
+                    std::cerr << "Enqueue: " << e.what() << std::endl;
+                }
+            }
+            break;
+        }
+        case RateAction::Disconnect:
+            ++limiter->disconnected;
+            kick_conn(pool, epfd, fd, from, "rate limit exceeded");
+            return;
+        }
+    }
+}
+
+
+void kick_conn(ThreadPool& pool, int epfd, int fd, const std::string& usr, const char* reason) {
+    {
+        std::lock_guard<std::mutex> lock(cli_map_mtx);
+        if (sock2usr.contains(fd)) rm_usr(pool, fd, usr);
+        else close(fd);
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    paused_conns.erase(fd);
+    if (limiter) limiter->forget(fd);
+    if (!conf.quiet) std::cout << std::format("Client {} disconnected: {}", usr, reason) << std::endl;
+}
+
+
+void shed_connections(ThreadPool& pool, int epfd) {
+    std::vector<std::tuple<int64_t, int, std::string>> conns;   // (占用, fd, 用户名)
+    {
+        std::lock_guard<std::mutex> lock(cli_map_mtx);
+        conns.reserve(sock2usr.size());
+        for (const auto& [fd, usr] : sock2usr) conns.emplace_back(MemAccount::by_fd(fd), fd, usr);
+    }
+    std::sort(conns.begin(), conns.end(), std::greater<>());
+
+    // 已断开连接的内存要等它排队的任务跑完才释放，所以按估计值算，不反复读总量
+    int64_t target = static_cast<int64_t>(MemAccount::limit() * MEM_SOFT_RATIO), usage = MemAccount::total();
+    for (auto& [bytes, fd, usr] : conns) {
+        if (usage < target || bytes <= CRYPTO_CONN_BYTES) break;   // 剩下的都是空闲连接，断开它们也省不了多少
+        kick_conn(pool, epfd, fd, usr, std::format("shed under memory pressure ({} bytes)", bytes).c_str());
+        usage -= bytes;
+        ++mem_shed;
+    }
+}
+
+
+void print_stats(ThreadPool& pool, ThreadPool& hs_pool) {
+    static AllocStats last{};
+    static uint64_t last_msgs = 0;
+
+    AllocStats now = alloc_stats();
+    uint64_t msgs = routed_msgs.load(std::memory_order_relaxed);
+    uint64_t dmsgs = msgs - last_msgs;
+    double per = dmsgs ? 1.0 / dmsgs : 0;
+
+    std::cout << std::format("[stats] Accepted conns: {}, pending handshakes: {}{}", 
+        accepted_conns.load(), pending_handshakes.load(), accept_paused ? " (accept paused)" : "") << std::endl;
+    coro::Stats cs = coro::stats();
+    std::cout << std::format("[stats] Coroutines: {} live, {} waiting on I/O, {} timers", cs.frames, cs.io_waiting, cs.timers) << std::endl;
+    if (!conf.unix_path.empty()) {
+        std::cout << std::format("[stats] Unix socket conns: {} ({} plaintext)", unix_conns.load(), plain_conns.load()) << std::endl;
+    }
+    std::cout << std::format("[stats] Routed msgs: {} (+{})\n"
+                             "[stats] Heap allocs: {} (+{}, {:.2f}/msg)\n"
+                             "[stats] Pool gets: {} (+{}, {:.2f}/msg), misses: {} (+{})", 
+        msgs, dmsgs,
+        now.heap_allocs, now.heap_allocs - last.heap_allocs, (now.heap_allocs - last.heap_allocs) * per,
+        now.pool_gets, now.pool_gets - last.pool_gets, (now.pool_gets - last.pool_gets) * per,
+        now.pool_misses, now.pool_misses - last.pool_misses) << std::endl;
+    std::cout << std::format("[stats] Fan-out: {} msgs to {} recipients, groups: {}", 
+        fanout_msgs.load(), fanout_rcpts.load(), [] { std::lock_guard<std::mutex> lock(cli_map_mtx); return groups.size(); }()) << std::endl;
+    std::cout << std::format("[stats] Key updates: {} by server, {} by clients", rekeys_srv.load(), rekeys_cli.load()) << std::endl;
+
+    // 排队时间：平均值为累计值，最大值为距上次打印
+    auto lane = [](const char* name, LaneStats st) {
+        return std::format("{} {} tasks, wait avg {:.1f} / max {} us", name, st.tasks, st.tasks ? static_cast<double>(st.wait_sum_us) / st.tasks : 0.0, st.wait_max_us);
+    };
+    if (conf.busy_poll_us) {
+        auto [spun, slept] = pool.wakeups();
+        std::cout << std::format("[stats] Busy poll {} us: reactor {} found by spinning / {} slept; workers {} / {}", 
+            conf.busy_poll_us, reactor_spun, reactor_slept, spun, slept) << std::endl;
+    }
+    std::cout << std::format("[stats] Queues: {}; {}; {} ({} threads)", lane("control", pool.lane_stats(LANE_CONTROL)),
+        lane("route", pool.lane_stats(LANE_ROUTE)), lane("handshake", hs_pool.lane_stats(LANE_ROUTE)), hs_pool.size()) << std::endl;
+    if (offline) {
+        OfflineStats st = offline->stats();
+        std::cout << std::format("[stats] Offline: stored {}, delivered {}, backlog {}, segments {}", 
+            st.stored, st.delivered, st.backlog, st.segments) << std::endl;
+    }
+    if (history) {
+        HistoryStats st = history->stats();
+        std::cout << std::format("[stats] History: stored {} (dropped {}), {} blocks, {} conversations, {} segments, queries {}", 
+            st.stored, st.dropped, st.blocks, st.conversations, st.segments, st.queries) << std::endl;
+    }
+    std::string breakdown;
+    for (int c = 0; c < MEM_NCAT; ++c) {
+        std::format_to(std::back_inserter(breakdown), "{}{} {:.1f} KB", c ? ", " : "", 
+            MemAccount::cat_name(static_cast<MemCat>(c)), MemAccount::by_cat(static_cast<MemCat>(c)) / 1024.0);
+    }
+    std::cout << std::format("[stats] Memory: {:.1f} MB{} ({})\n"
+                             "[stats] Memory guard: rejected conns {}, oversized frames {}, shed conns {}", 
+        MemAccount::total() / 1048576.0, conf.mem_limit ? std::format(" / {:.1f} MB", conf.mem_limit / 1048576.0) : "", breakdown,
+        mem_rejected, mem_oversized, mem_shed) << std::endl;
+    if (limiter) {
+        std::cout << std::format("[stats] Rate limited frames: delayed {}, dropped {}, disconnected {}; paused conns: {}", 
+            limiter->delayed, limiter->dropped, limiter->disconnected, paused_conns.size()) << std::endl;
+    }
+
+    // 每连接的实际开销：进程 RSS 减去启动时的 RSS ，再平摊到在线连接上（包括线程栈、池化缓冲区等，偏大）
+    size_t online = [] { std::lock_guard<std::mutex> lock(cli_map_mtx); return sock2usr.size(); }();
+    long rss = self_rss_kb();
+    std::cout << std::format("[stats] Connections: {}, RSS {:.1f} MB (+{:.1f} MB since start){}", online, rss / 1024.0, 
+        (rss - rss_base_kb) / 1024.0, online ? std::format(", ~{} bytes/conn", (rss - rss_base_kb) * 1024 / static_cast<long>(online)) : "") << std::endl;
+
+    last = now, last_msgs = msgs;
+}
+
+
+inline void rm_usr(ThreadPool& pool, int sock, const std::string& usr) {
+    {
+        std::lock_guard<std::mutex> lock1(pcks_mtx);
+        std::lock_guard<std::mutex> lock2(clicrypts_mtx);
+
+        if (usr2sock.erase(usr) && cluster) cluster->unregister_user(usr);    // 此函数要保证每次调用时 cli_map_mtx 都已经上锁
+        sock2usr.erase(sock);
+        if (ConnState* cs = conns.get(sock)) cs->conn_id = 0;
+        auto git = sock_groups.find(sock);
+        if (git != sock_groups.end()) {
+            for (const std::string& name : git->second) leave_group(sock, name);
+            sock_groups.erase(git);
+        }
+
+        if (ConnState* cs = conns.get(sock); cs && cs->receiving) {
+            MemAccount::add(MEM_RECV, sock, -static_cast<int64_t>(cs->recv.size()));
+            std::string().swap(cs->recv);
+            cs->expected = 0;
+            cs->receiving = false;
+        }
+
+        if (erase_crypto(sock)) MemAccount::add(MEM_CRYPTO, sock, -CRYPTO_CONN_BYTES);  // 之后到达的发送任务找不到密钥，会直接放弃
+    }
+
+    // ------------------------------
+    // 不能在这里直接 close ：fd 所属的工作线程可能还有排队中的发送任务，
+    // 立即 close 后 fd 号可能被新连接复用，旧消息就会发给新连接。
+    // 把 close 排到同一个分片，它一定在这些任务之后执行
+    // ------------------------------
+    try {
+        pool.enqueue(sock, [sock]() { close(sock); });
+    } catch (const std::exception& e) {
+        close(sock);
+    }
+}
+
+
+void deliver_offline(int fd, const std::string& user) {
+    unsigned char key[32];
+    bool plain;
+    {
+        std::lock_guard<std::mutex> lock(clicrypts_mtx);
+        Crypto* c = find_crypto(fd);
+        if (!c || c->aeskey.size() != 32) return;
+        memcpy(key, c->aeskey.data(), 32);
+        plain = c->plain;
+    }
+
+    // 每批的帧拼在同一块缓冲区里一次写出。这些帧记进密钥的用量，到期的更新由之后的收发发起
+    thread_local std::string out;
+    size_t n = offline->drain(user, OFFLINE_BATCH, [&](const std::vector<std::string_view>& froms, const std::vector<std::string_view>& msgs) {
+        size_t total = 0;
+        for (size_t i = 0; i < froms.size(); ++i) total += frame_len(froms[i].size(), msgs[i].size());
+        out.resize(total);
+        MemCharge charge(MEM_SEND, fd, total);
+        try {
+            BulkEncryptor enc(plain ? nullptr : key, froms.size() * 2);
+            size_t at = 0;
+            for (size_t i = 0; i < froms.size(); ++i) {
+                at += build_frame(reinterpret_cast<unsigned char*>(out.data() + at), to_bytes(froms[i]), to_bytes(msgs[i]), enc);
+            }
+            Send(fd, out.data(), static_cast<int>(at));
+        } catch (const std::exception& e) {
+            std::cerr << "Offline delivery: " << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    });
+    OPENSSL_cleanse(key, sizeof(key));
+    if (n) {
+        std::lock_guard<std::mutex> lock(clicrypts_mtx);
+        if (Crypto* c = find_crypto(fd)) c->key_uses += n;
+    }
+    if (n && !conf.quiet) std::cout << std::format("Delivered {} offline msgs to {}", n, user) << std::endl;
+}
+
+
+void query_history(ThreadPool& pool, int fd, uint32_t seq, const std::string& from, std::string_view peer, const Buf& q) {
+    HistQuery hq;
+    if (!history || !get_hist_query(bytes_view(q.data(), q.size()), hq)) {
+        send_ack(fd, seq, history ? NACK_BAD_FRAME : NACK_UNSUPPORTED);
+        return;
+    }
+
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(cli_map_mtx);
+        id = conn_id(fd);
+    }
+    bool queued = history->query(from, peer, hq.limit, hq.since_us, hq.until_us, [&pool, fd, id, seq](const std::vector<HistoryStore::Rec>& recs) {
+        // 在查询线程上：核对连接还是原来那个，复制密钥，把所有结果和结尾的确认拼成一块缓冲区
+        unsigned char key[32];
+        bool plain;
+        {
+            std::lock_guard<std::mutex> lock1(cli_map_mtx);
+            std::lock_guard<std::mutex> lock2(clicrypts_mtx);
+            Crypto* c = find_crypto(fd);
+            if (conn_id(fd) != id || !c || c->aeskey.size() != 32) return;
+            memcpy(key, c->aeskey.data(), 32);
+            plain = c->plain;
+            c->key_uses += recs.size();
+        }
+
+        size_t total = ACK_FRAME_LEN;
+        for (const auto& r : recs) total += msg_frame_len(8 + r.from.size(), r.msg.size());
+        Buf out = BufPool::get(total);
+        MemCharge charge(MEM_SEND, fd, total);
+        thread_local std::string head;      // [u64 时间戳][发送者]
+        try {
+            BulkEncryptor enc(plain ? nullptr : key, recs.size() * 2);
+            size_t at = 0;
+            for (const auto& r : recs) {
+                head.resize(8);
+                put_u64(reinterpret_cast<unsigned char*>(head.data()), r.ts_us);
+                head += r.from;
+                at += build_msg(out.data() + at, seq, to_bytes(head), to_bytes(r.msg), enc, FT_HIST);
+            }
+            make_ack(out.data() + at, seq, ACK_OK);
+        } catch (const std::exception& e) {
+            std::cerr << "History reply: " << e.what() << std::endl;
+            make_ack(out.data(), seq, NACK_BAD_FRAME);
+            out.resize(ACK_FRAME_LEN);
+        }
+        OPENSSL_cleanse(key, sizeof(key));
+
+        try {
+            pool.enqueue(fd, [out = std::move(out), charge = std::move(charge), fd, id]() {
+                {
+                    std::lock_guard<std::mutex> lock(cli_map_mtx);
+                    if (conn_id(fd) != id) return;
+                }
+                try {
+                    Send(fd, out.c_str(), out.size());
+                } catch (const std::exception& e) {
+                    std::cerr << "Send: " << e.what() << std::endl;
+                }
+            });
+        } catch (const std::exception& e) {
+            std::cerr << "Enqueue: " << e.what() << std::endl;
+        }
+    });
+    if (!queued) send_ack(fd, seq, NACK_RATE_LIMITED);
+}
+
+
+BulkEncryptor::BulkEncryptor(const unsigned char* key, size_t nseg) : key(key) {
+    if (!key) return;
+    ivs().resize(nseg * 12);
+    if (nseg && !RAND_bytes(ivs().data(), static_cast<int>(nseg * 12))) throw std::runtime_error("failed to generate IVs");
+}
+
+
+size_t BulkEncryptor::operator()(const unsigned char* plain, size_t len, unsigned char* out) {
+    if (!key) return Crypto::plain_seal(plain, len, out);
+    size_t n = Crypto::aes_encrypt_iv(seg ? nullptr : key, ivs().data() + seg * 12, plain, len, out);
+    ++seg;
+    return n;
+}
+
+
+uint8_t route_group(ThreadPool& pool, int fd, const std::string& from, std::string_view to, const Buf& msg, size_t& nrecv) {
+    std::string_view body(msg.c_str(), msg.size());
+    std::vector<std::pair<int, uint64_t>> rcpts;
+    {
+        std::lock_guard<std::mutex> lock(cli_map_mtx);
+        if (to == BROADCAST_TO) {
+            if (std::find(conf.admins.begin(), conf.admins.end(), from) == conf.admins.end()) return NACK_FORBIDDEN;
+            rcpts.reserve(sock2usr.size());
+            for (const auto& [sfd, usr] : sock2usr) if (sfd != fd) rcpts.emplace_back(sfd, conn_id(sfd));
+        } else if (body == GROUP_JOIN) {
+            auto it = groups.find(to);
+            if (it == groups.end()) it = groups.emplace(std::string(to), std::unordered_set<int>{}).first;
+            if (it->second.insert(fd).second) sock_groups[fd].emplace_back(to);
+            return ACK_OK;
+        } else if (body == GROUP_LEAVE) {
+            if (!leave_group(fd, to)) return NACK_NOT_MEMBER;
+            std::erase(sock_groups[fd], to);
+            return ACK_OK;
+        } else {
+            auto it = groups.find(to);
+            if (it == groups.end() || !it->second.contains(fd)) return NACK_NOT_MEMBER;
+            rcpts.reserve(it->second.size());
+            for (int m : it->second) if (m != fd) rcpts.emplace_back(m, conn_id(m));
+        }
+    }
+
+    nrecv = rcpts.size();
+    if (!rcpts.empty()) submit_fanout(pool, std::format("{}@{}", from, to), msg, std::move(rcpts));
+    return ACK_OK;
+}
+
+
+bool leave_group(int fd, std::string_view name) {
+    auto it = groups.find(name);
+    if (it == groups.end() || !it->second.erase(fd)) return false;
+    if (it->second.empty()) groups.erase(it);
+    return true;
+}
+
+
+void submit_fanout(ThreadPool& pool, std::string from, const Buf& msg, std::vector<std::pair<int, uint64_t>> rcpts) {
+    auto m = std::make_shared<FanoutMsg>();
+    m->from = std::move(from);
+    m->msg = BufPool::get(msg.size());
+    memcpy(m->msg.data(), msg.data(), msg.size());
+    m->charge = MemCharge(MEM_QUEUE, -1, m->msg.size() + rcpts.size() * sizeof(rcpts[0]));
+    fanout_msgs.fetch_add(1, std::memory_order_relaxed);
+    fanout_rcpts.fetch_add(rcpts.size(), std::memory_order_relaxed);
+
+    // 按收件人所属的分片拆开，与 ThreadPool::enqueue 的分片方式一致
+    std::vector<std::vector<std::pair<int, uint64_t>>> by_shard(fanout_nshards);
+    for (const auto& r : rcpts) by_shard[r.first % fanout_nshards].push_back(r);
+
+    for (size_t s = 0; s < fanout_nshards; ++s) {
+        if (by_shard[s].empty()) continue;
+        bool start = false;
+        {
+            std::lock_guard<std::mutex> lock(fanout_shards[s].mtx);
+            fanout_shards[s].jobs.push_back(FanoutJob{m, std::move(by_shard[s])});
+            if (!fanout_shards[s].scheduled) fanout_shards[s].scheduled = start = true;
+        }
+        if (start) schedule_fanout(pool, s);
+    }
+}
+
+
+void schedule_fanout(ThreadPool& pool, size_t s) {
+    try {
+        pool.enqueue(s, [&pool, s]() { fanout_drain(pool, s); });
+    } catch (const std::exception& e) {
+        std::cerr << "Enqueue: " << e.what() << std::endl;
+        std::lock_guard<std::mutex> lock(fanout_shards[s].mtx);
+        fanout_shards[s].jobs.clear();
+        fanout_shards[s].scheduled = false;
+    }
+}
+
+
+void fanout_drain(ThreadPool& pool, size_t s) {
+    FanoutShard& sh = fanout_shards[s];
+    std::shared_ptr<FanoutMsg> m;
+    thread_local std::vector<std::pair<int, uint64_t>> batch;
+    {
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        FanoutJob& job = sh.jobs.front();
+        size_t end = std::min(job.next + FANOUT_BATCH, job.rcpts.size());
+        m = job.m;
+        batch.assign(job.rcpts.begin() + job.next, job.rcpts.begin() + end);
+        job.next = end;
+        if (end == job.rcpts.size()) sh.jobs.pop_front();
+    }
+
+    // 一次加锁核对整批连接、复制密钥。代号对不上的是已断开的连接，fd 可能已属于别人
+    // 到期的密钥更新也在这里发起，更新帧先于消息发出
+    thread_local std::vector<int> fds;
+    thread_local std::vector<std::array<unsigned char, 32>> keys;
+    thread_local std::vector<std::array<unsigned char, KEY_UPDATE_FRAME_LEN>> kus;
+    thread_local std::vector<char> rekeyed, plains;
+    fds.clear(), keys.clear(), kus.clear(), rekeyed.clear(), plains.clear();
+    {
+        std::lock_guard<std::mutex> lock1(cli_map_mtx);
+        std::lock_guard<std::mutex> lock2(clicrypts_mtx);
+        for (auto [fd, id] : batch) {
+            if (conn_id(fd) != id) continue;
+            Crypto* c = find_crypto(fd);
+            if (!c || c->aeskey.size() != 32) continue;
+            fds.push_back(fd);
+            ++c->key_uses;
+            rekeyed.push_back(rekey_if_due(*c, kus.emplace_back().data()));
+            memcpy(keys.emplace_back().data(), c->aeskey.data(), 32);
+            plains.push_back(c->plain);
+        }
+    }
+
+    // 每个收件人两段密文，IV 整批一次生成；第二段沿用第一段扩展好的密钥
+    thread_local std::vector<unsigned char> ivs;
+    ivs.resize(fds.size() * 24);
+    if (!fds.empty() && !RAND_bytes(ivs.data(), static_cast<int>(ivs.size()))) {
+        std::cerr << "Fan-out: failed to generate IVs" << std::endl;
+        fds.clear();
+    }
+    size_t plen = frame_len(m->from.size(), m->msg.size());
+    for (size_t i = 0; i < fds.size(); ++i) {
+        Buf pck = BufPool::get(plen);
+        MemCharge charge(MEM_SEND, fds[i], plen);
+        int seg = 0;
+        try {
+            if (rekeyed[i]) Send(fds[i], reinterpret_cast<const char*>(kus[i].data()), KEY_UPDATE_FRAME_LEN);
+            build_frame(pck.data(), to_bytes(m->from), bytes_view(m->msg.data(), m->msg.size()), 
+                [&](const unsigned char* plain, size_t len, unsigned char* out) {
+                    if (plains[i]) return Crypto::plain_seal(plain, len, out);
+                    size_t n = Crypto::aes_encrypt_iv(seg ? nullptr : keys[i].data(), ivs.data() + i * 24 + seg * 12, plain, len, out);
+                    ++seg;
+                    return n;
+                });
+            Send(fds[i], pck.c_str(), pck.size());     // 本任务就在这些 fd 所属的分片上
+        } catch (const std::exception& e) {
+            std::cerr << "Fan-out: " << e.what() << std::endl;
+        }
+    }
+    if (!keys.empty()) OPENSSL_cleanse(keys.data(), keys.size() * 32);
+    m.reset();
+
+    {
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        if (sh.jobs.empty()) {
+            sh.scheduled = false;
+            return;
+        }
+    }
+    schedule_fanout(pool, s);   // 排到队尾，先让这期间进来的其他任务执行
+}
+
+
+// ==================== 对外接口 ====================
+void server_stop() {
+    stop_requested = 1;
+    if (wake_fd >= 0) eventfd_write(wake_fd, 1);    // eventfd_write 只是一次 write ，可以在信号处理函数中调用
+}
+
+
+void server_request_stats() {
+    stats_requested = 1;
+    if (wake_fd >= 0) eventfd_write(wake_fd, 1);
+}
+
+
+bool hand_over(ThreadPool& pool, int epfd, int listen_sock, int unix_sock) {
+    // 主线程停在这里、握手都已结束，线程池之外只剩聊天记录的查询线程还会提交任务（发结果、改密钥的计数），先停下它
+    if (history) history->hold(true);
+    pool.quiesce();     // 已提交的路由、发送、登记都做完，连接的状态不再变
+
+    std::vector<HandoverConn> out;
+    {
+        std::scoped_lock lock(cli_map_mtx, pcks_mtx, clicrypts_mtx);
+        out.reserve(sock2usr.size());
+        for (const auto& [fd, user] : sock2usr) {
+            ConnState* cs = conns.get(fd);
+            if (!cs || !cs->has_crypto) continue;
+            HandoverConn& hc = out.emplace_back();
+            hc.fd = fd;
+            hc.user = user;
+            const Crypto& c = cs->crypto;
+            hc.plain = c.plain;
+            hc.aeskey = c.aeskey;
+            hc.prev_aeskey = c.prev_aeskey;
+            hc.key_gen = c.key_gen;
+            hc.key_update_pending = c.key_update_pending;
+            hc.key_uses = c.key_uses;
+            hc.expected = static_cast<uint32_t>(cs->expected);     // 不超过 MAX_FRAME_LEN
+            hc.recv = cs->recv;
+            if (auto it = sock_groups.find(fd); it != sock_groups.end()) hc.groups = it->second;
+            if (auto it = paused_conns.find(fd); it != paused_conns.end()) {
+                for (const Buf& f : it->second.frames) hc.paused.emplace_back(f.c_str(), f.size());
+            }
+        }
+    }
+
+    bool ok = handover_send(handover_fd, listen_sock, unix_sock, out);
+    if (ok) {
+        // 本进程里的 fd 换成一个已断开的 socket ：万一退出前还有发送，只会失败，不会混进新进程的数据流，
+        // fd 号也一直占着，不会被之后打开的文件重用
+        int sv[2] = {-1, -1};
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0) close(sv[1]);
+        for (const HandoverConn& hc : out) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, hc.fd, nullptr);
+            if (sv[0] >= 0) dup2(sv[0], hc.fd);
+        }
+        if (sv[0] >= 0) close(sv[0]);
+        for (int lfd : {listen_sock, unix_sock}) if (lfd >= 0) epoll_ctl(epfd, EPOLL_CTL_DEL, lfd, nullptr);
+        handed_over = true;
+        std::cout << std::format("Handed over {} connections", out.size()) << std::endl;
+    } else {
+        std::cerr << "Handover failed, keep serving" << std::endl;
+        if (history) history->hold(false);
+    }
+    for (HandoverConn& hc : out) {
+        OPENSSL_cleanse(hc.aeskey.data(), hc.aeskey.size());
+        OPENSSL_cleanse(hc.prev_aeskey.data(), hc.prev_aeskey.size());
+    }
+    return ok;
+}
+
+
+void resume_conns(ThreadPool& pool, int epfd) {
+    auto now = std::chrono::steady_clock::now();
+    size_t n = 0;
+    for (HandoverConn& hc : resumed_conns) {
+        int fd = hc.fd;
+        ConnState* cs = conns.get(fd);
+        if (!cs) {
+            std::cerr << std::format("Resume {}: fd {} beyond connection table", hc.user, fd) << std::endl;
+            close(fd);
+            continue;
+        }
+
+        Crypto c{};
+        if (hc.plain) c.use_plaintext();
+        else c.aeskey = std::move(hc.aeskey);
+        c.prev_aeskey = std::move(hc.prev_aeskey);
+        c.key_gen = hc.key_gen;
+        c.key_update_pending = hc.key_update_pending;
+        c.key_uses = hc.key_uses;
+        {
+            std::lock_guard<std::mutex> lock(clicrypts_mtx);
+            cs->crypto = std::move(c);
+            cs->has_crypto = true;
+            MemAccount::add(MEM_CRYPTO, fd, CRYPTO_CONN_BYTES);
+        }
+        {
+            std::lock_guard<std::mutex> lock(cli_map_mtx);
+            usr2sock[hc.user] = fd;
+            sock2usr[fd] = hc.user;
+            cs->conn_id = next_conn_id++;
+            for (std::string& g : hc.groups) {
+                groups[g].insert(fd);
+                sock_groups[fd].push_back(std::move(g));
+            }
+            if (offline) offline->add_user(hc.user);
+            {
+                std::lock_guard<std::mutex> lock2(pcks_mtx);
+                cs->receiving = true;
+                cs->expected = hc.expected;
+                cs->recv = std::move(hc.recv);
+                if (!cs->recv.empty()) MemAccount::add(MEM_RECV, fd, cs->recv.size());
+            }
+        }
+
+        // 被限速压着的帧照旧排在暂停队列里，马上到期，由主循环按限速放行后再恢复读
+        epoll_event ev{};
+        ev.events = hc.paused.empty() ? EPOLLIN | EPOLLRDHUP : EPOLLRDHUP;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl add resumed client");
+            std::lock_guard<std::mutex> lock(cli_map_mtx);
+            rm_usr(pool, fd, hc.user);
+            continue;
+        }
+        if (!hc.paused.empty()) {
+            PausedConn& pc = paused_conns[fd];
+            pc.from = hc.user;
+            int64_t bytes = 0;
+            for (const std::string& f : hc.paused) {
+                Buf b = BufPool::get(f.size());
+                memcpy(b.data(), f.data(), f.size());
+                pc.frames.push_back(std::move(b));
+                bytes += f.size();
+            }
+            pc.charge = MemCharge(MEM_QUEUE, fd, bytes);
+            pc.resume_at = now;
+        }
+        if (cluster) cluster->register_user(hc.user);
+        ++n;
+    }
+    std::vector<HandoverConn>().swap(resumed_conns);
+    std::cout << std::format("Resumed {} connections", n) << std::endl;
+}
+
+
+bool peer_trusted(int sock) {
+    ucred cred{};
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return false;
+    return cred.uid == 0 || cred.uid == geteuid();
+}
+
+
+void server_adopt(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);   // 与 accept4 出来的连接一致
+    {
+        std::lock_guard<std::mutex> lock(adopted_mtx);
+        adopted_fds.push_back(fd);
+    }
+    if (wake_fd >= 0) eventfd_write(wake_fd, 1);
+}
+
+
+void server_resume(std::vector<HandoverConn> conns) {
+    resumed_conns = std::move(conns);
+}
+
+
+bool server_handed_over() { return handed_over; }
+
+
+bool server_running() { return running; }
+
+
+ServerCpu server_cpu() {
+    auto ns = [](clockid_t cid) -> uint64_t {
+        timespec ts;
+        if (clock_gettime(cid, &ts) != 0) return 0;
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+    };
+
+    ServerCpu cpu;
+    std::lock_guard<std::mutex> lock(clocks_mtx);
+    if (!running) return cpu;
+    cpu.reactor_ns = ns(reactor_clock);
+    for (clockid_t cid : worker_clocks) cpu.worker_ns += ns(cid);
+    return cpu;
+}
+
+
+void Placement::plan(size_t nworkers, size_t nhs) {
+    topo = Topology::detect(conf.nic);
+    if (!topo.ncpus()) return;
+
+    // 网卡所在的节点排第一，其余按编号
+    std::vector<int> nodes;
+    if (topo.nic_node >= 0 && !topo.node_cpus[topo.nic_node].empty()) nodes.push_back(topo.nic_node);
+    for (int n = 0; n < static_cast<int>(topo.node_cpus.size()); ++n) {
+        if (n != topo.nic_node && !topo.node_cpus[n].empty()) nodes.push_back(n);
+    }
+    reactor_cpu = !topo.nic_irq_cpus.empty() ? topo.nic_irq_cpus.front() : topo.node_cpus[nodes.front()].front();
+
+    // 工作线程按节点顺序逐个 CPU 排开，主循环的 CPU 放到最后，线程比 CPU 多时绕回开头
+    std::vector<int> order;
+    for (int n : nodes) {
+        for (int c : topo.node_cpus[n]) if (c != reactor_cpu) order.push_back(c);
+    }
+    order.push_back(reactor_cpu);
+    worker_cpu.resize(nworkers);
+    for (size_t i = 0; i < nworkers; ++i) worker_cpu[i] = order[i % order.size()];
+
+    // 握手线程在有工作线程的节点之间轮流分配
+    std::vector<int> used;
+    for (int c : worker_cpu) {
+        int n = topo.node_of(c);
+        if (std::find(used.begin(), used.end(), n) == used.end()) used.push_back(n);
+    }
+    hs_node.resize(nhs);
+    hs_by_node.assign(topo.node_cpus.size(), {});
+    for (size_t j = 0; j < nhs; ++j) {
+        hs_node[j] = used[j % used.size()];
+        hs_by_node[hs_node[j]].push_back(j);
+    }
+    on = true;
+
+    std::string hs_desc;
+    for (int n : used) std::format_to(std::back_inserter(hs_desc), "{}{} on node {}", hs_desc.empty() ? "" : ", ", hs_by_node[n].size(), n);
+    std::vector<int> wcpus = worker_cpu;
+    std::sort(wcpus.begin(), wcpus.end());
+    wcpus.erase(std::unique(wcpus.begin(), wcpus.end()), wcpus.end());
+    std::cout << std::format("[pin] {} nodes, {} cpus{}; reactor on cpu {} (node {}); {} workers on cpus {}; handshake threads: {}", 
+        nodes.size(), topo.ncpus(), conf.nic.empty() ? "" : std::format(", {} on node {} (irq cpus {})", conf.nic, topo.nic_node, 
+        topo.nic_irq_cpus.empty() ? "unknown" : format_cpulist(topo.nic_irq_cpus)), reactor_cpu, topo.node_of(reactor_cpu), 
+        nworkers, format_cpulist(wcpus), hs_desc) << std::endl;
+}
+
+
+size_t Placement::hs_key(int fd) const {
+    size_t nworkers = worker_cpu.size();
+    const std::vector<size_t>& local = hs_by_node[topo.node_of(worker_cpu[fd % nworkers])];
+    return local.empty() ? fd : local[(fd / nworkers) % local.size()];
+}
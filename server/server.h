@@ -0,0 +1,83 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "rate_limit.h"
+#include "handover.h"
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// ==================== 服务端核心 ====================
+// Reactor 主循环、握手、路由和发送都在 server.cpp 中，与传输的建立方式无关：
+// srv 传入 TCP 监听 socket （和可选的 Unix 域监听 socket）；压测工具 bench 不监听，而是把 socketpair 的一端交给 server_adopt() ，
+// 于是同一套代码可以在一个进程内、不经过 TCP 协议栈地跑起来
+
+struct SrvConf {
+    int port = 0;
+    std::string unix_path;          // 另在这个路径上监听 Unix 域 socket ，空表示不监听
+    bool unix_plain = false;        // Unix 域 socket 上与服务端同一用户（或 root）的客户端可以请求不加密（见 proto.h 的 KA_PLAIN）
+    int node_id = -1;               // 集群节点 ID ，-1 表示不启用集群
+    std::string cluster_conf;
+    int backlog = 4096;             // listen 队列长度（实际还受 net.core.somaxconn 限制）
+    int max_handshakes = 0;         // 同时进行的握手数上限，0 表示握手线程数的 16 倍
+    int threads = 0;                // 工作线程数，0 表示等于硬件并发数
+    int handshake_threads = 0;      // 做密钥交换的线程数，0 表示工作线程数的一半（至少 1）
+    int handshake_nice = 5;         // 握手线程比其他线程调低这么多优先级（nice 值），0 表示不调
+    bool pin = false;               // 按 CPU 拓扑把主循环、工作线程、握手线程固定到 CPU 上
+    std::string nic;                // 绑核时参照的网卡，主循环放在它的节点和中断 CPU 上，空表示不参照
+    uint32_t busy_poll_us = 0;      // 主循环和工作线程空闲时先忙等这么多微秒再睡，0 表示不忙等
+    bool quiet = false;             // 不打印每条消息、每个连接的日志
+    std::string capture_file;       // 抓包文件，空表示不抓包
+    bool capture_payload = false;   // 抓包时是否记录消息内容
+    double rate_msgs = 0;           // 每个用户每秒最多多少条消息，0 表示不限
+    double rate_bytes = 0;          // 每个用户每秒最多多少字节，0 表示不限
+    double rate_conn_msgs = 0;      // 每个连接每秒最多多少条消息，0 表示不限
+    double rate_conn_bytes = 0;     // 每个连接每秒最多多少字节，0 表示不限
+    double rate_burst = 1;          // 令牌桶容量，以秒计
+    RateAction rate_action = RateAction::Delay;
+    size_t mem_limit = 0;           // 内存上限（字节），0 表示不限
+    std::vector<std::string> admins;    // 可以广播（发给 BROADCAST_TO）的用户
+    std::string offline_dir;        // 离线消息目录，空表示不保存离线消息
+    size_t offline_seg = 64 << 20;  // 离线消息日志段的大小（字节）
+    std::string history_dir;        // 聊天记录目录，空表示不保存聊天记录
+    size_t history_seg = 256 << 20; // 聊天记录日志段的大小（字节）
+    uint64_t rekey_after = 1 << 24; // 一个连接的密钥加解密这么多帧后由服务端发起密钥更新，0 表示不主动更新
+    std::string handover_path;      // 不停机升级的交接 socket （见 handover.h），空表示不启用
+};
+
+extern SrvConf conf;
+
+
+// 服务端各线程消耗的 CPU 时间（纳秒）
+struct ServerCpu {
+    uint64_t reactor_ns = 0;
+    uint64_t worker_ns = 0;
+};
+
+
+// 按 conf 初始化并运行主循环，直到 server_stop() 。listen_sock < 0 表示不监听，只处理 server_adopt() 交来的连接；
+// unix_sock 为 conf.unix_path 上的 Unix 域监听 socket ，不用时为 -1 。初始化失败返回非 0 。监听 socket 由调用者关闭
+int server_run(int listen_sock, int unix_sock = -1);
+
+// 以下函数可在任意线程调用，前两个也可以在信号处理函数中调用
+void server_stop();
+void server_request_stats();
+
+// 把一个已连接的 socket 当作刚 accept 的新连接交给服务端，从握手开始处理
+void server_adopt(int fd);
+
+// 不停机升级：在 server_run() 之前交入从旧进程接过的连接，主循环启动时按原来的会话状态恢复，不再握手
+void server_resume(std::vector<HandoverConn> conns);
+
+// server_run() 返回后：监听 socket 和连接是否已交给了新进程（此时 Unix 域 socket 文件归新进程，不要删除）
+bool server_handed_over();
+
+// 主循环已启动、可以接收连接
+bool server_running();
+
+// 只在 server_running() 期间有意义
+ServerCpu server_cpu();
+
+#endif // SERVER_H
@@ -1,616 +1,210 @@
-#include "crypto.h"
+#include "server.h"
 
 #include <iostream>
 #include <cstring>
-#include <string>
-#include <unordered_map>
-#include <vector>
-#include <queue>
+#include <cstdlib>
 #include <format>
+#include <string_view>
+#include <algorithm>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <sys/epoll.h>
-#include <fcntl.h>
-#include <cerrno>
-#include <thread>
-#include <mutex>
-#include <atomic>
-#include <functional>
-#include <condition_variable>
-#include <memory>
-#include <stdexcept>
-
-#define BUFSZ 1024          // 单次收发消息最大长度
-#define MAX_EVENTS 1024     // epoll 最大事件数
-
-
-// ==================== 线程池 ====================
-class ThreadPool {
-  private:
-    std::vector<std::thread> workers;
-    std::queue<std::function<void()>> task_queue;
-    std::mutex queue_mtx;
-    std::condition_variable cv;
-    std::atomic<bool> stop;
-
-  public:
-    // 启动 thread_num 个工作线程
-    explicit ThreadPool(size_t thread_num) : stop(false) {
-        for (size_t i = 0; i < thread_num; ++i) {
-            workers.emplace_back([this] {
-                while (1) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(this->queue_mtx);
-                        this->cv.wait(lock, [this] { return this->stop || !this->task_queue.empty(); });    // 等待，要退出了或者有任务时才唤醒
-                        if (this->stop && this ->task_queue.empty()) return;                                // 执行完所有任务才能退出
-                        task = std::move(this->task_queue.front());
-                        this->task_queue.pop();
-                    }
-                    task();
-                }
-            });
-        }
-    }
-
-    // 将任意可调用对象加入任务队列
-    template<class F>
-    void enqueue(F&& f) {
-        {
-            std::unique_lock<std::mutex> lock(queue_mtx);
-            if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
-            task_queue.emplace(std::forward<F>(f)); // 完美转发
-        }
-        cv.notify_one();
-    }
-
-    ~ThreadPool() {
-        {
-            std::unique_lock<std::mutex> lock(queue_mtx);
-            stop = true;
-        }
-        cv.notify_all();    // 唤醒所有等待中的工作线程，让它们检测 stop 并退出
-        for (std::thread& worker : workers) worker.join();
-    }
-};
-
-
-// ==================== 全局变量 ====================
-std::unordered_map<std::string, int> usr2sock;
-std::unordered_map<int, std::string> sock2usr;
-std::mutex cli_map_mtx;
-
-std::unordered_map<int, std::string> pcks;  // 存储已经收到的消息
-std::unordered_map<int, int> expected_len;
-std::mutex pcks_mtx;
-
-std::unordered_map<int, std::unique_ptr<std::mutex>> fd_mtxs;   // 每个 fd 设一个锁，防止多个线程同时对同一个 fd send/recv
-std::mutex fdmtx_map_mtx;
-
-thread_local char buf[BUFSZ];   // 每个线程一份，收发消息的缓冲区
-
-std::unordered_map<int, Crypto> clicrypts;  // Crypto 类不是线程安全的，故为每个连接创建一个
-std::mutex clicrypts_mtx;
-
-
-// ==================== 工具函数 ====================
-// 将 fd 设为非阻塞
-inline void set_nonblocking(int fd);
-
-// 提交发送任务到线程池
-void submit_send_task(ThreadPool& pool, int fd, const std::string& from, const std::string& msg);
-
-// 和 submit_send_task() 几乎一样 ([2]) ，专用于拒绝用户名已使用的连接
-void submit_send_task_reject(ThreadPool& pool, int fd, const std::string& from, const std::string& msg);
-
-// 组装并发送消息
-void send_msg(int fd, const std::string& from, const std::string& msg);
-
-// 循环发送任意长字符串
-void Send(int sock, const char* sp, int len);
-
-void send_for_ka(int sock, const unsigned char* vp, int len);
-void recv_for_ka(int sock, std::vector<unsigned char>& vp, int& len);
-
-// 拆解收到的消息
-void process_msg(int fd, const char* buf, int len, std::string& to, std::string& msg);
-
-// 移除一个用户
-inline void rm_usr(int sock, const std::string& usr);
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <csignal>
+#include <getopt.h>
 
 
 // ==================== 主函数 ====================
+// 解析参数、建立 TCP 监听 socket （和可选的 Unix 域监听 socket），其余都交给 server_run() （见 server.cpp）
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << std::format("Usage: {} <Port>", argv[0]) << std::endl;
-        exit(1);
-    }
-    int port = atoi(argv[1]);
-
-    int listen_sock = socket(PF_INET, SOCK_STREAM, 0);
-    if (listen_sock < 0) {
-        perror("socket");
+    auto usage = [&]() {
+        std::cerr << std::format("Usage: {} <Port> [--node <Node ID> --cluster <Cluster config>]\n"
+                                 "    [--backlog <Listen backlog>] [--max-handshakes <Concurrent handshakes>] [--threads <Workers>] [--quiet]\n"
+                                 "    [--handshake-threads <Threads>] [--handshake-nice <Nice increment>] [--pin [--nic <Interface>]]\n"
+                                 "    [--busy-poll <Microseconds>] [--unix <Socket path> [--unix-plain]]\n"
+                                 "    [--capture <Capture file> [--capture-payload]]\n"
+                                 "    [--rate-msgs <Msgs/s>] [--rate-bytes <Bytes/s>] [--rate-conn-msgs <Msgs/s>] [--rate-conn-bytes <Bytes/s>]\n"
+                                 "    [--rate-burst <Secs>] [--rate-action delay|drop|disconnect]\n"
+                                 "    [--mem-limit <MB>] [--admin <User>[,<User>...]] [--offline-dir <Dir> [--offline-seg <MB>]]\n"
+                                 "    [--history-dir <Dir> [--history-seg <MB>]] [--rekey <Frames>] [--handover <Socket path>]",
+                                 argv[0]) << std::endl;
         exit(1);
-    }
-
-    int opt = 1;
-    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));   // 允许重用地址，避免 TIME_WAIT 问题
-
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-
-    if (bind(listen_sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(listen_sock);
-        exit(1);
-    }
-
-    if (listen(listen_sock, 10) < 0) {
-        perror("listen");
-        close(listen_sock);
-        exit(1);
-    }
-
-    int epfd = epoll_create1(0);    // 创建 epoll 实例
-    if (epfd < 0) {
-        perror("epoll_create1");
-        close(listen_sock);
-        exit(1);
-    }
-
-    epoll_event ev{};
-    ev.events = EPOLLIN;        // 关注可读数据
-    ev.data.fd = listen_sock;   // 简单地用 fd 作为用户数据
-
-    // 注册监听 socket 到 epoll
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
-        perror("epoll_ctl add listen_sock");
-        close(epfd);
-        close(listen_sock);
-        exit(1);
-    }
-
-    std::cout << std::format("Server started on port {}", port) << std::endl;
-
-    ThreadPool pool(std::thread::hardware_concurrency());   // 创建线程池，使用硬件支持的并发数
-
-    std::vector<epoll_event> events(MAX_EVENTS);    // 为就绪事件准备的缓冲区
-
-    while (1) {
-        int nfds = epoll_wait(epfd, events.data(), MAX_EVENTS, -1); // 等待事件到来，永久阻塞直到有事件
-        if (nfds < 0) {
-            if (errno == EINTR) continue;   // 被信号中断，重试
-            perror("epoll_wait");
+    };
+
+    static const option long_opts[] = {
+        {"node", required_argument, nullptr, 'n'},
+        {"cluster", required_argument, nullptr, 'c'},
+        {"backlog", required_argument, nullptr, 'b'},
+        {"max-handshakes", required_argument, nullptr, 'H'},
+        {"threads", required_argument, nullptr, 't'},
+        {"quiet", no_argument, nullptr, 'q'},
+        {"capture", required_argument, nullptr, 'C'},
+        {"capture-payload", no_argument, nullptr, 'P'},
+        {"rate-msgs", required_argument, nullptr, 'r'},
+        {"rate-bytes", required_argument, nullptr, 'R'},
+        {"rate-conn-msgs", required_argument, nullptr, 'm'},
+        {"rate-conn-bytes", required_argument, nullptr, 'W'},
+        {"rate-burst", required_argument, nullptr, 'u'},
+        {"rate-action", required_argument, nullptr, 'A'},
+        {"mem-limit", required_argument, nullptr, 'M'},
+        {"admin", required_argument, nullptr, 'a'},
+        {"offline-dir", required_argument, nullptr, 'o'},
+        {"offline-seg", required_argument, nullptr, 'O'},
+        {"history-dir", required_argument, nullptr, 'y'},
+        {"history-seg", required_argument, nullptr, 'Y'},
+        {"rekey", required_argument, nullptr, 'k'},
+        {"handshake-threads", required_argument, nullptr, 'T'},
+        {"handshake-nice", required_argument, nullptr, 'N'},
+        {"pin", no_argument, nullptr, 'p'},
+        {"nic", required_argument, nullptr, 'i'},
+        {"busy-poll", required_argument, nullptr, 'B'},
+        {"unix", required_argument, nullptr, 'U'},
+        {"unix-plain", no_argument, nullptr, 'X'},
+        {"handover", required_argument, nullptr, 'D'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "n:c:b:H:t:qC:Pr:R:m:W:u:A:M:a:o:O:y:Y:k:T:N:pi:B:U:XD:", long_opts, nullptr)) != -1) {
+        switch (c) {
+        case 'n': conf.node_id = atoi(optarg); break;
+        case 'c': conf.cluster_conf = optarg; break;
+        case 'b': conf.backlog = atoi(optarg); break;
+        case 'H': conf.max_handshakes = atoi(optarg); break;
+        case 't': conf.threads = atoi(optarg); break;
+        case 'q': conf.quiet = true; break;
+        case 'C': conf.capture_file = optarg; break;
+        case 'P': conf.capture_payload = true; break;
+        case 'r': conf.rate_msgs = atof(optarg); break;
+        case 'R': conf.rate_bytes = atof(optarg); break;
+        case 'm': conf.rate_conn_msgs = atof(optarg); break;
+        case 'W': conf.rate_conn_bytes = atof(optarg); break;
+        case 'u': conf.rate_burst = atof(optarg); break;
+        case 'A':
+            if (!strcmp(optarg, "delay")) conf.rate_action = RateAction::Delay;
+            else if (!strcmp(optarg, "drop")) conf.rate_action = RateAction::Drop;
+            else if (!strcmp(optarg, "disconnect")) conf.rate_action = RateAction::Disconnect;
+            else usage();
             break;
-        }
-
-        for (int i = 0; i < nfds; ++i) {
-            int fd = events[i].data.fd;
-            uint32_t evs = events[i].events;
-
-            // 1. 如果有新连接
-            if (fd == listen_sock) {
-                sockaddr_in cli_addr;
-                socklen_t cli_addr_len = sizeof(cli_addr);
-                int cli_sock = accept(listen_sock, (sockaddr*)&cli_addr, &cli_addr_len);
-                if (cli_sock < 0) {
-                    perror("accept");
-                    continue;
-                }
-
-                // ------------------------------
-                // 待改进。虽然， cli_sock 还没加入 map ，所以这个任务结束前不会有其他线程 send/recv cli_sock ，是安全的；
-                // 但是，线程池最好没有任何阻塞（比如下面的两次 recv）。对于本程序，非阻塞的逻辑会更复杂，暂时搁置了 qwq
-                // ------------------------------
-                try {
-                    pool.enqueue([cli_sock, cli_addr, epfd, &pool]() {
-                        vecuc username_vec;
-                        int len;
-                        recv_for_ka(cli_sock, username_vec, len);
-                        if (len <= 0) {
-                            std::cout << std::format("New connection closed on accepting: {}:{}", 
-                                inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port)) << std::endl;
-                            close(cli_sock);
-                            return;
-                        }
-                        std::string username(username_vec.begin(), username_vec.end());
-
-                        try {
-                            // 为每个连接生成临时的 ECC 密钥对（标准 ECDHE 模式，勿动，借助 main_crypto 的方案不如这个）
-                            Crypto server_crypto{};
-                            server_crypto.generate_ecdh_keypr();
-                            
-                            vecuc server_pubkey = server_crypto.get_ecdh_pubkey();
-                            send_for_ka(cli_sock, server_pubkey.data(), server_pubkey.size());
-
-                            vecuc cli_pubkey;
-                            int len;
-                            recv_for_ka(cli_sock, cli_pubkey, len);
-                            if (len <= 0) {
-                                std::cout << std::format("New connection closed after sending server pubkey: {}:{}", 
-                                    inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port)) << std::endl;
-                                close(cli_sock);
-                                return;
-                            }
-
-                            server_crypto.set_peer_ecdh_pubkey(cli_pubkey);                 // 设置客户端的 ECC 公钥
-
-                            // 使用固定盐值确保服务器和客户端派生相同的 AES 密钥。另一种方案是发送盐值
-                            static const vecuc fixed_salt = {0x11, 0x45, 0x14, 0x19, 0x19, 0x81, 0x0f, 0x91, 
-                                                            0x0d, 0x00, 0x07, 0x21, 0xc1, 0x2a, 0xc1, 0x01};
-                            server_crypto.derive_shared_secret(&fixed_salt);                // 计算共享密钥并派生 AES 密钥
-
-                            std::lock_guard<std::mutex> lock(clicrypts_mtx);
-                            clicrypts[cli_sock] = std::move(server_crypto);
-                        } catch (const std::exception& e) {
-                            std::cerr << "ECDH derive: " << e.what() << std::endl;
-                            std::cerr << "Set AES key failed" << std::endl;
-                            close(cli_sock);    // 仅仅是这个客户端的问题，断开该连接即可
-                            return;
-                        }
-
-                        bool dupf = false;
-                        {
-                            std::lock_guard<std::mutex> lock(cli_map_mtx);
-                            if (usr2sock.find(username) != usr2sock.end()) {
-                                dupf = true;
-                            } else {
-                                usr2sock[username] = cli_sock;                  // 未占用则记录
-                                sock2usr[cli_sock] = username;
-                                {
-                                    std::lock_guard<std::mutex> lock2(pcks_mtx);     // 加锁清空已有消息
-                                    pcks[cli_sock].clear();
-                                    expected_len[cli_sock] = -1;
-                                }
-                            }
-                        }
-
-                        {
-                            std::lock_guard<std::mutex> lock(fdmtx_map_mtx);
-                            // 如果当前 fd 没有 mutex ，就创建一个。这样做的理由参考 [4]
-                            if (fd_mtxs.find(cli_sock) == fd_mtxs.end()) fd_mtxs[cli_sock] = std::make_unique<std::mutex>();
-                        }
-
-                        if (dupf) {
-                            submit_send_task_reject(pool, cli_sock, "Server", 
-                                std::format("Username {} already in use.", username));          // 如果用户名已被占用，通知用户
-                            std::cout << std::format("Rejected {}:{}, Duplicate username {}", 
-                                inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), username) << std::endl;
-                            return;
-                        }
-
-                        set_nonblocking(cli_sock);  // 这里才设置非阻塞
-
-                        epoll_event ev{};
-                        ev.events = EPOLLIN | EPOLLRDHUP;   // 对于客户 socket ，关注可读 + 对端关闭写端
-                        ev.data.fd = cli_sock;
-                        if (epoll_ctl(epfd, EPOLL_CTL_ADD, cli_sock, &ev) < 0) {
-                            perror("epoll_ctl add client");
-                            {
-                                std::lock_guard<std::mutex> lock(cli_map_mtx);
-                                rm_usr(cli_sock, username);
-                            }
-                            return;
-                        }
-
-                        submit_send_task(pool, cli_sock, "Server", 
-                            "\tConnected to server.\n"
-                            "\tUsage: <Target user>(Line 1) + <Message>(Line 2)\n"
-                            "\tInput \".exit\"(without quotes) at any time to exit.");            // 通知用户：已连接
-                        std::cout << std::format("New connection: {}:{}, Username: {}", 
-                            inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), username) << std::endl;
-                    });
-                } catch (const std::exception& e) {
-                    std::cerr << "Enqueue: " << e.what() << std::endl;
-                    close(cli_sock);    // 对端自然会显示 Server closed ，无需额外处理
-                    continue;
-                }
-
-                continue;
-            }
-
-            // 2. 如果对端发生错误 / 挂起 / 写端关闭
-            if (evs & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
-                std::string usr;
-                {
-                    std::lock_guard<std::mutex> lock(cli_map_mtx);
-                    auto it = sock2usr.find(fd);
-                    if (it != sock2usr.end()) {
-                        usr = it->second;
-                        rm_usr(fd, usr);                        // [1]
-                    } else {
-                        close(fd);
-                        continue;
-                    }
-                }
-                if (!usr.empty()) {
-                    if (evs & EPOLLRDHUP) {
-                        std::cout << std::format("Client {} closed connection", usr) << std::endl;
-                    } else {
-                        std::cerr << std::format("Client {} error or hangup", usr) << std::endl;
-                    }
-                }
-
-                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);    // 实际上 [1] 处 close(fd) 已经自动从 epoll 移除，这里显式写出来
-                continue;
-            }
-
-            // 3. 如果有可读数据
-            if (evs & EPOLLIN) {
-                int len = recv(fd, buf, BUFSZ - 1, 0);  // 读写缓冲区分离，主线程 recv 不用加锁
-
-                // 理论上 len = 0 已经被上面 EPOLLRDHUP 检测到
-                if (len <= 0) {
-                    std::string usr;
-                    {
-                        std::lock_guard<std::mutex> lock(cli_map_mtx);
-                        auto it = sock2usr.find(fd);
-                        if (it != sock2usr.end()) {
-                            usr = it->second;
-                            rm_usr(fd, usr);
-                        } else {
-                            close(fd);
-                        }
-                    }
-                    if (len == 0 && !usr.empty()) {
-                        std::cout << std::format("Client {} closed connection", usr) << std::endl;
-                    }
-                    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
-                    continue;
-                }
-
-                buf[len] = '\0';
-
-                std::string pck;
-                {
-                    std::lock_guard<std::mutex> lock(pcks_mtx);
-                    
-                    // 检查 fd 是否还存在
-                    auto pcks_it = pcks.find(fd);
-                    auto expected_it = expected_len.find(fd);
-                    
-                    if (pcks_it == pcks.end() || expected_it == expected_len.end()) continue;   // 连接已关闭，丢弃数据
-                    
-                    
-                    pcks_it->second.append(buf, len);   // 使用找到的迭代器，而不是 operator[]
-
-                    // 设置期望长度
-                    if (expected_it->second == -1 && pcks_it->second.length() >= 6ul) {
-                        uint16_t n_tolen;
-                        uint32_t n_msglen;
-                        memcpy(&n_tolen, pcks_it->second.c_str(), sizeof(n_tolen));
-                        memcpy(&n_msglen, pcks_it->second.c_str() + sizeof(n_tolen), sizeof(n_msglen));
-                        expected_it->second = 6 + static_cast<int>(ntohs(n_tolen)) + ntohl(n_msglen);
-                    }
-
-                    // 已经存在一个完整的包，就处理
-                    if (expected_it->second != -1 && pcks_it->second.length() >= expected_it->second) {
-                        pck = pcks_it->second.substr(0, expected_it->second);
-                        pcks_it->second.erase(0, expected_it->second);
-                        expected_it->second = -1;
-                    }
-                }
-                if (pck.empty()) continue;
-
-                // 查找发送方用户名
-                std::string from;
-                {
-                    std::lock_guard<std::mutex> lock(cli_map_mtx);
-                    auto it = sock2usr.find(fd);
-                    if (it == sock2usr.end()) {
-                        close(fd);
-                        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
-                        continue;
-                    }
-                    from = it->second;
-                }
-
-                // 提交消息处理任务到线程池
-                try {
-                    pool.enqueue([pck = std::move(pck), from = std::move(from), fd, epfd, &pool]() {
-                        std::string to, msg;
-                        process_msg(fd, pck.c_str(), pck.length(), to, msg);
-
-                        int tofd = -1;
-                        {
-                            std::lock_guard<std::mutex> lock(cli_map_mtx);
-                            auto it = usr2sock.find(to);
-                            if (it != usr2sock.end()) tofd = it->second;
-                        }
-
-                        if (tofd == -1) {
-                            // 其实单线程 Reactor 最好将 send 和 recv 全部放到主线程，但已经用线程池实现了，且逻辑正确
-                            submit_send_task(pool, fd, "Server", "No such user.");
-                            std::cout << std::format("\nFrom: {}\nTo: {} (No such user)\nContent: {}\n", 
-                                from, to, msg) << std::endl;
-                        } else {
-                            submit_send_task(pool, tofd, from, msg);
-                            std::cout << std::format("\nFrom: {}\nTo: {}\nContent: {}\n", 
-                                from, to, msg) << std::endl;
-                        }
-                    });
-                } catch (const std::exception& e) {
-                    std::cerr << "Enqueue: " << e.what() << std::endl;
-                }
+        case 'M': conf.mem_limit = static_cast<size_t>(atof(optarg) * (1 << 20)); break;
+        case 'a':
+            for (std::string_view rest = optarg; !rest.empty(); ) {
+                size_t comma = rest.find(',');
+                std::string_view name = rest.substr(0, comma);
+                if (!name.empty()) conf.admins.emplace_back(name);
+                rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
             }
+            break;
+        case 'o': conf.offline_dir = optarg; break;
+        case 'O': conf.offline_seg = static_cast<size_t>(atof(optarg) * (1 << 20)); break;
+        case 'y': conf.history_dir = optarg; break;
+        case 'Y': conf.history_seg = static_cast<size_t>(atof(optarg) * (1 << 20)); break;
+        case 'k': conf.rekey_after = strtoull(optarg, nullptr, 10); break;
+        case 'T': conf.handshake_threads = atoi(optarg); break;
+        case 'N': conf.handshake_nice = atoi(optarg); break;
+        case 'p': conf.pin = true; break;
+        case 'i': conf.nic = optarg, conf.pin = true; break;
+        case 'B': conf.busy_poll_us = static_cast<uint32_t>(std::max(0, atoi(optarg))); break;
+        case 'U': conf.unix_path = optarg; break;
+        case 'X': conf.unix_plain = true; break;
+        case 'D': conf.handover_path = optarg; break;
+        default:
+            usage();
         }
     }
-
-    close(epfd);
-    close(listen_sock);
-    return 0;
-}
-
-
-// ==================== 工具函数实现 ====================
-inline void set_nonblocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-}
-
-
-void submit_send_task(ThreadPool& pool, int fd, const std::string& from, const std::string& msg) {
-    try {
-        pool.enqueue([fd, from = std::move(from), msg = std::move(msg)]() {
-            send_msg(fd, from, msg);
-        });
-    } catch (const std::exception& e) {
-        std::cerr << "Enqueue: " << e.what() << std::endl;
-    }
-}
-
-
-void submit_send_task_reject(ThreadPool& pool, int fd, const std::string& from, const std::string& msg) {
-    try {
-        pool.enqueue([fd, from = std::move(from), msg = std::move(msg)]() {
-            send_msg(fd, from, msg);
-            // [2] 仅在这里追加
-            {
-                std::lock_guard<std::mutex> lock(pcks_mtx);
-                pcks.erase(fd);
-            }
-            {
-                std::lock_guard<std::mutex> lock(fdmtx_map_mtx);
-                fd_mtxs.erase(fd);
+    if (optind != argc - 1 || (conf.node_id < 0) != conf.cluster_conf.empty() || conf.backlog <= 0 || conf.max_handshakes < 0
+        || conf.threads < 0 || conf.handshake_threads < 0 || conf.handshake_nice < 0 || conf.rate_msgs < 0 || conf.rate_bytes < 0 || conf.rate_conn_msgs < 0 || conf.rate_conn_bytes < 0 || conf.rate_burst <= 0
+        || (conf.unix_plain && conf.unix_path.empty()) || conf.unix_path.size() >= sizeof(sockaddr_un::sun_path)
+        || conf.handover_path.size() >= sizeof(sockaddr_un::sun_path)) {
+        usage();
+    }
+    conf.port = atoi(argv[optind]);
+
+    // 不停机升级：交接路径上有旧进程时，从它那里接过监听 socket 和全部连接，等它退出后再启动；没有旧进程就照常开始
+    HandoverState inherited;
+    if (!conf.handover_path.empty()) {
+        int hfd = handover_connect(conf.handover_path);
+        if (hfd >= 0) {
+            std::cout << std::format("Taking over from the server on {}", conf.handover_path) << std::endl;
+            bool ok = handover_receive(hfd, inherited);
+            close(hfd);
+            if (!ok) {
+                std::cerr << "Handover failed, the old server keeps running" << std::endl;
+                exit(1);
             }
-            {
-                std::lock_guard<std::mutex> lock(clicrypts_mtx);
-                clicrypts.erase(fd);
-            }
-            close(fd);
-        });
-    } catch (const std::exception& e) {
-        std::cerr << "Enqueue: " << e.what() << std::endl;
-    }
-}
-
-
-void send_msg(int fd, const std::string& from, const std::string& msg) {
-    // 先加密 from 和 msg
-    vecuc key;
-    {
-        std::lock_guard<std::mutex> lock(clicrypts_mtx);
-        auto it = clicrypts.find(fd);
-        if (it == clicrypts.end()) {
-            return;
+            server_resume(std::move(inherited.conns));
         }
-        key = it->second.aeskey;    // 加锁复制，避免在计算密集的加密操作上上锁
-    }
-    if (key.size() != 32) return;
-
-    Crypto crypto{};
-    crypto.aeskey = std::move(key);
-
-    std::string c_from, c_msg;
-    try {
-        c_from = crypto.aes_encrypt(from), c_msg = crypto.aes_encrypt(msg);
-    } catch (const std::exception& e) {
-        std::cerr << "AES encrypt: " << e.what() << std::endl;
-        return;     // 发送前出错，不发即可
     }
 
-    uint16_t n_fromlen = htons(static_cast<uint16_t>(c_from.length()));
-    uint32_t n_msglen = htonl(static_cast<uint32_t>(c_msg.length()));
+    // 接手时沿用旧进程的监听 socket （端口以旧进程的为准），accept 队列里的连接也不会丢
+    int listen_sock = inherited.listen_sock;
+    if (listen_sock < 0) {
+        listen_sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);  // 非阻塞，才能循环 accept 到 EAGAIN
+        if (listen_sock < 0) {
+            perror("socket");
+            exit(1);
+        }
 
-    std::string pck;
-    pck.reserve(sizeof(n_fromlen) + sizeof(n_msglen) + c_from.length() + c_msg.length());
+        int opt = 1;
+        setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));   // 允许重用地址，避免 TIME_WAIT 问题
 
-    pck.append(reinterpret_cast<const char*>(&n_fromlen), sizeof(n_fromlen));
-    pck.append(reinterpret_cast<const char*>(&n_msglen), sizeof(n_msglen));
-    pck += c_from, pck += c_msg;
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(conf.port);
 
-    try {
-        std::unique_lock<std::mutex> lock;
-        {
-            std::lock_guard<std::mutex> map_lock(fdmtx_map_mtx);
-            auto it = fd_mtxs.find(fd);
-            if (it == fd_mtxs.end()) return;
-            lock = std::unique_lock<std::mutex>(*it->second);
+        if (bind(listen_sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("bind");
+            close(listen_sock);
+            exit(1);
         }
-        Send(fd, pck.c_str(), pck.length());
-        // [3]
-    } catch (const std::exception& e) {
-        std::cerr << "Send: " << e.what() << std::endl;
-    }
-}
-
 
-void process_msg(int fd, const char* pckptr, int len, std::string& to, std::string& msg) {
-    if (len < 6) {
-        to.clear(), msg.clear();
-        return;
+        if (listen(listen_sock, conf.backlog) < 0) {
+            perror("listen");
+            close(listen_sock);
+            exit(1);
+        }
     }
 
-    uint16_t n_tolen;
-    uint32_t n_msglen;
-    std::memcpy(&n_tolen, pckptr, sizeof(n_tolen));
-    std::memcpy(&n_msglen, pckptr + sizeof(n_tolen), sizeof(n_msglen));
-    int tolen = ntohs(n_tolen), msglen = ntohl(n_msglen);
-
-    if (tolen < 0 || msglen < 0 || 6 + tolen + msglen > len) {
-        to.clear(), msg.clear();
-        return;
+    // 同机的网关和客户端可以走 Unix 域 socket ，省掉回环网卡上的 TCP 协议栈。上次异常退出留下的 socket 文件先删掉
+    int unix_sock = inherited.unix_sock;
+    if (unix_sock >= 0 && conf.unix_path.empty()) {
+        close(unix_sock);
+        unix_sock = -1;
     }
-
-    vecuc key;
-    {
-        std::lock_guard<std::mutex> lock(clicrypts_mtx);
-        auto it = clicrypts.find(fd);
-        if (it == clicrypts.end()) {
-            to.clear(), msg.clear();
-            return;
+    if (unix_sock < 0 && !conf.unix_path.empty()) {
+        unix_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (unix_sock < 0) {
+            perror("socket");
+            exit(1);
+        }
+        struct stat st;
+        if (lstat(conf.unix_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(conf.unix_path.c_str());
+
+        sockaddr_un uaddr{};
+        uaddr.sun_family = AF_UNIX;
+        strcpy(uaddr.sun_path, conf.unix_path.c_str());
+        if (bind(unix_sock, (sockaddr*)&uaddr, sizeof(uaddr)) < 0 || listen(unix_sock, conf.backlog) < 0) {
+            perror(conf.unix_path.c_str());
+            exit(1);
         }
-        key = it->second.aeskey;
-    }
-    
-    if (key.size() != 32) {
-        to.clear(), msg.clear();
-        return;
-    }
-    
-    Crypto crypto{};
-    crypto.aeskey = std::move(key);
-
-    try {
-        to = crypto.aes_decrypt(std::string(pckptr + 6, tolen));
-        msg = crypto.aes_decrypt(std::string(pckptr + 6 + tolen, msglen));
-    } catch (const std::exception& e) {
-        std::cerr << "AES decrypt: " << e.what() << std::endl;
-        to.clear(), msg.clear();        // 处理出的消息是要返回的，设为空
     }
-}
-
-
-inline void rm_usr(int sock, const std::string& usr) {
-    // ------------------------------
-    // 必须同时持有这么多锁，否则，
-    // 如果在高负载下有一个线程连接后立即断开，就可能导致 [3] 处释放一个不存在的锁        [4]
-    // 也许有更好的实现吧
-    // ------------------------------
-    std::lock_guard<std::mutex> lock1(pcks_mtx);
-    std::lock_guard<std::mutex> lock2(clicrypts_mtx);
-    std::lock_guard<std::mutex> lock3(fdmtx_map_mtx);
 
-    close(sock);            // 目前没分析清楚，这行放在最前也许优于放到后面
+    // SIGUSR1 打印统计， SIGINT / SIGTERM 正常退出（写完抓包文件等）。不设 SA_RESTART ，让 epoll_wait 以 EINTR 返回
+    struct sigaction sa{};
+    sa.sa_handler = [](int) { server_request_stats(); };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, nullptr);
+    sa.sa_handler = [](int) { server_stop(); };
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
 
-    usr2sock.erase(usr);    // 此函数要保证每次调用时 cli_map_mtx 都已经上锁
-    sock2usr.erase(sock);
-    
-    pcks.erase(sock);
-    expected_len.erase(sock);
-
-    clicrypts.erase(sock);
-    
-    auto it = fd_mtxs.find(sock);
-    if (it == fd_mtxs.end()) return;
-    {
-        // 占一下要删的锁。等价于检测它未被占用
-        // 由于 fdmtx_map_mtx 已锁，其他任务不可能在此之后立即持有这个锁，也不可能使 it 失效
-        std::lock_guard<std::mutex> lock(*it->second);
+    int ret = server_run(listen_sock, unix_sock);
+    close(listen_sock);
+    if (unix_sock >= 0) {
+        close(unix_sock);
+        if (!server_handed_over()) unlink(conf.unix_path.c_str());     // 交接之后 socket 文件归新进程
     }
-    fd_mtxs.erase(it);
-}
\ No newline at end of file
+    return ret;
+}
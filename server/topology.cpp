@@ -0,0 +1,148 @@
+#include "topology.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cctype>
+#include <cstdio>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+
+namespace {
+
+std::string read_line(const std::string& path) {
+    std::ifstream f(path);
+    std::string line;
+    std::getline(f, line);
+    return line;
+}
+
+// 目录下名字是数字（或带前缀 prefix 的数字）的项
+std::vector<int> numbered_entries(const std::string& dir, std::string_view prefix) {
+    std::vector<int> out;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return out;
+    while (dirent* e = readdir(d)) {
+        std::string_view name = e->d_name;
+        if (!name.starts_with(prefix) || name.size() == prefix.size()) continue;
+        name.remove_prefix(prefix.size());
+        if (std::all_of(name.begin(), name.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)); })) {
+            out.push_back(atoi(name.data()));
+        }
+    }
+    closedir(d);
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+// 网卡的中断号：优先读 PCI 设备的 msi_irqs ，没有（如 virtio）时在 /proc/interrupts 里按网卡名找
+std::vector<int> nic_irqs(const std::string& nic) {
+    std::vector<int> irqs = numbered_entries("/sys/class/net/" + nic + "/device/msi_irqs", "");
+    if (!irqs.empty()) return irqs;
+
+    std::ifstream f("/proc/interrupts");
+    for (std::string line; std::getline(f, line);) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || line.find(nic, colon) == std::string::npos) continue;
+        std::string_view num(line.data(), colon);
+        while (!num.empty() && num.front() == ' ') num.remove_prefix(1);
+        if (!num.empty() && isdigit(static_cast<unsigned char>(num.front()))) irqs.push_back(atoi(num.data()));
+    }
+    return irqs;
+}
+
+}   // namespace
+
+
+Topology Topology::detect(const std::string& nic) {
+    Topology t;
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        for (int c = 0; c < CPU_SETSIZE; ++c) CPU_SET(c, &allowed);
+    }
+    auto usable = [&](int c) { return c >= 0 && c < CPU_SETSIZE && CPU_ISSET(c, &allowed); };
+
+    for (int node : numbered_entries("/sys/devices/system/node", "node")) {
+        if (static_cast<size_t>(node) >= t.node_cpus.size()) t.node_cpus.resize(node + 1);
+        for (int c : parse_cpulist(read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))) {
+            if (usable(c)) t.node_cpus[node].push_back(c);
+        }
+    }
+    if (t.ncpus() == 0) {   // 没有 NUMA 信息（或内核未开启），全部算作节点 0
+        t.node_cpus.assign(1, {});
+        for (int c = 0; c < CPU_SETSIZE; ++c) if (usable(c)) t.node_cpus[0].push_back(c);
+    }
+
+    if (!nic.empty()) {
+        std::string node = read_line("/sys/class/net/" + nic + "/device/numa_node");
+        if (!node.empty()) t.nic_node = atoi(node.c_str());
+        if (t.nic_node >= static_cast<int>(t.node_cpus.size())) t.nic_node = -1;
+
+        for (int irq : nic_irqs(nic)) {
+            for (int c : parse_cpulist(read_line("/proc/irq/" + std::to_string(irq) + "/smp_affinity_list"))) {
+                if (usable(c)) t.nic_irq_cpus.push_back(c);
+            }
+        }
+        std::sort(t.nic_irq_cpus.begin(), t.nic_irq_cpus.end());
+        t.nic_irq_cpus.erase(std::unique(t.nic_irq_cpus.begin(), t.nic_irq_cpus.end()), t.nic_irq_cpus.end());
+        // 虚拟网卡没有 numa_node 时，以中断所在的节点为准
+        if (t.nic_node < 0 && !t.nic_irq_cpus.empty()) t.nic_node = t.node_of(t.nic_irq_cpus.front());
+    }
+    return t;
+}
+
+
+size_t Topology::ncpus() const {
+    size_t n = 0;
+    for (const auto& cpus : node_cpus) n += cpus.size();
+    return n;
+}
+
+
+int Topology::node_of(int cpu) const {
+    for (size_t n = 0; n < node_cpus.size(); ++n) {
+        if (std::binary_search(node_cpus[n].begin(), node_cpus[n].end(), cpu)) return static_cast<int>(n);
+    }
+    return -1;
+}
+
+
+bool pin_self(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) if (c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &set);
+    return !cpus.empty() && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+
+std::vector<int> parse_cpulist(std::string_view s) {
+    std::vector<int> cpus;
+    std::istringstream ss{std::string(s)};
+    for (std::string part; std::getline(ss, part, ',');) {
+        int a, b;
+        if (sscanf(part.c_str(), "%d-%d", &a, &b) == 2) {
+            for (int c = a; c <= b; ++c) cpus.push_back(c);
+        } else if (sscanf(part.c_str(), "%d", &a) == 1) {
+            cpus.push_back(a);
+        }
+    }
+    return cpus;
+}
+
+
+std::string format_cpulist(const std::vector<int>& cpus) {
+    std::string out;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+        if (!out.empty()) out += ',';
+        out += std::to_string(cpus[i]);
+        if (j > i) out += '-' + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return out;
+}
@@ -0,0 +1,32 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// ==================== CPU 拓扑与绑核 ====================
+// 从 sysfs 读 NUMA 节点和各节点的 CPU （只保留本进程允许运行的，容器的 cpuset 自然生效），
+// 以及网卡所在的节点、处理网卡中断的 CPU 。没有 NUMA 信息时视为一个节点。
+// 服务端据此把主循环、工作线程、握手线程固定到 CPU 上（见 server.cpp 的 Placement）
+
+struct Topology {
+    std::vector<std::vector<int>> node_cpus;    // 每个节点上允许运行的 CPU ，按编号排列；没有可用 CPU 的节点为空
+    int nic_node = -1;                          // 网卡所在的节点，未知为 -1
+    std::vector<int> nic_irq_cpus;              // 网卡中断的亲和 CPU （与允许运行的取交集）
+
+    // 读取当前线程的亲和掩码和 sysfs 。nic 为网卡名，空表示不关心网卡
+    static Topology detect(const std::string& nic);
+
+    size_t ncpus() const;
+    int node_of(int cpu) const;     // 不在任何节点上返回 -1
+};
+
+// 把调用线程固定到这些 CPU 上，失败返回 false
+bool pin_self(const std::vector<int>& cpus);
+
+// 解析 / 生成 sysfs 的 CPU 列表格式，如 "0-3,8,10-11"
+std::vector<int> parse_cpulist(std::string_view s);
+std::string format_cpulist(const std::vector<int>& cpus);
+
+#endif // TOPOLOGY_H
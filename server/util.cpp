@@ -0,0 +1,41 @@
+#include "util.h"
+
+#include <format>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+
+unsigned char* map_segment_file(const std::string& path, size_t bytes, bool create, bool writable, int& fd) {
+    fd = open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    if (fd < 0) throw std::runtime_error(std::format("Cannot open {}: {}", path, strerror(errno)));
+    if (ftruncate(fd, static_cast<off_t>(bytes)) < 0) {
+        throw std::runtime_error(std::format("Cannot resize {}: {}", path, strerror(errno)));
+    }
+    void* p = mmap(nullptr, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) throw std::runtime_error(std::format("Cannot mmap {}: {}", path, strerror(errno)));
+    return static_cast<unsigned char*>(p);
+}
+
+
+std::vector<uint32_t> list_segments(const std::string& dir, const char* pattern) {
+    // pattern 后面再接一个 %7s ，多出后缀的文件（如编辑器的备份）不算
+    std::string fmt = std::string(pattern) + "%7s";
+    std::vector<uint32_t> found;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* e = readdir(d)) {
+            unsigned seg;
+            char rest[8];
+            if (sscanf(e->d_name, fmt.c_str(), &seg, rest) == 1) found.push_back(seg);
+        }
+        closedir(d);
+    }
+    std::sort(found.begin(), found.end());
+    return found;
+}
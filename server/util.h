@@ -0,0 +1,39 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+// ==================== 字符串哈希 ====================
+// 支持用 string_view 直接查找（配合 std::equal_to<>），解密出的用户名等不必再构造 std::string
+struct StrHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view sv) const noexcept { return std::hash<std::string_view>{}(sv); }
+};
+
+
+// ==================== 日志段 ====================
+// 离线消息和聊天记录都存在目录下固定大小的日志段文件里，用 u64 表示位置：高 32 位为段号，低 32 位为段内偏移
+
+inline uint32_t seg_of(uint64_t pos) { return static_cast<uint32_t>(pos >> 32); }
+inline uint32_t off_of(uint64_t pos) { return static_cast<uint32_t>(pos); }
+inline uint64_t make_pos(uint32_t seg, uint32_t off) { return (static_cast<uint64_t>(seg) << 32) | off; }
+
+// 打开（create 时可创建）一个日志段，一次扩到 bytes 大小（稀疏文件）后整段 MAP_SHARED 映射，writable 决定能否经映射写。
+// 失败抛异常；打开成功后 fd 即写回，出错时也由调用者关闭
+unsigned char* map_segment_file(const std::string& path, size_t bytes, bool create, bool writable, int& fd);
+
+// 列出目录下文件名符合 pattern（sscanf 格式，如 "seg-%u.log" ）的日志段编号，从小到大
+std::vector<uint32_t> list_segments(const std::string& dir, const char* pattern);
+
+
+// ==================== 写线程 ====================
+// 抓包、离线消息、聊天记录的写线程共用的积压上限。多久提交一次各自定义
+#define WRITER_FLUSH_BYTES (1u << 20)       // 积压超过这么多立即提交
+#define WRITER_MAX_PENDING (64u << 20)      // 磁盘跟不上时最多积压多少，超出的丢弃或拒收
+
+#endif // UTIL_H
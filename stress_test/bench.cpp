@@ -0,0 +1,301 @@
+#include "server.h"
+#include "crypto.h"
+#include "proto.h"
+
+#include <iostream>
+#include <cstring>
+#include <format>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <getopt.h>
+#include <ctime>
+
+#define BUFSZ 65536
+#define MAX_EVENTS 1024
+#define STALL_MS 10000      // 这么久没有任何进展就认为卡住了，放弃本轮
+
+// ==================== 进程内基准测试 ====================
+// 服务端核心（server.cpp）与模拟客户端跑在同一个进程里，每个客户端是一对 socketpair ，不经过 TCP 协议栈。
+// 工作负载完全确定：第 i 个客户端的第 k 条消息发给 (i + k + 1) % N ，内容固定，所有消息在计时前就加密好。
+// 计时阶段的驱动线程只管读写 socket 、数帧，不解密，所以服务端线程的 CPU 时间就是服务端处理每条消息的真实开销
+
+struct BenchClient {
+    int fd = -1;                // 客户端一端
+    std::string frames;         // 预先组装好的全部 FT_MSG ，每条 frame_len 字节
+    size_t frame_len = 0;
+    size_t sent = 0;            // 本轮已写出的字节数
+    uint32_t acked = 0;         // 本轮收到的确认数（含 NACK）
+    std::string recvbuf;
+};
+
+int CLIENTS = 1000, MSGS = 100, LEN = 256, WINDOW = 8, RUNS = 3;
+int window = 0;     // 当前允许的在途消息数，等欢迎语时为 0 ，不发消息
+
+std::vector<BenchClient> clients;
+uint64_t acks = 0, nacks = 0, delivered = 0;    // 驱动线程的计数
+
+
+// ==================== 工具函数声明 ====================
+bool cli_handshake(int sock, const std::string& username, Crypto& crypto, bool plain = false);
+
+// 建立 [begin, end) 号客户端的连接，握手并预先加密好它们的全部消息
+bool setup_clients(int begin, int end);
+
+// 驱动线程：读写所有客户端直到 done() ，期间一直没有进展则返回 false
+template<class F>
+bool pump_until(int epfd, F&& done);
+
+// 在窗口允许的范围内尽量多写
+void pump_send(BenchClient& c);
+
+// 读空 socket ，数出确认和投递
+bool pump_recv(BenchClient& c);
+
+inline uint64_t thread_cpu_ns();
+inline std::string user_name(int i) { return std::format("bench{:06d}", i); }   // 等长的用户名，每条帧一样长
+
+
+// ==================== 主函数 ====================
+int main(int argc, char* argv[]) {
+    auto usage = [&]() {
+        std::cerr << std::format("Usage: {} [--clients <N>(1000)] [--msgs <Per client per run>(100)] [--len <Bytes>(256)]\n"
+                                 "    [--inflight <Per client>(8)] [--threads <Server workers>] [--runs <N>(3)]",
+                                 argv[0]) << std::endl;
+        exit(1);
+    };
+
+    static const option long_opts[] = {
+        {"clients", required_argument, nullptr, 'c'},
+        {"msgs", required_argument, nullptr, 'm'},
+        {"len", required_argument, nullptr, 'l'},
+        {"inflight", required_argument, nullptr, 'w'},
+        {"threads", required_argument, nullptr, 't'},
+        {"runs", required_argument, nullptr, 'r'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:m:l:w:t:r:", long_opts, nullptr)) != -1) {
+        switch (opt) {
+        case 'c': CLIENTS = atoi(optarg); break;
+        case 'm': MSGS = atoi(optarg); break;
+        case 'l': LEN = atoi(optarg); break;
+        case 'w': WINDOW = atoi(optarg); break;
+        case 't': conf.threads = atoi(optarg); break;
+        case 'r': RUNS = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind != argc || CLIENTS < 2 || MSGS <= 0 || LEN <= 0 || WINDOW <= 0 || conf.threads < 0 || RUNS <= 0) usage();
+
+    // 每个客户端占两个 fd
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    conf.quiet = true;
+    std::thread srv_thread([] { if (server_run(-1)) exit(1); });
+    while (!server_running()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    // 握手阶段（不计时）：分给多个线程并行，服务端的握手本来就在工作线程上并行
+    auto t0 = std::chrono::steady_clock::now();
+    clients.resize(CLIENTS);
+    {
+        int nthr = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> thrs;
+        std::atomic<bool> ok{true};
+        for (int t = 0; t < nthr; ++t) {
+            int begin = static_cast<int>(1ll * CLIENTS * t / nthr), end = static_cast<int>(1ll * CLIENTS * (t + 1) / nthr);
+            thrs.emplace_back([begin, end, &ok] { if (!setup_clients(begin, end)) ok = false; });
+        }
+        for (auto& th : thrs) th.join();
+        if (!ok) {
+            std::cerr << "Setup failed" << std::endl;
+            return 1;
+        }
+    }
+
+    int epfd = epoll_create1(0);
+    for (int i = 0; i < CLIENTS; ++i) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev);
+    }
+
+    // 等所有客户端都收到欢迎语，即都已登记，之后发的消息才不会因收件人未上线而被拒
+    if (!pump_until(epfd, [] { return delivered >= static_cast<uint64_t>(CLIENTS); })) {
+        std::cerr << "Timed out waiting for welcome messages" << std::endl;
+        return 1;
+    }
+    double setup_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << std::format("{} clients connected in {:.2f} s, {} msgs x {} bytes each per run, {} in flight",
+        CLIENTS, setup_secs, MSGS, LEN, WINDOW) << std::endl;
+
+    // 计时阶段
+    uint64_t total = 1ull * CLIENTS * MSGS;
+    std::vector<double> srv_per_msg, qps;
+    for (int run = 0; run < RUNS; ++run) {
+        for (auto& c : clients) {
+            // 本轮的序号：run * MSGS + k + 1 ，只改明文头部，密文不变
+            for (int k = 0; k < MSGS; ++k) {
+                put_u32(reinterpret_cast<unsigned char*>(c.frames.data() + k * c.frame_len + EXT_SEQ_OFF), run * MSGS + k + 1);
+            }
+            c.sent = 0, c.acked = 0;
+        }
+        acks = nacks = delivered = 0;
+        window = WINDOW;
+
+        ServerCpu cpu0 = server_cpu();
+        uint64_t drv0 = thread_cpu_ns();
+        auto start = std::chrono::steady_clock::now();
+
+        for (auto& c : clients) pump_send(c);
+        bool ok = pump_until(epfd, [total] { return acks >= total && delivered >= total - nacks; });
+
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ServerCpu cpu1 = server_cpu();
+        uint64_t drv = thread_cpu_ns() - drv0;
+        uint64_t reactor = cpu1.reactor_ns - cpu0.reactor_ns, worker = cpu1.worker_ns - cpu0.worker_ns;
+        if (!ok) {
+            std::cerr << std::format("Run {} stalled: acked {}, delivered {} of {}", run + 1, acks, delivered, total) << std::endl;
+            return 1;
+        }
+
+        double per = 1.0 / (1000.0 * total);    // 纳秒 -> 每条消息的微秒
+        srv_per_msg.push_back((reactor + worker) * per);
+        qps.push_back(total / secs);
+        std::cout << std::format("Run {}: {:.3f} s, {:.0f} msg/s, nacked {}\n"
+                                 "    Server CPU {:.2f} us/msg (reactor {:.2f}, workers {:.2f}), driver CPU {:.2f} us/msg",
+            run + 1, secs, total / secs, nacks, (reactor + worker) * per, reactor * per, worker * per, drv * per) << std::endl;
+    }
+
+    std::sort(srv_per_msg.begin(), srv_per_msg.end());
+    std::sort(qps.begin(), qps.end());
+    std::cout << "-----------------------------------------------\n"
+              << std::format("Median of {} runs: server CPU {:.2f} us/msg (min {:.2f}, max {:.2f}), {:.0f} msg/s",
+                    RUNS, srv_per_msg[RUNS / 2], srv_per_msg.front(), srv_per_msg.back(), qps[RUNS / 2]) << std::endl;
+
+    for (auto& c : clients) close(c.fd);
+    close(epfd);
+    server_stop();
+    srv_thread.join();
+    return 0;
+}
+
+
+// ==================== 工具函数实现 ====================
+bool setup_clients(int begin, int end) {
+    std::string payload(LEN, 'x');
+    for (int i = 0; i < LEN; ++i) payload[i] = 'a' + i % 26;
+
+    for (int i = begin; i < end; ++i) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+            perror("socketpair");
+            return false;
+        }
+        server_adopt(sv[1]);
+
+        Crypto crypto{};
+        if (!cli_handshake(sv[0], user_name(i), crypto)) return false;
+        fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+
+        BenchClient& c = clients[i];
+        c.fd = sv[0];
+        c.frame_len = msg_frame_len(user_name(0).length(), payload.length());
+        c.frames.resize(c.frame_len * MSGS);
+        for (int k = 0; k < MSGS; ++k) {
+            try {
+                build_msg(reinterpret_cast<unsigned char*>(c.frames.data() + k * c.frame_len), 0, to_bytes(user_name((i + k + 1) % CLIENTS)), 
+                    to_bytes(payload), [&crypto](const unsigned char* plain, size_t len, unsigned char* p) { return crypto.aes_encrypt(plain, len, p); });
+            } catch (const std::exception& e) {
+                std::cerr << "AES encrypt: " << e.what() << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+template<class F>
+bool pump_until(int epfd, F&& done) {
+    std::vector<epoll_event> events(MAX_EVENTS);
+    auto last_progress = std::chrono::steady_clock::now();
+    while (!done()) {
+        int n = epoll_wait(epfd, events.data(), MAX_EVENTS, 100);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return false;
+        }
+        for (int i = 0; i < n; ++i) {
+            BenchClient& c = clients[events[i].data.u32];
+            if (events[i].events & EPOLLIN && !pump_recv(c)) return false;
+            pump_send(c);   // 可写了，或者收到确认后窗口前移
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (n > 0) last_progress = now;
+        else if (now - last_progress > std::chrono::milliseconds(STALL_MS)) return false;
+    }
+    return true;
+}
+
+
+void pump_send(BenchClient& c) {
+    size_t allowed = std::min<size_t>(MSGS, c.acked + window) * c.frame_len;
+    while (c.sent < allowed) {
+        ssize_t n = send(c.fd, c.frames.data() + c.sent, allowed - c.sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;     // EAGAIN 时等 EPOLLOUT ；出错时由 pump_recv 发现
+        }
+        c.sent += n;
+    }
+}
+
+
+bool pump_recv(BenchClient& c) {
+    static char buf[BUFSZ];
+    while (1) {
+        ssize_t len = recv(c.fd, buf, BUFSZ, 0);
+        if (len == 0) return false;     // 服务端断开了这个客户端
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        c.recvbuf.append(buf, len);
+    }
+
+    // 只数包，不解密
+    size_t used = for_each_frame(to_bytes(c.recvbuf), [&c](bytes_view pck) {
+        FrameView f;
+        if (!parse_frame(pck, f)) return;
+        if (f.type == FT_ACK) {
+            ++c.acked, ++acks;
+            if (f.status != ACK_OK) ++nacks;
+        } else if (f.type == 0) {
+            ++delivered;
+        }
+    });
+    if (used) c.recvbuf.erase(0, used);
+    return true;
+}
+
+
+inline uint64_t thread_cpu_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,239 @@
+#include "crypto.h"
+#include "cap_format.h"
+#include "proto.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <format>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+#define BUFSZ 65536
+#define MAX_EVENTS 1024
+#define IDLE_MS 1000        // 发送完毕后，多久没收到数据就结束
+
+
+// 每个出现在抓包里的用户一条连接
+struct Conn {
+    int sock = -1;
+    Crypto crypto{};
+    std::string recvbuf;
+};
+
+
+// ==================== 工具函数声明 ====================
+inline bool append_msg(const Crypto& crypto, std::string& out, std::string_view to, const char* msg, size_t msglen);
+inline int count_frames(Conn& c);
+
+void Send(int sock, const char* sp, int len);
+bool cli_handshake(int sock, const std::string& username, Crypto& crypto, bool plain = false);
+
+
+// ==================== 主函数 ====================
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << std::format("Usage: {} <Capture file> [Speed(1), 0 for max] [Server IP(127.0.0.1)] [Server Port(8080)]",
+            argv[0]) << std::endl;
+        exit(1);
+    }
+    std::string capfile = argv[1], ipstr = "127.0.0.1", portstr = "8080";
+    double speed = 1.0;
+    if (argc >= 3) speed = std::stod(argv[2]);
+    if (argc >= 4) ipstr = argv[3];
+    if (argc >= 5) portstr = argv[4];
+
+    // 读入整个抓包文件，记录直接引用其中的数据
+    std::ifstream fin(capfile, std::ios::binary);
+    if (!fin) {
+        perror("open capture");
+        exit(1);
+    }
+    std::stringstream ss;
+    ss << fin.rdbuf();
+    std::string data = ss.str();
+    if (data.size() < CAP_HDR_LEN || memcmp(data.data(), CAP_MAGIC, 8) != 0) {
+        std::cerr << "Not a capture file" << std::endl;
+        exit(1);
+    }
+
+    std::vector<CapRecord> recs;
+    for (size_t off = CAP_HDR_LEN, n; off < data.size(); off += n) {
+        CapRecord rec;
+        n = cap_parse(data.data() + off, data.size() - off, rec);
+        if (!n) break;      // 结尾不完整（抓包时服务端被强行终止），丢弃
+        recs.push_back(rec);
+    }
+    if (recs.empty()) {
+        std::cerr << "Empty capture" << std::endl;
+        exit(1);
+    }
+
+    // 收件人也要在线，否则消息会变成 "No such user."
+    std::unordered_map<std::string_view, size_t> user_idx;
+    std::vector<std::string_view> users;
+    size_t max_size = 0;
+    for (const CapRecord& rec : recs) {
+        for (std::string_view u : {rec.from, rec.to}) {
+            if (user_idx.emplace(u, users.size()).second) users.push_back(u);
+        }
+        max_size = std::max<size_t>(max_size, rec.size);
+    }
+    std::string filler(max_size, 'a');     // 抓包没有记录内容时，用等长的填充代替
+
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // 建立连接（不计入回放时间）
+    std::vector<Conn> conns(users.size());
+    int failed = 0;
+    for (size_t i = 0; i < users.size(); ++i) {
+        int sock = socket(PF_INET, SOCK_STREAM, 0);
+        sockaddr_in srv_addr{};
+        srv_addr.sin_family = AF_INET;
+        srv_addr.sin_addr.s_addr = inet_addr(ipstr.c_str());
+        srv_addr.sin_port = htons(std::stoi(portstr));
+
+        if (sock < 0 || connect(sock, (sockaddr *)&srv_addr, sizeof(srv_addr)) < 0
+            || !cli_handshake(sock, std::string(users[i]), conns[i].crypto)) {
+            if (sock >= 0) close(sock);
+            ++failed;
+            continue;
+        }
+        conns[i].sock = sock;
+    }
+
+    // 接收线程：统计收到的包数
+    int epfd = epoll_create1(0);
+    for (size_t i = 0; i < conns.size(); ++i) {
+        if (conns[i].sock < 0) continue;
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].sock, &ev);
+    }
+
+    std::atomic<long> recv_frames{0};
+    std::atomic<bool> sending_done{false};
+    std::thread receiver([&] {
+        std::vector<epoll_event> events(MAX_EVENTS);
+        auto last_recv = std::chrono::steady_clock::now();
+        while (1) {
+            int nfds = epoll_wait(epfd, events.data(), MAX_EVENTS, 100);
+            auto now = std::chrono::steady_clock::now();
+            if (nfds > 0) last_recv = now;
+            if (sending_done && now - last_recv > std::chrono::milliseconds(IDLE_MS)) return;
+
+            for (int i = 0; i < nfds; ++i) {
+                Conn& c = conns[events[i].data.u64];
+                char buf[BUFSZ];
+                int len = recv(c.sock, buf, BUFSZ, 0);
+                if (len <= 0) {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, c.sock, nullptr);
+                    continue;
+                }
+                c.recvbuf.append(buf, len);
+                recv_frames += count_frames(c);
+            }
+        }
+    });
+
+    // 按时间线回放
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    uint64_t first_ts = recs.front().ts_us;
+    double max_lag_ms = 0;
+    long sent = 0, skipped = 0;
+    std::string pck;
+
+    for (const CapRecord& rec : recs) {
+        if (speed > 0) {
+            auto target = start + std::chrono::microseconds(static_cast<int64_t>((rec.ts_us - first_ts) / speed));
+            auto now = clock::now();
+            if (now < target) std::this_thread::sleep_until(target);
+            else max_lag_ms = std::max(max_lag_ms, std::chrono::duration<double, std::milli>(now - target).count());
+        }
+
+        Conn& c = conns[user_idx[rec.from]];
+        if (c.sock < 0) {
+            ++skipped;
+            continue;
+        }
+
+        const char* msg = rec.payload.empty() ? filler.data() : rec.payload.data();
+        pck.clear();
+        if (!append_msg(c.crypto, pck, rec.to, msg, rec.size)) {
+            ++skipped;
+            continue;
+        }
+        try {
+            Send(c.sock, pck.data(), pck.size());
+            ++sent;
+        } catch (const std::exception& e) {
+            ++skipped;
+        }
+    }
+    auto end = clock::now();
+    sending_done = true;
+    receiver.join();
+
+    double replay_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    double span_ms = (recs.back().ts_us - first_ts) / 1000.0;
+    long connected = static_cast<long>(users.size()) - failed;
+
+    std::cout << "----------------------------------------\n";
+    std::cout << "Capture Records : " << recs.size() << "\n";
+    std::cout << "Users           : " << users.size() << " (failed handshakes: " << failed << ")\n";
+    std::cout << "Speed           : " << (speed > 0 ? std::format("{}x", speed) : std::string("max")) << "\n";
+    std::cout << "Capture Span    : " << std::format("{:.1f}", span_ms) << " ms\n";
+    std::cout << "Replay Time     : " << std::format("{:.1f}", replay_ms) << " ms\n";
+    std::cout << "Replay Rate     : " << std::format("{:.2f}", replay_ms > 0 ? sent / (replay_ms / 1000.0) : 0) << " msgs/sec\n";
+    std::cout << "Max Lag         : " << std::format("{:.3f}", max_lag_ms) << " ms\n";
+    std::cout << "Sent / Skipped  : " << sent << " / " << skipped << "\n";
+    std::cout << "Received Msgs   : " << recv_frames - connected << " (excluding welcome)\n";
+    std::cout << "----------------------------------------\n";
+
+    for (Conn& c : conns) if (c.sock >= 0) close(c.sock);
+    close(epfd);
+    return 0;
+}
+
+
+// ==================== 工具函数实现 ====================
+inline bool append_msg(const Crypto& crypto, std::string& out, std::string_view to, const char* msg, size_t msglen) {
+    size_t at = out.size();
+    out.resize(at + frame_len(to.size(), msglen));
+    try {
+        build_frame(reinterpret_cast<unsigned char*>(out.data() + at), to_bytes(to), to_bytes({msg, msglen}), 
+            [&crypto](const unsigned char* plain, size_t len, unsigned char* p) { return crypto.aes_encrypt(plain, len, p); });
+    } catch (const std::exception& e) {
+        std::cerr << "AES encrypt: " << e.what() << std::endl;
+        out.resize(at);
+        return false;
+    }
+    return true;
+}
+
+
+// 只数包，不解密
+inline int count_frames(Conn& c) {
+    int cnt = 0;
+    size_t used = for_each_frame(to_bytes(c.recvbuf), [&cnt](bytes_view) { ++cnt; });
+    if (used) c.recvbuf.erase(0, used);
+    return cnt;
+}
@@ -0,0 +1,246 @@
+#ifndef RESULTS_H
+#define RESULTS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <utility>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <format>
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+
+// ==================== 结果文件 ====================
+// 压测结果写成两层的 JSON ：{"<分组>": {"<指标>": 数值或字符串, ...}, ...} ，分组有 config 、env 、results 、server 。
+// 对比时把数值展平为 "<分组>.<指标>" ，只比较 results 和 server 两组，方向按指标名判断：
+//   以 _ms 结尾、错误计数（nacked / lost / failed）、server 的 CPU 和内存：越小越好；
+//   qps 、以 _rate 结尾：越大越好；
+//   其余（如总条数）只列出，不参与判定。以 max_ms 结尾的抖动太大，默认也不参与判定；
+//   参与判定的指标在本次结果里没有也算回退。config 组不比较数值，但与基线不同时给出警告
+// 只有头文件，不引入 JSON 库：写出的格式是固定的，读入的解析器只认这种两层结构
+
+class Results {
+  private:
+    // 每个分组按加入的先后保存，值是已经转成 JSON 字面量的字符串
+    std::vector<std::pair<std::string, std::vector<std::pair<std::string, std::string>>>> sections;
+
+    std::vector<std::pair<std::string, std::string>>& section(std::string_view name) {
+        for (auto& [n, kv] : sections) {
+            if (n == name) return kv;
+        }
+        return sections.emplace_back(std::string(name), std::vector<std::pair<std::string, std::string>>{}).second;
+    }
+
+    static std::string quote(std::string_view s) {
+        std::string out = "\"";
+        for (char ch : s) {
+            switch (ch) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20) out += std::format("\\u{:04x}", ch);
+                else out += ch;
+            }
+        }
+        return out + '"';
+    }
+
+  public:
+    void num(std::string_view sec, std::string_view key, double v) {
+        section(sec).emplace_back(std::string(key), std::isfinite(v) ? std::format("{}", v) : "null");
+    }
+
+    void str(std::string_view sec, std::string_view key, std::string_view v) {
+        section(sec).emplace_back(std::string(key), quote(v));
+    }
+
+    bool empty() const { return sections.empty(); }
+
+    std::string json() const {
+        std::string out = "{\n";
+        for (size_t i = 0; i < sections.size(); ++i) {
+            out += std::format("  {}: {{\n", quote(sections[i].first));
+            const auto& kv = sections[i].second;
+            for (size_t j = 0; j < kv.size(); ++j) {
+                out += std::format("    {}: {}{}\n", quote(kv[j].first), kv[j].second, j + 1 < kv.size() ? "," : "");
+            }
+            out += std::format("  }}{}\n", i + 1 < sections.size() ? "," : "");
+        }
+        return out + "}\n";
+    }
+
+    bool save(const std::string& path) const {
+        std::ofstream f(path, std::ios::trunc);
+        f << json();
+        return static_cast<bool>(f.flush());
+    }
+};
+
+
+// 解析 Results::json() 写出的文本，数值展平为 "<分组>.<指标>" 放进 nums ，字符串放进 strs ，null 跳过。
+// 格式不对返回 false ，err 以 name 开头
+inline bool parse_results(const std::string& s, const std::string& name, std::map<std::string, double>& nums,
+                          std::map<std::string, std::string>& strs, std::string& err) {
+    size_t i = 0;
+
+    auto ws = [&] { while (i < s.size() && isspace(static_cast<unsigned char>(s[i]))) ++i; };
+    auto eat = [&](char ch) {
+        ws();
+        if (i < s.size() && s[i] == ch) return ++i, true;
+        return false;
+    };
+    auto string_lit = [&](std::string& out) {
+        ws();
+        if (i >= s.size() || s[i] != '"') return false;
+        out.clear();
+        for (++i; i < s.size() && s[i] != '"'; ++i) {
+            if (s[i] == '\\' && i + 1 < s.size()) {
+                ++i;
+                if (s[i] == 'u') i += 4, out += '?';     // 名字里不会有，原样占位
+                else out += s[i] == 'n' ? '\n' : s[i] == 't' ? '\t' : s[i];
+            } else {
+                out += s[i];
+            }
+        }
+        return i++ < s.size();
+    };
+
+    // 逐个读 "<分组>": { "<指标>": 值, ... }
+    std::string sec, key, sval;
+    auto fail = [&](const char* what) {
+        err = std::format("{}: {} at offset {}", name, what, i);
+        return false;
+    };
+    if (!eat('{')) return fail("expected '{'");
+    if (eat('}')) return true;
+    do {
+        if (!string_lit(sec) || !eat(':') || !eat('{')) return fail("expected section");
+        if (eat('}')) continue;
+        do {
+            if (!string_lit(key) || !eat(':')) return fail("expected key");
+            ws();
+            if (i < s.size() && s[i] == '"') {
+                if (!string_lit(sval)) return fail("bad string");
+                strs[sec + '.' + key] = sval;
+            } else if (s.compare(i, 4, "null") == 0) {
+                i += 4;
+            } else {
+                const char* begin = s.c_str() + i;
+                char* end;
+                double v = strtod(begin, &end);
+                if (end == begin) return fail("expected value");
+                i += end - begin;
+                nums[sec + '.' + key] = v;
+            }
+        } while (eat(','));
+        if (!eat('}')) return fail("expected '}'");
+    } while (eat(','));
+    if (!eat('}')) return fail("expected '}'");
+    return true;
+}
+
+
+// 读入结果文件，同 parse_results
+inline bool load_results(const std::string& path, std::map<std::string, double>& nums, std::map<std::string, std::string>& strs,
+                         std::string& err) {
+    std::ifstream f(path);
+    if (!f) {
+        err = "cannot open " + path;
+        return false;
+    }
+    std::stringstream ss;
+    ss << f.rdbuf();
+    return parse_results(ss.str(), path, nums, strs, err);
+}
+
+
+// 指标的方向：1 越大越好，-1 越小越好，0 不参与判定
+inline int metric_direction(std::string_view key) {
+    if (!key.starts_with("results.") && !key.starts_with("server.")) return 0;
+    std::string_view name = key.substr(key.find('.') + 1);
+    if (key.starts_with("server.")) return name.starts_with("cpu") || name.starts_with("rss") || name.starts_with("hwm") || name.starts_with("bytes") ? -1 : 0;
+    if (name == "qps" || name.ends_with("_rate") || name.ends_with("_qps")) return 1;
+    if (name.ends_with("_ms") || name.ends_with("nacked") || name.ends_with("lost") || name.ends_with("failed") || name.ends_with("errors")) return -1;
+    return 0;
+}
+
+
+// 两次的压测配置（config 组）不同时逐项警告，返回不同的项数。配置不同时比较的结果未必有意义
+inline int warn_config_diff(const std::map<std::string, double>& base_nums, const std::map<std::string, std::string>& base_strs,
+                            const std::map<std::string, double>& cur_nums, const std::map<std::string, std::string>& cur_strs) {
+    // 数值也转成字符串，便于一起比较
+    auto config = [](const std::map<std::string, double>& nums, const std::map<std::string, std::string>& strs) {
+        std::map<std::string, std::string> out;
+        for (const auto& [key, v] : nums) {
+            if (key.starts_with("config.")) out[key] = std::format("{}", v);
+        }
+        for (const auto& [key, v] : strs) {
+            if (key.starts_with("config.")) out[key] = std::format("\"{}\"", v);
+        }
+        return out;
+    };
+    auto b = config(base_nums, base_strs), c = config(cur_nums, cur_strs);
+
+    int diffs = 0;
+    auto warn = [&diffs](const std::string& key, const std::string& bv, const std::string& cv) {
+        std::cout << std::format("Warning: {} differs: baseline {}, current {}\n", key, bv, cv);
+        ++diffs;
+    };
+    for (const auto& [key, v] : b) {
+        auto it = c.find(key);
+        if (it == c.end()) warn(key, v, "(none)");
+        else if (it->second != v) warn(key, v, it->second);
+    }
+    for (const auto& [key, v] : c) {
+        if (!b.contains(key)) warn(key, "(none)", v);
+    }
+    return diffs;
+}
+
+
+// 逐项比较 base 和 cur ，打印变化；参与判定的指标变差超过阈值（百分比），或本次结果里没有，即为回退。
+// thresholds 按指标名（不含分组）覆盖默认阈值，负数表示不判定。返回回退的项数
+inline int compare_results(const std::map<std::string, double>& base, const std::map<std::string, double>& cur,
+                           double max_regress, const std::map<std::string, double>& thresholds) {
+    int regressions = 0;
+    std::cout << std::format("{:<28} {:>14} {:>14} {:>9}  {}\n", "Metric", "Baseline", "Current", "Change", "Verdict");
+    for (const auto& [key, b] : base) {
+        int dir = metric_direction(key);
+        if (!dir) continue;
+
+        std::string_view name = std::string_view(key).substr(key.find('.') + 1);
+        double limit = name.ends_with("max_ms") ? -1 : max_regress;
+        auto t = thresholds.find(std::string(name));
+        if (t != thresholds.end()) limit = t->second;
+
+        auto it = cur.find(key);
+        if (it == cur.end()) {
+            // 参与判定的指标不见了（如改动后这项没有输出），不能当作没变差
+            if (limit < 0) continue;
+            ++regressions;
+            std::cout << std::format("{:<28} {:>14.3f} {:>14} {:>9}  {}\n", key, b, "-", "-", "MISSING");
+            continue;
+        }
+        double c = it->second;
+
+        // 变差的百分比：基线为 0 的计数只要变大就算回退
+        double change = b != 0 ? (c - b) / std::fabs(b) * 100 : (c != 0 ? INFINITY : 0);
+        double worse = dir > 0 ? -change : change;
+        bool regressed = limit >= 0 && worse > limit;
+        regressions += regressed;
+
+        std::cout << std::format("{:<28} {:>14.3f} {:>14.3f} {:>8.1f}%  {}\n", key, b, c, change,
+            limit < 0 ? "-" : regressed ? "REGRESSED" : worse < -limit ? "improved" : "ok");
+    }
+    std::cout << std::format("Verdict: {} ({} regression{}, threshold {:.1f}%)\n", regressions ? "FAIL" : "PASS",
+        regressions, regressions == 1 ? "" : "s", max_regress);
+    return regressions;
+}
+
+#endif // RESULTS_H
@@ -1,4 +1,6 @@
 #include "crypto.h"
+#include "proto.h"
+#include "results.h"
 
 #include <iostream>
 #include <cstring>
@@ -7,109 +9,635 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <sys/select.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <stdexcept>
 #include <chrono>
 #include <vector>
 #include <numeric>
+#include <atomic>
+#include <ctime>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/utsname.h>
+#include <fstream>
+#include <map>
+#include <sys/resource.h>
 
-#define BUFSZ 1024
+#define BUFSZ 65536
+#define LAT_SUB 16                      // 每个 2 的幂区间再细分的档数，相对误差约 1/16
+#define LAT_BUCKETS (40 * LAT_SUB)      // 覆盖到 2^40 us ，足够了
+#define MAX_MSG_LEN (1 << 20)           // 按分布抽取的消息长度的上限
+#define FLEET_DRAIN_MS 5000             // 工作负载模式：发完后这么久没有新的投递就不再等
 
 Crypto crypto{};
 int LOOPS;          // 每个子进程发送多少次消息。由于 [1] 和 [2] ，值应当适中
-std::string msg;    // 发送的消息
+int WINDOW = 1;     // 每个连接同时在途的消息数上限
+int HEAVY = 0;      // 前 HEAVY 个连接是 “重” 用户，以 HEAVY_WINDOW 条在途的速度猛发，用于观察限速下轻重用户是否公平
+int HEAVY_WINDOW = 64;
+int BCAST = 0;      // 广播模式：user_0 向所有人广播 BCAST 条，其余连接只收。服务端需以 --admin user_0 启动
+int STORM = 0;      // 连接风暴模式：各进程合计完成 STORM 次握手，只测握手
+double STORM_RATE = 0;      // 所有进程合计每秒发起多少次连接，0 表示尽快
+bool STORM_KEEP = false;    // 握手完成后不断开，所有进程都做完后再一起关闭（否则断开后立即重连）
+int STORM_HOLD = 0;         // 保持连接时，全部握手完成后再保持这么多秒才关闭，便于观察服务端
+std::string UNIX_PATH;      // 改走服务端的 Unix 域 socket ，IP 和端口参数不起作用
+bool PLAIN = false;         // 经 Unix 域 socket 连接时请求不加密（服务端需以 --unix-plain 启动）
+int SRC_IPS = 0;            // 连接本机时轮流从 127.0.1.1 ~ 127.0.1.N 发起，每个源地址各有一套本地端口，突破单个地址约 28K 个连接的限制
+std::string msg;    // 发送的消息（按分布抽取长度时为最长的那条，取前缀）
+
+// 工作负载：收件人、消息长度的分布，空闲连接，突发
+enum class ToMode { Self, Uniform, Zipf };
+ToMode TO_MODE = ToMode::Self;  // 默认发给自己；否则在所有连接中抽取收件人
+double ZIPF_S = 1.0;            // Zipf 分布的指数， user_0 最热
+std::vector<double> zipf_cdf;
+enum class SizeMode { Fixed, Uniform, Exp };
+SizeMode SIZE_MODE = SizeMode::Fixed;
+size_t SIZE_A = 0, SIZE_B = 0;  // Fixed: 长度；Uniform: [A, B]；Exp: 均值 A
+double IDLE = 0;                // 空闲连接（只登录、收消息，不发）的比例，取序号最大的那些
+int IDLE_CONNS = 0, TOTAL_CONNS = 0;
+int BURST = 0, BURST_GAP_MS = 0;    // 每发 BURST 条停 BURST_GAP_MS 毫秒，0 表示不停
+bool FLEET = false;             // 发给别人或有空闲连接时为真：所有连接登录后一起开始，发完后继续收，由主进程宣布结束
+
+// 结果文件与基线对比
+std::string JSON_OUT;           // 结果写到这个文件
+std::string BASELINE;           // 跑完后与这个结果文件比较，有回退时退出码为 2
+double MAX_REGRESS = 10;        // 默认允许变差的百分比
+std::map<std::string, double> THRESHOLDS;  // 按指标名覆盖 MAX_REGRESS
+pid_t SERVER_PID = 0;           // 同机的服务端进程，压测前后采样它的 CPU 时间和内存
+double SERVER_CPU0 = -1;
+Results res;
+
+
+// ==================== 跨进程统计 ====================
+// fork 之前 mmap 一块共享内存，子进程直接原子累加，父进程等子进程全部退出后汇总。轻、重用户分开统计
+struct SharedStats {
+    std::atomic<uint64_t> acked, nacked, lost;      // 已确认 / 服务端拒绝 / 连接断开时仍未完成
+    std::atomic<uint64_t> rtt_sum_us, rtt_max_us;
+    std::atomic<uint64_t> rtt_hist[LAT_BUCKETS];    // 往返时延的对数直方图
+    std::atomic<uint64_t> busy_us;                  // 各连接压测阶段耗时之和，用于算每个连接的平均吞吐
+    std::atomic<uint64_t> key_updates;              // 服务端发起、已回应的密钥更新
+    std::atomic<uint64_t> key_errors;               // 处理不了的密钥更新和解不开的消息，不为 0 说明之后的投递没算进去
+};
+
+SharedStats* shared_stats;  // [0] 轻用户， [1] 重用户
+SharedStats* stats;         // 子进程所属的那一组
+
+// 广播模式另外的共享数据。投递时延按收件人收到第 k 条广播的时刻减去第 k 条的发出时刻：服务端对每个收件人保持群发的先后顺序
+struct BcastShared {
+    std::atomic<int> ready;                     // 已登录、等待广播的收件人数
+    std::atomic<uint64_t> delivered;
+    std::atomic<uint64_t> last_ns;              // 最后一个收件人收完的时刻
+    uint64_t start_ns;                          // 第一条广播的发出时刻
+    uint64_t sent_ns[];                         // 第 k 条广播的发出时刻（steady_clock ，跨进程可比）
+};
+
+BcastShared* bcast;
+
+// 连接风暴模式的共享统计。每次握手分三段计时：TCP 连接、密钥交换（发用户名到发出自己的公钥）、等到欢迎语
+#define STORM_TIMEOUT 10        // 单次握手中任何一步超过这么多秒即算失败
+enum { PH_CONNECT, PH_KEX, PH_WELCOME, PH_TOTAL, PH_N };
+
+struct LatStats {
+    std::atomic<uint64_t> sum_us, max_us;
+    std::atomic<uint64_t> hist[LAT_BUCKETS];
+};
+
+struct StormShared {
+    std::atomic<uint64_t> ok;
+    std::atomic<uint64_t> failed[PH_TOTAL];     // 失败在哪一段
+    std::atomic<uint64_t> last_ns;              // 最后一次握手结束的时刻
+    uint64_t start_ns;
+    LatStats phase[PH_N];
+    std::atomic<int> done, release;             // 保持连接时：做完自己那份的进程数；主进程采样完服务端后通知关闭
+};
+
+StormShared* storm;
+
+// 工作负载模式的共享数据。投递时延 = 收件人收到的时刻 - 发送者写进消息开头的发出时刻（steady_clock ，跨进程可比）
+struct FleetShared {
+    std::atomic<int> ready, login_failed, senders_done;
+    std::atomic<int> go, stop;
+    std::atomic<uint64_t> delivered;
+    std::atomic<uint64_t> last_ns;              // 最后一次投递或发送者收完确认的时刻
+    uint64_t start_ns;                          // 所有连接登录完毕的时刻
+    LatStats delivery;
+};
+
+FleetShared* fleet;
 
 
 // ==================== 工具函数声明 ====================
-inline void send_msg(int sock, const std::string& to, const std::string& msg);
-inline void process_msg(const char* buf, int len, std::string& from, std::string& msg);
+inline bool append_msg(std::string& out, uint32_t seq, std::string_view to, std::string_view msg);
+
+// 处理服务端发起的密钥更新（同 cli ）：换成新密钥，需要回应的追加到 reply
+inline void handle_key_update(const FrameView& f, std::string& reply);
+
+// 按配置的分布抽取收件人序号、消息长度
+inline int pick_rcpt(std::mt19937_64& rng);
+inline size_t pick_size(std::mt19937_64& rng);
+
+// 解析 --to / --sizes / --burst 的参数，格式不对返回 false
+bool parse_to(const char* s);
+bool parse_sizes(const char* s);
+bool parse_burst(const char* s);
+
+// 往返时延（微秒）与直方图档位的互相换算
+inline int lat_bucket(uint64_t us);
+inline uint64_t bucket_upper(int b);
+
+// 直方图的第 p 分位数（微秒）
+uint64_t percentile(const uint64_t* hist, uint64_t total, double p);
+// 同上，换算为毫秒。档位上界可能超过实际的最大值，不超过 max_us 。输出和结果文件都用它，两边一致
+double percentile_ms(const uint64_t* hist, uint64_t total, double p, uint64_t max_us);
 
 void Send(int sock, const char* sp, int len);
 void send_for_ka(int sock, const unsigned char* vp, int len);
 void recv_for_ka(int sock, std::vector<unsigned char>& vp, int& len);
+bool cli_handshake(int sock, const std::string& username, Crypto& crypto, bool plain = false);
 
+// 连接、握手并收完欢迎语，失败返回 -1 。欢迎语之后多收的数据留在 recvbuf
+int login(const std::string& ip, const std::string& port, const std::string& username, std::string& recvbuf);
+int open_socket();      // 按 --unix 建 TCP 或 Unix 域 socket
+bool connect_to(int sock, const std::string& ip, const std::string& port);
 
-// ==================== 子进程 ====================
-void task(const std::string& ip, const std::string& port, const std::string& username) {
-    int sock = socket(PF_INET, SOCK_STREAM, 0);
-    if (sock < 0) _exit(1);     // exit() 会默认刷缓冲区
+inline uint64_t now_ns();
 
-    sockaddr_in srv_addr{};
-    srv_addr.sin_family = AF_INET;
-    srv_addr.sin_addr.s_addr = inet_addr(ip.c_str());
-    srv_addr.sin_port = htons(std::stoi(port));
+// 记录运行环境：核数、内核、CPU 型号、主机名、时间
+void record_env();
 
-    if (connect(sock, (sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) {
-        close(sock);
-        _exit(1);
-    }
+// 进程累计的 CPU 时间（毫秒）、/proc/<pid>/status 里某一项（kB），读不到返回 -1
+double proc_cpu_ms(pid_t pid);
+long proc_status_kb(pid_t pid, const char* field);
 
-    char buf[BUFSZ];
+// 把直方图的平均值和分位数（毫秒）记为 <prefix>_avg_ms 、 <prefix>_p50_ms 等
+void record_lat(const std::string& prefix, const uint64_t* hist, uint64_t n, uint64_t sum_us, uint64_t max_us);
 
+// 收尾：采样服务端、写结果文件、与基线比较。work 为本次完成的消息数或握手数，unit 为它的名字
+int finish(int ret, double work, const char* unit);
+
+// 把一个时延记进直方图、总和与最大值
+inline void add_lat(std::atomic<uint64_t>* hist, std::atomic<uint64_t>& sum, std::atomic<uint64_t>& mx, uint64_t us);
+
+
+// ==================== 子进程 ====================
+void task(const std::string& ip, const std::string& port, int idx, int window) {
     // ------------------------------
     // 由于连接初始化这部分在服务器端是阻塞调用，所以 LOOPS 不能太大，否则会掩盖这个缺点    [2]
     // ------------------------------
 
     // 初始化连接阶段（不计入 QPS 统计）
-    send_for_ka(sock, reinterpret_cast<const unsigned char*>(username.c_str()), username.length());
-    vecuc srv_pubkey;
-    int len;
-    recv_for_ka(sock, srv_pubkey, len);
-    if (len <= 0) {
-        close(sock);
-        _exit(1);
+    std::string username = "user_" + std::to_string(idx), recvbuf;
+    int sock = login(ip, port, username, recvbuf);
+
+    // 工作负载模式：所有连接登录后才一起开始，否则先开始的会发给还没登录的人。登录失败的也要报到
+    if (FLEET) {
+        if (sock < 0) fleet->login_failed.fetch_add(1);
+        if (fleet->ready.fetch_add(1) + 1 == TOTAL_CONNS) fleet->start_ns = now_ns(), fleet->go = 1;
+        while (!fleet->go) usleep(1000);
+    }
+    if (sock < 0) {
+        if (FLEET && idx < TOTAL_CONNS - IDLE_CONNS) fleet->senders_done.fetch_add(1);
+        _exit(1);     // exit() 会默认刷缓冲区
     }
 
-    try {
-        crypto.generate_ecdh_keypr();
-        vecuc cli_pubkey = crypto.get_ecdh_pubkey();
-        crypto.set_peer_ecdh_pubkey(srv_pubkey);
-        
-        static const vecuc fixed_salt = {0x11, 0x45, 0x14, 0x19, 0x19, 0x81, 0x0f, 0x91, 
-                                        0x0d, 0x00, 0x07, 0x21, 0xc1, 0x2a, 0xc1, 0x01};
-        crypto.derive_shared_secret(&fixed_salt);
-        
-        send_for_ka(sock, cli_pubkey.data(), cli_pubkey.size());
-        len = recv(sock, buf, BUFSZ - 1, 0);
+    char buf[BUFSZ];
+    const int loops = idx < TOTAL_CONNS - IDLE_CONNS ? LOOPS : 0;  // 空闲连接只收不发
+    const bool cross = TO_MODE != ToMode::Self;
+
+    // 收件人和消息长度按连接的序号播种，同样的参数每次生成同样的负载
+    std::mt19937_64 rng(idx * 7919 + 1);
+    std::string to = username, body;
+
+    // 取出 recvbuf 中所有完整的包：确认交给 on_ack ，其余（消息、欢迎语）交给 on_msg ，密钥更新就地回应
+    std::string reply;
+    auto drain = [&](auto&& on_ack, auto&& on_msg) {
+        size_t used = for_each_frame(to_bytes(recvbuf), [&](bytes_view pck) {
+            FrameView f;
+            if (!parse_frame(pck, f)) return;
+            if (f.type == FT_ACK) on_ack(f.seq, f.status);
+            else if (f.type == FT_KEY_UPDATE) handle_key_update(f, reply);
+            else if (f.type == 0) on_msg(f);
+        });
+        if (used) recvbuf.erase(0, used);
+        if (!reply.empty()) {
+            try {
+                Send(sock, reply.c_str(), reply.length());
+            } catch (...) {}
+            reply.clear();
+        }
+    };
+
+    // 压测阶段：保持最多 WINDOW 条消息在途。
+    // 发给自己时：服务端按发送顺序路由、按序回确认和投递，所以收到的第 k 条回显就是第 k 条没被拒绝的消息，以回显计往返时延；
+    // 发给别人时：以确认计往返时延，收到的消息解密出开头的发送时刻，计投递时延
+    using clock = std::chrono::steady_clock;
+    std::vector<clock::time_point> sent_at(loops + 1);
+    std::vector<char> rejected(loops + 1);
+    uint32_t sent = 0, next_echo = 1;
+    int completed = 0, unsuccessful_cnt = 0, burst_left = BURST;
+    std::string pck;
+    auto test_start = clock::now(), burst_until = test_start;
+
+    auto add_rtt = [&](clock::time_point since) {
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - since).count();
+        add_lat(stats->rtt_hist, stats->rtt_sum_us, stats->rtt_max_us, us);
+    };
+
+    auto on_ack = [&](uint32_t seq, uint8_t status) {
+        if (seq == 0 || seq > sent) return;
+        if (ack_accepted(status)) {
+            stats->acked.fetch_add(1, std::memory_order_relaxed);
+            if (cross) ++completed, add_rtt(sent_at[seq]);
+            return;
+        }
+        rejected[seq] = 1;      // 这条不会有回显
+        ++completed, ++unsuccessful_cnt;
+        stats->nacked.fetch_add(1, std::memory_order_relaxed);
+    };
+
+    std::string plain;
+    auto on_msg = [&](const FrameView& f) {
+        if (!cross) {
+            while (next_echo <= sent && rejected[next_echo]) ++next_echo;
+            if (next_echo > sent) return;
+            add_rtt(sent_at[next_echo]);
+            ++next_echo, ++completed;
+            return;
+        }
+        plain.resize(f.c_b.size() - AES_OVERHEAD);
+        try {
+            plain.resize(crypto.aes_decrypt(f.c_b.data(), f.c_b.size(), reinterpret_cast<unsigned char*>(plain.data())));
+        } catch (const std::exception&) {
+            stats->key_errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (plain.size() < 8) return;
+        uint64_t t = now_ns(), s = get_u64(reinterpret_cast<const unsigned char*>(plain.data()));
+        add_lat(fleet->delivery.hist, fleet->delivery.sum_us, fleet->delivery.max_us, t > s ? (t - s) / 1000 : 0);
+        fleet->delivered.fetch_add(1, std::memory_order_relaxed);
+        uint64_t last = fleet->last_ns.load();
+        while (t > last && !fleet->last_ns.compare_exchange_weak(last, t)) {}
+    };
+
+    bool lost = false;
+    while (completed < loops) {
+        // 补满窗口，一次写出。突发模式下每发 BURST 条停 BURST_GAP_MS ，期间照常收
+        pck.clear();
+        auto now = clock::now();
+        while (sent < static_cast<uint32_t>(loops) && static_cast<int>(sent) - completed < window) {
+            if (BURST && !burst_left) {
+                if (now < burst_until) break;
+                burst_left = BURST;
+            }
+            ++sent;
+            sent_at[sent] = now;
+            if (cross) to = "user_" + std::to_string(pick_rcpt(rng));
+            size_t len = pick_size(rng);
+            body.assign(msg, 0, len);
+            if (cross) put_u64(reinterpret_cast<unsigned char*>(body.data()), now_ns());
+            append_msg(pck, sent, to, body);
+            if (BURST && !--burst_left) burst_until = now + std::chrono::milliseconds(BURST_GAP_MS);
+        }
+        if (!pck.empty()) {
+            try {
+                Send(sock, pck.c_str(), pck.length());
+            } catch (...) {}
+        }
+
+        // 窗口没满却停着，说明在突发的间隙，最多等到间隙结束
+        if (BURST && !burst_left && static_cast<int>(sent) - completed < window && sent < static_cast<uint32_t>(loops)) {
+            int wait = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(burst_until - clock::now()).count()) + 1;
+            pollfd pfd{sock, POLLIN, 0};
+            if (poll(&pfd, 1, std::max(wait, 0)) == 0) continue;
+        }
+
+        int len = recv(sock, buf, BUFSZ, 0);
         if (len <= 0) {
-            close(sock);
-            _exit(1);
+            unsuccessful_cnt += loops - completed;
+            stats->lost.fetch_add(loops - completed, std::memory_order_relaxed);
+            lost = true;
+            break;
         }
-    } catch (...) {
-        close(sock);
-        _exit(1);
-    }
-
-    // 压测阶段
-    auto start_test = std::chrono::high_resolution_clock::now();
-    int unsuccessful_cnt{};
-
-    for (int i = 0; i < LOOPS; ++i) {
-        send_msg(sock, username, msg);
-        
-        int totlen{};
-        while((size_t)totlen < msg.length()) {
-            int len = recv(sock, buf, BUFSZ - 1, 0);
-            if (len < 0) {
-                ++unsuccessful_cnt;
-                break;
+        recvbuf.append(buf, len);
+        drain(on_ack, on_msg);
+    }
+
+    if (FLEET && loops) {
+        uint64_t t = now_ns(), last = fleet->last_ns.load();
+        while (t > last && !fleet->last_ns.compare_exchange_weak(last, t)) {}
+    }
+    if (loops) {
+        stats->busy_us.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - test_start).count(),
+            std::memory_order_relaxed);
+    }
+
+    // 必须保证可用性。重用户被限速拒绝是预期之内的
+    if (unsuccessful_cnt > loops / 100 && stats == &shared_stats[0]) std::cerr << "1 PROC ERROR\n";
+
+    // 工作负载模式：发完后继续收别人发来的消息，直到主进程宣布结束
+    if (FLEET) {
+        if (loops) fleet->senders_done.fetch_add(1);
+        while (!lost && !fleet->stop) {
+            pollfd pfd{sock, POLLIN, 0};
+            if (poll(&pfd, 1, 100) <= 0) continue;
+            int len = recv(sock, buf, BUFSZ, 0);
+            if (len <= 0) break;
+            recvbuf.append(buf, len);
+            drain(on_ack, on_msg);
+        }
+    }
+
+    close(sock);
+    _exit(0);
+}
+
+// ==================== 广播模式 ====================
+// 发送者：等所有收件人登录后，保持最多 WINDOW 条在途，向 BROADCAST_TO 发 BCAST 条
+void bcast_send_task(const std::string& ip, const std::string& port, int receivers) {
+    std::string recvbuf;
+    int sock = login(ip, port, "user_0", recvbuf);
+    if (sock < 0) _exit(1);
+    while (bcast->ready.load() < receivers) usleep(10000);
+
+    char buf[BUFSZ];
+    std::string pck;
+    uint32_t sent = 0;
+    int completed = 0;
+    bcast->start_ns = now_ns();
+    while (completed < BCAST) {
+        pck.clear();
+        while (sent < static_cast<uint32_t>(BCAST) && static_cast<int>(sent) - completed < WINDOW) {
+            ++sent;
+            bcast->sent_ns[sent - 1] = now_ns();
+            append_msg(pck, sent, BROADCAST_TO, msg);
+        }
+        if (!pck.empty()) {
+            try {
+                Send(sock, pck.c_str(), pck.length());
+            } catch (...) {}
+        }
+
+        int len = recv(sock, buf, BUFSZ, 0);
+        if (len <= 0) {
+            stats->lost.fetch_add(BCAST - completed, std::memory_order_relaxed);
+            break;
+        }
+        recvbuf.append(buf, len);
+        pck.clear();
+        size_t used = for_each_frame(to_bytes(recvbuf), [&](bytes_view p) {
+            FrameView f;
+            if (!parse_frame(p, f)) return;
+            if (f.type == FT_KEY_UPDATE) handle_key_update(f, pck);
+            if (f.type != FT_ACK || f.seq == 0 || f.seq > sent) return;
+            ++completed;
+            if (f.status == ACK_OK) stats->acked.fetch_add(1, std::memory_order_relaxed);
+            else {
+                if (f.status == NACK_FORBIDDEN && completed == 1) std::cerr << "Broadcast forbidden: start the server with --admin user_0\n";
+                stats->nacked.fetch_add(1, std::memory_order_relaxed);
             }
-            totlen += len;
+        });
+        recvbuf.erase(0, used);
+        if (!pck.empty()) {
+            try {
+                Send(sock, pck.c_str(), pck.length());
+            } catch (...) {}
         }
     }
+    close(sock);
+    _exit(0);
+}
+
 
-    auto end_test = std::chrono::high_resolution_clock::now();
-    auto duration_us = std::chrono::duration_cast<std::chrono::microseconds>(end_test - start_test).count();
+// 收件人：登录后报到，然后收满 BCAST 条广播。超过 BCAST_TIMEOUT 秒收不到新数据就放弃
+#define BCAST_TIMEOUT 30
+void bcast_recv_task(const std::string& ip, const std::string& port, const std::string& username) {
+    std::string recvbuf;
+    int sock = login(ip, port, username, recvbuf);
+    if (sock < 0) _exit(1);
+    timeval tv{BCAST_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    bcast->ready.fetch_add(1);
 
-    if(unsuccessful_cnt > LOOPS / 100) std::cerr << "1 PROC ERROR\n";   // 必须保证可用性
+    char buf[BUFSZ];
+    int got = 0;
+    std::string reply;
+    while (1) {
+        size_t used = for_each_frame(to_bytes(recvbuf), [&](bytes_view p) {
+            FrameView f;
+            if (!parse_frame(p, f)) return;
+            if (f.type == FT_KEY_UPDATE) handle_key_update(f, reply);
+            if (f.type != 0 || got >= BCAST) return;
+            uint64_t t = now_ns(), s = bcast->sent_ns[got++];
+            uint64_t us = t > s ? (t - s) / 1000 : 0;
+            stats->rtt_hist[lat_bucket(us)].fetch_add(1, std::memory_order_relaxed);
+            stats->rtt_sum_us.fetch_add(us, std::memory_order_relaxed);
+            uint64_t mx = stats->rtt_max_us.load(std::memory_order_relaxed);
+            while (us > mx && !stats->rtt_max_us.compare_exchange_weak(mx, us, std::memory_order_relaxed)) {}
+        });
+        recvbuf.erase(0, used);
+        if (!reply.empty()) {
+            try {
+                Send(sock, reply.c_str(), reply.length());
+            } catch (...) {}
+            reply.clear();
+        }
+        if (got >= BCAST) break;
+
+        int len = recv(sock, buf, BUFSZ, 0);
+        if (len <= 0) break;
+        recvbuf.append(buf, len);
+    }
 
+    bcast->delivered.fetch_add(got, std::memory_order_relaxed);
+    uint64_t t = now_ns(), last = bcast->last_ns.load();
+    while (t > last && !bcast->last_ns.compare_exchange_weak(last, t)) {}
     close(sock);
     _exit(0);
 }
 
+
+// ==================== 连接风暴模式 ====================
+// 第 id 个进程负责第 id, id + nprocs, ... 次握手；限速时第 k 次握手在 start + k / STORM_RATE 发起，落后了就立即发起
+void storm_task(const std::string& ip, const std::vector<std::string>& ports, int id, int nprocs) {
+    std::vector<int> kept;
+    char buf[BUFSZ];
+    for (int k = id; k < STORM; k += nprocs) {
+        if (STORM_RATE > 0) {
+            uint64_t due = storm->start_ns + static_cast<uint64_t>(k / STORM_RATE * 1e9), now = now_ns();
+            if (due > now) {
+                timespec ts{static_cast<time_t>((due - now) / 1000000000), static_cast<long>((due - now) % 1000000000)};
+                nanosleep(&ts, nullptr);
+            }
+        }
+
+        uint64_t t[PH_N + 1];
+        int ph = PH_CONNECT;
+        t[0] = now_ns();
+        int sock = open_socket();
+        bool ok = sock >= 0;
+        if (ok) {
+            timeval tv{STORM_TIMEOUT, 0};
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            if (SRC_IPS && UNIX_PATH.empty()) {
+                // 本地端口推迟到 connect 时按四元组分配，否则 bind 就会占住端口，换源地址也没用
+                int one = 1;
+                setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+                sockaddr_in src{};
+                src.sin_family = AF_INET;
+                src.sin_addr.s_addr = htonl(0x7f000100u + 1 + k % SRC_IPS);
+                ok = bind(sock, (sockaddr *)&src, sizeof(src)) == 0;
+            }
+            ok = ok && connect_to(sock, ip, ports[k % ports.size()]);
+        }
+        if (ok) {
+            t[++ph] = now_ns();
+            Crypto c{};
+            ok = cli_handshake(sock, std::format("storm_{}", k), c, PLAIN);
+        }
+        if (ok) {
+            t[++ph] = now_ns();
+            // 等到第一个普通帧（欢迎语），只数包，不解密
+            std::string recvbuf;
+            bool welcomed = false;
+            while (!welcomed) {
+                int len = recv(sock, buf, BUFSZ, 0);
+                if (len <= 0) break;
+                recvbuf.append(buf, len);
+                size_t used = for_each_frame(to_bytes(recvbuf), [&](bytes_view pck) {
+                    FrameView f;
+                    if (parse_frame(pck, f) && f.type == 0) welcomed = true;
+                });
+                recvbuf.erase(0, used);
+            }
+            ok = welcomed;
+        }
+
+        if (!ok) {
+            storm->failed[ph].fetch_add(1, std::memory_order_relaxed);
+        } else {
+            t[++ph] = now_ns();
+            for (int p = PH_CONNECT; p < PH_TOTAL; ++p) {
+                add_lat(storm->phase[p].hist, storm->phase[p].sum_us, storm->phase[p].max_us, (t[p + 1] - t[p]) / 1000);
+            }
+            add_lat(storm->phase[PH_TOTAL].hist, storm->phase[PH_TOTAL].sum_us, storm->phase[PH_TOTAL].max_us, (t[PH_TOTAL] - t[0]) / 1000);
+            storm->ok.fetch_add(1, std::memory_order_relaxed);
+            uint64_t last = storm->last_ns.load();
+            while (t[PH_TOTAL] > last && !storm->last_ns.compare_exchange_weak(last, t[PH_TOTAL])) {}
+        }
+
+        if (sock < 0) continue;
+        if (ok && STORM_KEEP) {
+            kept.push_back(sock);
+            continue;
+        }
+        // 以 RST 断开，本端不留 TIME_WAIT ，否则循环重连很快会用完本地端口
+        linger lg{1, 0};
+        setsockopt(sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        close(sock);
+    }
+    if (STORM_KEEP) {
+        storm->done.fetch_add(1);
+        while (!storm->release.load()) usleep(10000);
+    }
+    for (int sock : kept) close(sock);
+    _exit(0);
+}
+
+
 // ==================== 主函数 ====================
 int main(int argc, char* argv[]) {
+    static const option long_opts[] = {
+        {"inflight", required_argument, nullptr, 'w'},
+        {"heavy", required_argument, nullptr, 'h'},
+        {"heavy-inflight", required_argument, nullptr, 'W'},
+        {"broadcast", required_argument, nullptr, 'B'},
+        {"storm", required_argument, nullptr, 's'},
+        {"storm-rate", required_argument, nullptr, 'S'},
+        {"storm-keep", no_argument, nullptr, 'k'},
+        {"to", required_argument, nullptr, 'T'},
+        {"sizes", required_argument, nullptr, 'z'},
+        {"idle", required_argument, nullptr, 'i'},
+        {"burst", required_argument, nullptr, 'b'},
+        {"json", required_argument, nullptr, 'j'},
+        {"baseline", required_argument, nullptr, 'J'},
+        {"compare", required_argument, nullptr, 'C'},
+        {"max-regress", required_argument, nullptr, 'R'},
+        {"threshold", required_argument, nullptr, 't'},
+        {"server-pid", required_argument, nullptr, 'p'},
+        {"hold", required_argument, nullptr, 'H'},
+        {"src-ips", required_argument, nullptr, 'I'},
+        {"unix", required_argument, nullptr, 'U'},
+        {"plain", no_argument, nullptr, 'P'},
+        {nullptr, 0, nullptr, 0},
+    };
+    auto usage = [&]() {
+        std::cerr << std::format("Usage: {} [Clients] [Loops] [Length] [Server IP] [Server Port(s)] [--inflight <Msgs in flight>]\n"
+                                 "    [--heavy <Heavy clients> [--heavy-inflight <Msgs in flight>]]\n"
+                                 "    [--to self|uniform|zipf[:<Exponent>]] [--sizes uniform:<Min>-<Max>|exp:<Mean>]\n"
+                                 "    [--idle <Fraction>] [--burst <Msgs>:<Gap ms>]\n"
+                                 "    [--broadcast <Broadcasts>] [--storm <Handshakes> [--storm-rate <Conns/s>] [--storm-keep [--hold <Secs>]]]\n"
+                                 "    [--src-ips <N>] [--unix <Socket path> [--plain]]\n"
+                                 "    [--json <File>] [--baseline <File>] [--max-regress <Percent>] [--threshold <Metric>=<Percent>]...\n"
+                                 "    [--server-pid <Pid>]\n"
+                                 "       {} --compare <File> --baseline <File> [--max-regress <Percent>] [--threshold <Metric>=<Percent>]...", argv[0], argv[0]) << std::endl;
+        exit(1);
+    };
+    int c;
+    std::string compare;
+    while ((c = getopt_long(argc, argv, "w:h:W:B:s:S:kT:z:i:b:j:J:C:R:t:p:H:I:U:P", long_opts, nullptr)) != -1) {
+        switch (c) {
+        case 'w': WINDOW = std::max(1, atoi(optarg)); break;
+        case 'h': HEAVY = std::max(0, atoi(optarg)); break;
+        case 'W': HEAVY_WINDOW = std::max(1, atoi(optarg)); break;
+        case 'B': BCAST = std::max(0, atoi(optarg)); break;
+        case 's': STORM = std::max(0, atoi(optarg)); break;
+        case 'S': STORM_RATE = std::max(0.0, atof(optarg)); break;
+        case 'k': STORM_KEEP = true; break;
+        case 'T': if (!parse_to(optarg)) usage(); break;
+        case 'z': if (!parse_sizes(optarg)) usage(); break;
+        case 'i': IDLE = std::clamp(atof(optarg), 0.0, 1.0); break;
+        case 'b': if (!parse_burst(optarg)) usage(); break;
+        case 'j': JSON_OUT = optarg; break;
+        case 'J': BASELINE = optarg; break;
+        case 'C': compare = optarg; break;
+        case 'R': MAX_REGRESS = atof(optarg); break;
+        case 't': {
+            const char* eq = strchr(optarg, '=');
+            if (!eq || eq == optarg) usage();
+            THRESHOLDS[std::string(optarg, eq - optarg)] = atof(eq + 1);
+            break;
+        }
+        case 'p': SERVER_PID = atoi(optarg); break;
+        case 'H': STORM_HOLD = std::max(0, atoi(optarg)); break;
+        case 'I': SRC_IPS = std::clamp(atoi(optarg), 0, 254); break;
+        case 'U': UNIX_PATH = optarg; break;
+        case 'P': PLAIN = true; break;
+        default: usage();
+        }
+    }
+
+    // 只比较两个已有的结果文件，不压测
+    if (!compare.empty()) {
+        if (BASELINE.empty()) usage();
+        std::map<std::string, double> base, cur;
+        std::map<std::string, std::string> base_strs, cur_strs;
+        std::string err;
+        if (!load_results(BASELINE, base, base_strs, err) || !load_results(compare, cur, cur_strs, err)) {
+            std::cerr << err << std::endl;
+            return 1;
+        }
+        warn_config_diff(base, base_strs, cur, cur_strs);
+        return compare_results(base, cur, MAX_REGRESS, THRESHOLDS) ? 2 : 0;
+    }
+    if ((PLAIN && UNIX_PATH.empty()) || UNIX_PATH.size() >= sizeof(sockaddr_un::sun_path)) usage();
+    argc -= optind - 1, argv += optind - 1;     // 之后 argv[1..] 是位置参数
+
     std::string numstr = "10000", loopstr = "100", lenstr = "2000", ipstr = "127.0.0.1", portstr = "8080";
 
     if (argc >= 2) numstr = argv[1];
@@ -123,8 +651,219 @@ int main(int argc, char* argv[]) {
     int LEN = std::stoi(lenstr);
     std::vector<pid_t> pids(CNUM);
 
-    // 构造发的消息
-    for (int i = 0; i < LEN; ++i) msg += 'a';
+    // 端口可以是逗号分隔的列表（集群的多个节点），第 i 个客户端连第 i % n 个端口
+    std::vector<std::string> ports;
+    for (size_t pos = 0, next; pos <= portstr.length(); pos = next + 1) {
+        next = portstr.find(',', pos);
+        if (next == std::string::npos) next = portstr.length();
+        if (next > pos) ports.push_back(portstr.substr(pos, next - pos));
+    }
+    if (ports.empty()) ports.push_back("8080");
+
+    // 构造发的消息。按分布抽取长度时构造最长的一条，发送时取前缀
+    if (SIZE_MODE == SizeMode::Fixed) SIZE_A = LEN;
+    size_t maxlen = SIZE_MODE == SizeMode::Fixed ? SIZE_A : SIZE_MODE == SizeMode::Uniform ? SIZE_B : MAX_MSG_LEN;
+    msg.assign(std::max<size_t>(maxlen, 8), 'a');
+
+    // Zipf 分布：第 k 个用户被选中的概率正比于 1 / (k + 1)^s ，预先算好累积分布，抽样时二分
+    TOTAL_CONNS = CNUM;
+    if (TO_MODE == ToMode::Zipf) {
+        zipf_cdf.resize(CNUM);
+        double acc = 0;
+        for (int k = 0; k < CNUM; ++k) zipf_cdf[k] = acc += 1.0 / std::pow(k + 1.0, ZIPF_S);
+        for (double& v : zipf_cdf) v /= acc;
+    }
+    IDLE_CONNS = std::min(static_cast<int>(IDLE * CNUM), std::max(CNUM - HEAVY, 0));     // 重用户不会空闲
+    FLEET = TO_MODE != ToMode::Self || IDLE_CONNS > 0;
+
+    HEAVY = std::min(HEAVY, CNUM);
+
+    // 压测的配置和环境一并写进结果文件，对比时便于确认两次跑的是同一件事
+    res.num("config", "clients", CNUM);
+    res.num("config", "loops", LOOPS);
+    res.num("config", "length", LEN);
+    res.str("config", "ip", ipstr);
+    res.str("config", "ports", portstr);
+    res.num("config", "inflight", WINDOW);
+    res.num("config", "heavy", HEAVY);
+    res.num("config", "heavy_inflight", HEAVY_WINDOW);
+    res.str("config", "to", TO_MODE == ToMode::Self ? "self" : TO_MODE == ToMode::Uniform ? "uniform" : std::format("zipf:{}", ZIPF_S));
+    res.str("config", "sizes", SIZE_MODE == SizeMode::Fixed ? std::format("fixed:{}", SIZE_A)
+                             : SIZE_MODE == SizeMode::Uniform ? std::format("uniform:{}-{}", SIZE_A, SIZE_B) : std::format("exp:{}", SIZE_A));
+    res.num("config", "idle", IDLE);
+    res.str("config", "burst", std::format("{}:{}", BURST, BURST_GAP_MS));
+    res.num("config", "broadcast", BCAST);
+    res.num("config", "storm", STORM);
+    res.num("config", "storm_rate", STORM_RATE);
+    res.num("config", "storm_keep", STORM_KEEP);
+    res.num("config", "src_ips", SRC_IPS);
+    res.str("config", "unix", UNIX_PATH);
+    res.num("config", "plain", PLAIN);
+    record_env();
+    if (SERVER_PID) {
+        SERVER_CPU0 = proc_cpu_ms(SERVER_PID);
+        if (SERVER_CPU0 < 0) std::cerr << "Cannot read /proc/" << SERVER_PID << "/stat, server metrics skipped" << std::endl;
+    }
+
+    void* shm = mmap(nullptr, 2 * sizeof(SharedStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    shared_stats = new (shm) SharedStats[2]{};
+
+    if (STORM) {
+        if (CNUM < 1) {
+            std::cerr << "Storm mode needs at least 1 client" << std::endl;
+            return 1;
+        }
+        void* sshm = mmap(nullptr, sizeof(StormShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (sshm == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+        storm = new (sshm) StormShared{};
+        storm->start_ns = now_ns();
+
+        // 保持大量连接时每个进程要占很多 fd
+        rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+        long rss0 = SERVER_PID ? proc_status_kb(SERVER_PID, "VmRSS:") : -1;
+
+        // 计时从创建子进程之前开始，到最后一次握手结束
+        for (int i = 0; i < CNUM; ++i) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                storm_task(ipstr, ports, i, CNUM);
+                exit(0);
+            } else if (pid < 0) {
+                perror("fork");
+                return 1;
+            }
+        }
+        // 保持连接时，等所有进程都握手完（连接都还开着），采样服务端的内存，再让它们关闭
+        long rss1 = -1;
+        if (STORM_KEEP) {
+            while (storm->done.load() < CNUM) usleep(10000);
+            rss1 = rss0 >= 0 ? proc_status_kb(SERVER_PID, "VmRSS:") : -1;
+            if (STORM_HOLD) sleep(STORM_HOLD);
+            storm->release = 1;
+        }
+        for (int i = 0; i < CNUM; ++i) wait(nullptr);
+
+        uint64_t ok = storm->ok, failed = 0;
+        for (int p = PH_CONNECT; p < PH_TOTAL; ++p) failed += storm->failed[p];
+        double secs = storm->last_ns > storm->start_ns ? (storm->last_ns - storm->start_ns) / 1e9 : 0;
+
+        std::cout << "----------------------------------------\n";
+        std::cout << "Processes       : " << CNUM << "\n";
+        std::cout << "Handshakes      : " << ok << " / " << STORM << (STORM_KEEP ? " (kept open)" : " (reconnecting)") << "\n";
+        if (STORM_RATE > 0) std::cout << "Target Rate     : " << std::format("{:.2f}", STORM_RATE) << " conns/sec\n";
+        std::cout << "Failed          : " << std::format("{} (connect {}, key exchange {}, welcome {})", 
+            failed, storm->failed[PH_CONNECT].load(), storm->failed[PH_KEX].load(), storm->failed[PH_WELCOME].load()) << "\n";
+        std::cout << "Total Time      : " << std::format("{:.2f}", secs * 1000) << " ms\n";
+        if (secs > 0) std::cout << "Conn Rate       : " << std::format("{:.2f}", ok / secs) << " conns/sec\n";
+        res.num("results", "handshakes", ok);
+        res.num("results", "failed", failed);
+        res.num("results", "total_ms", secs * 1000);
+        if (secs > 0) res.num("results", "conn_rate", ok / secs);
+        if (rss1 >= 0 && ok) {
+            // 服务端 RSS 的增量平摊到保持着的连接上，即每个空闲连接的内存开销
+            double per = (rss1 - rss0) * 1024.0 / ok;
+            std::cout << "Server RSS Held : " << std::format("{:.1f} MB (+{:.1f} MB, {:.0f} bytes/conn)", rss1 / 1024.0, (rss1 - rss0) / 1024.0, per) << "\n";
+            res.num("server", "bytes_per_conn", per);
+        }
+        if (ok) {
+            static const char* names[PH_N] = {"connect", "key exchange", "welcome", "total"};
+            static const char* keys[PH_N] = {"connect", "kex", "welcome", "handshake"};
+            std::cout << "Latency (ms)    :      avg /      p50 /      p99 /     p999 /      max\n";
+            for (int p = 0; p < PH_N; ++p) {
+                uint64_t hist[LAT_BUCKETS], n = 0;
+                for (int b = 0; b < LAT_BUCKETS; ++b) n += hist[b] = storm->phase[p].hist[b].load();
+                uint64_t mx = storm->phase[p].max_us;
+                auto ms = [&](double q) { return percentile_ms(hist, n, q, mx); };
+                std::cout << std::format("  {:<14}: {:8.3f} / {:8.3f} / {:8.3f} / {:8.3f} / {:8.3f}\n", names[p], 
+                    storm->phase[p].sum_us / 1000.0 / n, ms(0.5), ms(0.99), ms(0.999), mx / 1000.0);
+                record_lat(keys[p], hist, n, storm->phase[p].sum_us, storm->phase[p].max_us);
+            }
+        }
+        std::cout << "----------------------------------------\n";
+        return finish(failed ? 1 : 0, ok, "conn");
+    }
+
+    if (BCAST) {
+        if (CNUM < 2) {
+            std::cerr << "Broadcast mode needs at least 2 clients" << std::endl;
+            return 1;
+        }
+        size_t sz = sizeof(BcastShared) + BCAST * sizeof(uint64_t);
+        void* bshm = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (bshm == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+        bcast = new (bshm) BcastShared{};
+        stats = &shared_stats[0];
+
+        // 收件人先连，user_0 等他们全部报到后才开始广播，所以计时不含登录
+        for (int i = CNUM - 1; i >= 0; --i) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                if (i == 0) bcast_send_task(ipstr, ports[0], CNUM - 1);
+                else bcast_recv_task(ipstr, ports[0], "user_" + std::to_string(i));
+                exit(0);
+            } else if (pid < 0) {
+                perror("fork");
+                return 1;
+            }
+        }
+        for (int i = 0; i < CNUM; ++i) wait(nullptr);
+
+        SharedStats& st = shared_stats[0];
+        uint64_t expect = static_cast<uint64_t>(CNUM - 1) * BCAST, got = bcast->delivered;
+        double secs = bcast->last_ns > bcast->start_ns ? (bcast->last_ns - bcast->start_ns) / 1e9 : 0;
+        uint64_t hist[LAT_BUCKETS], echoed = 0;
+        for (int b = 0; b < LAT_BUCKETS; ++b) echoed += hist[b] = st.rtt_hist[b].load();
+        auto lat_ms = [&](double p) { return percentile_ms(hist, echoed, p, st.rtt_max_us); };
+
+        std::cout << "----------------------------------------\n";
+        std::cout << "Receivers       : " << CNUM - 1 << "\n";
+        std::cout << "Broadcasts      : " << BCAST << " (in flight " << WINDOW << ")\n";
+        std::cout << "Message Length  : " << LEN << "\n";
+        std::cout << "Acked / Nacked  : " << st.acked << " / " << st.nacked << " (lost " << st.lost << ")\n";
+        std::cout << "Deliveries      : " << got << " / " << expect << "\n";
+        if (st.key_updates || st.key_errors) std::cout << "Key updates     : " << st.key_updates << " (errors " << st.key_errors << ")\n";
+        std::cout << "Total Time      : " << std::format("{:.2f}", secs * 1000) << " ms\n";
+        if (secs > 0) std::cout << "Delivery Rate   : " << std::format("{:.2f}", got / secs) << " msgs/sec\n";
+        if (echoed) {
+            std::cout << "Latency avg     : " << std::format("{:.3f}", st.rtt_sum_us / 1000.0 / echoed) << " ms\n";
+            std::cout << "Latency p50/p99 : " << std::format("{:.3f} / {:.3f}", lat_ms(0.5), lat_ms(0.99)) << " ms\n";
+            std::cout << "Latency max     : " << std::format("{:.3f}", st.rtt_max_us / 1000.0) << " ms\n";
+        }
+        std::cout << "----------------------------------------\n";
+        res.num("results", "acked", st.acked);
+        res.num("results", "nacked", st.nacked);
+        res.num("results", "lost", st.lost);
+        res.num("results", "deliveries", got);
+        res.num("results", "key_updates", st.key_updates);
+        res.num("results", "key_errors", st.key_errors);
+        res.num("results", "total_ms", secs * 1000);
+        if (secs > 0) res.num("results", "delivery_rate", got / secs);
+        record_lat("latency", hist, echoed, st.rtt_sum_us, st.rtt_max_us);
+        return finish(got == expect ? 0 : 1, got, "msg");
+    }
+
+    if (FLEET) {
+        void* fshm = mmap(nullptr, sizeof(FleetShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (fshm == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+        fleet = new (fshm) FleetShared{};
+    }
 
     // 计时区间包含了创建子进程的耗时，所以 LOOPS 不能太小                  [1]
     auto global_start = std::chrono::high_resolution_clock::now();  // 计时开始
@@ -133,7 +872,8 @@ int main(int argc, char* argv[]) {
         pid_t pid = fork();
         if (pid == 0) {
             // 子进程
-            task(ipstr, portstr, "user_" + std::to_string(i));      // 子进程压测
+            stats = &shared_stats[i < HEAVY];
+            task(ipstr, ports[i % ports.size()], i, i < HEAVY ? HEAVY_WINDOW : WINDOW);      // 子进程压测
             exit(0);
         } else if (pid > 0) {
             pids[i] = pid;
@@ -143,48 +883,389 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // 工作负载模式：等发送者都收完确认，再等投递追上被接受的条数（或 FLEET_DRAIN_MS 没有进展），然后让所有连接退出
+    int senders = CNUM - IDLE_CONNS;
+    if (FLEET) {
+        while (fleet->senders_done < senders) usleep(1000);
+        uint64_t seen = fleet->delivered, idle_since = now_ns();
+        while (TO_MODE != ToMode::Self && fleet->delivered < shared_stats[0].acked + shared_stats[1].acked
+               && now_ns() - idle_since < FLEET_DRAIN_MS * 1000000ull) {
+            usleep(1000);
+            if (fleet->delivered != seen) seen = fleet->delivered, idle_since = now_ns();
+        }
+        fleet->stop = 1;
+    }
+
     for (int i = 0; i < CNUM; ++i) wait(nullptr);                   // 等待所有子进程结束
     auto global_end = std::chrono::high_resolution_clock::now();    // 计时结束
 
-    auto total_duration_ms = std::chrono::duration<double, std::milli>(global_end - global_start).count();
-    long total_messages = static_cast<long>(CNUM) * LOOPS;
-    
+    // 工作负载模式从所有连接登录完毕算起，到最后一次投递或确认为止
+    auto total_duration_ms = FLEET ? (fleet->last_ns > fleet->start_ns ? (fleet->last_ns - fleet->start_ns) / 1e6 : 0)
+                                   : std::chrono::duration<double, std::milli>(global_end - global_start).count();
+    long total_messages = static_cast<long>(senders) * LOOPS;
+
     // QPS = 总消息数 / 总耗时（秒）
     double qps = (total_duration_ms > 0) ? (total_messages / (total_duration_ms / 1000.0)) : 0;
     double avg_latency_ms = (total_messages > 0) ? (total_duration_ms / total_messages) : 0;
 
     std::cout << "----------------------------------------\n";
     std::cout << "Total Clients   : " << CNUM << "\n";
+    if (ports.size() > 1) std::cout << "Server Nodes    : " << ports.size() << "\n";
     std::cout << "Loops per Client: " << LOOPS << "\n";
-    std::cout << "Message Length  : " << LEN << "\n";
+    if (WINDOW > 1) std::cout << "In-flight Msgs  : " << WINDOW << "\n";
+    if (SIZE_MODE == SizeMode::Uniform) std::cout << std::format("Message Length  : uniform {}-{}\n", SIZE_A, SIZE_B);
+    else if (SIZE_MODE == SizeMode::Exp) std::cout << std::format("Message Length  : exp, mean {}\n", SIZE_A);
+    else std::cout << "Message Length  : " << LEN << "\n";
+    if (TO_MODE == ToMode::Uniform) std::cout << "Recipients      : uniform\n";
+    else if (TO_MODE == ToMode::Zipf) std::cout << std::format("Recipients      : zipf, s = {:.2f}\n", ZIPF_S);
+    if (IDLE_CONNS) std::cout << "Idle Clients    : " << IDLE_CONNS << "\n";
+    if (BURST) std::cout << std::format("Bursts          : {} msgs every {} ms\n", BURST, BURST_GAP_MS);
+    if (FLEET && fleet->login_failed) std::cout << "Login Failed    : " << fleet->login_failed << "\n";
     std::cout << "Total Messages  : " << total_messages << "\n";
     std::cout << "Total Time      : " << total_duration_ms << " ms\n";
     std::cout << "Overall QPS     : " << std::format("{:.2f}", qps) << " msgs/sec\n";
     std::cout << "Avg Latency     : " << std::format("{:.4f}", avg_latency_ms) << " ms/msg\n";
+    res.num("results", "messages", total_messages);
+    res.num("results", "total_ms", total_duration_ms);
+    res.num("results", "qps", qps);
+    if (FLEET) res.num("results", "login_failed", fleet->login_failed);
+
+    // 投递时延：从发出到收件人收到
+    if (TO_MODE != ToMode::Self) {
+        uint64_t hist[LAT_BUCKETS], n = 0;
+        for (int b = 0; b < LAT_BUCKETS; ++b) n += hist[b] = fleet->delivery.hist[b].load();
+        auto ms = [&](double p) { return percentile_ms(hist, n, p, fleet->delivery.max_us); };
+        std::cout << "Deliveries      : " << n << " / " << shared_stats[0].acked + shared_stats[1].acked << " accepted\n";
+        if (n) {
+            std::cout << "Delivery avg    : " << std::format("{:.3f}", fleet->delivery.sum_us / 1000.0 / n) << " ms\n";
+            std::cout << "Delivery p50/p99/p999: " << std::format("{:.3f} / {:.3f} / {:.3f}", ms(0.5), ms(0.99), ms(0.999)) << " ms\n";
+            std::cout << "Delivery max    : " << std::format("{:.3f}", fleet->delivery.max_us / 1000.0) << " ms\n";
+        }
+        res.num("results", "deliveries", n);
+        record_lat("delivery", hist, n, fleet->delivery.sum_us, fleet->delivery.max_us);
+    }
+
+    // 往返时延：从发出到收到回显（发给别人时为收到确认）。有重用户时两组分开输出，便于比较
+    // 结果文件里重用户那组的指标名加 heavy_ 前缀
+    auto report = [&](const char* title, SharedStats& st, int clients, std::string prefix) {
+        uint64_t hist[LAT_BUCKETS], echoed = 0;
+        for (int b = 0; b < LAT_BUCKETS; ++b) echoed += hist[b] = st.rtt_hist[b].load();
+        auto rtt_ms = [&](double p) { return percentile_ms(hist, echoed, p, st.rtt_max_us); };
+
+        if (title) std::cout << std::format("[{} x {}]\n", title, clients);
+        std::cout << "Acked / Nacked  : " << st.acked << " / " << st.nacked << " (lost " << st.lost << ")\n";
+        if (st.key_updates || st.key_errors) std::cout << "Key updates     : " << st.key_updates << " (errors " << st.key_errors << ")\n";
+        res.num("results", prefix + "acked", st.acked);
+        res.num("results", prefix + "nacked", st.nacked);
+        res.num("results", prefix + "lost", st.lost);
+        res.num("results", prefix + "key_updates", st.key_updates);
+        res.num("results", prefix + "key_errors", st.key_errors);
+        if (!echoed) return;
+        res.num("results", prefix + "client_qps", echoed / (st.busy_us / 1e6));
+        record_lat(prefix + "rtt", hist, echoed, st.rtt_sum_us, st.rtt_max_us);
+        std::cout << "Per-client QPS  : " << std::format("{:.2f}", echoed / (st.busy_us / 1e6)) << " msgs/sec\n";
+        std::cout << "RTT avg         : " << std::format("{:.3f}", st.rtt_sum_us / 1000.0 / echoed) << " ms\n";
+        std::cout << "RTT p50/p99/p999: " << std::format("{:.3f} / {:.3f} / {:.3f}", rtt_ms(0.5), rtt_ms(0.99), rtt_ms(0.999)) << " ms\n";
+        std::cout << "RTT max         : " << std::format("{:.3f}", st.rtt_max_us / 1000.0) << " ms\n";
+    };
+    if (!HEAVY) {
+        report(nullptr, shared_stats[0], CNUM, "");
+    } else {
+        if (HEAVY < CNUM) report("Light", shared_stats[0], CNUM - HEAVY, "");
+        report(std::format("Heavy, {} in flight", HEAVY_WINDOW).c_str(), shared_stats[1], HEAVY, "heavy_");
+    }
     std::cout << "----------------------------------------\n";
-    
-    return 0;
+
+    return finish(0, shared_stats[0].acked + shared_stats[1].acked, "msg");
 }
 
 // ==================== 工具函数实现 ====================
-inline void send_msg(int sock, const std::string& to, const std::string& msg) {
-    std::string c_to, c_msg;
+inline bool append_msg(std::string& out, uint32_t seq, std::string_view to, std::string_view msg) {
+    size_t at = out.length();
+    out.resize(at + msg_frame_len(to.length(), msg.length()));
     try {
-        c_to = crypto.aes_encrypt(to), c_msg = crypto.aes_encrypt(msg);
+        build_msg(reinterpret_cast<unsigned char*>(out.data() + at), seq, to_bytes(to), to_bytes(msg), 
+            [](const unsigned char* plain, size_t len, unsigned char* p) { return crypto.aes_encrypt(plain, len, p); });
     } catch (const std::exception& e) {
         std::cerr << "AES encrypt: " << e.what() << std::endl;
-        return;
+        out.resize(at);
+        return false;
     }
+    return true;
+}
 
-    uint16_t n_tolen = htons(static_cast<uint16_t>(c_to.length()));
-    uint32_t n_msglen = htonl(static_cast<uint32_t>(c_msg.length()));
-    std::string pck;
-    pck.reserve(sizeof(n_tolen) + sizeof(n_msglen) + c_to.length() + c_msg.length());
-    pck.append(reinterpret_cast<const char*>(&n_tolen), sizeof(n_tolen));
-    pck.append(reinterpret_cast<const char*>(&n_msglen), sizeof(n_msglen));
-    pck += c_to, pck += c_msg;
 
+inline void handle_key_update(const FrameView& f, std::string& reply) {
+    Crypto::KeyUpdate r;
     try {
-        Send(sock, pck.c_str(), pck.length());
-    } catch (...) {}
-}
\ No newline at end of file
+        r = crypto.on_key_update(f.seq, f.c_a.data(), f.c_a.size());
+    } catch (const std::exception&) {
+        r = Crypto::KeyUpdate::Invalid;
+    }
+    if (r == Crypto::KeyUpdate::Invalid) {
+        stats->key_errors.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    stats->key_updates.fetch_add(1, std::memory_order_relaxed);
+    if (r == Crypto::KeyUpdate::Confirmed) return;
+
+    size_t at = reply.length();
+    reply.resize(at + KEY_UPDATE_FRAME_LEN);
+    try {
+        build_key_update(reinterpret_cast<unsigned char*>(reply.data() + at), f.seq,
+            [](const unsigned char* plain, size_t len, unsigned char* p) { return crypto.aes_encrypt(plain, len, p); });
+    } catch (const std::exception&) {
+        reply.resize(at);
+        stats->key_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+
+// 小于 LAT_SUB 的值各占一档；之后每个 [2^k, 2^(k+1)) 均分成 LAT_SUB 档
+inline int lat_bucket(uint64_t us) {
+    if (us < LAT_SUB) return static_cast<int>(us);
+    int shift = 63 - __builtin_clzll(us) - 4;       // LAT_SUB == 2^4
+    int b = (shift + 1) * LAT_SUB + static_cast<int>((us >> shift) & (LAT_SUB - 1));
+    return std::min(b, LAT_BUCKETS - 1);
+}
+
+
+inline uint64_t bucket_upper(int b) {
+    if (b < LAT_SUB) return b;
+    int shift = b / LAT_SUB - 1, sub = b % LAT_SUB;
+    return ((static_cast<uint64_t>(LAT_SUB + sub + 1)) << shift) - 1;
+}
+
+
+uint64_t percentile(const uint64_t* hist, uint64_t total, double p) {
+    uint64_t want = static_cast<uint64_t>(p * total), acc = 0;
+    for (int b = 0; b < LAT_BUCKETS; ++b) {
+        acc += hist[b];
+        if (acc > want) return bucket_upper(b);
+    }
+    return bucket_upper(LAT_BUCKETS - 1);
+}
+
+
+double percentile_ms(const uint64_t* hist, uint64_t total, double p, uint64_t max_us) {
+    return std::min(percentile(hist, total, p), max_us) / 1000.0;
+}
+
+
+int open_socket() {
+    return socket(UNIX_PATH.empty() ? PF_INET : AF_UNIX, SOCK_STREAM, 0);
+}
+
+
+bool connect_to(int sock, const std::string& ip, const std::string& port) {
+    if (!UNIX_PATH.empty()) {
+        sockaddr_un srv_addr{};
+        srv_addr.sun_family = AF_UNIX;
+        strcpy(srv_addr.sun_path, UNIX_PATH.c_str());
+        return connect(sock, (sockaddr *)&srv_addr, sizeof(srv_addr)) == 0;
+    }
+    sockaddr_in srv_addr{};
+    srv_addr.sin_family = AF_INET;
+    srv_addr.sin_addr.s_addr = inet_addr(ip.c_str());
+    srv_addr.sin_port = htons(std::stoi(port));
+    return connect(sock, (sockaddr *)&srv_addr, sizeof(srv_addr)) == 0;
+}
+
+
+int login(const std::string& ip, const std::string& port, const std::string& username, std::string& recvbuf) {
+    int sock = open_socket();
+    if (sock < 0) return -1;
+
+    if (!connect_to(sock, ip, port) || !cli_handshake(sock, username, crypto, PLAIN)) {
+        close(sock);
+        return -1;
+    }
+
+    // 等到完整的欢迎语（第一个普通帧），只数包，不解密
+    char buf[BUFSZ];
+    bool welcomed = false;
+    while (!welcomed) {
+        int len = recv(sock, buf, BUFSZ, 0);
+        if (len <= 0) {
+            close(sock);
+            return -1;
+        }
+        recvbuf.append(buf, len);
+        size_t used = for_each_frame(to_bytes(recvbuf), [&](bytes_view pck) {
+            FrameView f;
+            if (!welcomed && parse_frame(pck, f) && f.type == 0) welcomed = true;
+        });
+        recvbuf.erase(0, used);
+    }
+    return sock;
+}
+
+
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+inline void add_lat(std::atomic<uint64_t>* hist, std::atomic<uint64_t>& sum, std::atomic<uint64_t>& mx, uint64_t us) {
+    hist[lat_bucket(us)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(us, std::memory_order_relaxed);
+    uint64_t m = mx.load(std::memory_order_relaxed);
+    while (us > m && !mx.compare_exchange_weak(m, us, std::memory_order_relaxed)) {}
+}
+
+
+inline int pick_rcpt(std::mt19937_64& rng) {
+    if (TO_MODE == ToMode::Uniform) return std::uniform_int_distribution<int>(0, TOTAL_CONNS - 1)(rng);
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    return std::min(static_cast<int>(std::lower_bound(zipf_cdf.begin(), zipf_cdf.end(), u) - zipf_cdf.begin()), TOTAL_CONNS - 1);
+}
+
+
+// 发给别人时消息开头要放 8 字节的发出时刻，所以至少 8 字节
+inline size_t pick_size(std::mt19937_64& rng) {
+    size_t len = SIZE_A;
+    if (SIZE_MODE == SizeMode::Uniform) len = std::uniform_int_distribution<size_t>(SIZE_A, SIZE_B)(rng);
+    else if (SIZE_MODE == SizeMode::Exp) len = static_cast<size_t>(std::exponential_distribution<double>(1.0 / SIZE_A)(rng));
+    return std::clamp<size_t>(len, TO_MODE == ToMode::Self ? 1 : 8, msg.size());
+}
+
+
+bool parse_to(const char* s) {
+    std::string_view v = s;
+    if (v == "self") TO_MODE = ToMode::Self;
+    else if (v == "uniform") TO_MODE = ToMode::Uniform;
+    else if (v.starts_with("zipf")) {
+        TO_MODE = ToMode::Zipf;
+        if (v.size() > 4) {
+            if (v[4] != ':') return false;
+            ZIPF_S = atof(s + 5);
+        }
+        return ZIPF_S > 0;
+    } else return false;
+    return true;
+}
+
+
+bool parse_sizes(const char* s) {
+    unsigned long a, b;
+    if (sscanf(s, "uniform:%lu-%lu", &a, &b) == 2 && a && a <= b && b <= MAX_MSG_LEN) {
+        SIZE_MODE = SizeMode::Uniform, SIZE_A = a, SIZE_B = b;
+        return true;
+    }
+    if (sscanf(s, "exp:%lu", &a) == 1 && a && a <= MAX_MSG_LEN) {
+        SIZE_MODE = SizeMode::Exp, SIZE_A = a;
+        return true;
+    }
+    return false;
+}
+
+
+bool parse_burst(const char* s) {
+    return sscanf(s, "%d:%d", &BURST, &BURST_GAP_MS) == 2 && BURST > 0 && BURST_GAP_MS >= 0;
+}
+
+
+void record_env() {
+    res.num("env", "cores", sysconf(_SC_NPROCESSORS_ONLN));
+    utsname u{};
+    if (uname(&u) == 0) {
+        res.str("env", "kernel", std::format("{} {} {}", u.sysname, u.release, u.machine));
+        res.str("env", "hostname", u.nodename);
+    }
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    for (std::string line; std::getline(cpuinfo, line);) {
+        if (!line.starts_with("model name")) continue;
+        size_t pos = line.find(':');
+        if (pos != std::string::npos) res.str("env", "cpu", line.substr(line.find_first_not_of(' ', pos + 1)));
+        break;
+    }
+    time_t now = time(nullptr);
+    char ts[32];
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    res.str("env", "time", ts);
+}
+
+
+double proc_cpu_ms(pid_t pid) {
+    std::ifstream f(std::format("/proc/{}/stat", pid));
+    std::string line;
+    if (!std::getline(f, line)) return -1;
+    // 第 2 项是括号里的进程名，可能含空格，从右括号之后数：utime 、 stime 是第 14 、 15 项
+    size_t pos = line.rfind(')');
+    if (pos == std::string::npos) return -1;
+    std::istringstream ss(line.substr(pos + 1));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && ss >> field; ++i) {
+        if (i == 14) utime = std::stoull(field);
+        if (i == 15) stime = std::stoull(field);
+    }
+    if (!ss) return -1;
+    return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+
+long proc_status_kb(pid_t pid, const char* field) {
+    std::ifstream f(std::format("/proc/{}/status", pid));
+    for (std::string line; std::getline(f, line);) {
+        if (line.starts_with(field)) return atol(line.c_str() + strlen(field));
+    }
+    return -1;
+}
+
+
+void record_lat(const std::string& prefix, const uint64_t* hist, uint64_t n, uint64_t sum_us, uint64_t max_us) {
+    if (!n) return;
+    res.num("results", prefix + "_avg_ms", sum_us / 1000.0 / n);
+    for (auto [name, q] : {std::pair{"p50", 0.5}, {"p99", 0.99}, {"p999", 0.999}}) {
+        res.num("results", std::format("{}_{}_ms", prefix, name), percentile_ms(hist, n, q, max_us));
+    }
+    res.num("results", prefix + "_max_ms", max_us / 1000.0);
+}
+
+
+int finish(int ret, double work, const char* unit) {
+    if (SERVER_CPU0 >= 0) {
+        double cpu = proc_cpu_ms(SERVER_PID) - SERVER_CPU0;
+        long rss = proc_status_kb(SERVER_PID, "VmRSS:"), hwm = proc_status_kb(SERVER_PID, "VmHWM:");
+        if (cpu >= 0) {
+            res.num("server", "cpu_ms", cpu);
+            std::cout << "Server CPU      : " << std::format("{:.0f}", cpu) << " ms";
+            if (work > 0) {
+                res.num("server", std::format("cpu_us_per_{}", unit), cpu * 1000 / work);
+                std::cout << std::format(" ({:.2f} us/{})", cpu * 1000 / work, unit);
+            }
+            std::cout << "\n";
+        }
+        if (rss >= 0 && hwm >= 0) {
+            res.num("server", "rss_mb", rss / 1024.0);
+            res.num("server", "hwm_mb", hwm / 1024.0);
+            std::cout << "Server RSS / HWM: " << std::format("{:.1f} / {:.1f}", rss / 1024.0, hwm / 1024.0) << " MB\n";
+        }
+        std::cout << "----------------------------------------\n";
+    }
+
+    if (!JSON_OUT.empty() && !res.save(JSON_OUT)) {
+        std::cerr << "Cannot write " << JSON_OUT << std::endl;
+        ret = ret ? ret : 1;
+    }
+    if (BASELINE.empty()) return ret;
+
+    std::map<std::string, double> base;
+    std::map<std::string, std::string> base_strs;
+    std::string err;
+    if (!load_results(BASELINE, base, base_strs, err)) {
+        std::cerr << err << std::endl;
+        return ret ? ret : 1;
+    }
+    std::cout << "Compared with " << BASELINE << ":\n";
+    // 本次的结果也走一遍同样的解析，两边的数值和字符串才一致
+    std::map<std::string, double> cur;
+    std::map<std::string, std::string> cur_strs;
+    if (!parse_results(res.json(), "results", cur, cur_strs, err)) {
+        std::cerr << err << std::endl;
+        return ret ? ret : 1;
+    }
+    warn_config_diff(base, base_strs, cur, cur_strs);
+    return compare_results(base, cur, MAX_REGRESS, THRESHOLDS) ? 2 : ret;
+}